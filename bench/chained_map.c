@@ -0,0 +1,232 @@
+/* Source file for the chained pair map of map_bench, the map of nfs_manager
+ * before the open addressing table, with its names changed so both can be
+ * linked together. Writers lock the shard and make its sequence odd while
+ * they change it, readers read again if the sequence changed, and removed
+ * nodes and hash tables are freed only when no reader is in the shard.
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include "chained_map.h"
+#include "../include/nfs.h"
+
+#define CHAINED_LOAD_FACTOR 0.9 // when  size / capacity > load factor, we rehash
+
+// Prime sizes for the hash tables, every one at least double the previous
+int CHAINED_PRIME_SIZES[] = {53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593, 49157, 98317, 196613, 393241,
+	786433, 1572869, 3145739, 6291469, 12582917, 25165843, 50331653, 100663319, 201326611, 402653189, 805306457, 1610612741};
+
+// We use the dbj2 hash function
+uint chained_hash_code(char* value) {
+    uint hash = 5381;
+    int i = 0;
+    while (value[i] != '\0') {
+        hash = (hash * 33) + value[i++];
+    }
+    return hash;
+}
+
+// Returns the shard of a hash code, the rest of the hash code picks the chain
+chained_shard* chained_shard_of(chained_map* mem,uint hash) {
+    return &mem->shards[hash & (CHAINED_SHARDS - 1)];
+}
+
+// Returns the chain of a hash code in a hash_table with the given capacity
+int chained_chain_of(int capacity,uint hash) {
+    return (hash / CHAINED_SHARDS) % capacity;
+}
+
+// Creates and initializes a chained map
+chained_map* chained_map_create(void) {
+    chained_map* mem = malloc(sizeof(chained_map));
+    if (mem == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    for (int s = 0; s < CHAINED_SHARDS; s++) {
+        chained_shard* shard = &mem->shards[s];
+        pthread_mutex_init(&shard->lock,NULL);
+        atomic_init(&shard->sequence,0);
+        atomic_init(&shard->readers,0);
+        shard->retired_memory = NULL;
+        shard->size = 0;
+        shard->capacity = CHAINED_INITIAL_SIZE;
+        shard->hash_table = calloc(shard->capacity,sizeof(chained_node*));
+        if (shard->hash_table == NULL)
+            perror_exit("ERROR! calloc failed\n");
+    }
+    return mem;
+}
+
+// Locks shard for a writer and makes its sequence odd
+void chained_write_begin(chained_shard* shard) {
+    pthread_mutex_lock(&shard->lock);
+    atomic_fetch_add(&shard->sequence,1);
+}
+
+// Makes shard's sequence even, frees the retired memory if no reader can use
+// it and unlocks shard
+void chained_write_end(chained_shard* shard) {
+    atomic_fetch_add(&shard->sequence,1);
+    if (atomic_load(&shard->readers) == 0) {
+        while (shard->retired_memory != NULL) {
+            chained_retired* temp = shard->retired_memory;
+            shard->retired_memory = temp->next;
+            free(temp->memory);
+            free(temp);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Retires memory that was removed from shard
+void chained_retire(chained_shard* shard,void* memory) {
+    chained_retired* node = malloc(sizeof(chained_retired));
+    if (node == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    node->memory = memory;
+    node->next = shard->retired_memory;
+    shard->retired_memory = node;
+}
+
+// Returns the node of source in shard or NULL
+chained_node* chained_find_node(chained_shard* shard,char* source,uint hash) {
+    // A rehash publishes the new hash_table before its capacity
+    int capacity = __atomic_load_n(&shard->capacity,__ATOMIC_ACQUIRE);
+    chained_node** hash_table = __atomic_load_n(&shard->hash_table,__ATOMIC_ACQUIRE);
+    chained_node* node = __atomic_load_n(&hash_table[chained_chain_of(capacity,hash)],__ATOMIC_ACQUIRE);
+    while (node != NULL) {
+        if (!strcmp(node->value.key,source))
+            return node;
+        node = __atomic_load_n(&node->next,__ATOMIC_ACQUIRE);
+    }
+    return NULL;
+}
+
+// Moves the nodes of shard to a bigger hash_table. The shard's lock must be
+// held
+void chained_rehash(chained_shard* shard) {
+    int old_capacity = shard->capacity;
+    int new_capacity = 2 * shard->capacity;
+    for (int i = 0; i < sizeof(CHAINED_PRIME_SIZES) / sizeof(int); i++) {
+        if (CHAINED_PRIME_SIZES[i] > old_capacity) {
+            new_capacity = CHAINED_PRIME_SIZES[i];
+            break;
+        }
+    }
+    chained_node** old_hash_table = shard->hash_table;
+    chained_node** new_hash_table = calloc(new_capacity,sizeof(chained_node*));
+    if (new_hash_table == NULL)
+        perror_exit("ERROR! calloc failed\n");
+    for (int i = 0; i < old_capacity; i++) {
+        chained_node* node = old_hash_table[i];
+        while (node != NULL) {
+            chained_node* next = node->next;
+            int pos = chained_chain_of(new_capacity,chained_hash_code(node->value.key));
+            __atomic_store_n(&node->next,new_hash_table[pos],__ATOMIC_RELEASE);
+            new_hash_table[pos] = node;
+            node = next;
+        }
+    }
+    __atomic_store_n(&shard->hash_table,new_hash_table,__ATOMIC_RELEASE);
+    __atomic_store_n(&shard->capacity,new_capacity,__ATOMIC_RELEASE);
+    chained_retire(shard,old_hash_table);
+}
+
+// Adds a pair into the map, or changes it if it exists
+void chained_map_add(chained_map* mem,char* source,char* target) {
+    chained_info new_value;
+    strcpy(new_value.key,source);
+    decode_format(source,new_value.source_dir,new_value.source_host,&new_value.source_port);
+    decode_format(target,new_value.target_dir,new_value.target_host,&new_value.target_port);
+    strcpy(new_value.targets,target);
+    new_value.is_active = true;
+    uint hash = chained_hash_code(new_value.key);
+    chained_shard* shard = chained_shard_of(mem,hash);
+    chained_write_begin(shard);
+    chained_node* pair = chained_find_node(shard,new_value.key,hash);
+    if (pair != NULL) {
+        pair->value = new_value;
+    }
+    else {
+        // The node is complete before it is linked
+        int pos = chained_chain_of(shard->capacity,hash);
+        chained_node* node = malloc(sizeof(chained_node));
+        if (node == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        node->value = new_value;
+        node->next = shard->hash_table[pos];
+        __atomic_store_n(&shard->hash_table[pos],node,__ATOMIC_RELEASE);
+        shard->size++;
+        if ((shard->size / (double)shard->capacity) > CHAINED_LOAD_FACTOR) {
+            chained_rehash(shard);
+        }
+    }
+    chained_write_end(shard);
+}
+
+// Removes the pair with the given source
+void chained_map_remove(chained_map* mem,char* source) {
+    uint hash = chained_hash_code(source);
+    chained_shard* shard = chained_shard_of(mem,hash);
+    chained_write_begin(shard);
+    chained_node** node = &shard->hash_table[chained_chain_of(shard->capacity,hash)];
+    while (*node != NULL) {
+        if (!strcmp((*node)->value.key,source)) {
+            chained_node* temp = *node;
+            __atomic_store_n(node,temp->next,__ATOMIC_RELEASE);
+            chained_retire(shard,temp);
+            shard->size--;
+            break;
+        }
+        node = &((*node)->next);
+    }
+    chained_write_end(shard);
+}
+
+// Copies the pair of source in result, or returns false if it doesn't exist
+bool chained_map_find(chained_map* mem,char* source,chained_info* result) {
+    uint hash = chained_hash_code(source);
+    chained_shard* shard = chained_shard_of(mem,hash);
+    atomic_fetch_add(&shard->readers,1);
+    bool found;
+    uint sequence;
+    do {
+        // A writer is changing the shard, we let it finish
+        while ((sequence = atomic_load(&shard->sequence)) & 1) {
+            sched_yield();
+        }
+        chained_node* node = chained_find_node(shard,source,hash);
+        found = node != NULL;
+        if (found)
+            memcpy(result,&node->value,sizeof(chained_info));
+        atomic_thread_fence(memory_order_acquire);
+    } while (atomic_load_explicit(&shard->sequence,memory_order_relaxed) != sequence);
+    atomic_fetch_sub(&shard->readers,1);
+    return found;
+}
+
+// Frees the map from the memory. No other thread should use it
+void chained_map_destroy(chained_map* mem) {
+    for (int s = 0; s < CHAINED_SHARDS; s++) {
+        chained_shard* shard = &mem->shards[s];
+        for (int i = 0; i < shard->capacity; i++) {
+            while (shard->hash_table[i] != NULL) {
+                chained_node* temp = shard->hash_table[i];
+                shard->hash_table[i] = temp->next;
+                free(temp);
+            }
+        }
+        free(shard->hash_table);
+        while (shard->retired_memory != NULL) {
+            chained_retired* temp = shard->retired_memory;
+            shard->retired_memory = temp->next;
+            free(temp->memory);
+            free(temp);
+        }
+        pthread_mutex_destroy(&shard->lock);
+    }
+    free(mem);
+}
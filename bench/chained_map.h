@@ -0,0 +1,80 @@
+/* Header file for the chained pair map, the sync_info_mem_store that
+ * nfs_manager used before its entries were stored in an open addressing
+ * table (see map.h). It is kept only for map_bench, to compare the two: every
+ * pair is a node of a linked chain, with all its strings in fixed arrays.
+ * Like the current map, it is split in shards that writers lock, and readers
+ * search without locks (seqlock).
+ * */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "../include/nfs.h"
+
+#define CHAINED_INITIAL_SIZE 53 // initial size for the hash_table of every shard
+
+#define CHAINED_SHARDS 64 // Number of shards, a power of 2
+
+#pragma once
+
+typedef struct {
+    char key[256]; // Our key is the <source_dir>@<ip>:<port> format
+    char source_dir[128]; // Our source directory
+    char source_host[128];
+    int source_port;
+    char target_dir[128]; // Our target directory
+    char target_host[128];
+    int target_port;
+    char targets[1024]; // All the targets of the pair seperated by commas,
+                        // the first one is also decoded above
+    bool is_active; // Is true if the directory is actively monitored
+} chained_info;
+
+typedef struct chained_node chained_node;
+
+// A node of a chain
+struct chained_node {
+    chained_info value;
+    chained_node* next;
+};
+
+typedef struct chained_retired chained_retired;
+
+// Memory that was removed from a shard, but a reader can still be using it
+struct chained_retired {
+    void* memory;
+    chained_retired* next;
+};
+
+typedef struct {
+    pthread_mutex_t lock; // Locked by the writers of the shard
+    atomic_uint sequence; // Odd while a writer changes the shard
+    atomic_int readers; // Number of readers in the shard
+    // Our hash table uses seperate chaining
+    chained_node** hash_table;
+    int size;
+    int capacity;
+    chained_retired* retired_memory; // Freed when there are no readers
+} chained_shard;
+
+typedef struct {
+    chained_shard shards[CHAINED_SHARDS];
+} chained_map;
+
+// Creates and initializes a chained map
+chained_map* chained_map_create(void);
+
+// Adds a pair into the map, or changes it if it exists. source and target
+// are entries of <source_dir>@<ip>:<port>
+void chained_map_add(chained_map* mem,char* source,char* target);
+
+// Removes the pair with the given source
+void chained_map_remove(chained_map* mem,char* source);
+
+// Copies the pair of source in result and returns true, or returns false if
+// it doesn't exist
+bool chained_map_find(chained_map* mem,char* source,chained_info* result);
+
+// Frees the map from the memory
+void chained_map_destroy(chained_map* mem);
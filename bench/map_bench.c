@@ -0,0 +1,407 @@
+/* map_bench times the pair map of nfs_manager (map.h) against the chained map
+ * it replaced (chained_map.h). For every number of pairs (10k, 1M and 10M,
+ * or the ones given as arguments) it measures, for each map:
+ *      - the inserts of all the pairs
+ *      - the lookups of all of them, in random order
+ *      - the lookups of as many pairs that don't exist
+ *      - the removals of all of them, in random order
+ *      - the memory the map used, from the resident size of the process
+ *
+ * Pairs look like the pairs of a config file, with their hosts picked from
+ * a few ones. A map that wouldn't fit in the available memory (guessed from
+ * the memory it used for the previous number of pairs) is skipped.
+ *
+ * The mixed benchmark loads 1M pairs (or the given number), and then the main
+ * thread does as many operations, 80% lookups and 20% inserts of new pairs,
+ * while reader threads check random pairs the way workers check the pair of
+ * every file they sync. It runs on the chained map, on the current map with
+ * its lock-free readers, and on the current map behind a single mutex (how a
+ * map without lock-free readers would be shared). It reports the time of the
+ * main thread's operations, the checks the readers did meanwhile, and the 
+ * checks that saw a pair that wasn't the one they asked for (torn reads,
+ * always 0).
+ *
+ * Usage: ./map_bench [scale] [pairs...]
+ *        ./map_bench mixed [readers] [pairs]
+ */
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "../include/map.h"
+#include "../include/nfs.h"
+#include "chained_map.h"
+
+#define BENCH_KEY 32 // Bytes of a source or a target of the benchmark
+
+#define BENCH_HOSTS 16 // Number of different hosts of the pairs
+
+#define BENCH_MAPS 2 // The chained map and the open addressing one
+
+#define BENCH_MIXED_MAPS 3 // The maps of the mixed benchmark, the last one is
+                           // the open addressing one behind a mutex
+
+#define BENCH_MAX_READERS 64
+
+char* map_names[BENCH_MIXED_MAPS] = {"chained","open","locked"};
+
+// The pairs of a run
+typedef struct {
+    long count;
+    char* sources; // count sources of BENCH_KEY bytes
+    char* targets;
+    int* order; // A random order of the pairs
+} bench_pairs;
+
+// A map of the mixed benchmark, and what its readers share
+typedef struct {
+    int which; // The index of its name in map_names
+    map* mem;
+    chained_map* chained;
+    pthread_mutex_t lock; // Locked around every call of the locked map
+    bench_pairs* pairs;
+    long loaded; // Pairs that were added before the readers started
+    unsigned int* generations; // The generation of every loaded pair
+    atomic_bool stop;
+} bench_mixed_map;
+
+// A reader thread of the mixed benchmark
+typedef struct {
+    bench_mixed_map* shared;
+    unsigned long long seed;
+    long checks;
+    long torn; // Checks that saw another pair, or didn't find theirs
+    pthread_t thread;
+} bench_reader;
+
+// Returns the time of a monotonic clock, in nanoseconds
+long long bench_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// Returns the resident memory of the process, in bytes
+long long bench_resident(void) {
+    long long pages = 0,resident = 0;
+    FILE* statm = fopen("/proc/self/statm","r");
+    if (statm != NULL) {
+        if (fscanf(statm,"%lld %lld",&pages,&resident) != 2)
+            resident = 0;
+        fclose(statm);
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+}
+
+// Returns the memory the system can still give us, in bytes
+long long bench_available(void) {
+    char line[256];
+    long long kb = -1;
+    FILE* meminfo = fopen("/proc/meminfo","r");
+    if (meminfo == NULL)
+        return -1;
+    while (fgets(line,sizeof(line),meminfo) != NULL) {
+        if (sscanf(line,"MemAvailable: %lld kB",&kb) == 1)
+            break;
+    }
+    fclose(meminfo);
+    return (kb < 0) ? -1 : kb * 1024;
+}
+
+// Creates count pairs and a random order of them
+void bench_pairs_create(bench_pairs* pairs,long count) {
+    pairs->count = count;
+    pairs->sources = malloc(count * BENCH_KEY);
+    pairs->targets = malloc(count * BENCH_KEY);
+    pairs->order = malloc(count * sizeof(int));
+    if (pairs->sources == NULL || pairs->targets == NULL || pairs->order == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    for (long i = 0; i < count; i++) {
+        snprintf(pairs->sources + i * BENCH_KEY,BENCH_KEY,"/d%08ld@h%02d:%d",i,(int)(i % BENCH_HOSTS),9000);
+        snprintf(pairs->targets + i * BENCH_KEY,BENCH_KEY,"/t%08ld@t%02d:%d",i,(int)(i % BENCH_HOSTS),9001);
+        pairs->order[i] = i;
+    }
+    // Fisher-Yates shuffle
+    srand(1);
+    for (long i = count - 1; i > 0; i--) {
+        long j = ((long)rand() * RAND_MAX + rand()) % (i + 1);
+        int temp = pairs->order[i];
+        pairs->order[i] = pairs->order[j];
+        pairs->order[j] = temp;
+    }
+}
+
+// Frees the pairs of a run
+void bench_pairs_free(bench_pairs* pairs) {
+    free(pairs->sources);
+    free(pairs->targets);
+    free(pairs->order);
+}
+
+// Runs the inserts, lookups, misses and removals of pairs on one of the
+// maps, and prints their times. Returns the bytes the map used
+long long bench_scale_map(int which,bench_pairs* pairs) {
+    long long times[4];
+    char key[BENCH_KEY];
+    long found = 0;
+    map* mem = NULL;
+    chained_map* chained = NULL;
+    dir_info info;
+    chained_info chained_result;
+
+    malloc_trim(0);
+    long long resident = bench_resident();
+    long long start = bench_now();
+    if (which == 0) {
+        chained = chained_map_create();
+        for (long i = 0; i < pairs->count; i++) {
+            chained_map_add(chained,pairs->sources + i * BENCH_KEY,pairs->targets + i * BENCH_KEY);
+        }
+    }
+    else {
+        mem = map_create();
+        for (long i = 0; i < pairs->count; i++) {
+            map_add(mem,pairs->sources + i * BENCH_KEY,pairs->targets + i * BENCH_KEY);
+        }
+    }
+    times[0] = bench_now() - start;
+    long long used = bench_resident() - resident;
+
+    // Lookups of every pair, and of as many pairs that don't exist (their
+    // directory starts with x instead of d)
+    for (int miss = 0; miss < 2; miss++) {
+        start = bench_now();
+        for (long i = 0; i < pairs->count; i++) {
+            memcpy(key,pairs->sources + pairs->order[i] * (long)BENCH_KEY,BENCH_KEY);
+            if (miss)
+                key[1] = 'x';
+            found += (which == 0) ? chained_map_find(chained,key,&chained_result) : map_find(mem,key,&info);
+        }
+        times[1 + miss] = bench_now() - start;
+    }
+    if (found != pairs->count) {
+        fprintf(stderr,"ERROR! %s map found %ld of %ld pairs\n",map_names[which],found,pairs->count);
+        exit(1);
+    }
+
+    start = bench_now();
+    for (long i = 0; i < pairs->count; i++) {
+        char* source = pairs->sources + pairs->order[i] * (long)BENCH_KEY;
+        if (which == 0)
+            chained_map_remove(chained,source);
+        else
+            map_remove(mem,source);
+    }
+    times[3] = bench_now() - start;
+    if (which == 0)
+        chained_map_destroy(chained);
+    else
+        map_destroy(mem);
+
+    printf("%-10ld %-8s",pairs->count,map_names[which]);
+    for (int i = 0; i < 4; i++) {
+        printf(" %10.1f",times[i] / (double)pairs->count);
+    }
+    printf(" %10.1f\n",used / (1024.0 * 1024.0));
+    fflush(stdout);
+    return used;
+}
+
+// Runs the scale benchmark for every number of pairs
+void bench_scale(long* counts,int count_len) {
+    long long per_pair[BENCH_MAPS] = {0,0}; // Bytes a pair used in the last run
+    printf("%-10s %-8s %10s %10s %10s %10s %10s\n","pairs","map","insert ns","find ns","miss ns","remove ns","memory MB");
+    for (int c = 0; c < count_len; c++) {
+        bench_pairs pairs;
+        bench_pairs_create(&pairs,counts[c]);
+        for (int which = 0; which < BENCH_MAPS; which++) {
+            // A map whose memory grows with its pairs, plus a half for the
+            // hash tables of a rehash
+            long long needed = per_pair[which] * counts[c] * 3 / 2;
+            long long available = bench_available();
+            if (available >= 0 && needed > available) {
+                printf("%-10ld %-8s skipped: needs about %lld MB, %lld MB available\n",counts[c],map_names[which],
+                    needed / (1024 * 1024),available / (1024 * 1024));
+                continue;
+            }
+            long long used = bench_scale_map(which,&pairs);
+            if (used > 0)
+                per_pair[which] = used / counts[c];
+        }
+        bench_pairs_free(&pairs);
+    }
+}
+
+// Returns a random number of the xorshift generator of seed
+unsigned long long bench_random(unsigned long long* seed) {
+    *seed ^= *seed << 13;
+    *seed ^= *seed >> 7;
+    *seed ^= *seed << 17;
+    return *seed;
+}
+
+// Checks random loaded pairs until the main thread stops, like workers check
+// the pair of every file they sync
+void* bench_reader_thread(void* args) {
+    bench_reader* reader = args;
+    bench_mixed_map* shared = reader->shared;
+    chained_info chained_result;
+    while (!atomic_load_explicit(&shared->stop,memory_order_relaxed)) {
+        long i = bench_random(&reader->seed) % shared->loaded;
+        char* source = shared->pairs->sources + i * BENCH_KEY;
+        bool ok;
+        if (shared->which == 0) {
+            ok = chained_map_find(shared->chained,source,&chained_result) && chained_result.is_active
+                && !strcmp(chained_result.key,source);
+        }
+        else if (shared->which == 1)
+            ok = map_is_current(shared->mem,source,shared->generations[i]);
+        else {
+            pthread_mutex_lock(&shared->lock);
+            ok = map_is_current(shared->mem,source,shared->generations[i]);
+            pthread_mutex_unlock(&shared->lock);
+        }
+        reader->torn += !ok;
+        reader->checks++;
+    }
+    return NULL;
+}
+
+// Runs the mixed benchmark on one of the maps, with count loaded pairs (the
+// rest of pairs are added), and prints its results
+void bench_mixed_map_run(int which,bench_pairs* pairs,long count,int reader_count) {
+    bench_mixed_map shared;
+    bench_reader readers[BENCH_MAX_READERS];
+    dir_info info;
+    chained_info chained_result;
+    shared.which = which;
+    shared.pairs = pairs;
+    shared.loaded = count;
+    shared.mem = NULL;
+    shared.chained = NULL;
+    pthread_mutex_init(&shared.lock,NULL);
+    atomic_init(&shared.stop,false);
+    shared.generations = malloc(count * sizeof(unsigned int));
+    if (shared.generations == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    if (which == 0)
+        shared.chained = chained_map_create();
+    else
+        shared.mem = map_create();
+    for (long i = 0; i < count; i++) {
+        char* source = pairs->sources + i * BENCH_KEY;
+        char* target = pairs->targets + i * BENCH_KEY;
+        if (which == 0)
+            chained_map_add(shared.chained,source,target);
+        else
+            shared.generations[i] = map_add(shared.mem,source,target);
+    }
+
+    for (int r = 0; r < reader_count; r++) {
+        readers[r].shared = &shared;
+        readers[r].seed = 88172645463325252ULL + r;
+        readers[r].checks = 0;
+        readers[r].torn = 0;
+        if (pthread_create(&readers[r].thread,NULL,bench_reader_thread,&readers[r]) != 0)
+            perror_exit("ERROR! pthread_create failed\n");
+    }
+    // The main thread looks up loaded pairs, and adds the pairs after them
+    unsigned long long seed = 2463534242ULL;
+    long added = count;
+    long long start = bench_now();
+    for (long op = 0; op < count; op++) {
+        if (op % 5 == 4 && added < pairs->count) {
+            char* source = pairs->sources + added * BENCH_KEY;
+            char* target = pairs->targets + added * BENCH_KEY;
+            added++;
+            if (which == 0)
+                chained_map_add(shared.chained,source,target);
+            else if (which == 1)
+                map_add(shared.mem,source,target);
+            else {
+                pthread_mutex_lock(&shared.lock);
+                map_add(shared.mem,source,target);
+                pthread_mutex_unlock(&shared.lock);
+            }
+            continue;
+        }
+        char* source = pairs->sources + (bench_random(&seed) % count) * BENCH_KEY;
+        if (which == 0)
+            chained_map_find(shared.chained,source,&chained_result);
+        else if (which == 1)
+            map_find(shared.mem,source,&info);
+        else {
+            pthread_mutex_lock(&shared.lock);
+            map_find(shared.mem,source,&info);
+            pthread_mutex_unlock(&shared.lock);
+        }
+    }
+    long long elapsed = bench_now() - start;
+    atomic_store(&shared.stop,true);
+    long checks = 0,torn = 0;
+    for (int r = 0; r < reader_count; r++) {
+        pthread_join(readers[r].thread,NULL);
+        checks += readers[r].checks;
+        torn += readers[r].torn;
+    }
+
+    printf("%-10ld %-8s %7d %10.1f %14.0f %8ld\n",count,map_names[which],reader_count,elapsed / (double)count,
+        checks / (elapsed / 1e9),torn);
+    fflush(stdout);
+    if (which == 0)
+        chained_map_destroy(shared.chained);
+    else
+        map_destroy(shared.mem);
+    free(shared.generations);
+    pthread_mutex_destroy(&shared.lock);
+    malloc_trim(0);
+}
+
+// Runs the mixed benchmark with count loaded pairs on every map
+void bench_mixed(long count,int reader_count) {
+    bench_pairs pairs;
+    // A fifth of the operations add new pairs
+    bench_pairs_create(&pairs,count + count / 5 + 1);
+    printf("%-10s %-8s %7s %10s %14s %8s\n","pairs","map","readers","op ns","checks/sec","torn");
+    for (int which = 0; which < BENCH_MIXED_MAPS; which++) {
+        bench_mixed_map_run(which,&pairs,count,reader_count);
+    }
+    bench_pairs_free(&pairs);
+}
+
+int main(int argc,char* argv[]) {
+    long counts[16] = {10000,1000000,10000000};
+    int count_len = 3;
+    int arg = 1;
+    if (arg < argc && !strcmp(argv[arg],"mixed")) {
+        int reader_count = (arg + 1 < argc) ? atoi(argv[arg + 1]) : 4;
+        long count = (arg + 2 < argc) ? atol(argv[arg + 2]) : 1000000;
+        if (reader_count < 0 || reader_count > BENCH_MAX_READERS || count <= 0) {
+            fprintf(stderr,"Usage: %s mixed [readers (at most %d)] [pairs]\n",argv[0],BENCH_MAX_READERS);
+            return 1;
+        }
+        bench_mixed(count,reader_count);
+        return 0;
+    }
+    if (arg < argc && !strcmp(argv[arg],"scale"))
+        arg++;
+    if (arg < argc) {
+        count_len = 0;
+        while (arg < argc && count_len < 16) {
+            counts[count_len] = atol(argv[arg++]);
+            if (counts[count_len] <= 0) {
+                fprintf(stderr,"Usage: %s [scale] [pairs...]\n",argv[0]);
+                return 1;
+            }
+            count_len++;
+        }
+    }
+    bench_scale(counts,count_len);
+    return 0;
+}
@@ -0,0 +1,75 @@
+/* Header file for nfs_manager's admission control. It limits the transfers
+ * that use an endpoint (<host>:<port>, as source or as target) at the same
+ * time, so the workers don't all sync with the same nfs_client while others
+ * are idle. Every endpoint also keeps its bandwidth limit and its circuit
+ * breaker here, for as many endpoints as we connect to.
+ *
+ * A worker asks for admission before it syncs a file, for all the endpoints
+ * of the file at once. If one of them is full, the file is deferred: it is
+ * kept in the queue of that endpoint, and the worker goes on with the next
+ * file of the buffer. When a transfer ends and releases its endpoints, the
+ * files that wait for them are admitted in their order, and given to the
+ * same worker. A file that still finds a full endpoint moves to the queue of
+ * that one, so a deferred file always waits for a transfer that is running.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "ratelimit.h"
+#include "breaker.h"
+
+#pragma once
+
+#define ADMISSION_BUCKETS 1543 // Number of chains in our hash table
+
+#define MAX_ENDPOINTS 17 // Maximum number of endpoints of a file (its source
+                         // and MAX_TARGETS targets)
+
+typedef struct admission_endpoint admission_endpoint;
+
+typedef struct deferred_task deferred_task;
+
+// A file that waits for an endpoint, or that was admitted after waiting
+struct deferred_task {
+    char* action; // The action of the file, as it was in worker's buffer
+    admission_endpoint* endpoints[MAX_ENDPOINTS]; // Its distinct endpoints
+    int count;
+    deferred_task* next;
+};
+
+struct admission_endpoint {
+    char key[1024]; // <host>:<port>
+    int active; // Transfers that use the endpoint
+    deferred_task* head; // Files that wait for the endpoint
+    deferred_task* tail;
+    token_bucket limit; // The endpoint's bandwidth limit
+    circuit_breaker breaker; // Stops connections while it doesn't answer
+    admission_endpoint* next;
+};
+
+/* Initializes admission control, with at most max_transfers transfers for
+ * every endpoint (0 means that there is no limit). It should be called once,
+ * before any worker thread is created */
+void admission_init(int max_transfers);
+
+/* Returns the endpoint of key (<host>:<port>), and creates it if it doesn't
+ * exist. Endpoints are only freed by admission_destroy, so their limit and 
+ * breaker can be used without locking admission control */
+admission_endpoint* admission_lookup(char* key);
+
+/* Admits a file with the given endpoints (<host>:<port>, an endpoint can be
+ * given many times) and returns true, or if an endpoint is full, keeps a copy
+ * of action in its queue and returns false */
+bool admission_acquire(char** endpoints,int count,char* action);
+
+/* Releases the endpoints of a file that was admitted. The files that were
+ * waiting for them and are now admitted, are added to the end of admitted */
+void admission_release(char** endpoints,int count,deferred_task** admitted);
+
+/* Removes the first file of admitted and copies its action in action, or
+ * returns false if there isn't one */
+bool admission_next(deferred_task** admitted,char* action);
+
+/* Frees admission control from the memory */
+void admission_destroy(void);
@@ -0,0 +1,60 @@
+/* Header file for the string arena. The arena stores strings in big chunks of
+ * memory, one after the other, instead of a malloc for each one. A string is
+ * stored only once (it is interned), so when many pairs have the same host or
+ * target, they share the same copy of it.
+ *
+ * Strings are never freed one by one, they all stay valid until
+ * arena_destroy. Other small objects that must outlive their owner can be
+ * allocated in the arena too. The arena isn't thread safe, its owner must
+ * lock it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+
+#pragma once
+
+#define ARENA_CHUNK 65536 // Size of a chunk of the arena
+
+#define ARENA_ALIGN 8 // Alignment of the memory of arena_alloc
+
+typedef struct arena_chunk arena_chunk;
+
+struct arena_chunk {
+    arena_chunk* next;
+    size_t used; // Bytes of data that are used
+    size_t size; // Bytes of data
+    char data[];
+};
+
+// A string of the arena and its hash code
+typedef struct {
+    unsigned int hash;
+    char* string;
+} interned;
+
+typedef struct {
+    arena_chunk* chunks; // The chunk we store in is the first one
+    // Open addressing table of all the strings of the arena
+    interned* strings;
+    int count;
+    int capacity; // A power of 2
+    // The previous table, while its strings are moved to the new one a few
+    // at a time
+    interned* old_strings;
+    int old_capacity;
+    int migrated; // Strings of old_strings before this one were moved
+} arena;
+
+/* Creates an empty arena */
+arena* arena_create(void);
+
+/* Returns the copy of string that is stored in the arena, it is stored if
+ * it isn't already there */
+char* arena_intern(arena* strings,const char* string);
+
+/* Returns size bytes of zeroed memory, aligned to ARENA_ALIGN, that stay
+ * valid until arena_destroy */
+void* arena_alloc(arena* strings,size_t size);
+
+/* Frees the arena and all its strings */
+void arena_destroy(arena* strings);
@@ -0,0 +1,57 @@
+/* Header file for nfs_manager's circuit breakers. Every endpoint (host:port)
+ * has a breaker, kept with the endpoint's metrics, that stops us from 
+ * connecting to an nfs_client that doesn't answer.
+ *
+ * A breaker is closed while connections succeed. After BREAKER_FAILURES 
+ * connections in a row fail, it opens: connections to the endpoint fail at 
+ * once, without waiting for the connect timeout, so the workers go on with
+ * the files of healthy pairs. When the breaker's backoff passes, it lets one
+ * connection through to probe the endpoint. If the probe succeeds the breaker
+ * closes, else it opens again with double the backoff.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#pragma once
+
+#define BREAKER_FAILURES 3 // Failures in a row that open a breaker
+
+#define BREAKER_BACKOFF_USEC 1000000 // The first backoff of a breaker
+
+#define BREAKER_MAX_BACKOFF_USEC 60000000 // A backoff doesn't grow beyond this
+
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_PROBING 2 // A connection probes the endpoint
+
+typedef struct {
+    pthread_mutex_t lock;
+    int state;
+    int failures; // Connections that failed in a row
+    long long backoff; // The backoff the breaker opens with next time
+    long long open_until; // When a probe is let through
+} circuit_breaker;
+
+/* Initializes breaker closed */
+void breaker_init(circuit_breaker* breaker);
+
+/* Returns true if a connection can be attempted at time now (in the clock of
+ * metrics_now). When the backoff of an open breaker has passed, it returns 
+ * true once, for the probe */
+bool breaker_allow(circuit_breaker* breaker,long long now);
+
+/* Returns true if breaker is open at time now, and connections would fail at
+ * once. It doesn't let a probe through */
+bool breaker_is_open(circuit_breaker* breaker,long long now);
+
+/* Records that a connection succeeded */
+void breaker_success(circuit_breaker* breaker);
+
+/* Records that a connection failed at time now */
+void breaker_failure(circuit_breaker* breaker,long long now);
+
+/* Returns the state of breaker, and puts in retry_in the microseconds until
+ * it lets a probe through (0 if it isn't open) */
+int breaker_state(circuit_breaker* breaker,long long now,long long* retry_in);
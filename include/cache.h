@@ -0,0 +1,95 @@
+/* Header file for nfs_manager's content cache. Files that are synced to many
+ * targets (e.g. shared libraries, base images) are kept in memory after they
+ * are pulled, so the next worker that needs them pushes them from the cache, 
+ * instead of pulling them from their source again.
+ *
+ * A cached file is identified by its source path (<source_dir>/<file>@<host>:
+ * <port>) together with its size and modification time, so a file that 
+ * changes in source is never served from an older version.
+ *
+ * The cache is bounded. When it is full, the least recently used files are 
+ * evicted, and if an on-disk tier is given, they are moved to disk instead of
+ * being dropped. The cache can be used by many worker threads at the same time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+
+#pragma once
+
+#define CACHE_BUCKETS 1543 // Number of chains in our hash tables
+
+typedef struct cache_entry cache_entry;
+
+// A cached file. Only the extents of the file that contain data are kept
+struct cache_entry {
+    char key[1024]; // <source_dir>/<file>@<host>:<port>
+    long long size;
+    long long mtime;
+    int extent_count;
+    int extent_capacity;
+    long long* extent_offsets;
+    long long* extent_lengths;
+    char* data; // The data of all extents, one after the other
+    long long data_len;
+    long long data_capacity;
+    int refs; // Number of workers that are using the entry
+    bool cached; // False after the entry is removed from the cache
+    cache_entry* prev; // Neighbours in our LRU list
+    cache_entry* next;
+    cache_entry* chain; // Next entry in the hash table's chain
+};
+
+typedef struct disk_entry disk_entry;
+
+// A cached file, that was moved to the on-disk tier 
+struct disk_entry {
+    char key[1024];
+    long long size;
+    long long mtime;
+    long long bytes; // Bytes the file uses in disk
+    char filename[1024];
+    disk_entry* prev; // Neighbours in our LRU list
+    disk_entry* next;
+    disk_entry* chain; // Next entry in the hash table's chain
+};
+
+/* Initializes the cache, with memory_limit bytes of memory. If disk_dir is 
+ * not NULL, evicted files are moved in disk_dir until they use disk_limit 
+ * bytes. A memory_limit of 0 disables the cache */
+void cache_init(long long memory_limit,char* disk_dir,long long disk_limit);
+
+/* Returns true if the cache is enabled */
+bool cache_enabled(void);
+
+/* Returns the maximum size of a file that the cache accepts */
+long long cache_max_entry(void);
+
+/* Creates an empty entry for the file key, that has the given size and mtime.
+ * The caller adds the file's data with cache_entry_add, and then either adds
+ * it to the cache with cache_insert or frees it with cache_entry_free */
+cache_entry* cache_entry_create(char* key,long long size,long long mtime);
+
+/* Appends len bytes of data, that are at offset of the file, to entry */
+void cache_entry_add(cache_entry* entry,long long offset,char* data,int len);
+
+/* Frees an entry that isn't in the cache from the memory */
+void cache_entry_free(cache_entry* entry);
+
+/* Adds entry to the cache, evicting the least recently used files if needed.
+ * The cache owns the entry after this call */
+void cache_insert(cache_entry* entry);
+
+/* Returns the cached file key, if its size and mtime are the ones given, or 
+ * NULL. The entry isn't evicted until it is given back with cache_release */
+cache_entry* cache_lookup(char* key,long long size,long long mtime);
+
+/* Gives back an entry returned by cache_lookup */
+void cache_release(cache_entry* entry);
+
+/* Puts in buffer a line with cache's hits, misses, hit ratio and memory and 
+ * disk usage, and returns a pointer to buffer */
+char* cache_report(char* buffer);
+
+/* Frees the cache from the memory and deletes its files in disk */
+void cache_destroy(void);
@@ -0,0 +1,50 @@
+/* Header file for the checkpoint store. nfs_manager uses it to remember how 
+ * far an unfinished transfer got, so that the next attempt to sync the same 
+ * file resumes from there, instead of starting again from byte zero.
+ * Checkpoints are keyed by the target file, in the form
+ *      <target_dir>/<filename>@<host>:<port>
+ * and the store can be used by many worker threads at the same time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#pragma once
+
+#define CHECKPOINT_BUCKETS 1543 // Number of chains in our hash table
+
+// The source file when a checkpoint was recorded. If any of these changed,
+// the bytes that target has belong to another file
+typedef struct {
+    long long size;
+    long long mtime; // Modification time, in nanoseconds
+    uint64_t inode; // 0 if it isn't known
+} checkpoint_source;
+
+typedef struct checkpoint_node checkpoint_node;
+
+struct checkpoint_node {
+    char key[1024]; // <target_dir>/<filename>@<host>:<port>
+    checkpoint_source source;
+    long long offset; // Bytes of the file that were sent to target
+    checkpoint_node* next;
+};
+
+/* Initializes the checkpoint store. It should be called once, before any 
+ * worker thread is created */
+void checkpoint_init(void);
+
+/* Records that offset bytes of the source file were sent for key. If key 
+ * already has a checkpoint it is replaced */
+void checkpoint_set(char* key,checkpoint_source* source,long long offset);
+
+/* Returns the offset recorded for key and copies the source file it was
+ * recorded for in source, or 0 if there is no checkpoint for key */
+long long checkpoint_get(char* key,checkpoint_source* source);
+
+/* Removes key's checkpoint, if it exists */
+void checkpoint_remove(char* key);
+
+/* Frees the checkpoint store from the memory */
+void checkpoint_destroy(void);
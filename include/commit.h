@@ -0,0 +1,50 @@
+/* Header file for nfs_client's group commit. A PUSH (or a COPY) writes a temp
+ * file, that replaces the real file when it is complete, so readers never
+ * see a half written file. To make the file durable too, without an fsync
+ * for every file, the files that are completed within a time window are
+ * committed together by a background thread, in a single round:
+ *
+ *      - syncfs for every filesystem of the round's files, so their data
+ *        are in the disk before any of them is renamed
+ *      - every temp file is renamed to its real file
+ *      - syncfs again, so the renames are in the disk too
+ *
+ * The thread that completed a file waits for its round, and only then it
+ * acknowledges the file to nfs_manager.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+#pragma once
+
+#define COMMIT_WINDOW_MS 10 // Default time window of a round
+
+typedef struct commit_request commit_request;
+
+// A completed temp file that waits for its round
+struct commit_request {
+    int fd; // The temp file, it is closed by its round
+    char* tmp_filename;
+    char* filename;
+    dev_t dev; // The filesystem of the file
+    int error; // The errno of the commit, or 0
+    bool done;
+    commit_request* next;
+};
+
+/* Starts the background thread, that commits the files every window_ms
+ * milliseconds. If window_ms is 0, files are renamed as soon as they are
+ * complete, without syncing them. It should be called once, before any
+ * connection is served */
+void commit_init(int window_ms);
+
+/* Commits the temp file fd (tmp_filename) as filename, and closes fd. It
+ * waits until the round of the file is over.
+ *
+ * Returns 0 when filename is durable, or -1 in case of an error (errno is
+ * set, and the temp file stays as it was)
+ */
+int commit_file(int fd,char* tmp_filename,char* filename);
@@ -0,0 +1,54 @@
+/* Header file for nfs_manager's dedup index. Pairs with the dedup option find
+ * out the SHA-256 hash of a file before they pull it (the DIGEST command of
+ * its source), and look it up in a global index of the contents we have 
+ * already placed on every target (<host>:<port>). If the target already has
+ * a file with the same size and hash, under any pair and any name, it clones
+ * it (CLONE, a hard link or a copy_file_range), so the file's data aren't 
+ * pulled and pushed again. A file that a target received whole is added to
+ * the index. The hash is a cryptographic one, as a collision would give a 
+ * file the content of another one.
+ *
+ * The index is kept in memory, so it starts empty in every run. An entry can
+ * get stale (its file was changed or deleted), so a target checks the hash
+ * of the file it clones, and a clone that fails removes the entry.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "nfs.h"
+
+#pragma once
+
+#define DEDUP_BUCKETS 4099 // Number of chains in our hash table
+
+typedef struct dedup_entry dedup_entry;
+
+// A content that a target has, and the file that has it
+struct dedup_entry {
+    char* endpoint; // <host>:<port> of the target
+    long long size;
+    char hash[2 * SHA256_SIZE + 1]; // SHA-256, in hexadecimal
+    char* path; // The file in target, <target_dir>/<filename>
+    dedup_entry* next;
+};
+
+/* Initializes the index. It should be called once, before any worker thread
+ * is created */
+void dedup_init(void);
+
+/* Puts in path (of 1024 bytes) a file of host:port that has size bytes with
+ * the given hash and returns true, or returns false if there is none */
+bool dedup_find(char* host,int port,long long size,char* hash,char* path);
+
+/* Records that path of host:port has size bytes with the given hash. It 
+ * replaces an older file with the same content */
+void dedup_add(char* host,int port,long long size,char* hash,char* path);
+
+/* Removes the entry of path of host:port with the given content, if there 
+ * is one, after a clone of it failed */
+void dedup_forget(char* host,int port,long long size,char* hash,char* path);
+
+/* Frees the index from the memory */
+void dedup_destroy(void);
@@ -0,0 +1,46 @@
+/* Header file for nfs_manager's logger. Worker threads format every record of
+ * the logfile in their own stack, and they put it in a ring of slots, without
+ * taking any lock. A background thread takes the records out of the ring and
+ * writes as many of them as it can with a single writev, so writing to the
+ * logfile never makes the workers wait for each other.
+ *
+ * The logger also keeps a coarse clock, the timestamp of the current second,
+ * that the background thread updates, so the records don't need to call
+ * localtime and strftime every time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#pragma once
+
+#define LOG_SLOTS 1024 // Number of records the ring can keep (a power of 2)
+
+#define LOG_RECORD 1024 // Records longer than that are kept out of the ring
+
+#define LOG_BATCH 512 // Maximum number of records of a single writev
+
+// A slot of our ring
+typedef struct {
+    atomic_ullong sequence; // Tells if the slot is free or it has a record
+    int len;
+    char* long_record; // Records longer than LOG_RECORD, or NULL
+    char record[LOG_RECORD];
+} log_slot;
+
+/* Starts the background thread, that writes the records to logfile_fd. It
+ * should be called once, before any worker thread is created */
+void logger_init(int logfile_fd);
+
+/* Puts a record of len bytes in the ring, to be written to the logfile. If the
+ * ring is full, it waits until there is a free slot, so no record is lost */
+void logger_write(char* record,int len);
+
+/* Puts the current timestamp of the coarse clock inside time_buffer and
+ * returns a pointer to it */
+char* logger_timestamp(char time_buffer[32]);
+
+/* Writes every record that is still in the ring and stops the background
+ * thread. The logfile isn't closed */
+void logger_destroy(void);
@@ -0,0 +1,90 @@
+/* Header file for the manifest of synced files. nfs_manager records in it
+ * every file it syncs to a target: the file's size, modification time,
+ * content hash, inode and when it was synced. The manifest is a file that is
+ * mapped in memory, with the same layout in disk and in memory, so it survives
+ * restarts and a lookup reads a record directly, without parsing anything.
+ *
+ * Records are keyed by the source and the target file of a sync, in the form
+ *      <source_dir>/<filename>@<host>:<port> <target_dir>/<filename>@<host>:<port>
+ * and the manifest can be used by many worker threads at the same time.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#pragma once
+
+#define MANIFEST_MAGIC "NFSMAN02" // The first bytes of a manifest file
+
+#define MANIFEST_MAGIC_V1 "NFSMAN01" // A manifest without inodes, that is
+                                     // upgraded when it is opened
+
+#define MANIFEST_INITIAL_RECORDS 1024 // Initial capacity, a power of 2
+
+#define MANIFEST_INITIAL_STRINGS 65536 // Initial bytes for the keys
+
+#define MANIFEST_HASH_INIT 14695981039346656037ULL // Initial value of a
+                                                    // content hash
+
+// The start of a manifest file. After it there are capacity records, and
+// after them strings_size bytes where the keys are stored
+typedef struct {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t count;
+    uint64_t strings_used;
+    uint64_t strings_size;
+} manifest_header;
+
+// The record of a synced file. key_hash is 0 if the record is empty
+typedef struct {
+    uint64_t key_hash;
+    uint64_t key_offset; // Where the key is, in the strings of the manifest
+    uint32_t key_len;
+    uint32_t unused;
+    int64_t size;
+    int64_t mtime; // Modification time of source's file, in nanoseconds, or 0
+    uint64_t content_hash; // 0 if the whole file wasn't seen by nfs_manager
+    int64_t synced_at; // When the file was synced, in seconds since the Epoch
+    uint64_t inode; // The inode of source's file, or 0 if it isn't known
+} manifest_record;
+
+// A record of the manifest and its key
+typedef struct {
+    char* key; // <source_path> <target_path>, allocated
+    manifest_record record;
+} manifest_entry;
+
+/* Opens the manifest in manifest_file, it is created if it doesn't exist.
+ * Without it, the other functions do nothing */
+void manifest_init(char* manifest_file);
+
+/* Returns true if the manifest is enabled */
+bool manifest_enabled(void);
+
+/* Records that the source file was synced to the target file, with the given
+ * size, modification time, content hash and inode. An older record of the
+ * same files is replaced */
+void manifest_set(char* source_path,char* target_path,long long size,long long mtime,uint64_t content_hash,uint64_t inode);
+
+/* Removes the record of the source and target file, if there is one */
+void manifest_remove(char* source_path,char* target_path);
+
+/* Puts in entries (allocated) a copy of every record whose key starts with
+ * prefix, and returns their number. They are freed with manifest_free */
+int manifest_list(char* prefix,manifest_entry** entries);
+
+/* Frees count entries that manifest_list returned */
+void manifest_free(manifest_entry* entries,int count);
+
+/* Copies the record of the source and target file in result and returns
+ * true, or returns false if there is none */
+bool manifest_get(char* source_path,char* target_path,manifest_record* result);
+
+/* Adds len bytes of data to a content hash (FNV-1a), that starts as
+ * MANIFEST_HASH_INIT, and returns it */
+uint64_t manifest_hash(uint64_t hash,const void* data,long long len);
+
+/* Writes the manifest to its file and unmaps it */
+void manifest_destroy(void);
@@ -1,38 +1,137 @@
-/* Header file for sync_info_mem_store data structure. This structure is used 
- * by nfs_manager program, to allow fast access (O(1) amortised) to the 
+/* Header file for sync_info_mem_store data structure. This structure is used
+ * by nfs_manager program, to allow fast access (O(1) amortised) to the
  * information stored for every pair of files.
- * The sync_info_mem data structure is implemented using a hash table, with 
- * linked chains, using theory princibles from Data Structures course, to 
- * improve efficency (rehashing,using prime sizes etc). We use source directory as a primary key
+ * The sync_info_mem data structure is implemented using a hash table with open
+ * addressing (Robin Hood hashing), using theory princibles from Data Structures
+ * course, to improve efficency (rehashing,using prime sizes etc). We use source
+ * directory as a primary key. The entries are stored in the table itself, next
+ * to their hash code, and their strings are interned in an arena, so a lookup
+ * touches one or two cache lines instead of following a linked chain.
+ *
+ * The structure is used by many threads at the same time: the main thread adds
+ * and cancels pairs, while workers check the state of the pair of every file
+ * they sync. So the table is split in MAP_SHARDS shards, each one with its own
+ * hash table and lock for the writers. Readers don't take any lock, they use
+ * the sequence number of the shard (seqlock) to know that nothing changed
+ * while they were reading, and the memory writers remove is freed only when
+ * no reader is in the shard. A shard doesn't rehash all at once when it
+ * grows, its entries are moved gradually, so no single add stalls the
+ * thread that does it.
  * */
 #include <stdio.h>
 #include <stdlib.h>
-#include "lnode.h"
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "arena.h"
 #include "nfs.h"
-#define INITIAL_SIZE 193 // initial size for our hash_table
+#include "ratelimit.h"
+#define INITIAL_SIZE 53 // initial size for the hash_table of every shard
+
+#define MAP_SHARDS 64 // Number of shards, a power of 2
+
+#define MAP_MIGRATE_STEP 8 // Entries that a write moves from the old hash table
 
 #pragma once
 
+// The settings of a pair, from its line in the config file
+typedef struct {
+    int bulk; // Its bulk I/O mode (BULK_*)
+    bool verify; // True if its transfers are verified
+    bool dedup; // True if its files are cloned from files with the same
+                // content that their targets already have
+} pair_options;
+
+typedef struct {
+    // The strings are in the arena of the map, they stay valid until
+    // map_destroy, even if the pair is removed
+    char* key; // Our key is the <source_dir>@<ip>:<port> format
+    char* source_dir; // Our source directory
+    char* source_host;
+    int source_port;
+    char* target_dir; // Our target directory
+    char* target_host;
+    int target_port;
+    char* targets; // All the targets of the pair seperated by commas, the
+                   // first one is also decoded above
+    bool is_active; // Is true if the directory is actively monitored
+    unsigned int generation; // Changes every time the pair is added or 
+                             // cancelled, the files we queue carry it
+    // The limit and the options are kept when the pair is added again
+    token_bucket* limit; // The pair's bandwidth limit. It is in the arena of
+                         // the map, like the strings
+    pair_options options;
+} dir_info;
+
+// An entry of the hash table. hash is 0 if the entry is empty
+typedef struct {
+    unsigned int hash;
+    bool moved; // The entry of an old hash table was moved to the new one
+    dir_info value;
+} map_slot;
+
+// A hash table, its capacity is allocated with it so readers always see the
+// capacity of the table they read
 typedef struct {
-    // Our hash table uses seperate chaining
-    lnode** hash_table; 
     int size;
     int capacity;
+    map_slot slots[];
+} map_table;
+
+typedef struct retired retired;
+
+// Memory that was removed from a shard, but a reader can still be using it
+struct retired {
+    void* memory;
+    retired* next;
+};
+
+typedef struct {
+    pthread_mutex_t lock; // Locked by the writers of the shard
+    atomic_uint sequence; // Odd while a writer changes the shard
+    atomic_int readers; // Number of readers in the shard
+    map_table* hash_table;
+    // While the shard grows, the entries of the previous hash table are moved
+    // to the new one a few at a time, by every write. Until they all move,
+    // both tables are searched
+    map_table* old_hash_table;
+    int migrated; // Entries of old_hash_table before this one were moved
+    arena* strings; // The strings of the shard's entries
+    retired* retired_memory; // Freed when there are no readers
+} map_shard;
+
+typedef struct {
+    map_shard shards[MAP_SHARDS];
+    atomic_uint generations; // The last generation that was given to a pair
 } map;
 
 // Creates and initializes a map data structure
 map* map_create(void);
 
 // Adds new_value into structure. source and target are entries of
-//  <source_dir>@<ip>:<port>
-void map_add(map* mem,char* source,char* target);
+//  <source_dir>@<ip>:<port>, target can also be many entries seperated by
+//  commas. A pair that is already in map keeps its limit and options.
+//  Returns the new generation of the pair
+unsigned int map_add(map* mem,char* source,char* target);
 
 // Removes value with given source_dir
 void map_remove(map* mem,char* source);
 
-// Returns status of the source dir or NULL if it doesn't exist
-dir_info* map_find(map* mem,char* source);
+// Copies the status of the source dir in result and returns true, or returns
+// false if it doesn't exist
+bool map_find(map* mem,char* source,dir_info* result);
 
-// Frees the structure from the memory 
-void map_destroy(map* mem);
+// Changes whether the source dir is actively monitored, and gives it a new
+// generation. Returns false if it doesn't exist
+bool map_set_active(map* mem,char* source,bool is_active);
+
+// Changes the options of the source dir. Returns false if it doesn't exist
+bool map_set_options(map* mem,char* source,pair_options* options);
 
+// Returns true if the source dir is actively monitored and it is still in the
+// given generation, so a file that was queued for it should still be synced.
+// It doesn't take any lock, so workers can check it as often as they need
+bool map_is_current(map* mem,char* source,unsigned int generation);
+
+// Frees the structure from the memory
+void map_destroy(map* mem);
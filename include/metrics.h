@@ -0,0 +1,153 @@
+/* Header file for nfs_manager's metrics. The metrics are counters, gauges and
+ * latency histograms, that the workers update with atomic operations, so
+ * keeping them doesn't make the workers wait for each other. Some metrics are
+ * kept for every pair (by its source) and for every endpoint (host:port) we
+ * connect to. The report also shows their bandwidth limits, and the circuit
+ * breakers of the endpoints, that are kept with the pairs in the map and
+ * with the endpoints in admission control.
+ *
+ * The metrics are shown by the stats command of nfs_console, and they can also
+ * be written periodically in a snapshot file, as text or as JSON.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include "ratelimit.h"
+
+#pragma once
+
+// Histograms are HDR-style: every power of 2 is split in HISTOGRAM_SUB 
+// buckets, so a value is known with an error of at most 1/HISTOGRAM_SUB
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_MAX_BITS 40 // Values up to 2^40 usec (~12 days)
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB)
+
+#define METRICS_PAIRS 256 // Initial room for the metrics of pairs, more is
+                          // added when it is needed
+
+#define METRICS_ENDPOINTS 256 // Initial room for the metrics of endpoints
+
+#define STATS_INTERVAL 5 // Seconds between two snapshots of the metrics
+
+// The counters, that only increase
+#define COUNTER_TASKS_DONE 0 // Files synced to all their targets
+#define COUNTER_TASKS_FAILED 1
+#define COUNTER_RETRIES 2
+#define COUNTER_BYTES_PULLED 3
+#define COUNTER_BYTES_PUSHED 4
+#define COUNTER_BYTES_COPIED 5 // Bytes copied locally by nfs_client (COPY)
+#define COUNTER_BYTES_CACHED 6 // Bytes sent from our cache
+#define COUNTER_BUSY_USEC 7 // Time workers spent syncing files
+#define COUNTER_CHECKSUM_MISMATCHES 8 // Verified files whose target's digest 
+                                      // wasn't the source's
+#define COUNTER_BYTES_MOVED 9 // Bytes that targets renamed or linked, instead
+                              // of receiving them
+#define COUNTER_BYTES_DEDUPED 10 // Bytes that targets cloned from a file with
+                                 // the same content, instead of receiving them
+#define COUNTERS 11
+
+// The phases of a file transfer, that we keep a latency histogram for
+#define PHASE_CONNECT 0 // Connecting to the targets and the source
+#define PHASE_FIRST_BYTE 1 // From sending PULL (or STAT) until source replies
+#define PHASE_RELAY 2 // Relaying the file's data from source to the targets
+#define PHASE_CLOSE 3 // Sending the last data and PUSH -1 after source ended
+#define PHASE_COPY 4 // A COPY of a local target
+#define PHASES 5
+
+// The gauges, that show a current value
+#define GAUGE_QUEUE_DEPTH 0 // Actions waiting in worker's buffer
+#define GAUGE_BUSY_WORKERS 1
+#define GAUGE_DEFERRED 2 // Files that wait for an endpoint
+#define GAUGES 3
+
+// A histogram of latencies, in microseconds
+typedef struct {
+    atomic_llong buckets[HISTOGRAM_BUCKETS];
+    atomic_llong count;
+    atomic_llong sum;
+    atomic_llong max;
+} histogram;
+
+typedef struct metrics_table metrics_table;
+
+// A table of pair or endpoint metrics (its entries), with linear probing.
+// When it is 3/4 full, new entries go to a table twice its size, that is
+// chained after it
+struct metrics_table {
+    char* entries; // capacity entries of entry_size bytes, each starting
+                   // with its used flag
+    int capacity;
+    int count;
+    size_t entry_size;
+    metrics_table* _Atomic next;
+};
+
+// The metrics of a pair
+typedef struct {
+    atomic_bool used;
+    char source[1024]; // <source_dir>@<host>:<port>
+    atomic_llong files_queued;
+    atomic_llong files_done;
+    atomic_llong files_failed;
+    atomic_llong bytes; // Bytes that its targets received
+    token_bucket* _Atomic limit; // The pair's bandwidth limit (it is kept
+                                 // with the pair in the map), or NULL
+} pair_metrics;
+
+// The metrics of an endpoint we connect to
+typedef struct {
+    atomic_bool used;
+    char endpoint[1024]; // <host>:<port>
+    atomic_llong failures; // Connections that failed
+    histogram connect_latency;
+} endpoint_metrics;
+
+/* Initializes the metrics. It should be called once, before any worker thread
+ * is created */
+void metrics_init(void);
+
+/* Adds value to a counter */
+void metrics_add(int counter,long long value);
+
+/* Changes a gauge to value */
+void metrics_set(int gauge,long long value);
+
+/* Adds value to a gauge (value can be negative) */
+void metrics_change(int gauge,long long value);
+
+/* Adds a latency of usec microseconds to histogram */
+void metrics_observe(histogram* hist,long long usec);
+
+/* Returns the histogram of task latencies (the time a file needs to be synced
+ * to all its targets) */
+histogram* metrics_task_latency(void);
+
+/* Returns the latency histogram of a phase of the transfers */
+histogram* metrics_phase(int phase);
+
+/* Returns the name of a phase */
+char* metrics_phase_name(int phase);
+
+/* Returns the metrics of the pair with the given source, and creates them if
+ * they don't exist */
+pair_metrics* metrics_pair(char* source);
+
+/* Returns the metrics of host:port, and creates them if they don't exist */
+endpoint_metrics* metrics_endpoint(char* host,int port);
+
+/* Returns the microseconds since an unspecified point, for measuring latencies */
+long long metrics_now(void);
+
+/* Writes a report of all the metrics to fd, as text, or as JSON if json is
+ * true */
+void metrics_report(int fd,bool json);
+
+/* Starts a thread that writes a report of the metrics to stats_file every
+ * STATS_INTERVAL seconds. The report is JSON if stats_file ends with .json */
+void metrics_start_snapshots(char* stats_file);
+
+/* Stops the snapshot thread, after it writes a last report */
+void metrics_destroy(void);
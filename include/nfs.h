@@ -4,9 +4,61 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
 
 #pragma once
 
+#define RESOLVE_CACHE_SIZE 64 // Number of host names we keep resolved
+
+#define RESOLVE_TTL 60 // Seconds a resolved host name is kept
+
+// Bulk I/O modes of a transfer (BULK <mode>), so a big sync doesn't evict 
+// the page cache of the hosts it passes through
+#define BULK_OFF 0 // Normal I/O
+
+#define BULK_CACHE 1 // The file's pages are dropped after they are used
+
+#define BULK_DIRECT 2 // Like BULK_CACHE, but the target also writes with 
+                      // O_DIRECT
+
+#define DIGEST_LANES 4 // Words of a stripe, that a digest mixes independently
+
+#define DIGEST_STRIPE (DIGEST_LANES * 8) // Bytes a digest mixes at once
+
+// The digest of the data of a transfer, that both its ends compute while 
+// the data stream through them (VERIFY), so they can be compared without
+// reading the file again. It doesn't depend on how the data were split in
+// reads or chunks, only on their offsets and their bytes
+typedef struct {
+    uint64_t lanes[DIGEST_LANES]; // Every word of a stripe has its own lane
+    long long end; // Offset after the last data, -1 before any data
+    unsigned char tail[DIGEST_STRIPE]; // Bytes that don't make a whole 
+    int tail_len;                      // stripe yet
+    long long length; // Bytes of data in the digest
+} digest;
+
+#define SHA256_SIZE 32 // Bytes of a SHA-256 hash
+
+#define SHA256_BLOCK 64 // Bytes SHA-256 mixes at once
+
+// A SHA-256 hash, for contents that must never be taken for another one (the
+// dedup index of nfs_manager), where a 64-bit digest could collide
+typedef struct {
+    uint32_t state[8];
+    uint64_t length; // Bytes in the hash
+    unsigned char block[SHA256_BLOCK]; // Bytes that don't make a whole block
+    int block_len;                     // yet
+} sha256;
+
+// A host name and the address it was resolved to
+typedef struct {
+    char host[256];
+    struct in_addr addr;
+    time_t expires; // 0 means that the entry is empty
+} resolved_host;
+
 
 /* Puts the current timestamp inside time_buffer and returns a pointer to it */
 char* print_timestamp(char time_buffer[32]); 
@@ -17,7 +69,7 @@ void perror_exit(char* error_msg);
 /* Puts n's decimal representation in buffer, and returns a pointer to buffer. 
  * !!! It doesn't allocate memory for buffer !!!
  */
-char* number_to_string(char* buffer,int n);
+char* number_to_string(char* buffer,long long n);
 
 /* Decodes the following string format:
  *      <directory_name>@<host_addr>:<port_number>
@@ -45,15 +97,34 @@ int decode_format(const char* input,char* dir_name,char* host_addr,int* port);
  * !!! This function doesn't allocate space for dir buffer it should be already
  *     done by its caller !!!
  *
+ * Returns 0, or -1 if the connection was closed (or dropped) before a word was
+ * read
  */
-void getnextword(int sockfd,char* dir);
+int getnextword(int sockfd,char* dir);
 
 /* This function reads a numbers from a socket until whitespace is given and 
  * returns the number that was read
  *
- * In case of an error, it returns INT_MIN
+ * In case of an error, or if the connection was closed, it returns LLONG_MIN
+ */
+long long getsize(int sockfd);
+
+/* Puts the ipv4 address of host in addr, and returns 0, or -1 if host can't
+ * be resolved. Resolved hosts are kept for RESOLVE_TTL seconds, so workers
+ * don't ask the resolver for every connection. It is thread safe
  */
-int getsize(int sockfd);
+int resolve_host(char* host,struct in_addr* addr);
+
+/* Sets the size of the send and receive buffers of the sockets we create from
+ * now on. 0 (the default) leaves them to the kernel, that grows them on its
+ * own up to its own limits. Links with a high bandwidth-delay product need 
+ * buffers bigger than that, to keep enough data in flight
+ */
+void set_socket_buffers(int bytes);
+
+/* Gives sock the buffers of set_socket_buffers. It should be called before 
+ * sock connects (or listens), so the TCP window can use them */
+void tune_socket(int sock);
 
 /* Attemps to connect to <host> in port <port>. At success it returns a socket
  * we can use for communicating with host, else -1. 
@@ -63,4 +134,44 @@ int getsize(int sockfd);
  */
 int connect_to_host(char* host,int port);
 
+/* Makes a blocking read of sock (and getsize or getnextword on it) fail, with
+ * errno EAGAIN, after timeout_ms milliseconds without data */
+void set_receive_timeout(int sock,int timeout_ms);
+
+/* Like connect_to_host, but gives up after timeout_ms milliseconds (a
+ * negative timeout means that there is no deadline), with errno ETIMEDOUT.
+ * The socket it returns is blocking, like the one of connect_to_host
+ */
+int connect_with_timeout(char* host,int port,int timeout_ms);
+
+/* Starts an empty digest */
+void digest_init(digest* sum);
+
+/* Adds len bytes of data, that are at offset of the file, to sum. Data that 
+ * don't continue the previous ones (after a hole) add their offset too */
+void digest_data(digest* sum,long long offset,const void* data,size_t len);
 
+/* Returns the value of sum. sum can't take more data after it */
+uint64_t digest_final(digest* sum);
+
+/* Puts the hexadecimal representation of a digest's value in buffer, and 
+ * returns a pointer to buffer.
+ * !!! It doesn't allocate memory for buffer (17 bytes) !!!
+ */
+char* digest_to_string(char* buffer,uint64_t value);
+
+/* Starts an empty SHA-256 hash */
+void sha256_init(sha256* sum);
+
+/* Adds len bytes of data to sum */
+void sha256_data(sha256* sum,const void* data,size_t len);
+
+/* Puts the value of sum (SHA256_SIZE bytes) in value. sum can't take more
+ * data after it */
+void sha256_final(sha256* sum,unsigned char* value);
+
+/* Puts the hexadecimal representation of a SHA-256 value in buffer, and 
+ * returns a pointer to buffer.
+ * !!! It doesn't allocate memory for buffer (2 * SHA256_SIZE + 1 bytes) !!!
+ */
+char* sha256_to_string(char* buffer,const unsigned char* value);
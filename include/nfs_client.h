@@ -4,20 +4,110 @@
  * offers the following options:
  *      - LIST source_dir: Sends to the host the files contained inside 
  *                         source_dir. At the end of the message it sends
- *                         the character '.'
+ *                         the character '.', or -1<space><error> if
+ *                         source_dir can't be opened
  *
- *      - PULL /source_dir/file.txt: Sends to the host the contents of
+ *      - LISTX source_dir: Like LIST, but only for regular files, and every 
+ *                         file is sent in a line with its inode, its size 
+ *                         and its modification time in nanoseconds:
+ *                         <filename><space><inode><space><filesize><space><mtime><space>
+ *                         so the host can find the files that were renamed,
+ *                         linked or deleted since they were synced
+ *
+ *      - PULL /source_dir/file.txt offset: Sends to the host the contents of
  *                         ./source_dir/file.txt (Paths are relative due
- *                         to security concerns), with the following format:
- *                         <filesize><space><data...>
- *                          If filesize is -1 then data will contain the ERROR
- *                          occured
+ *                         to security concerns) that are after offset, with 
+ *                         the following format:
+ *                         <filesize><space><mtime><space><extents...>-1<space>
+ *                          (followed by <digest><space> if it was verified)
+ *                          filesize is always the size of the whole file and
+ *                          mtime is its modification time in nanoseconds. If 
+ *                          filesize is -1 then the rest of the message is 
+ *                          the ERROR occured. Only the parts of the file that
+ *                          contain data are sent (holes of sparse files are 
+ *                          skipped), each one as an extent:
+ *                          <offset><space><length><space><data...>
 
  *      - PUSH /target_dir/file.txt chunk_size data: Reads from host the data
  *                          sent, and appends it to /target/file.txt. if 
- *                          chunk_size is -1 then we clear the file first and 
- *                          if chunk_size is 0, then we have read all the data
- *                          given, and we can close the file
+ *                          chunk_size is 0 then it is followed by an offset, 
+ *                          and we open the file keeping only its first offset
+ *                          bytes, if chunk_size is -2 then it is followed by 
+ *                          an offset and the file has a hole until offset, 
+ *                          and if chunk_size is -1, then we have read 
+ *                          all the data given, and we can close the file.
+ *                          The data are written in a temp file, that replaces
+ *                          /target/file.txt only when the file is closed.
+ *                          A closed file is committed with the files of its
+ *                          group commit round, and then we reply with 0, or
+ *                          with -1 and the ERROR occured.
+ *                          If chunk_size is -3 then it is followed by an 
+ *                          offset, the temp file is opened like with 0, and
+ *                          the rest of the file follows as a stream of 
+ *                          extents <offset><space><length><space><data...>,
+ *                          like the ones of PULL, that ends with -1 (and the 
+ *                          file is closed), so a single PUSH sends the whole
+ *                          file. A verified stream ends with -1 <digest>, 
+ *                          and if the digest of the data we received isn't 
+ *                          the same, the temp file is deleted and we reply 
+ *                          with -2 and our digest instead
+ *
+ *      - STAT /source_dir/file.txt: Sends to the host the size and the 
+ *                          modification time of the file, in the form
+ *                          <filesize><space><mtime><space>, or -1 and the 
+ *                          ERROR occured. It can be followed by a PULL of 
+ *                          the file in the same connection
+ *
+ *      - OFFSET /target_dir/file.txt: Sends to the host how many bytes an 
+ *                          unfinished PUSH of /target/file.txt has written, 
+ *                          so the transfer can be resumed after them
+ *
+ *      - COPY /source_dir/file.txt /target_dir/file.txt: Copies a local file
+ *                          to another local file, without sending its data 
+ *                          through the network. The copy is committed like
+ *                          a PUSH, and it replies with the number of bytes
+ *                          copied, or with -1 and the ERROR occured
+ *
+ *      - RENAME /target_dir/old.txt /target_dir/new.txt size: Renames a 
+ *                          file we already have, when its source file was 
+ *                          renamed, so its data aren't sent again. The file
+ *                          must still have size bytes (else it fails with
+ *                          ESTALE, and the file has to be synced). The rename
+ *                          is committed like a PUSH, and it replies with 
+ *                          size, or with -1 and the ERROR occured
+ *
+ *      - LINK /target_dir/old.txt /target_dir/new.txt size: Like RENAME, but
+ *                          old.txt stays too, and new.txt is a hard link to 
+ *                          it (or a copy, if the filesystem can't link it)
+ *
+ *      - UNLINK /target_dir/file.txt: Deletes a file whose source file was
+ *                          deleted, and the temp file of an unfinished PUSH
+ *                          of it. It replies with 0 (also if there was no 
+ *                          file), or with -1 and the ERROR occured
+ *
+ *      - CLONE /target_dir/old.txt /target_dir/new.txt size hash: Like 
+ *                          LINK, for a file of any directory that has the 
+ *                          same content as new.txt. old.txt must still have
+ *                          size bytes and the given SHA-256 hash (else it 
+ *                          fails with ESTALE), so a stale file is never cloned
+ *
+ *      - DIGEST /source_dir/file.txt: Sends to the host the size, the 
+ *                          modification time and the SHA-256 hash of the 
+ *                          file's data (see file_hash), in the form
+ *                          <filesize><space><mtime><space><hash><space>,
+ *                          or -1 and the ERROR occured
+ *
+ *      - BULK mode: The PULL or PUSH stream that follows in the connection 
+ *                          is a bulk one (mode is BULK_CACHE or BULK_DIRECT),
+ *                          so the pages of the file are dropped from the 
+ *                          page cache behind it, and with BULK_DIRECT the 
+ *                          PUSH stream writes with O_DIRECT. It has no reply
+ *
+ *      - VERIFY: The PULL or PUSH stream that follows in the connection is 
+ *                          verified. Its data are added to a digest while
+ *                          they are sent (or received and written), so the 
+ *                          source's digest can be compared with the target's
+ *                          without reading the file again. It has no reply
  *
  *
  */
@@ -30,13 +120,198 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <stdbool.h>
 #include <dirent.h>
 #include "../include/nfs.h"
+#include "../include/outbuf.h"
+#include "../include/uring.h"
 
 #pragma once
 
+#define TEMP_SUFFIX ".nfspart" // Suffix of the temp files PUSH writes to
+
+#define STREAM_BUFFER (256 * 1024) // Bytes we read at once from a PUSH stream
+
+#define SEND_BUFFER 65536 // Bytes of a file we send at once in a PULL
+
+#define URING_BUFFER (256 * 1024) // Bytes of every buffer of an io_uring
+
+#define URING_FILE 0 // Registered index of a transfer's file in its io_uring
+
+#define URING_SOCKET 1 // Registered index of a transfer's socket
+
+#define URING_DIRECT 2 // Registered index of the file opened with O_DIRECT
+                       // (or of the file again, if it isn't)
+
+// The kind of an io_uring operation is kept in the lowest bit of its 
+// user_data, and the buffer it uses in the rest
+#define URING_FILE_IO 0 
+
+#define URING_SOCKET_IO 1
+
+#define BULK_WINDOW (8 * 1024 * 1024) // Bytes we read or write before we drop
+                                      // them from the page cache
+
+#define BULK_ALIGN 4096 // Alignment of the offsets, lengths and buffers of
+                        // O_DIRECT writes
+
+// The bulk I/O of a transfer's file
+typedef struct {
+    int mode; // BULK_OFF, BULK_CACHE or BULK_DIRECT
+    int fd;
+    int direct_fd; // The file opened with O_DIRECT, or -1
+    off_t synced; // The data before synced were given to writeback
+    off_t dropped; // The data before dropped were dropped from the cache
+} bulk_io;
+
 /* Function that deals with worker_threads and executes the PUSH/PULL/LIST 
  * requests
  */
 void* provide_service(void* arg_list); 
 
+/* Puts in buffer the name of the temp file, that PUSH writes before moving it
+ * to filename, and returns a pointer to buffer.
+ * !!! It doesn't allocate memory for buffer !!!
+ */
+char* temp_file_name(char* buffer,char* filename);
+
+/* Returns true if filename is a temp file of an unfinished PUSH */
+bool is_temp_file(char* filename);
+
+/* Opens the temp file of filename for a PUSH, keeping only its first offset
+ * bytes, and puts the temp file's name in tmp_filename.
+ *
+ * Returns its file descriptor (positioned at offset), or -1 in case of an 
+ * error
+ */
+int open_push(char* tmp_filename,char* filename,off_t offset);
+
+/* Commits the temp file of a PUSH (fd is closed) in place of filename, with
+ * the group commit, and replies to out with 0 when filename is durable, or 
+ * with -1 and the ERROR occured.
+ *
+ * Returns 0, or -1 in case of an error
+ */
+int close_push(outbuf* out,int fd,char* tmp_filename,char* filename);
+
+/* Moves the position of fd to offset, after a hole of the file. If the hole
+ * is after the end of the file we extend it, else we deallocate any data the
+ * hole covers.
+ *
+ * Returns 0, or -1 in case of an error
+ */
+int skip_hole(int fd,off_t offset);
+
+/* Reads the extents of a PUSH stream (<offset><space><length><space><data>)
+ * from sockfd until the -1 that ends it, and writes them to bulk's file using
+ * buffer, that has STREAM_BUFFER bytes and is aligned to BULK_ALIGN. The data
+ * are added to sum as they are received, if it isn't NULL.
+ *
+ * Returns 0, or -1 if the connection was lost or the file couldn't be written
+ */
+int receive_extents(int sockfd,bulk_io* bulk,char* buffer,digest* sum);
+
+/* Sends to out an extent of bulk's file, that starts at start and has length
+ * bytes, in the form <start><space><length><space><data...>. The data are 
+ * added to sum as they are sent, if it isn't NULL.
+ *
+ * Returns 0, or -1 if the extent couldn't be sent
+ */
+int send_extent(outbuf* out,bulk_io* bulk,off_t start,off_t length,digest* sum);
+
+/* Reads from sockfd the digest that ends a verified PUSH stream, and 
+ * compares it with sum, the digest of the data we received. If they aren't
+ * the same, tmp_filename is deleted and we reply to out with -2 and our 
+ * digest.
+ *
+ * Returns true if the data we received are the ones that were sent
+ */
+bool verify_push(outbuf* out,int sockfd,char* tmp_filename,digest* sum);
+
+/* Starts the bulk I/O of fd from offset, with the mode bulk was given. When
+ * we are reading fd the kernel is told that we read it sequentially */
+void bulk_begin(bulk_io* bulk,int fd,off_t offset,bool reading);
+
+/* Opens filename with O_DIRECT for the writes of bulk, if its mode is 
+ * BULK_DIRECT. If the filesystem doesn't support it, bulk writes through the
+ * page cache */
+void bulk_open_direct(bulk_io* bulk,char* filename);
+
+/* Returns true if len bytes at offset can be written with O_DIRECT */
+bool bulk_direct(bulk_io* bulk,off_t offset,size_t len);
+
+/* Tells bulk that the data before pos were read and sent */
+void bulk_read(bulk_io* bulk,off_t pos);
+
+/* Tells bulk that the data before pos were written */
+void bulk_written(bulk_io* bulk,off_t pos);
+
+/* Writes len bytes of data at offset of bulk's file, with O_DIRECT if they 
+ * can be.
+ *
+ * Returns 0, or -1 if they couldn't be written
+ */
+int bulk_write(bulk_io* bulk,char* data,size_t len,off_t offset);
+
+/* Ends the bulk I/O of its file. What is left of the file in the page cache
+ * is dropped (after it is written, if written is true) */
+void bulk_end(bulk_io* bulk,bool written);
+
+/* Sets up ring for a transfer between bulk's file and sockfd, with the queue
+ * depth given with -q.
+ *
+ * Returns true, or false if the transfer should use the blocking syscalls
+ */
+bool open_uring(uring* ring,bulk_io* bulk,int sockfd);
+
+/* Like send_extent, but the data of the extent are read and sent through 
+ * ring, that reads the next chunks while it sends the previous ones. The 
+ * socket of ring is the socket of out
+ *
+ * Returns 0, or -1 if the extent couldn't be sent
+ */
+int send_extent_uring(uring* ring,outbuf* out,bulk_io* bulk,off_t start,off_t length,digest* sum);
+
+/* Like receive_extents, but the data are received and written through ring,
+ * that writes the chunks it received while it receives the next ones
+ *
+ * Returns 0, or -1 if the stream didn't end (what we wrote stays in fd)
+ */
+int receive_extents_uring(uring* ring,int sockfd,bulk_io* bulk,digest* sum);
+
+/* Gives filename the file old_filename (the RENAME, LINK and CLONE commands),
+ * if it has size bytes, and the given SHA-256 hash if it isn't NULL. If link_file 
+ * is true old_filename stays, and filename is a hard link to it, or a copy if
+ * the filesystem can't link it. The new file is committed like a PUSH.
+ *
+ * Returns size, or -1 in case of an error (errno is ESTALE if old_filename 
+ * isn't a regular file of size bytes, with the hash)
+ */
+long long change_file(bool link_file,char* old_filename,char* filename,long long size,char* hash);
+
+/* Puts in value (2 * SHA256_SIZE + 1 bytes) the SHA-256 hash of the data of
+ * the first size bytes of fd, in hexadecimal. The holes are skipped, every 
+ * extent with data is hashed after its offset and its length, so the input
+ * of the hash can only come from one file.
+ *
+ * Returns 0, or -1 if the file couldn't be read
+ */
+int file_hash(int fd,off_t size,char* value);
+
+/* Sends to out -1 and the message of error (the reply of a failed command),
+ * and flushes it */
+void send_error(outbuf* out,int error);
+
+/* Copies the first size bytes of in_fd to out_fd, keeping the holes of the 
+ * file, with copy_file_range (or read and write if it isn't supported).
+ *
+ * Returns the number of bytes copied, or -1 in case of an error
+ */
+long long copy_extents(int in_fd,int out_fd,off_t size);
+
+/* Adds to out the size and the modification time (in nanoseconds) of the
+ * file info describes, in the form <filesize><space><mtime><space>. It 
+ * doesn't flush out
+ */
+void send_stat(outbuf* out,struct stat* info);
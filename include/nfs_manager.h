@@ -4,7 +4,10 @@
  * nfs_manager is executed as follows:
  *
  *      ./nfs_manager -l <manager_logfile> -c <config_file> -n <worker_limit> 
- *          -p <port_number> -b <bufferSize>
+ *          -p <port_number> -b <bufferSize> [-m <cache_mb>] [-d <cache_dir>]
+ *          [-D <cache_disk_mb>] [-s <stats_file>] [-t <trace_file>]
+ *          [-f <manifest_file>] [-e <endpoint_limit>] [-w <connect_timeout>]
+ *          [-B <socket_buffer_kb>]
  *
  *  Each parameter is described below:
  *
@@ -12,7 +15,8 @@
  *  logfiles
  *
  *  config_file: the config file that specifies a set of directories, that the 
- *  nfs_manager will synchronize at start
+ *  nfs_manager will synchronize at start. A pair with the dedup option clones
+ *  the files its targets already have (see dedup.h)
  *
  *  worker_limit: the maximum number of threads used for synchronizing processes
  *
@@ -21,18 +25,83 @@
  *  bufferSize: number of slots of a buffer that will keep syncing processes 
  *  that will be executed by worker_threads
  *
+ *  cache_mb: memory (in MB) of a cache that keeps the files we pull, so files
+ *  that are synced many times aren't pulled from their source again. Without 
+ *  it there is no cache
+ *
+ *  cache_dir: a directory where files evicted from the cache are kept, until 
+ *  they use cache_disk_mb MB (1024 if it isn't given)
+ *
+ *  stats_file: a file where a report of nfs_manager's metrics is written 
+ *  every few seconds. The report is JSON if the file ends with .json
+ *
+ *  trace_file: a file where the phases of every transfer are written, in 
+ *  Chrome's trace event format, to be opened in a timeline viewer
+ *
+ *  manifest_file: a file where the size, modification time, content hash and
+ *  inode of every synced file are recorded. It is kept between runs, and it
+ *  lets a later sync rename, link or delete the files of targets when source's
+ *  files were renamed, linked or deleted
+ *
+ *  endpoint_limit: the maximum number of files that are synced at the same
+ *  time from or to an nfs_client (host:port). The files of a full nfs_client
+ *  wait without keeping a worker busy. Without it there is no limit
+ *
+ *  connect_timeout: the milliseconds we wait for a connection to an 
+ *  nfs_client, before it fails (5000 if it isn't given)
+ *
+ *  socket_buffer_kb: the size (in KB) of the send and receive buffers of our
+ *  sockets, for links with a high bandwidth-delay product. Without it the 
+ *  kernel sizes them
+ *
  */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
 #include <pthread.h>
 #include <sys/socket.h>
 #include "nfs.h"
 #include "map.h"
+#include "metrics.h"
+#include "manifest.h"
+#include "outbuf.h"
+#include "admission.h"
 
 #pragma once
 
+#define MAX_ATTEMPTS 3 // Number of times a worker tries to sync a file
+
+#define CONNECT_TIMEOUT_MS 5000 // Default time we wait for a connection
+
+#define REPLY_TIMEOUT_MS 30000 // Time a target has to answer OFFSET, or to
+                               // commit a file after its PUSH stream, before
+                               // it counts as failed
+
+#define CANCEL_CHECK_MS 50 // A transfer that waits for its hosts checks at
+                           // least this often whether its pair was cancelled
+
+#define MAX_ACTION 4096 // Maximum length of an action in worker's buffer
+
+#define MAX_TARGETS 16 // Maximum number of targets a pair can have
+
+#define MAX_TARGET_LIST (MAX_TARGETS * 1024) // Length of the target paths of
+                                             // a file, separated by commas
+
+#define FANOUT_MIN_CHUNK 65536 // Bytes we read from source at once, the 
+#define FANOUT_MAX_CHUNK (4 * 1024 * 1024) // chunk grows with the throughput
+
+#define FANOUT_CHUNK_USEC 20000 // A chunk holds about 20ms of the transfer
+
+#define FANOUT_BACKLOG (16 * 1024 * 1024) // Bytes a target can fall behind
+                                          // before it stops slowing the others
+
+// States of a transfer's target
+#define TARGET_PENDING 0 
+#define TARGET_DONE 1
+#define TARGET_LAGGING 2 // Was too slow and it was left behind by the others
+
 // Structure that contains variables, used to access our thread buffer
 typedef struct {
     char** buffer; // Size is given at end
@@ -41,14 +110,245 @@ typedef struct {
     int count;
 } pool_t;
 
+// A chunk of data read from source. It is shared by all the targets that 
+// still need to send it
+typedef struct {
+    int refs; // Number of records that use the chunk
+    char data[]; // Allocated with the chunk
+} fanout_chunk;
+
+typedef struct fanout_record fanout_record;
+
+// A PUSH command that waits to be sent to a target
+struct fanout_record {
+    char header[1100]; // PUSH <target_dir>/<filename> -3 <offset>, or the
+                       // <offset><space><length><space> of an extent
+    int header_len;
+    fanout_chunk* chunk; // The data of the command, or NULL
+    int data_start;
+    int data_len;
+    int sent; // Bytes of header and data that we have already sent
+    long long end_position; // Target's file position after the command
+    fanout_record* next;
+};
+
+// A target of a file transfer. A file is pulled once from its source and it
+// is pushed to all its targets at the same time
+typedef struct {
+    char* target_file; // Target directory
+    char* target_host;
+    int target_port;
+    char target_path[1024]; // <target_dir>/<filename>@<host>:<port>, it is
+                            // also the key of target's checkpoint
+    bool local; // True if target is the same nfs_client as source
+    int state;
+    long long bytes_pushed;
+    uint64_t content_hash; // Hash of the file that target received, or 0 if
+                           // we didn't send it the whole file
+    bool verify; // True if target compares the digest of the data it 
+                 // receives with source's, in the current attempt
+    bool cloned; // True if target cloned the file from clone_path, a file
+                 // with the same content, instead of receiving it
+    char clone_path[1024];
+    char error_buffer[1024]; // Reasons the last attempt failed, or empty
+
+    // Used while a transfer_file is in progress
+    int sock;
+    long long offset; // Where this target resumes from
+    long long position; // Target's file position after the queued commands
+    long long committed; // Target's file position after the sent commands
+    fanout_record* head; // Commands that wait to be sent
+    fanout_record* tail;
+    long long backlog; // Bytes of the commands that wait to be sent
+} transfer_target;
+
+// Structure that contains a file transfer, that a worker_thread performs
+typedef struct {
+    char* filename;
+    char pair[1024]; // The source of the pair, <source_dir>@<host>:<port>
+    unsigned int generation; // The pair's generation when the file was queued
+    char* source_file; // Source directory
+    char* source_host;
+    int source_port;
+    char source_path[1024]; // <source_dir>/<filename>@<host>:<port>
+    transfer_target targets[MAX_TARGETS];
+    int target_count;
+    long long size; // Size of source's file
+    long long mtime; // Modification time of source's file, in nanoseconds
+    uint64_t inode; // Inode of source's file when it was listed, or 0
+    int change; // CHANGE_SYNC, or the change of a file its target already has
+    char* old_filename; // The file a RENAME or LINK starts from
+    long long bytes_pulled;
+    long long bytes_cached; // Bytes that were sent from our cache
+    token_bucket* limit; // The pair's bandwidth limit, or NULL
+    int bulk; // The pair's bulk I/O mode (BULK_*) when the file was taken
+    bool verify; // True if the pair's transfers were verified when the file
+                 // was taken
+    uint64_t digest; // The digest of the data source sent (or of our cached
+                     // data), for the targets that verify them
+    bool dedup; // True if the pair's files were deduped when the file was
+                // taken
+    long long content_size; // Size of source's file with content_hash, or
+                            // -1 if we didn't ask for its hash
+    long long content_mtime;
+    char content_hash[2 * SHA256_SIZE + 1]; // The SHA-256 hash of source's 
+                                            // file (in hexadecimal), before
+                                            // the transfer
+    char error_buffer[1024]; // Reasons the source failed, or empty
+    long long phase_marks[PHASE_CLOSE + 2]; // When every phase of the last 
+                                            // transfer_file started (0 if it
+                                            // didn't) and when it ended
+} transfer_t;
 
 
 /* A worker_thread implements the syncing process between different nfs_clients.
- * It takes an action of the form <filename> <source client> <target client> 
- * from the pool_t buffer and connects to source and target client.
+ * It takes an action of the form 
+ *      <filename> <source client> <target clients> <generation> <inode> <change> <old_filename>
+ * from the pool_t buffer and connects to source and target clients. Target 
+ * clients are seperated by commas. If change isn't CHANGE_SYNC, there is a 
+ * single target, that renames or links its old_filename to filename, or 
+ * deletes filename (old_filename is "." when there is none). A RENAME or 
+ * LINK that fails falls back to syncing the file.
  */
 void* worker_thread(void* args);
 
+/* Adds the phases of the last transfer_file of transfer to the phase 
+ * histograms of our metrics, and to the trace if it is enabled */
+void record_phases(transfer_t* transfer);
+
+/* Makes a single attempt to copy transfer's file from source to all of its 
+ * pending targets that are not local. The file is pulled once and every 
+ * chunk is queued for every target. A target whose queue grows more than 
+ * FANOUT_BACKLOG, while others keep up, is left behind (TARGET_LAGGING), so 
+ * it doesn't stall the rest. If a target has a part of the file from a 
+ * previous attempt, that we have a checkpoint for, it only receives the rest 
+ * of the file. Targets that don't finish get a checkpoint of the bytes that 
+ * were sent to them. If the manifest is enabled, targets that receive the 
+ * whole file get its content hash. The transfer stops if its pair is 
+ * cancelled.
+ *
+ * Returns 0, or -1 if a target didn't finish (its error_buffer contains the
+ * reason)
+ */
+int transfer_file(transfer_t* transfer);
+
+/* Asks the nfs_client of transfer, that is both its source and target's 
+ * nfs_client, to copy the file locally with the COPY command.
+ *
+ * Returns 0, or -1 in case of an error (error_buffer contains the reason)
+ */
+int copy_file(transfer_t* transfer,transfer_target* target);
+
+/* Asks the nfs_client of target to rename or link its copy of transfer's 
+ * old_filename to filename, or to delete filename, depending on transfer's
+ * change. The old file must still have the size of its record in the 
+ * manifest.
+ *
+ * Returns 0, or -1 in case of an error (error_buffer contains the reason)
+ */
+int change_file(transfer_t* transfer,transfer_target* target);
+
+/* Asks the source of a deduped transfer for the SHA-256 hash of its file 
+ * (with the DIGEST command), and every target that isn't local and already has a file
+ * with the same content (see dedup.h) to clone it. The targets that cloned 
+ * the file are done, the rest of them are synced as always */
+void dedup_file(transfer_t* transfer);
+
+/* Asks the nfs_client of target to clone its file path, that should have the
+ * content of transfer's file, with the CLONE command.
+ *
+ * Returns 0, or -1 in case of an error (error_buffer contains the reason)
+ */
+int clone_file(transfer_t* transfer,transfer_target* target,char* path);
+
+/* Reads the reply of a command of transfer's file, its size or -1 and an 
+ * error, from sock.
+ *
+ * Returns the size, or -1 in case of an error (the error is added to 
+ * error_buffer)
+ */
+long long receive_size(int sock,transfer_t* transfer,char* error_buffer);
+
+/* Puts in buffer the path of filename in transfer's source, or in target if
+ * it isn't NULL, in the form <dir>/<filename>@<host>:<port> (a part of the 
+ * manifest's keys), and returns buffer */
+char* change_path(char* buffer,transfer_t* transfer,transfer_target* target,char* filename);
+
+/* Updates the manifest after a change of target succeeded: the record of the
+ * old file moves to the file after a RENAME, it is copied after a LINK, and 
+ * the file's record is removed after an UNLINK */
+void change_manifest(transfer_t* transfer,transfer_target* target);
+
+/* Connects to host:port like connect_to_host, and keeps the connection's 
+ * latency (or its failure) in the metrics of the endpoint. It gives up after
+ * connect_timeout milliseconds, and fails at once (with errno EHOSTDOWN) 
+ * while the endpoint's circuit breaker is open */
+int connect_endpoint(char* host,int port);
+
+/* Returns true if the circuit breaker of host:port is open, so connecting to
+ * it would fail at once */
+bool endpoint_unavailable(char* host,int port);
+
+/* Returns the endpoint host:port of admission control, that keeps its 
+ * bandwidth limit and its circuit breaker */
+admission_endpoint* endpoint_of(char* host,int port);
+
+/* Sends STAT <source_dir>/<filename> to source_sock and returns the file's 
+ * size that source's nfs_client replied with (its modification time is put in
+ * transfer's mtime), or a negative number in case of an error */
+long long request_stat(int source_sock,transfer_t* transfer);
+
+/* Sends PULL <source_dir>/<filename> <offset> to source_sock and returns the
+ * file's size that source's nfs_client replied with (its modification time is
+ * put in transfer's mtime), or a negative number in case of an error. A 
+ * verified transfer asks source for the digest of the data it sends */
+long long request_pull(int source_sock,transfer_t* transfer,long long offset);
+
+/* Waits for the reply of target to the end of its PUSH stream, that comes
+ * when the file is committed (durable in place of the real file). If target
+ * verified the data and its digest wasn't source's, the mismatch is counted
+ * in our metrics, and target has deleted what it received. A target that 
+ * doesn't reply in REPLY_TIMEOUT_MS fails.
+ *
+ * Returns 0, or -1 in case of an error (target's error_buffer contains the 
+ * reason)
+ */
+int receive_commit(transfer_t* transfer,transfer_target* target);
+
+/* Adds BULK <bulk> to out, before the STAT, PULL or PUSH command of a bulk 
+ * transfer (nothing if bulk is BULK_OFF) */
+void request_bulk(outbuf* out,int bulk);
+
+/* Reads from sock the data that are already available, up to length bytes, 
+ * waiting only for the first of them.
+ *
+ * Returns the number of bytes read, or what read returned if nothing was read
+ */
+int read_available(int sock,char* buffer,int length);
+
+/* Returns the size of the next chunk we read from source, for a transfer that
+ * relayed bytes in elapsed microseconds. It is between FANOUT_MIN_CHUNK and 
+ * FANOUT_MAX_CHUNK, and holds about FANOUT_CHUNK_USEC of the transfer */
+int fanout_chunk_size(long long bytes,long long elapsed);
+
+/* Queues a part of the PUSH stream of target. When chunk_size is 0 the stream
+ * starts (PUSH <target_dir>/<filename> -3 <argument>), when it is -2 there is
+ * a hole until argument, when it is -1 the stream ends (with transfer's 
+ * digest, if target verifies it), and when it is positive we send an extent
+ * at target's position, with chunk_size bytes of chunk after data_start */
+void queue_push(transfer_t* transfer,transfer_target* target,long long chunk_size,long long argument,fanout_chunk* chunk,int data_start);
+
+/* Sends as many queued commands of target as its socket accepts, without 
+ * blocking.
+ *
+ * Returns 0, or -1 in case of an error (target's error_buffer contains the 
+ * reason)
+ */
+int flush_queue(transfer_target* target);
+
+/* Drops all the queued commands of target */
+void drop_queue(transfer_target* target);
+
 /* Places an action in worker's buffer. This function uses condition variables 
  * and mutexes, to deal with problems like racing and a full buffer
  */
@@ -62,19 +362,48 @@ void obtain(pool_t* pool,char* action);
 
 /* Adds a pair for sychronization, by doing the following:
  *      - Starts a connection with source's nfs_client in the specified port
- *      - Sends LIST command to source's nfs_client, to obtain source_dir's 
- *        files
+ *      - Sends LISTX command to source's nfs_client, to obtain source_dir's 
+ *        files with their inodes, sizes and modification times
+ *      - Compares them with the files the manifest says were synced to the
+ *        targets (see planner.h), to find the ones that were renamed, linked
+ *        or deleted in source
  *      - For every file in source_dir, adds a sync request in worker's queue
+ *        for the targets that need its data, and a RENAME or LINK request for
+ *        every target that already has it under another name, and an UNLINK
+ *        request for every file that a target has but source doesn't. They 
+ *        carry the pair's generation, so workers skip them (or stop them) if
+ *        the pair is cancelled
  *
  *  
  *  This function acts as the producer in our consumer-producer approach to 
  *  worker-threads synchronization. It uses mutexes and condition variables to
  *  deal with the danger of racing conditions.
  *
- *  Returns 0, or else -1 in case of an error.
+ *  Returns 0, or else -1 if the pair has more than MAX_TARGETS targets, if
+ *  source can't be reached, or if its listing failed or was cut off (then
+ *  nothing is queued, so files that weren't listed are never taken as
+ *  deleted).
  *
  * */
-int add_pair(char* source,char* target,int console_sock);
+int add_pair(char* source,char* target,unsigned int generation,int console_sock);
+
+/* Places an action of add_pair in worker's buffer, and counts it in the 
+ * queued files of pair (if it isn't NULL) */
+void place_action(char* action,pair_metrics* pair);
+
+/* Returns true if source's pair has at most MAX_TARGETS targets (separated by
+ * commas), or else writes to nfs_console that it has too many and returns
+ * false */
+bool check_targets(char* source,char* targets,int console_sock);
+
+/* Sets the bandwidth limit of what to rate (bytes per second, that can end 
+ * with K, M or G, 0 removes the limit). what is global, the source of a pair
+ * that was added (<source_dir>@<host>:<port>) or an endpoint (<host>:<port>). The result is
+ * written to the logfile, stdout and nfs_console.
+ *
+ * Returns 0, or -1 if what or rate aren't valid
+ */
+int set_limit(char* what,char* rate,int console_sock);
 
 
 
@@ -82,14 +411,15 @@ int add_pair(char* source,char* target,int console_sock);
  *
  *  [TIMESTAMP] [SOURCE_DIR] [TARGET_DIR] [THREAD_PID] [OPERATION] [RESULT] [DETAILS]
  *
- *  when a worker finishes a given action.
+ *  when a worker finishes a given action. The record is written by the 
+ *  logger's background thread, so workers don't wait for each other.
  */
 
-void write_worker_result(int logfile_fd,char* source_dir,char* target_dir,char* operation,char* result,char* details);
+void write_worker_result(char* source_dir,char* target_dir,char* operation,char* result,char* details);
 
-/* This function writes the given message using write, and if write fails, it 
- * appends an error message, for the reason of fail in error_buffer. 
+/* This function flushes the message gathered in out, and if the flush fails,
+ * it appends an error message, for the reason of fail in error_buffer. 
  * This function will be used by worker threads, to reduce the number of 
- * conditional branches that check for fails of syscalls, as worker threads 
- * are using a lot of write syscalls */
-void write_and_check(int fd,char* buf,int len,char* error_buffer);
+ * conditional branches that check for fails of syscalls. A message is made 
+ * of many pieces, and they are all sent with a single syscall */
+void flush_and_check(outbuf* out,char* error_buffer);
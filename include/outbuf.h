@@ -0,0 +1,60 @@
+/* Header file for our output buffers. Most of our messages are made of many 
+ * small pieces (a command, a path, a number, a space), and writing each one 
+ * with its own write costs a syscall, and on a socket it can cost a tiny TCP
+ * segment too. An output buffer gathers the pieces of a message as iovecs, 
+ * and sends all of them with a single writev (or sendmsg for sockets) when it
+ * is flushed.
+ *
+ * Small pieces are copied in the buffer, so they can be temporary. Big ones 
+ * can be added by reference, and they have to stay valid until the next 
+ * flush. The buffer flushes itself when it is full. A flush can tell TCP that
+ * more data follow (MSG_MORE), so it waits for them before it sends a 
+ * segment that isn't full.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+
+#pragma once
+
+#define OUTBUF_IOVECS 32 // Pieces we gather before we flush
+
+#define OUTBUF_SPACE 4096 // Bytes for the copies of small pieces
+
+typedef struct {
+    int fd;
+    bool socket; // MSG_MORE can only be used with sockets
+    struct iovec iov[OUTBUF_IOVECS];
+    int iovcnt;
+    char space[OUTBUF_SPACE];
+    int used; // Bytes of space that are used
+    int error; // The errno of the first flush that failed, or 0
+} outbuf;
+
+/* Initializes out, for writing to fd */
+void outbuf_init(outbuf* out,int fd);
+
+/* Adds a copy of len bytes of data to out */
+void outbuf_add(outbuf* out,const void* data,size_t len);
+
+/* Adds len bytes of data to out without copying them. data must not change 
+ * until out is flushed */
+void outbuf_add_ref(outbuf* out,const void* data,size_t len);
+
+/* Adds a copy of string to out */
+void outbuf_string(outbuf* out,const char* string);
+
+/* Adds the decimal representation of n to out */
+void outbuf_number(outbuf* out,long long n);
+
+/* Sends everything out has gathered, with as few syscalls as possible.
+ *
+ * Returns 0, or -1 if the data couldn't be sent (errno is set, and out's 
+ * error keeps it). After an error out drops everything it is given
+ */
+int outbuf_flush(outbuf* out);
+
+/* Like outbuf_flush, but tells TCP that more data follow soon, so it can put
+ * them in the same segments */
+int outbuf_flush_more(outbuf* out);
@@ -0,0 +1,95 @@
+/* Header file for nfs_manager's change planner. When a pair is added, the
+ * files that source lists (with LISTX) are compared with the files that the
+ * manifest says were synced from source to every target. A listed file that
+ * a target doesn't have under its name, but has under another name with the
+ * same inode, size and modification time, was renamed (or linked) in source,
+ * so the target is asked to do the same instead of receiving the data again:
+ *
+ *      - RENAME, if the old name isn't listed anymore
+ *      - LINK, if the old name is still listed, unchanged
+ *
+ * and a file that a target has, whose name isn't listed anymore and that
+ * wasn't renamed, was deleted in source, so the target deletes it (UNLINK).
+ * Everything else is synced as always. Only the files of the listed directory
+ * are compared, listings aren't recursive.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#pragma once
+
+#define PLAN_MAX_TARGETS 16 // Maximum number of targets of a pair, like
+                            // nfs_manager's MAX_TARGETS
+
+// The changes a target can be asked for
+#define CHANGE_SYNC 0 // The file's data are sent
+#define CHANGE_RENAME 1
+#define CHANGE_LINK 2
+#define CHANGE_UNLINK 3
+
+// A file that source listed
+typedef struct {
+    char name[256];
+    uint64_t inode;
+    long long size;
+    long long mtime; // Modification time, in nanoseconds
+    int changes[PLAN_MAX_TARGETS]; // What every target is asked for
+    char* old_names[PLAN_MAX_TARGETS]; // The file a target renames or links
+                                       // to this one, or NULL
+} listed_file;
+
+// A file that the manifest says was synced to a target of the pair
+typedef struct {
+    char name[256];
+    int target; // Its index in the targets of the pair
+    uint64_t inode; // 0 if it isn't known
+    long long size;
+    long long mtime;
+    bool listed; // True if source listed a file with the same name
+    bool unchanged; // True if that file has the same inode, size and mtime
+    bool used; // True if a listed file is renamed from it
+} synced_file;
+
+// The changes of a pair's files
+typedef struct {
+    char source[1024]; // <source_dir>@<host>:<port>
+    char source_dir[1024];
+    char source_suffix[1100]; // @<host>:<port> of source
+    char targets[PLAN_MAX_TARGETS][1024]; // <target_dir>@<host>:<port>
+    char target_dirs[PLAN_MAX_TARGETS][1024];
+    char target_suffixes[PLAN_MAX_TARGETS][1100];
+    int target_count;
+    listed_file* files; // Sorted by name, after plan_changes
+    int file_count;
+    int file_capacity;
+    bool complete; // True if source's listing ended, so a synced file that
+                   // isn't listed was really deleted
+    synced_file* synced; // Sorted by target and name, after plan_changes
+    int synced_count;
+} plan_t;
+
+/* Starts the plan of the pair source (<source_dir>@<host>:<port>) and
+ * targets (<target_dir>@<host>:<port>, separated by commas). Returns false
+ * if there are more than PLAN_MAX_TARGETS targets, and then the plan has
+ * only the first of them */
+bool plan_init(plan_t* plan,char* source,char* targets);
+
+/* Adds a file that source listed */
+void plan_add(plan_t* plan,char* name,uint64_t inode,long long size,long long mtime);
+
+/* Decides the change of every listed file for every target, and finds the
+ * synced files that were deleted (the ones with plan_unlinked true). Without
+ * a manifest, or if the listing isn't complete, every file is synced and 
+ * nothing is renamed, linked or deleted */
+void plan_changes(plan_t* plan);
+
+/* Returns true if the synced file has to be deleted from its target */
+bool plan_unlinked(synced_file* synced);
+
+/* Returns the name of a change, the operation in manager's log */
+char* plan_change_name(int change);
+
+/* Frees the files of plan */
+void plan_free(plan_t* plan);
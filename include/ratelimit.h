@@ -0,0 +1,64 @@
+/* Header file for nfs_manager's bandwidth limits. A limit is a token bucket:
+ * tokens (bytes) are added to it with the limit's rate, and a worker takes
+ * tokens for every chunk it relays. A worker can take more tokens than the
+ * bucket has, and then it has to wait until the bucket is no longer in debt,
+ * before it relays the next chunk. Workers wait in the poll of their relay
+ * loop, so they keep sending the queued data to their targets meanwhile.
+ *
+ * There is a global limit, and every pair and every endpoint (host:port) has
+ * a limit of its own (kept with the pair in the map, and with the endpoint's
+ * metrics). A
+ * chunk counts in all the limits it passes through. The rate a limit actually
+ * achieved is also kept, for the stats command.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#pragma once
+
+#define RATE_BURST_USEC 100000 // A bucket keeps at most the tokens of 100ms
+
+#define RATE_WINDOW_USEC 1000000 // The achieved rate is measured every second
+
+typedef struct {
+    pthread_mutex_t lock;
+    long long rate; // Bytes per second, 0 means that there is no limit
+    double tokens; // Negative when the bucket is in debt
+    long long last; // When tokens were last added
+    long long window_start; // Start of the window we measure the rate in
+    long long window_bytes;
+    double achieved; // Bytes per second in the last complete window
+} token_bucket;
+
+// A bucket without a limit, for buckets that are created without bucket_init
+#define BUCKET_INITIALIZER {PTHREAD_MUTEX_INITIALIZER,0,0,0,0,0,0}
+
+/* Initializes the global limit, without a limit. It should be called once,
+ * before any worker thread is created */
+void ratelimit_init(void);
+
+/* Initializes bucket without a limit */
+void bucket_init(token_bucket* bucket);
+
+/* Changes the rate of bucket, 0 removes its limit */
+void bucket_set_rate(token_bucket* bucket,long long rate);
+
+/* Returns the rate of bucket */
+long long bucket_rate(token_bucket* bucket);
+
+/* Takes bytes tokens from bucket at time now (in the clock of metrics_now),
+ * and returns how many microseconds the caller has to wait before it takes
+ * tokens again */
+long long bucket_take(token_bucket* bucket,long long bytes,long long now);
+
+/* Returns the rate (bytes per second) bucket achieved in the last second */
+double bucket_achieved(token_bucket* bucket,long long now);
+
+/* Returns the global limit */
+token_bucket* ratelimit_global(void);
+
+/* Returns the rate of a limit given as a number of bytes per second, that can
+ * end with K, M or G, or -1 if it isn't valid */
+long long ratelimit_parse(char* rate);
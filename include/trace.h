@@ -0,0 +1,25 @@
+/* Header file for nfs_manager's trace. When it is enabled, every phase of every
+ * file transfer is written as an event in a trace file, in the trace event
+ * format of Chrome, so a sync run can be opened in a timeline viewer (e.g.
+ * chrome://tracing or Perfetto), with one row for every worker thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#pragma once
+
+/* Opens trace_file and starts the trace. Without it, trace_event does nothing */
+void trace_init(char* trace_file);
+
+/* Returns true if the trace is enabled */
+bool trace_enabled(void);
+
+/* Writes an event of the calling thread, that started at start and lasted
+ * duration microseconds (in the clock of metrics_now). file is the file the
+ * event is about, and bytes are the bytes that were transferred, or -1 */
+void trace_event(char* name,char* file,long long start,long long duration,long long bytes);
+
+/* Ends the trace and closes the trace file */
+void trace_destroy(void);
@@ -0,0 +1,87 @@
+/* Header file for our io_uring rings. nfs_client can do the file and socket
+ * I/O of PULL and PUSH through an io_uring instead of blocking syscalls, so
+ * it reads the next chunks of a file while it sends the previous ones (and
+ * writes the chunks it received while it receives the next ones), with a
+ * single syscall for many operations.
+ *
+ * We use the io_uring syscalls directly, without any library. Every ring has
+ * its own buffers, that are registered with the kernel (so they aren't
+ * mapped again for every read and write), and the descriptors of a transfer
+ * can be registered too. If the kernel doesn't support io_uring, or doesn't
+ * allow it, uring_init fails and the caller uses the blocking syscalls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <linux/io_uring.h>
+
+#pragma once
+
+#define URING_MAX_BUFFERS 64 // Maximum buffers (and queue depth) of a ring
+
+typedef struct {
+    int fd; // -1 if the ring isn't set up
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring; // The mapped rings, to unmap them
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    unsigned pending; // Operations that we prepared but haven't submitted
+    unsigned inflight; // Operations that we submitted and haven't completed
+    char* buffers; // buffer_count registered buffers of buffer_size bytes
+    int buffer_count;
+    size_t buffer_size;
+} uring;
+
+/* Sets up ring with buffer_count registered buffers of buffer_size bytes,
+ * and enough entries to have all of them in flight.
+ *
+ * Returns 0, or -1 if io_uring can't be used (ring's fd is then -1)
+ */
+int uring_init(uring* ring,int buffer_count,size_t buffer_size);
+
+/* Registers count descriptors with ring. Operations then refer to them by
+ * their index in fds. They stay registered until ring is destroyed
+ *
+ * Returns 0, or -1 in case of an error
+ */
+int uring_register_files(uring* ring,int* fds,int count);
+
+/* Returns the registered buffer with the given index */
+char* uring_buffer(uring* ring,int buffer);
+
+/* Prepares a read (IORING_OP_READ_FIXED) or a write (IORING_OP_WRITE_FIXED)
+ * of len bytes of the registered file file at offset, from or to data (that
+ * is inside a registered buffer). user_data comes back with its completion
+ */
+void uring_file(uring* ring,int op,int file,char* data,unsigned len,off_t offset,uint64_t user_data);
+
+/* Prepares a send (IORING_OP_SEND) or a receive (IORING_OP_RECV) of len
+ * bytes of data to or from the registered socket file, with flags */
+void uring_socket(uring* ring,int op,int file,char* data,unsigned len,int flags,uint64_t user_data);
+
+/* Submits the prepared operations, and waits until one of them completes.
+ * Its user_data and its result (bytes, or -errno) are put in user_data and
+ * res
+ *
+ * Returns 0, or -1 if there is nothing to wait for, or io_uring_enter failed
+ */
+int uring_wait(uring* ring,uint64_t* user_data,int* res);
+
+/* Waits until every operation of ring has completed, so its buffers can be
+ * used again */
+void uring_drain(uring* ring);
+
+/* Frees ring and its buffers. It must have no operations in flight */
+void uring_destroy(uring* ring);
@@ -0,0 +1,95 @@
+#!/bin/bash
+# Syncs a sparse file bigger than 4GB through nfs_manager and checks that the
+# target got it whole: the same size and the same content (cmp). The file is
+# made with truncate, with a few extents written in it, one of them across
+# the 4GB offset and one after it, so offsets that don't fit in 32 bits are
+# tested. Holes aren't sent, so the file takes a few MB on disk and on the
+# network.
+#
+# Usage: scripts/sparse_sync_test.sh [size] (5G by default, more than 4G)
+#
+# It runs two nfs_clients, nfs_manager and nfs_console of the repo (make all
+# first) on 127.0.0.1, in a temporary directory that is removed at the end.
+
+REPO=$(cd "$(dirname "$0")/.." && pwd)
+SIZE=${1:-5G}
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/sparse_sync.XXXXXX")
+PORT=$(( (RANDOM % 20000) + 20000 ))
+PIDS=""
+
+cleanup() {
+    [ -n "$PIDS" ] && kill $PIDS 2>/dev/null
+    rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+for program in nfs_client nfs_manager nfs_console; do
+    if [ ! -x "$REPO/$program" ]; then
+        echo "FAIL: $program isn't built, run make first"
+        exit 1
+    fi
+done
+
+mkdir -p "$WORK/a/src" "$WORK/b/dst"
+FILE="$WORK/a/src/sparse.img"
+truncate -s "$SIZE" "$FILE" || exit 1
+BYTES=$(stat -c %s "$FILE")
+if [ "$BYTES" -le $(( 4 * 1024 * 1024 * 1024 )) ]; then
+    echo "FAIL: $SIZE isn't bigger than 4GB"
+    exit 1
+fi
+
+# Extents of random data: at the start, at 1GB, across 4GB, after 4GB and at
+# the end of the file
+write_extent() {
+    head -c "$2" /dev/urandom | dd of="$FILE" bs=1 seek="$1" conv=notrunc status=none
+}
+MB=$(( 1024 * 1024 ))
+write_extent 0 65536
+write_extent $(( 1024 * MB )) 100000
+write_extent $(( 4096 * MB - 3000 )) 6000
+write_extent $(( 4096 * MB + 512 * MB + 7 )) 200000
+write_extent $(( BYTES - 4096 )) 4096
+
+(cd "$WORK/a" && exec "$REPO/nfs_client" -p $(( PORT + 1 )) >"$WORK/client_a.log" 2>&1) &
+PIDS="$PIDS $!"
+(cd "$WORK/b" && exec "$REPO/nfs_client" -p $(( PORT + 2 )) >"$WORK/client_b.log" 2>&1) &
+PIDS="$PIDS $!"
+sleep 0.5
+echo "/src@127.0.0.1:$(( PORT + 1 )) /dst@127.0.0.1:$(( PORT + 2 ))" > "$WORK/config"
+(cd "$WORK" && exec "$REPO/nfs_manager" -l "$WORK/manager.log" -c "$WORK/config" -n 2 -p $PORT -b 8 >"$WORK/manager.out" 2>&1) &
+PIDS="$PIDS $!"
+sleep 0.5
+
+# The target's file appears only when it is complete (it is written to a
+# temp file that is renamed), then we shut the manager down
+TARGET="$WORK/b/dst/sparse.img"
+start=$(date +%s)
+(
+    while [ ! -f "$TARGET" ] && [ $(( $(date +%s) - start )) -lt 600 ]; do
+        sleep 0.2
+    done
+    echo shutdown
+    sleep 1
+) | timeout 660 "$REPO/nfs_console" -l "$WORK/console.log" -h 127.0.0.1 -p $PORT >"$WORK/console.out" 2>&1
+echo "Synced in $(( $(date +%s) - start ))s"
+
+status=0
+if [ ! -f "$TARGET" ]; then
+    echo "FAIL: the target didn't get the file"
+    tail -5 "$WORK/manager.log" 2>/dev/null
+    exit 1
+fi
+TARGET_BYTES=$(stat -c %s "$TARGET")
+if [ "$TARGET_BYTES" -ne "$BYTES" ]; then
+    echo "FAIL: the target has $TARGET_BYTES bytes instead of $BYTES"
+    status=1
+fi
+if ! cmp "$FILE" "$TARGET"; then
+    echo "FAIL: the target's content isn't the same"
+    status=1
+fi
+echo "Source: $BYTES bytes, $(du -k "$FILE" | cut -f1)KB on disk"
+echo "Target: $TARGET_BYTES bytes, $(du -k "$TARGET" | cut -f1)KB on disk"
+[ $status -eq 0 ] && echo "PASS"
+exit $status
@@ -0,0 +1,200 @@
+/* Source file for nfs_manager's admission control. Endpoints are kept in a
+ * hash table with seperate chaining, protected by a mutex, as it is shared by
+ * all worker threads. Endpoints are few, so we never remove or rehash them,
+ * and a chain grows with them.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "../include/nfs.h"
+#include "../include/metrics.h"
+#include "../include/admission.h"
+
+int max_endpoint_transfers = 0; // 0 means that there is no limit
+
+admission_endpoint* admission_endpoints[ADMISSION_BUCKETS];
+
+pthread_mutex_t admission_mtx; // Locks every access to the endpoints
+
+// We use the djb2 hash function
+unsigned int admission_hash(char* key) {
+    unsigned int hash = 5381;
+    for (int i = 0; key[i] != '\0'; i++) {
+        hash = (hash * 33) + key[i];
+    }
+    return hash % ADMISSION_BUCKETS;
+}
+
+// Initializes admission control
+void admission_init(int max_transfers) {
+    max_endpoint_transfers = max_transfers;
+    for (int i = 0; i < ADMISSION_BUCKETS; i++) {
+        admission_endpoints[i] = NULL;
+    }
+    pthread_mutex_init(&admission_mtx,NULL);
+}
+
+// Returns the endpoint of key, it is created if it doesn't exist.
+// admission_mtx must be locked
+admission_endpoint* admission_endpoint_of(char* key) {
+    int pos = admission_hash(key);
+    admission_endpoint* endpoint = admission_endpoints[pos];
+    while (endpoint != NULL && strcmp(endpoint->key,key)) {
+        endpoint = endpoint->next;
+    }
+    if (endpoint == NULL) {
+        endpoint = malloc(sizeof(admission_endpoint));
+        if (endpoint == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        strcpy(endpoint->key,key);
+        endpoint->active = 0;
+        endpoint->head = NULL;
+        endpoint->tail = NULL;
+        bucket_init(&endpoint->limit);
+        breaker_init(&endpoint->breaker);
+        endpoint->next = admission_endpoints[pos];
+        admission_endpoints[pos] = endpoint;
+    }
+    return endpoint;
+}
+
+// Returns the endpoint of key, it is created if it doesn't exist
+admission_endpoint* admission_lookup(char* key) {
+    pthread_mutex_lock(&admission_mtx);
+    admission_endpoint* endpoint = admission_endpoint_of(key);
+    pthread_mutex_unlock(&admission_mtx);
+    return endpoint;
+}
+
+// Puts the distinct endpoints of keys in result and returns their number.
+// admission_mtx must be locked
+int admission_distinct(char** keys,int count,admission_endpoint** result) {
+    int distinct = 0;
+    for (int i = 0; i < count && i < MAX_ENDPOINTS; i++) {
+        admission_endpoint* endpoint = admission_endpoint_of(keys[i]);
+        bool seen = false;
+        for (int j = 0; j < distinct; j++) {
+            seen = seen || result[j] == endpoint;
+        }
+        if (!seen)
+            result[distinct++] = endpoint;
+    }
+    return distinct;
+}
+
+// Returns the first full endpoint of a file, or NULL if it can be admitted.
+// admission_mtx must be locked
+admission_endpoint* admission_full(admission_endpoint** endpoints,int count) {
+    for (int i = 0; i < count; i++) {
+        if (endpoints[i]->active >= max_endpoint_transfers)
+            return endpoints[i];
+    }
+    return NULL;
+}
+
+// Adds task to the end of the queue of endpoint. admission_mtx must be locked
+void admission_defer(admission_endpoint* endpoint,deferred_task* task) {
+    task->next = NULL;
+    if (endpoint->tail != NULL)
+        endpoint->tail->next = task;
+    else
+        endpoint->head = task;
+    endpoint->tail = task;
+}
+
+// Admits a file with the given endpoints, or defers it
+bool admission_acquire(char** endpoints,int count,char* action) {
+    if (max_endpoint_transfers == 0)
+        return true;
+    admission_endpoint* distinct[MAX_ENDPOINTS];
+    pthread_mutex_lock(&admission_mtx);
+    int distinct_count = admission_distinct(endpoints,count,distinct);
+    admission_endpoint* full = admission_full(distinct,distinct_count);
+    // The file waits in the queue of the full endpoint
+    if (full != NULL) {
+        deferred_task* task = malloc(sizeof(deferred_task));
+        if (task == NULL || (task->action = strdup(action)) == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        memcpy(task->endpoints,distinct,distinct_count * sizeof(admission_endpoint*));
+        task->count = distinct_count;
+        admission_defer(full,task);
+        metrics_change(GAUGE_DEFERRED,1);
+        pthread_mutex_unlock(&admission_mtx);
+        return false;
+    }
+    for (int i = 0; i < distinct_count; i++) {
+        distinct[i]->active++;
+    }
+    pthread_mutex_unlock(&admission_mtx);
+    return true;
+}
+
+// Releases the endpoints of a file, and admits the files that waited for them
+void admission_release(char** endpoints,int count,deferred_task** admitted) {
+    if (max_endpoint_transfers == 0)
+        return;
+    admission_endpoint* distinct[MAX_ENDPOINTS];
+    // We find the end of admitted, to add the files in their order
+    while (*admitted != NULL)
+        admitted = &(*admitted)->next;
+    pthread_mutex_lock(&admission_mtx);
+    int distinct_count = admission_distinct(endpoints,count,distinct);
+    for (int i = 0; i < distinct_count; i++) {
+        distinct[i]->active--;
+    }
+    for (int i = 0; i < distinct_count; i++) {
+        admission_endpoint* endpoint = distinct[i];
+        // Until the endpoint is full again, or it has no files waiting
+        while (endpoint->head != NULL && endpoint->active < max_endpoint_transfers) {
+            deferred_task* task = endpoint->head;
+            endpoint->head = task->next;
+            if (endpoint->head == NULL)
+                endpoint->tail = NULL;
+            admission_endpoint* full = admission_full(task->endpoints,task->count);
+            if (full != NULL) {
+                admission_defer(full,task);
+                continue;
+            }
+            for (int j = 0; j < task->count; j++) {
+                task->endpoints[j]->active++;
+            }
+            task->next = NULL;
+            *admitted = task;
+            admitted = &task->next;
+            metrics_change(GAUGE_DEFERRED,-1);
+        }
+    }
+    pthread_mutex_unlock(&admission_mtx);
+}
+
+// Removes the first admitted file and copies its action
+bool admission_next(deferred_task** admitted,char* action) {
+    deferred_task* task = *admitted;
+    if (task == NULL)
+        return false;
+    *admitted = task->next;
+    strcpy(action,task->action);
+    free(task->action);
+    free(task);
+    return true;
+}
+
+// Frees admission control from the memory
+void admission_destroy(void) {
+    for (int i = 0; i < ADMISSION_BUCKETS; i++) {
+        while (admission_endpoints[i] != NULL) {
+            admission_endpoint* endpoint = admission_endpoints[i];
+            admission_endpoints[i] = endpoint->next;
+            while (endpoint->head != NULL) {
+                deferred_task* task = endpoint->head;
+                endpoint->head = task->next;
+                free(task->action);
+                free(task);
+            }
+            free(endpoint);
+        }
+    }
+    pthread_mutex_destroy(&admission_mtx);
+}
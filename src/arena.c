@@ -0,0 +1,152 @@
+/* Source file for the string arena. Strings are appended to the first chunk,
+ * and when it is full a new chunk becomes the first one. The table of the
+ * strings uses open addressing with linear probing, and it is doubled when it
+ * gets half full. Like the map, the strings of the previous table are moved to
+ * the new one gradually, by the next interns, so no intern stalls.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../include/nfs.h"
+#include "../include/arena.h"
+
+#define INITIAL_STRINGS 64 // Initial capacity of the table of the strings
+
+#define ARENA_MIGRATE_STEP 4 // Strings an intern moves from the old table
+
+// We use the djb2 hash function
+unsigned int arena_hash(const char* string) {
+    unsigned int hash = 5381;
+    for (int i = 0; string[i] != '\0'; i++) {
+        hash = (hash * 33) + string[i];
+    }
+    return hash;
+}
+
+// Creates an empty arena
+arena* arena_create(void) {
+    arena* strings = malloc(sizeof(arena));
+    if (strings == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    strings->chunks = NULL;
+    strings->count = 0;
+    strings->capacity = INITIAL_STRINGS;
+    strings->strings = calloc(strings->capacity,sizeof(interned));
+    if (strings->strings == NULL)
+        perror_exit("ERROR! calloc failed\n");
+    strings->old_strings = NULL;
+    strings->old_capacity = 0;
+    strings->migrated = 0;
+    return strings;
+}
+
+// Returns size bytes of the first chunk, starting at a multiple of align
+char* arena_reserve(arena* strings,size_t size,size_t align) {
+    arena_chunk* chunk = strings->chunks;
+    size_t start = (chunk != NULL) ? (chunk->used + align - 1) & ~(align - 1) : 0;
+    if (chunk == NULL || start > chunk->size || chunk->size - start < size) {
+        // Long strings get a chunk of their own
+        size_t chunk_size = (size > ARENA_CHUNK) ? size : ARENA_CHUNK;
+        chunk = malloc(sizeof(arena_chunk) + chunk_size);
+        if (chunk == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = strings->chunks;
+        strings->chunks = chunk;
+        start = 0;
+    }
+    chunk->used = start + size;
+    return chunk->data + start;
+}
+
+// Copies string in the arena and returns the copy
+char* arena_store(arena* strings,const char* string,size_t len) {
+    char* copy = arena_reserve(strings,len + 1,1);
+    memcpy(copy,string,len + 1);
+    return copy;
+}
+
+// Returns size bytes of zeroed memory of the arena
+void* arena_alloc(arena* strings,size_t size) {
+    void* memory = arena_reserve(strings,size,ARENA_ALIGN);
+    memset(memory,0,size);
+    return memory;
+}
+
+// Returns the position of string in table, or the empty position where it
+// would be put
+int arena_find(interned* table,int capacity,const char* string,unsigned int hash) {
+    int pos = hash & (capacity - 1);
+    while (table[pos].string != NULL) {
+        if (table[pos].hash == hash && !strcmp(table[pos].string,string))
+            return pos;
+        pos = (pos + 1) & (capacity - 1);
+    }
+    return pos;
+}
+
+// Moves up to steps strings of the old table to the current one
+void arena_migrate(arena* strings,int steps) {
+    if (strings->old_strings == NULL)
+        return;
+    while (steps > 0 && strings->migrated < strings->old_capacity) {
+        interned* old = &strings->old_strings[strings->migrated++];
+        // A string is in one of the two tables, never in both
+        if (old->string != NULL)
+            strings->strings[arena_find(strings->strings,strings->capacity,old->string,old->hash)] = *old;
+        steps--;
+    }
+    if (strings->migrated == strings->old_capacity) {
+        free(strings->old_strings);
+        strings->old_strings = NULL;
+    }
+}
+
+// Doubles the table of the strings, the current one becomes the old one
+void arena_grow(arena* strings) {
+    // The old table is empty long before the new one is half full, we only
+    // make sure of it
+    arena_migrate(strings,strings->old_capacity);
+    strings->old_strings = strings->strings;
+    strings->old_capacity = strings->capacity;
+    strings->migrated = 0;
+    strings->capacity *= 2;
+    strings->strings = calloc(strings->capacity,sizeof(interned));
+    if (strings->strings == NULL)
+        perror_exit("ERROR! calloc failed\n");
+}
+
+// Returns the copy of string that is stored in the arena
+char* arena_intern(arena* strings,const char* string) {
+    unsigned int hash = arena_hash(string);
+    arena_migrate(strings,ARENA_MIGRATE_STEP);
+    int pos = arena_find(strings->strings,strings->capacity,string,hash);
+    if (strings->strings[pos].string != NULL)
+        return strings->strings[pos].string;
+    if (strings->old_strings != NULL) {
+        int old_pos = arena_find(strings->old_strings,strings->old_capacity,string,hash);
+        if (strings->old_strings[old_pos].string != NULL)
+            return strings->old_strings[old_pos].string;
+    }
+    // It is a new string
+    strings->strings[pos].hash = hash;
+    strings->strings[pos].string = arena_store(strings,string,strlen(string));
+    strings->count++;
+    char* copy = strings->strings[pos].string;
+    if (2 * strings->count > strings->capacity)
+        arena_grow(strings);
+    return copy;
+}
+
+// Frees the arena and all its strings
+void arena_destroy(arena* strings) {
+    while (strings->chunks != NULL) {
+        arena_chunk* chunk = strings->chunks;
+        strings->chunks = chunk->next;
+        free(chunk);
+    }
+    free(strings->strings);
+    free(strings->old_strings);
+    free(strings);
+}
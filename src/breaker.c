@@ -0,0 +1,71 @@
+/* Source file for nfs_manager's circuit breakers. Every breaker has its own
+ * mutex, a worker takes it once for every connection.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "../include/breaker.h"
+
+// Initializes breaker closed
+void breaker_init(circuit_breaker* breaker) {
+    pthread_mutex_init(&breaker->lock,NULL);
+    breaker->state = BREAKER_CLOSED;
+    breaker->failures = 0;
+    breaker->backoff = BREAKER_BACKOFF_USEC;
+    breaker->open_until = 0;
+}
+
+// Returns true if a connection can be attempted
+bool breaker_allow(circuit_breaker* breaker,long long now) {
+    pthread_mutex_lock(&breaker->lock);
+    bool allow = breaker->state == BREAKER_CLOSED;
+    // Only one connection probes the endpoint
+    if (breaker->state == BREAKER_OPEN && now >= breaker->open_until) {
+        breaker->state = BREAKER_PROBING;
+        allow = true;
+    }
+    pthread_mutex_unlock(&breaker->lock);
+    return allow;
+}
+
+// Returns true if connections would fail at once
+bool breaker_is_open(circuit_breaker* breaker,long long now) {
+    pthread_mutex_lock(&breaker->lock);
+    bool open = breaker->state == BREAKER_PROBING || (breaker->state == BREAKER_OPEN && now < breaker->open_until);
+    pthread_mutex_unlock(&breaker->lock);
+    return open;
+}
+
+// Records that a connection succeeded
+void breaker_success(circuit_breaker* breaker) {
+    pthread_mutex_lock(&breaker->lock);
+    breaker->state = BREAKER_CLOSED;
+    breaker->failures = 0;
+    breaker->backoff = BREAKER_BACKOFF_USEC;
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+// Records that a connection failed
+void breaker_failure(circuit_breaker* breaker,long long now) {
+    pthread_mutex_lock(&breaker->lock);
+    breaker->failures++;
+    // A failed probe opens the breaker again right away
+    if (breaker->state == BREAKER_PROBING || (breaker->state == BREAKER_CLOSED && breaker->failures >= BREAKER_FAILURES)) {
+        breaker->state = BREAKER_OPEN;
+        breaker->open_until = now + breaker->backoff;
+        breaker->backoff *= 2;
+        if (breaker->backoff > BREAKER_MAX_BACKOFF_USEC)
+            breaker->backoff = BREAKER_MAX_BACKOFF_USEC;
+    }
+    pthread_mutex_unlock(&breaker->lock);
+}
+
+// Returns the state of breaker, and when it lets a probe through
+int breaker_state(circuit_breaker* breaker,long long now,long long* retry_in) {
+    pthread_mutex_lock(&breaker->lock);
+    int state = breaker->state;
+    *retry_in = (state == BREAKER_OPEN && breaker->open_until > now) ? breaker->open_until - now : 0;
+    pthread_mutex_unlock(&breaker->lock);
+    return state;
+}
@@ -0,0 +1,443 @@
+/* Source file for nfs_manager's content cache. Cached files are kept in a
+ * hash table with seperate chaining, and in a doubly linked list ordered from
+ * the most to the least recently used file, that gives us the files to evict.
+ * The on-disk tier uses the same structures, for the files that were moved in
+ * disk. A mutex protects both tiers, but no file I/O is done while holding it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "../include/nfs.h"
+#include "../include/cache.h"
+
+#define MOD 0600
+
+long long memory_limit = 0; // 0 means that the cache is disabled
+long long memory_used = 0;
+char* disk_dir = NULL; // NULL means that there is no on-disk tier
+long long disk_limit = 0;
+long long disk_used = 0;
+int disk_files = 0; // Used to give a unique name to every file in disk
+
+long long cache_hits = 0;
+long long cache_misses = 0;
+
+cache_entry* entries[CACHE_BUCKETS];
+cache_entry* lru_head = NULL; // Most recently used
+cache_entry* lru_tail = NULL; // Least recently used
+
+disk_entry* disk_entries[CACHE_BUCKETS];
+disk_entry* disk_head = NULL;
+disk_entry* disk_tail = NULL;
+
+pthread_mutex_t cache_mtx; // Locks every access to the structures above
+
+// We use the djb2 hash function
+unsigned int cache_hash(char* key) {
+    unsigned int hash = 5381;
+    for (int i = 0; key[i] != '\0'; i++) {
+        hash = (hash * 33) + key[i];
+    }
+    return hash % CACHE_BUCKETS;
+}
+
+// Returns the memory an entry uses
+long long entry_bytes(cache_entry* entry) {
+    return sizeof(cache_entry) + entry->data_capacity + entry->extent_capacity * 2 * sizeof(long long);
+}
+
+// Initializes the cache
+void cache_init(long long memory,char* dir,long long disk) {
+    memory_limit = memory;
+    disk_dir = dir;
+    disk_limit = disk;
+    for (int i = 0; i < CACHE_BUCKETS; i++) {
+        entries[i] = NULL;
+        disk_entries[i] = NULL;
+    }
+    pthread_mutex_init(&cache_mtx,NULL);
+}
+
+// Returns true if the cache is enabled
+bool cache_enabled(void) {
+    return memory_limit > 0;
+}
+
+// A file can use up to a quarter of the cache, so a single big file doesn't
+// evict everything else
+long long cache_max_entry(void) {
+    return memory_limit / 4;
+}
+
+// Creates an empty entry for the file key
+cache_entry* cache_entry_create(char* key,long long size,long long mtime) {
+    cache_entry* entry = malloc(sizeof(cache_entry));
+    if (entry == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    strcpy(entry->key,key);
+    entry->size = size;
+    entry->mtime = mtime;
+    entry->extent_count = 0;
+    entry->extent_capacity = 0;
+    entry->extent_offsets = NULL;
+    entry->extent_lengths = NULL;
+    entry->data = NULL;
+    entry->data_len = 0;
+    entry->data_capacity = 0;
+    entry->refs = 0;
+    entry->cached = false;
+    entry->prev = NULL;
+    entry->next = NULL;
+    entry->chain = NULL;
+    return entry;
+}
+
+// Appends len bytes of data, that are at offset of the file, to entry
+void cache_entry_add(cache_entry* entry,long long offset,char* data,int len) {
+    int last = entry->extent_count - 1;
+    // Data that continue the last extent are merged with it
+    if (last < 0 || entry->extent_offsets[last] + entry->extent_lengths[last] != offset) {
+        if (entry->extent_count == entry->extent_capacity) {
+            entry->extent_capacity = (entry->extent_capacity == 0) ? 4 : 2 * entry->extent_capacity;
+            entry->extent_offsets = realloc(entry->extent_offsets,entry->extent_capacity * sizeof(long long));
+            entry->extent_lengths = realloc(entry->extent_lengths,entry->extent_capacity * sizeof(long long));
+            if (entry->extent_offsets == NULL || entry->extent_lengths == NULL)
+                perror_exit("ERROR! realloc failed\n");
+        }
+        last = entry->extent_count++;
+        entry->extent_offsets[last] = offset;
+        entry->extent_lengths[last] = 0;
+    }
+    if (entry->data_len + len > entry->data_capacity) {
+        long long capacity = (entry->data_capacity == 0) ? 65536 : entry->data_capacity;
+        while (capacity < entry->data_len + len) {
+            capacity *= 2;
+        }
+        // We never need more than the file's size
+        if (capacity > entry->size)
+            capacity = entry->size;
+        entry->data = realloc(entry->data,capacity);
+        if (entry->data == NULL)
+            perror_exit("ERROR! realloc failed\n");
+        entry->data_capacity = capacity;
+    }
+    memcpy(entry->data + entry->data_len,data,len);
+    entry->data_len += len;
+    entry->extent_lengths[last] += len;
+}
+
+// Frees an entry that isn't in the cache from the memory
+void cache_entry_free(cache_entry* entry) {
+    free(entry->extent_offsets);
+    free(entry->extent_lengths);
+    free(entry->data);
+    free(entry);
+}
+
+// Removes entry from the hash table and the LRU list. cache_mtx must be locked
+void unlink_entry(cache_entry* entry) {
+    cache_entry** node = &entries[cache_hash(entry->key)];
+    while (*node != entry) {
+        node = &((*node)->chain);
+    }
+    *node = entry->chain;
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        lru_head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        lru_tail = entry->prev;
+    entry->cached = false;
+    memory_used -= entry_bytes(entry);
+}
+
+// Removes entry from the on-disk tier. cache_mtx must be locked
+void unlink_disk_entry(disk_entry* entry) {
+    disk_entry** node = &disk_entries[cache_hash(entry->key)];
+    while (*node != entry) {
+        node = &((*node)->chain);
+    }
+    *node = entry->chain;
+    if (entry->prev != NULL)
+        entry->prev->next = entry->next;
+    else
+        disk_head = entry->next;
+    if (entry->next != NULL)
+        entry->next->prev = entry->prev;
+    else
+        disk_tail = entry->prev;
+    disk_used -= entry->bytes;
+}
+
+// Writes entry in a file of the on-disk tier and adds it to the tier
+void spill_entry(cache_entry* entry) {
+    disk_entry* spilled = malloc(sizeof(disk_entry));
+    if (spilled == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    strcpy(spilled->key,entry->key);
+    spilled->size = entry->size;
+    spilled->mtime = entry->mtime;
+    spilled->bytes = sizeof(cache_entry) + 2 * entry->extent_count * sizeof(long long) + entry->data_len;
+    pthread_mutex_lock(&cache_mtx);
+    int id = disk_files++;
+    pthread_mutex_unlock(&cache_mtx);
+    char number_buffer[32];
+    strcpy(spilled->filename,disk_dir);
+    strcat(spilled->filename,"/");
+    strcat(spilled->filename,number_to_string(number_buffer,id));
+    strcat(spilled->filename,".cache");
+
+    // The file contains the entry followed by its extents and data
+    int fd = open(spilled->filename,O_CREAT | O_WRONLY | O_TRUNC,MOD);
+    bool failed = fd < 0;
+    if (!failed) {
+        failed = write(fd,entry,sizeof(cache_entry)) < (ssize_t)sizeof(cache_entry)
+              || write(fd,entry->extent_offsets,entry->extent_count * sizeof(long long)) < 0
+              || write(fd,entry->extent_lengths,entry->extent_count * sizeof(long long)) < 0
+              || write(fd,entry->data,entry->data_len) < entry->data_len;
+        close(fd);
+    }
+    cache_entry_free(entry);
+    if (failed) {
+        unlink(spilled->filename);
+        free(spilled);
+        return;
+    }
+
+    pthread_mutex_lock(&cache_mtx);
+    // We make room in disk, by deleting the least recently spilled files
+    disk_entry* victims = NULL;
+    while (disk_used + spilled->bytes > disk_limit && disk_tail != NULL) {
+        disk_entry* victim = disk_tail;
+        unlink_disk_entry(victim);
+        victim->next = victims;
+        victims = victim;
+    }
+    int pos = cache_hash(spilled->key);
+    spilled->chain = disk_entries[pos];
+    disk_entries[pos] = spilled;
+    spilled->prev = NULL;
+    spilled->next = disk_head;
+    if (disk_head != NULL)
+        disk_head->prev = spilled;
+    disk_head = spilled;
+    if (disk_tail == NULL)
+        disk_tail = spilled;
+    disk_used += spilled->bytes;
+    pthread_mutex_unlock(&cache_mtx);
+
+    while (victims != NULL) {
+        disk_entry* temp = victims;
+        victims = victims->next;
+        unlink(temp->filename);
+        free(temp);
+    }
+}
+
+// Reads back a file of the on-disk tier, or returns NULL if it fails
+cache_entry* load_entry(disk_entry* spilled) {
+    int fd = open(spilled->filename,O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    cache_entry header;
+    if (read(fd,&header,sizeof(cache_entry)) < (ssize_t)sizeof(cache_entry)) {
+        close(fd);
+        return NULL;
+    }
+    cache_entry* entry = cache_entry_create(spilled->key,spilled->size,spilled->mtime);
+    entry->extent_count = header.extent_count;
+    entry->extent_capacity = header.extent_count;
+    entry->data_len = header.data_len;
+    entry->data_capacity = header.data_len;
+    entry->extent_offsets = malloc(entry->extent_count * sizeof(long long) + 1);
+    entry->extent_lengths = malloc(entry->extent_count * sizeof(long long) + 1);
+    entry->data = malloc(entry->data_len + 1);
+    if (entry->extent_offsets == NULL || entry->extent_lengths == NULL || entry->data == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    long long extents_len = entry->extent_count * sizeof(long long);
+    bool failed = read(fd,entry->extent_offsets,extents_len) < extents_len
+               || read(fd,entry->extent_lengths,extents_len) < extents_len;
+    // Data can be bigger than what a single read returns
+    long long data_read = 0;
+    while (!failed && data_read < entry->data_len) {
+        ssize_t n = read(fd,entry->data + data_read,entry->data_len - data_read);
+        if (n <= 0)
+            failed = true;
+        data_read += n;
+    }
+    close(fd);
+    if (failed) {
+        cache_entry_free(entry);
+        return NULL;
+    }
+    return entry;
+}
+
+// Adds entry to the cache, evicting the least recently used files if needed
+void cache_insert(cache_entry* entry) {
+    cache_entry* victims = NULL; // Evicted entries, that we spill or free
+    pthread_mutex_lock(&cache_mtx);
+    // Another worker cached the same file in the meantime
+    for (cache_entry* node = entries[cache_hash(entry->key)]; node != NULL; node = node->chain) {
+        if (!strcmp(node->key,entry->key)) {
+            if (node->refs > 0)  {
+                pthread_mutex_unlock(&cache_mtx);
+                // A pinned entry is freed by cache_release
+                if (entry->refs == 0)
+                    cache_entry_free(entry);
+                return;
+            }
+            unlink_entry(node);
+            node->next = victims;
+            victims = node;
+            break;
+        }
+    }
+    // We evict the least recently used entries, that no worker uses
+    cache_entry* node = lru_tail;
+    while (memory_used + entry_bytes(entry) > memory_limit && node != NULL) {
+        cache_entry* prev = node->prev;
+        if (node->refs == 0) {
+            unlink_entry(node);
+            node->next = victims;
+            victims = node;
+        }
+        node = prev;
+    }
+    if (memory_used + entry_bytes(entry) > memory_limit) {
+        pthread_mutex_unlock(&cache_mtx);
+        if (entry->refs == 0)
+            cache_entry_free(entry);
+    }
+    else {
+        int pos = cache_hash(entry->key);
+        entry->chain = entries[pos];
+        entries[pos] = entry;
+        entry->prev = NULL;
+        entry->next = lru_head;
+        if (lru_head != NULL)
+            lru_head->prev = entry;
+        lru_head = entry;
+        if (lru_tail == NULL)
+            lru_tail = entry;
+        entry->cached = true;
+        memory_used += entry_bytes(entry);
+        pthread_mutex_unlock(&cache_mtx);
+    }
+
+    // Evicted files go to disk if we have an on-disk tier
+    while (victims != NULL) {
+        cache_entry* victim = victims;
+        victims = victims->next;
+        if (disk_dir != NULL)
+            spill_entry(victim);
+        else
+            cache_entry_free(victim);
+    }
+}
+
+// Returns the cached file key, if its size and mtime are the ones given
+cache_entry* cache_lookup(char* key,long long size,long long mtime) {
+    pthread_mutex_lock(&cache_mtx);
+    for (cache_entry* entry = entries[cache_hash(key)]; entry != NULL; entry = entry->chain) {
+        if (strcmp(entry->key,key))
+            continue;
+        // The file changed in source, so the entry is useless
+        if (entry->size != size || entry->mtime != mtime) {
+            unlink_entry(entry);
+            if (entry->refs == 0)
+                cache_entry_free(entry);
+            break;
+        }
+        // We move entry to the head of our LRU list
+        if (entry != lru_head) {
+            entry->prev->next = entry->next;
+            if (entry->next != NULL)
+                entry->next->prev = entry->prev;
+            else
+                lru_tail = entry->prev;
+            entry->prev = NULL;
+            entry->next = lru_head;
+            lru_head->prev = entry;
+            lru_head = entry;
+        }
+        entry->refs++;
+        cache_hits++;
+        pthread_mutex_unlock(&cache_mtx);
+        return entry;
+    }
+
+    // We search the on-disk tier
+    disk_entry* spilled = NULL;
+    for (disk_entry* node = disk_entries[cache_hash(key)]; node != NULL; node = node->chain) {
+        if (!strcmp(node->key,key)) {
+            spilled = node;
+            unlink_disk_entry(spilled);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&cache_mtx);
+
+    cache_entry* entry = NULL;
+    if (spilled != NULL) {
+        if (spilled->size == size && spilled->mtime == mtime)
+            entry = load_entry(spilled);
+        unlink(spilled->filename);
+        free(spilled);
+    }
+    pthread_mutex_lock(&cache_mtx);
+    if (entry == NULL)
+        cache_misses++;
+    else
+        cache_hits++;
+    pthread_mutex_unlock(&cache_mtx);
+    // Files found in disk are moved back to memory
+    if (entry != NULL) {
+        entry->refs = 1;
+        cache_insert(entry);
+    }
+    return entry;
+}
+
+// Gives back an entry returned by cache_lookup
+void cache_release(cache_entry* entry) {
+    pthread_mutex_lock(&cache_mtx);
+    entry->refs--;
+    bool removed = entry->refs == 0 && !entry->cached;
+    pthread_mutex_unlock(&cache_mtx);
+    // The entry was removed while we were using it
+    if (removed)
+        cache_entry_free(entry);
+}
+
+// Puts in buffer a line with cache's statistics
+char* cache_report(char* buffer) {
+    pthread_mutex_lock(&cache_mtx);
+    long long lookups = cache_hits + cache_misses;
+    sprintf(buffer,"Cache: %lld hits, %lld misses, %.1f%% hit ratio, %lld/%lld bytes of memory, %lld/%lld bytes of disk",
+        cache_hits,cache_misses,(lookups > 0) ? 100.0 * cache_hits / lookups : 0.0,memory_used,memory_limit,disk_used,disk_limit);
+    pthread_mutex_unlock(&cache_mtx);
+    return buffer;
+}
+
+// Frees the cache from the memory and deletes its files in disk
+void cache_destroy(void) {
+    while (lru_head != NULL) {
+        cache_entry* temp = lru_head;
+        lru_head = lru_head->next;
+        cache_entry_free(temp);
+    }
+    while (disk_head != NULL) {
+        disk_entry* temp = disk_head;
+        disk_head = disk_head->next;
+        unlink(temp->filename);
+        free(temp);
+    }
+    pthread_mutex_destroy(&cache_mtx);
+}
@@ -0,0 +1,99 @@
+/* Source file for the checkpoint store. It is a hash table with seperate 
+ * chaining, protected by a mutex, as it is shared by all worker threads. 
+ * Checkpoints are few (one for every unfinished transfer), so we use a fixed
+ * number of chains and we never rehash.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "../include/checkpoint.h"
+
+checkpoint_node* checkpoints[CHECKPOINT_BUCKETS];
+
+pthread_mutex_t checkpoint_mtx; // Locks every access to checkpoints
+
+// We use the djb2 hash function
+unsigned int checkpoint_hash(char* key) {
+    unsigned int hash = 5381;
+    for (int i = 0; key[i] != '\0'; i++) {
+        hash = (hash * 33) + key[i];
+    }
+    return hash % CHECKPOINT_BUCKETS;
+}
+
+// Initializes the checkpoint store
+void checkpoint_init(void) {
+    for (int i = 0; i < CHECKPOINT_BUCKETS; i++) {
+        checkpoints[i] = NULL;
+    }
+    pthread_mutex_init(&checkpoint_mtx,NULL);
+}
+
+// Records that offset bytes of the source file were sent for key
+void checkpoint_set(char* key,checkpoint_source* source,long long offset) {
+    int pos = checkpoint_hash(key);
+    pthread_mutex_lock(&checkpoint_mtx);
+    checkpoint_node* node = checkpoints[pos];
+    while (node != NULL && strcmp(node->key,key)) {
+        node = node->next;
+    }
+    // New checkpoint, we add it at the head of the chain
+    if (node == NULL) {
+        node = malloc(sizeof(checkpoint_node));
+        if (node == NULL) {
+            perror("ERROR! malloc failed\n");
+            exit(-1);
+        }
+        strcpy(node->key,key);
+        node->next = checkpoints[pos];
+        checkpoints[pos] = node;
+    }
+    node->source = *source;
+    node->offset = offset;
+    pthread_mutex_unlock(&checkpoint_mtx);
+}
+
+// Returns the offset recorded for key, or 0 if there is no checkpoint
+long long checkpoint_get(char* key,checkpoint_source* source) {
+    long long offset = 0;
+    memset(source,0,sizeof(checkpoint_source));
+    pthread_mutex_lock(&checkpoint_mtx);
+    for (checkpoint_node* node = checkpoints[checkpoint_hash(key)]; node != NULL; node = node->next) {
+        if (!strcmp(node->key,key)) {
+            *source = node->source;
+            offset = node->offset;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&checkpoint_mtx);
+    return offset;
+}
+
+// Removes key's checkpoint, if it exists
+void checkpoint_remove(char* key) {
+    pthread_mutex_lock(&checkpoint_mtx);
+    checkpoint_node** node = &checkpoints[checkpoint_hash(key)];
+    while (*node != NULL) {
+        if (!strcmp((*node)->key,key)) {
+            checkpoint_node* temp = *node;
+            *node = (*node)->next;
+            free(temp);
+            break;
+        }
+        node = &((*node)->next);
+    }
+    pthread_mutex_unlock(&checkpoint_mtx);
+}
+
+// Frees the checkpoint store from the memory
+void checkpoint_destroy(void) {
+    for (int i = 0; i < CHECKPOINT_BUCKETS; i++) {
+        while (checkpoints[i] != NULL) {
+            checkpoint_node* temp = checkpoints[i];
+            checkpoints[i] = checkpoints[i]->next;
+            free(temp);
+        }
+    }
+    pthread_mutex_destroy(&checkpoint_mtx);
+}
@@ -0,0 +1,144 @@
+/* Source file for nfs_client's group commit. The files that wait for a round
+ * are kept in a list, protected by a mutex. The background thread takes the
+ * whole list at the end of a window, so files that are completed during a
+ * round wait for the next one.
+ */
+#define _GNU_SOURCE // For syncfs
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../include/nfs.h"
+#include "../include/commit.h"
+
+int commit_window_ms = 0; // 0 means that files are renamed without syncing
+
+commit_request* commit_head = NULL; // Files that wait for the next round
+commit_request* commit_tail = NULL;
+
+pthread_mutex_t commit_mtx; // Locks the list and the state of the requests
+pthread_cond_t commit_pending; // Signaled when the list isn't empty
+pthread_cond_t commit_done; // Broadcasted at the end of every round
+
+pthread_t committer;
+
+// Syncs the filesystem of every request of round once. The requests of a
+// filesystem whose sync failed get its error
+void commit_sync(commit_request* round) {
+    for (commit_request* request = round; request != NULL; request = request->next) {
+        // Only the first request of a filesystem syncs it
+        commit_request* first = round;
+        while (first->dev != request->dev)
+            first = first->next;
+        if (first != request || syncfs(request->fd) == 0)
+            continue;
+        int error = errno;
+        for (commit_request* other = request; other != NULL; other = other->next) {
+            if (other->dev == request->dev && other->error == 0)
+                other->error = error;
+        }
+    }
+}
+
+// Commits the files of a round
+void commit_round(commit_request* round) {
+    // The data of the files are durable before they are renamed
+    commit_sync(round);
+    for (commit_request* request = round; request != NULL; request = request->next) {
+        if (request->error == 0 && rename(request->tmp_filename,request->filename) < 0)
+            request->error = errno;
+    }
+    // And the renames are durable before we acknowledge them
+    commit_sync(round);
+    for (commit_request* request = round; request != NULL; request = request->next) {
+        close(request->fd);
+    }
+}
+
+// The background thread, that commits the files a round at a time
+void* commit_thread(void* args) {
+    while (true) {
+        pthread_mutex_lock(&commit_mtx);
+        while (commit_head == NULL)
+            pthread_cond_wait(&commit_pending,&commit_mtx);
+        pthread_mutex_unlock(&commit_mtx);
+
+        // More files join the round while we wait for the window to end
+        struct timespec window;
+        window.tv_sec = commit_window_ms / 1000;
+        window.tv_nsec = (commit_window_ms % 1000) * 1000000L;
+        nanosleep(&window,NULL);
+
+        pthread_mutex_lock(&commit_mtx);
+        commit_request* round = commit_head;
+        commit_head = NULL;
+        commit_tail = NULL;
+        pthread_mutex_unlock(&commit_mtx);
+
+        commit_round(round);
+
+        pthread_mutex_lock(&commit_mtx);
+        for (commit_request* request = round; request != NULL; request = request->next) {
+            request->done = true;
+        }
+        pthread_cond_broadcast(&commit_done);
+        pthread_mutex_unlock(&commit_mtx);
+    }
+}
+
+// Starts the background thread, if files are synced
+void commit_init(int window_ms) {
+    commit_window_ms = window_ms;
+    if (window_ms == 0)
+        return;
+    pthread_mutex_init(&commit_mtx,NULL);
+    pthread_cond_init(&commit_pending,NULL);
+    pthread_cond_init(&commit_done,NULL);
+    if (pthread_create(&committer,NULL,commit_thread,NULL) != 0)
+        perror_exit("ERROR! pthread_create failed\n");
+    pthread_detach(committer);
+}
+
+// Commits a temp file and waits for its round
+int commit_file(int fd,char* tmp_filename,char* filename) {
+    if (commit_window_ms == 0) {
+        if (close(fd) < 0 || rename(tmp_filename,filename) < 0)
+            return -1;
+        return 0;
+    }
+    commit_request request;
+    struct stat info;
+    request.fd = fd;
+    request.tmp_filename = tmp_filename;
+    request.filename = filename;
+    request.error = 0;
+    request.dev = 0;
+    if (fstat(fd,&info) < 0)
+        request.error = errno;
+    else
+        request.dev = info.st_dev;
+    request.done = false;
+    request.next = NULL;
+
+    pthread_mutex_lock(&commit_mtx);
+    if (commit_tail != NULL)
+        commit_tail->next = &request;
+    else
+        commit_head = &request;
+    commit_tail = &request;
+    pthread_cond_signal(&commit_pending);
+    while (!request.done)
+        pthread_cond_wait(&commit_done,&commit_mtx);
+    pthread_mutex_unlock(&commit_mtx);
+
+    if (request.error != 0) {
+        errno = request.error;
+        return -1;
+    }
+    return 0;
+}
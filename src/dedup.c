@@ -0,0 +1,117 @@
+/* Source file for nfs_manager's dedup index. Entries are kept in a hash table
+ * with seperate chaining, protected by a mutex, as it is shared by all worker
+ * threads. A content has a single entry for every target, the last file that
+ * received it.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <pthread.h>
+#include "../include/nfs.h"
+#include "../include/dedup.h"
+
+dedup_entry* dedup_entries[DEDUP_BUCKETS];
+
+pthread_mutex_t dedup_mtx; // Locks every access to the index
+
+// We use the djb2 hash function, on the endpoint and the content's hash, and
+// mix in the size
+unsigned int dedup_hash(char* endpoint,long long size,char* hash) {
+    unsigned int value = 5381;
+    for (int i = 0; endpoint[i] != '\0'; i++) {
+        value = (value * 33) + endpoint[i];
+    }
+    for (int i = 0; hash[i] != '\0'; i++) {
+        value = (value * 33) + hash[i];
+    }
+    return (value ^ size) % DEDUP_BUCKETS;
+}
+
+// Initializes the index
+void dedup_init(void) {
+    for (int i = 0; i < DEDUP_BUCKETS; i++) {
+        dedup_entries[i] = NULL;
+    }
+    pthread_mutex_init(&dedup_mtx,NULL);
+}
+
+// Returns the address of the pointer to the entry of a content of endpoint,
+// that points to NULL if there is none. dedup_mtx must be locked
+dedup_entry** dedup_entry_of(char* endpoint,long long size,char* hash) {
+    dedup_entry** entry = &dedup_entries[dedup_hash(endpoint,size,hash)];
+    while (*entry != NULL && ((*entry)->size != size || strcmp((*entry)->hash,hash) || strcmp((*entry)->endpoint,endpoint)))
+        entry = &(*entry)->next;
+    return entry;
+}
+
+// Finds a file of host:port with the given content
+bool dedup_find(char* host,int port,long long size,char* hash,char* path) {
+    char endpoint[1024];
+    snprintf(endpoint,sizeof(endpoint),"%s:%d",host,port);
+    pthread_mutex_lock(&dedup_mtx);
+    dedup_entry* entry = *dedup_entry_of(endpoint,size,hash);
+    if (entry != NULL)
+        snprintf(path,1024,"%s",entry->path);
+    pthread_mutex_unlock(&dedup_mtx);
+    return entry != NULL;
+}
+
+// Records that path of host:port has the given content
+void dedup_add(char* host,int port,long long size,char* hash,char* path) {
+    char endpoint[1024];
+    snprintf(endpoint,sizeof(endpoint),"%s:%d",host,port);
+    char* new_path = strdup(path);
+    if (new_path == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    pthread_mutex_lock(&dedup_mtx);
+    dedup_entry** slot = dedup_entry_of(endpoint,size,hash);
+    dedup_entry* entry = *slot;
+    if (entry == NULL) {
+        entry = malloc(sizeof(dedup_entry));
+        if (entry == NULL || (entry->endpoint = strdup(endpoint)) == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        entry->size = size;
+        snprintf(entry->hash,sizeof(entry->hash),"%s",hash);
+        entry->next = NULL;
+        *slot = entry;
+    }
+    else
+        free(entry->path);
+    entry->path = new_path;
+    pthread_mutex_unlock(&dedup_mtx);
+}
+
+// Removes the entry of path of host:port with the given content
+void dedup_forget(char* host,int port,long long size,char* hash,char* path) {
+    char endpoint[1024];
+    snprintf(endpoint,sizeof(endpoint),"%s:%d",host,port);
+    pthread_mutex_lock(&dedup_mtx);
+    dedup_entry** slot = dedup_entry_of(endpoint,size,hash);
+    dedup_entry* entry = *slot;
+    // Another file may have got the content in the meantime
+    if (entry != NULL && !strcmp(entry->path,path)) {
+        *slot = entry->next;
+        free(entry->endpoint);
+        free(entry->path);
+        free(entry);
+    }
+    pthread_mutex_unlock(&dedup_mtx);
+}
+
+// Frees the index
+void dedup_destroy(void) {
+    for (int i = 0; i < DEDUP_BUCKETS; i++) {
+        dedup_entry* entry = dedup_entries[i];
+        while (entry != NULL) {
+            dedup_entry* next = entry->next;
+            free(entry->endpoint);
+            free(entry->path);
+            free(entry);
+            entry = next;
+        }
+        dedup_entries[i] = NULL;
+    }
+    pthread_mutex_destroy(&dedup_mtx);
+}
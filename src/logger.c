@@ -0,0 +1,213 @@
+/* Source file for nfs_manager's logger. The ring is a bounded queue of slots,
+ * where every slot has a sequence number. A thread that wants to write a
+ * record reserves the next position with compare and swap, and when the
+ * slot's sequence number shows that it is free, it copies the record in it
+ * and publishes it by changing the sequence number. The background thread is
+ * the only one that takes records out, so it needs no compare and swap.
+ *
+ * When the ring is empty the background thread sleeps on a condition variable
+ * and the workers only take its mutex, to wake it up, if it is sleeping.
+ */
+#define _GNU_SOURCE // For CLOCK_REALTIME_COARSE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include "../include/nfs.h"
+#include "../include/logger.h"
+
+log_slot slots[LOG_SLOTS];
+atomic_ullong enqueue_position; // Next position a worker will reserve
+unsigned long long dequeue_position; // Next position the writer will take
+
+int log_fd;
+pthread_t writer;
+atomic_bool stopping;
+atomic_bool writer_sleeping; // True while the writer waits for records
+pthread_mutex_t writer_mtx;
+pthread_cond_t writer_cond; // The writer waits on it when the ring is empty
+
+// The coarse clock. A seqlock protects clock_buffer, clock_sequence is odd
+// while the writer changes it
+atomic_uint clock_sequence;
+char clock_buffer[32];
+time_t clock_second;
+
+// Updates the coarse clock, if a new second has started
+void update_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME_COARSE,&now);
+    if (now.tv_sec == clock_second)
+        return;
+    clock_second = now.tv_sec;
+    struct tm time_info;
+    localtime_r(&now.tv_sec,&time_info);
+    atomic_fetch_add(&clock_sequence,1);
+    strftime(clock_buffer,32,"%Y-%m-%d %H:%M:%S",&time_info);
+    atomic_fetch_add(&clock_sequence,1);
+}
+
+// Puts the current timestamp of the coarse clock inside time_buffer
+char* logger_timestamp(char time_buffer[32]) {
+    unsigned int sequence;
+    do {
+        sequence = atomic_load_explicit(&clock_sequence,memory_order_acquire);
+        memcpy(time_buffer,clock_buffer,32);
+        atomic_thread_fence(memory_order_acquire);
+    } while ((sequence & 1) || sequence != atomic_load_explicit(&clock_sequence,memory_order_relaxed));
+    return time_buffer;
+}
+
+// Returns true if the next slot of the ring has a record
+bool record_ready(void) {
+    log_slot* slot = &slots[dequeue_position % LOG_SLOTS];
+    return atomic_load(&slot->sequence) == dequeue_position + 1;
+}
+
+// Writes every record that is in the ring, in batches of LOG_BATCH records
+void flush_records(void) {
+    struct iovec iov[LOG_BATCH];
+    while (record_ready()) {
+        int count = 0;
+        while (count < LOG_BATCH && record_ready()) {
+            log_slot* slot = &slots[dequeue_position % LOG_SLOTS];
+            iov[count].iov_base = (slot->long_record != NULL) ? slot->long_record : slot->record;
+            iov[count++].iov_len = slot->len;
+            dequeue_position++;
+        }
+        // A writev can write less than we asked for, so we continue after
+        // the bytes it wrote
+        struct iovec* next = iov;
+        int left = count;
+        while (left > 0) {
+            ssize_t n = writev(log_fd,next,left);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                perror("ERROR! writev on logfile failed\n");
+                break;
+            }
+            while (left > 0 && (size_t)n >= next->iov_len) {
+                n -= next->iov_len;
+                next++;
+                left--;
+            }
+            if (left > 0) {
+                next->iov_base = (char*)next->iov_base + n;
+                next->iov_len -= n;
+            }
+        }
+        // The slots are free again for the workers
+        for (unsigned long long position = dequeue_position - count; position < dequeue_position; position++) {
+            log_slot* slot = &slots[position % LOG_SLOTS];
+            free(slot->long_record);
+            slot->long_record = NULL;
+            atomic_store_explicit(&slot->sequence,position + LOG_SLOTS,memory_order_release);
+        }
+    }
+}
+
+// The background thread, that writes the records of the ring to the logfile
+void* writer_thread(void* args) {
+    while (true) {
+        flush_records();
+        update_clock();
+        if (atomic_load(&stopping)) {
+            flush_records();
+            return NULL;
+        }
+        pthread_mutex_lock(&writer_mtx);
+        atomic_store(&writer_sleeping,true);
+        // A record could be published before we started sleeping. We wake up
+        // at least every 100ms, to keep the coarse clock up to date
+        if (!record_ready() && !atomic_load(&stopping)) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME,&until);
+            until.tv_nsec += 100000000;
+            if (until.tv_nsec >= 1000000000) {
+                until.tv_sec++;
+                until.tv_nsec -= 1000000000;
+            }
+            pthread_cond_timedwait(&writer_cond,&writer_mtx,&until);
+        }
+        atomic_store(&writer_sleeping,false);
+        pthread_mutex_unlock(&writer_mtx);
+    }
+}
+
+// Starts the background thread, that writes the records to logfile_fd
+void logger_init(int logfile_fd) {
+    log_fd = logfile_fd;
+    for (unsigned long long i = 0; i < LOG_SLOTS; i++) {
+        atomic_init(&slots[i].sequence,i);
+        slots[i].long_record = NULL;
+    }
+    atomic_init(&enqueue_position,0);
+    dequeue_position = 0;
+    atomic_init(&stopping,false);
+    atomic_init(&writer_sleeping,false);
+    atomic_init(&clock_sequence,0);
+    clock_second = 0;
+    update_clock();
+    pthread_mutex_init(&writer_mtx,NULL);
+    pthread_cond_init(&writer_cond,NULL);
+    pthread_create(&writer,NULL,writer_thread,NULL);
+}
+
+// Puts a record of len bytes in the ring, to be written to the logfile
+void logger_write(char* record,int len) {
+    unsigned long long position = atomic_load_explicit(&enqueue_position,memory_order_relaxed);
+    log_slot* slot;
+    while (true) {
+        slot = &slots[position % LOG_SLOTS];
+        unsigned long long sequence = atomic_load_explicit(&slot->sequence,memory_order_acquire);
+        long long diff = (long long)(sequence - position);
+        if (diff == 0) {
+            // The slot is free, we try to reserve it
+            if (atomic_compare_exchange_weak(&enqueue_position,&position,position + 1))
+                break;
+        }
+        else if (diff < 0) {
+            // The ring is full, we let the writer empty it
+            sched_yield();
+            position = atomic_load_explicit(&enqueue_position,memory_order_relaxed);
+        }
+        else
+            position = atomic_load_explicit(&enqueue_position,memory_order_relaxed);
+    }
+    if (len > LOG_RECORD) {
+        slot->long_record = malloc(len);
+        if (slot->long_record == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        memcpy(slot->long_record,record,len);
+    }
+    else
+        memcpy(slot->record,record,len);
+    slot->len = len;
+    atomic_store(&slot->sequence,position + 1);
+
+    // We wake up the writer only if it is sleeping
+    if (atomic_load(&writer_sleeping)) {
+        pthread_mutex_lock(&writer_mtx);
+        pthread_cond_signal(&writer_cond);
+        pthread_mutex_unlock(&writer_mtx);
+    }
+}
+
+// Writes every record that is still in the ring and stops the writer
+void logger_destroy(void) {
+    atomic_store(&stopping,true);
+    pthread_mutex_lock(&writer_mtx);
+    pthread_cond_signal(&writer_cond);
+    pthread_mutex_unlock(&writer_mtx);
+    pthread_join(writer,NULL);
+    pthread_mutex_destroy(&writer_mtx);
+    pthread_cond_destroy(&writer_cond);
+}
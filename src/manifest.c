@@ -0,0 +1,370 @@
+/* Source file for the manifest of synced files. The manifest file starts with
+ * a manifest_header, then there is an open addressing table (with linear
+ * probing) of records, and then the keys of the records, one after the other.
+ * The whole file is mapped in memory and a mutex protects it, as it is shared
+ * by all worker threads. Records are updated in place. When the table or the
+ * keys need more space, a bigger manifest is written in a new file that
+ * replaces the old one, so a crash never leaves a half resized manifest.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "../include/nfs.h"
+#include "../include/manifest.h"
+
+#define MOD 0600
+
+#define MANIFEST_LOAD 0.7 // when count / capacity > load, the table grows
+
+// The record of a manifest of the first version, that had no inodes
+typedef struct {
+    uint64_t key_hash;
+    uint64_t key_offset;
+    uint32_t key_len;
+    uint32_t unused;
+    int64_t size;
+    int64_t mtime;
+    uint64_t content_hash;
+    int64_t synced_at;
+} manifest_record_v1;
+
+char* manifest_path = NULL; // NULL means that the manifest is disabled
+char* manifest_base = NULL; // Where the manifest file is mapped
+size_t manifest_length = 0;
+int manifest_fd = -1;
+
+pthread_mutex_t manifest_mtx; // Locks every access to the manifest
+
+// Returns the header of the manifest mapped at base
+manifest_header* manifest_header_of(char* base) {
+    return (manifest_header*)base;
+}
+
+// Returns the records of the manifest mapped at base
+manifest_record* manifest_records_of(char* base) {
+    return (manifest_record*)(base + sizeof(manifest_header));
+}
+
+// Returns the keys of the manifest mapped at base
+char* manifest_strings_of(char* base) {
+    return base + sizeof(manifest_header) + manifest_header_of(base)->capacity * sizeof(manifest_record);
+}
+
+// Returns the length of a manifest file with the given capacity and keys
+size_t manifest_length_of(uint32_t capacity,uint64_t strings_size) {
+    return sizeof(manifest_header) + capacity * sizeof(manifest_record) + strings_size;
+}
+
+// Adds len bytes of data to a content hash (FNV-1a)
+uint64_t manifest_hash(uint64_t hash,const void* data,long long len) {
+    const unsigned char* bytes = data;
+    for (long long i = 0; i < len; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// Puts the key of the source and the target file in key (of 2100 bytes), and
+// its hash in key_hash, and returns the key's length
+int manifest_key(char* key,char* source_path,char* target_path,uint64_t* key_hash) {
+    int key_len = snprintf(key,2100,"%s %s",source_path,target_path);
+    *key_hash = manifest_hash(MANIFEST_HASH_INIT,key,key_len);
+    if (*key_hash == 0) // 0 marks the empty records
+        *key_hash = 1;
+    return key_len;
+}
+
+// Returns the position of key's record in the manifest mapped at base, or the
+// empty position where it would be put
+uint32_t manifest_find(char* base,char* key,uint32_t key_len,uint64_t key_hash) {
+    manifest_header* header = manifest_header_of(base);
+    manifest_record* records = manifest_records_of(base);
+    char* strings = manifest_strings_of(base);
+    uint32_t pos = key_hash & (header->capacity - 1);
+    while (records[pos].key_hash != 0) {
+        if (records[pos].key_hash == key_hash && records[pos].key_len == key_len
+            && !memcmp(strings + records[pos].key_offset,key,key_len))
+            return pos;
+        pos = (pos + 1) & (header->capacity - 1);
+    }
+    return pos;
+}
+
+// Creates a manifest file of length bytes at path, maps it in memory and
+// returns where. Its descriptor is put in fd
+char* manifest_create(char* path,size_t length,int* fd) {
+    *fd = open(path,O_RDWR | O_CREAT | O_TRUNC,MOD);
+    if (*fd < 0)
+        perror_exit("ERROR! open failed\n");
+    if (ftruncate(*fd,length) < 0)
+        perror_exit("ERROR! ftruncate failed\n");
+    char* base = mmap(NULL,length,PROT_READ | PROT_WRITE,MAP_SHARED,*fd,0);
+    if (base == MAP_FAILED)
+        perror_exit("ERROR! mmap failed\n");
+    return base;
+}
+
+// Replaces a manifest of the first version with one that has the same
+// records, without inodes
+void manifest_upgrade(void) {
+    char tmp_path[1024];
+    snprintf(tmp_path,sizeof(tmp_path),"%s.tmp",manifest_path);
+    int fd;
+    manifest_header* old_header = manifest_header_of(manifest_base);
+    size_t length = manifest_length_of(old_header->capacity,old_header->strings_size);
+    char* base = manifest_create(tmp_path,length,&fd);
+    manifest_header* header = manifest_header_of(base);
+    *header = *old_header;
+    memcpy(header->magic,MANIFEST_MAGIC,sizeof(header->magic));
+    // The table has the same capacity, so every record keeps its position
+    manifest_record_v1* old_records = (manifest_record_v1*)(manifest_base + sizeof(manifest_header));
+    manifest_record* records = manifest_records_of(base);
+    for (uint32_t i = 0; i < header->capacity; i++) {
+        records[i].key_hash = old_records[i].key_hash;
+        records[i].key_offset = old_records[i].key_offset;
+        records[i].key_len = old_records[i].key_len;
+        records[i].size = old_records[i].size;
+        records[i].mtime = old_records[i].mtime;
+        records[i].content_hash = old_records[i].content_hash;
+        records[i].synced_at = old_records[i].synced_at;
+        records[i].inode = 0;
+    }
+    memcpy(manifest_strings_of(base),(char*)(old_records + header->capacity),header->strings_used);
+    if (msync(base,length,MS_SYNC) < 0 || rename(tmp_path,manifest_path) < 0)
+        perror_exit("ERROR! manifest upgrade failed\n");
+    munmap(manifest_base,manifest_length);
+    close(manifest_fd);
+    manifest_base = base;
+    manifest_length = length;
+    manifest_fd = fd;
+}
+
+// Opens the manifest in manifest_file
+void manifest_init(char* manifest_file) {
+    pthread_mutex_init(&manifest_mtx,NULL);
+    manifest_path = manifest_file;
+    manifest_fd = open(manifest_file,O_RDWR | O_CREAT,MOD);
+    if (manifest_fd < 0)
+        perror_exit("ERROR! open failed\n");
+    struct stat info;
+    if (fstat(manifest_fd,&info) < 0)
+        perror_exit("ERROR! fstat failed\n");
+    // A new manifest
+    if (info.st_size == 0) {
+        close(manifest_fd);
+        manifest_length = manifest_length_of(MANIFEST_INITIAL_RECORDS,MANIFEST_INITIAL_STRINGS);
+        manifest_base = manifest_create(manifest_file,manifest_length,&manifest_fd);
+        manifest_header* header = manifest_header_of(manifest_base);
+        memcpy(header->magic,MANIFEST_MAGIC,sizeof(header->magic));
+        header->capacity = MANIFEST_INITIAL_RECORDS;
+        header->count = 0;
+        header->strings_used = 0;
+        header->strings_size = MANIFEST_INITIAL_STRINGS;
+        return;
+    }
+    manifest_length = info.st_size;
+    manifest_base = mmap(NULL,manifest_length,PROT_READ | PROT_WRITE,MAP_SHARED,manifest_fd,0);
+    if (manifest_base == MAP_FAILED)
+        perror_exit("ERROR! mmap failed\n");
+    manifest_header* header = manifest_header_of(manifest_base);
+    if (manifest_length >= sizeof(manifest_header) && !memcmp(header->magic,MANIFEST_MAGIC_V1,sizeof(header->magic))
+        && manifest_length == sizeof(manifest_header) + header->capacity * sizeof(manifest_record_v1) + header->strings_size) {
+        manifest_upgrade();
+        header = manifest_header_of(manifest_base);
+    }
+    if (manifest_length < sizeof(manifest_header) || memcmp(header->magic,MANIFEST_MAGIC,sizeof(header->magic))
+        || manifest_length != manifest_length_of(header->capacity,header->strings_size)) {
+        fprintf(stderr,"ERROR! %s is not a manifest file\n",manifest_file);
+        exit(-1);
+    }
+}
+
+// Returns true if the manifest is enabled
+bool manifest_enabled(void) {
+    return manifest_path != NULL;
+}
+
+// Replaces the manifest with one that has the given capacity and bytes for
+// keys. manifest_mtx must be locked
+void manifest_resize(uint32_t capacity,uint64_t strings_size) {
+    char tmp_path[1024];
+    snprintf(tmp_path,sizeof(tmp_path),"%s.tmp",manifest_path);
+    int fd;
+    size_t length = manifest_length_of(capacity,strings_size);
+    char* base = manifest_create(tmp_path,length,&fd);
+    manifest_header* old_header = manifest_header_of(manifest_base);
+    manifest_header* header = manifest_header_of(base);
+    memcpy(header->magic,MANIFEST_MAGIC,sizeof(header->magic));
+    header->capacity = capacity;
+    header->count = old_header->count;
+    header->strings_used = old_header->strings_used;
+    header->strings_size = strings_size;
+    // Keys keep their offsets, so the records are only put in new positions
+    memcpy(manifest_strings_of(base),manifest_strings_of(manifest_base),old_header->strings_used);
+    manifest_record* old_records = manifest_records_of(manifest_base);
+    manifest_record* records = manifest_records_of(base);
+    for (uint32_t i = 0; i < old_header->capacity; i++) {
+        if (old_records[i].key_hash == 0)
+            continue;
+        uint32_t pos = old_records[i].key_hash & (capacity - 1);
+        while (records[pos].key_hash != 0)
+            pos = (pos + 1) & (capacity - 1);
+        records[pos] = old_records[i];
+    }
+    // The new manifest is complete in disk before it replaces the old one
+    if (msync(base,length,MS_SYNC) < 0 || rename(tmp_path,manifest_path) < 0)
+        perror_exit("ERROR! manifest resize failed\n");
+    munmap(manifest_base,manifest_length);
+    close(manifest_fd);
+    manifest_base = base;
+    manifest_length = length;
+    manifest_fd = fd;
+}
+
+// Records that the source file was synced to the target file
+void manifest_set(char* source_path,char* target_path,long long size,long long mtime,uint64_t content_hash,uint64_t inode) {
+    if (manifest_path == NULL)
+        return;
+    char key[2100];
+    uint64_t key_hash;
+    int key_len = manifest_key(key,source_path,target_path,&key_hash);
+    pthread_mutex_lock(&manifest_mtx);
+    uint32_t pos = manifest_find(manifest_base,key,key_len,key_hash);
+    manifest_record* record = &manifest_records_of(manifest_base)[pos];
+    // A new record, that may need a bigger manifest
+    if (record->key_hash == 0) {
+        manifest_header* header = manifest_header_of(manifest_base);
+        uint32_t capacity = header->capacity;
+        uint64_t strings_size = header->strings_size;
+        if (header->count + 1 > capacity * MANIFEST_LOAD)
+            capacity *= 2;
+        while (header->strings_used + key_len > strings_size)
+            strings_size *= 2;
+        if (capacity != header->capacity || strings_size != header->strings_size) {
+            manifest_resize(capacity,strings_size);
+            pos = manifest_find(manifest_base,key,key_len,key_hash);
+            record = &manifest_records_of(manifest_base)[pos];
+            header = manifest_header_of(manifest_base);
+        }
+        memcpy(manifest_strings_of(manifest_base) + header->strings_used,key,key_len);
+        record->key_offset = header->strings_used;
+        record->key_len = key_len;
+        header->strings_used += key_len;
+        header->count++;
+    }
+    record->size = size;
+    record->mtime = mtime;
+    record->content_hash = content_hash;
+    record->inode = inode;
+    record->synced_at = time(NULL);
+    // The record is complete before it can be found
+    record->key_hash = key_hash;
+    pthread_mutex_unlock(&manifest_mtx);
+}
+
+// Copies the record of the source and target file in result
+bool manifest_get(char* source_path,char* target_path,manifest_record* result) {
+    if (manifest_path == NULL)
+        return false;
+    char key[2100];
+    uint64_t key_hash;
+    int key_len = manifest_key(key,source_path,target_path,&key_hash);
+    pthread_mutex_lock(&manifest_mtx);
+    manifest_record* record = &manifest_records_of(manifest_base)[manifest_find(manifest_base,key,key_len,key_hash)];
+    bool found = record->key_hash != 0;
+    if (found)
+        *result = *record;
+    pthread_mutex_unlock(&manifest_mtx);
+    return found;
+}
+
+/* Removes the record of the source and target file. The records after it,
+ * that would not be found past the empty position, are moved back into it
+ * (there are no tombstones). The key's bytes stay unused in the strings */
+void manifest_remove(char* source_path,char* target_path) {
+    if (manifest_path == NULL)
+        return;
+    char key[2100];
+    uint64_t key_hash;
+    int key_len = manifest_key(key,source_path,target_path,&key_hash);
+    pthread_mutex_lock(&manifest_mtx);
+    manifest_header* header = manifest_header_of(manifest_base);
+    manifest_record* records = manifest_records_of(manifest_base);
+    uint32_t mask = header->capacity - 1;
+    uint32_t empty = manifest_find(manifest_base,key,key_len,key_hash);
+    if (records[empty].key_hash == 0) {
+        pthread_mutex_unlock(&manifest_mtx);
+        return;
+    }
+    records[empty].key_hash = 0;
+    header->count--;
+    for (uint32_t pos = (empty + 1) & mask; records[pos].key_hash != 0; pos = (pos + 1) & mask) {
+        // A record stays if its home is after the empty position, up to it
+        uint32_t home = records[pos].key_hash & mask;
+        if (((pos - home) & mask) < ((pos - empty) & mask))
+            continue;
+        records[empty] = records[pos];
+        records[pos].key_hash = 0;
+        empty = pos;
+    }
+    pthread_mutex_unlock(&manifest_mtx);
+}
+
+// Copies the records whose key starts with prefix
+int manifest_list(char* prefix,manifest_entry** entries) {
+    *entries = NULL;
+    if (manifest_path == NULL)
+        return 0;
+    int count = 0;
+    int capacity = 0;
+    size_t prefix_len = strlen(prefix);
+    pthread_mutex_lock(&manifest_mtx);
+    manifest_header* header = manifest_header_of(manifest_base);
+    manifest_record* records = manifest_records_of(manifest_base);
+    char* strings = manifest_strings_of(manifest_base);
+    for (uint32_t i = 0; i < header->capacity; i++) {
+        if (records[i].key_hash == 0 || records[i].key_len < prefix_len || memcmp(strings + records[i].key_offset,prefix,prefix_len))
+            continue;
+        if (count == capacity) {
+            capacity = (capacity == 0) ? 64 : capacity * 2;
+            *entries = realloc(*entries,capacity * sizeof(manifest_entry));
+            if (*entries == NULL)
+                perror_exit("ERROR! realloc failed\n");
+        }
+        manifest_entry* entry = &(*entries)[count++];
+        entry->key = strndup(strings + records[i].key_offset,records[i].key_len);
+        if (entry->key == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        entry->record = records[i];
+    }
+    pthread_mutex_unlock(&manifest_mtx);
+    return count;
+}
+
+// Frees the entries of manifest_list
+void manifest_free(manifest_entry* entries,int count) {
+    for (int i = 0; i < count; i++) {
+        free(entries[i].key);
+    }
+    free(entries);
+}
+
+// Writes the manifest to its file and unmaps it
+void manifest_destroy(void) {
+    if (manifest_path == NULL)
+        return;
+    msync(manifest_base,manifest_length,MS_SYNC);
+    munmap(manifest_base,manifest_length);
+    close(manifest_fd);
+    manifest_path = NULL;
+    pthread_mutex_destroy(&manifest_mtx);
+}
@@ -1,28 +1,84 @@
-/* sync_info_mem_store is a hash_table implemented using seperate chaining. It 
- * stores dir_info values and uses target_dir as primary key.
- * */ 
+/* sync_info_mem_store is a hash_table implemented using open addressing with
+ * Robin Hood hashing: an entry that is inserted takes the place of an entry
+ * that is closer to its home position, so all entries stay close to their home
+ * position, and a search stops as soon as it finds an entry closer to its home
+ * than the searched one would be. Removing an entry moves the entries after it
+ * one position back, so we don't need tombstones.
+ *
+ * When a shard needs more space, a new hash table becomes the current one and
+ * the previous table stays as the old one. Every write moves MAP_MIGRATE_STEP
+ * entries of the old table to the new one, and marks them as moved (the old
+ * table's structure never changes, so it can still be searched). Entries that
+ * a write changes are moved first. The new table is at least about double, so
+ * the old one is empty long before the new one needs to grow too.
+ *
+ * The table is split in shards, every shard is changed only by a writer at a
+ * time (under its lock), while readers search it without locks:
+ *      - A writer makes the shard's sequence odd before it changes the shard
+ *        and even again after it, so a reader that saw the sequence change
+ *        reads again.
+ *      - A writer never frees a hash_table while a reader could be reading it.
+ *        It retires it, and retired memory is freed by the next writer that
+ *        finds no readers in the shard. Strings and the limits of the pairs
+ *        are never freed before map_destroy, so a reader never sees them
+ *        freed.
+ * */
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
 #include "../include/map.h"
-#include "../include/lnode.h"
+#include "../include/arena.h"
 #include "../include/nfs.h"
 
-#define LOAD_FACTOR 0.9 // when  size / capacity > load factor, we rehash
+#define LOAD_FACTOR 0.85 // when  size / capacity > load factor, we rehash
 
 // According to data structure theory, we improve our hash table efficiency by
 // selecting a prime integer as array's size. Also to accieve a O(1) complexity in
-// rehashing we use at least double the size. So this array helps to accieve 
+// rehashing we use at least double the size. So this array helps to accieve
 // those goals
 int PRIME_SIZES[] = {53, 97, 193, 389, 769, 1543, 3079, 6151, 12289, 24593, 49157, 98317, 196613, 393241,
 	786433, 1572869, 3145739, 6291469, 12582917, 25165843, 50331653, 100663319, 201326611, 402653189, 805306457, 1610612741};
 
 
-// This function returns a hash code for the string value
+// This function returns a hash code for the string value, never 0
 uint hash_code(char* value);
 
 // This function will be used to rehash our hash_table for efficiently
-void map_rehash(map* mem);
+void map_rehash(map_shard* shard);
+
+// Returns the shard of a hash code, the rest of the hash code picks the home
+// position of the entry
+map_shard* map_shard_of(map* mem,uint hash) {
+    return &mem->shards[hash & (MAP_SHARDS - 1)];
+}
+
+// Returns the home position of a hash code in a hash_table with the given
+// capacity
+int map_home_of(int capacity,uint hash) {
+    return (hash / MAP_SHARDS) % capacity;
+}
+
+// Returns how far from its home position is an entry with hash at pos
+int map_distance(int capacity,uint hash,int pos) {
+    return (pos + capacity - map_home_of(capacity,hash)) % capacity;
+}
+
+// Creates an empty hash table with the given capacity
+map_table* map_table_create(int capacity) {
+    // Empty entries have a 0 hash
+    map_table* table = calloc(1,sizeof(map_table) + capacity * sizeof(map_slot));
+    if (table == NULL) {
+        perror("ERRROR! calloc failed\n");
+        exit(-1);
+    }
+    table->size = 0;
+    table->capacity = capacity;
+    return table;
+}
 
 // Creates and initializes a map data structure
 map* map_create(void) {
@@ -31,120 +87,373 @@ map* map_create(void) {
         perror("ERRROR! malloc failed\n");
         exit(-1);
     }
-    mem->size = 0;
-    mem->capacity = INITIAL_SIZE;
-    mem->hash_table = malloc(sizeof(lnode*) * mem->capacity);
-    if (mem->hash_table == NULL) {
+    atomic_init(&mem->generations,0);
+    for (int s = 0; s < MAP_SHARDS; s++) {
+        map_shard* shard = &mem->shards[s];
+        pthread_mutex_init(&shard->lock,NULL);
+        atomic_init(&shard->sequence,0);
+        atomic_init(&shard->readers,0);
+        shard->retired_memory = NULL;
+        shard->strings = arena_create();
+        shard->hash_table = map_table_create(INITIAL_SIZE);
+        shard->old_hash_table = NULL;
+        shard->migrated = 0;
+    }
+    return mem;
+}
+
+// Locks shard for a writer and makes its sequence odd
+void map_write_begin(map_shard* shard) {
+    pthread_mutex_lock(&shard->lock);
+    atomic_fetch_add(&shard->sequence,1);
+}
+
+// Makes shard's sequence even, frees the retired memory if no reader can use
+// it and unlocks shard
+void map_write_end(map_shard* shard) {
+    atomic_fetch_add(&shard->sequence,1);
+    // A reader that comes after this can't find the retired memory, as it is
+    // no longer in the shard
+    if (atomic_load(&shard->readers) == 0) {
+        while (shard->retired_memory != NULL) {
+            retired* temp = shard->retired_memory;
+            shard->retired_memory = temp->next;
+            free(temp->memory);
+            free(temp);
+        }
+    }
+    pthread_mutex_unlock(&shard->lock);
+}
+
+// Retires memory that was removed from shard
+void map_retire(map_shard* shard,void* memory) {
+    retired* node = malloc(sizeof(retired));
+    if (node == NULL) {
         perror("ERRROR! malloc failed\n");
         exit(-1);
     }
-    // We initialize with NULL values
-    for (int i = 0; i < mem->capacity; i++) {
-        mem->hash_table[i] = NULL;
+    node->memory = memory;
+    node->next = shard->retired_memory;
+    shard->retired_memory = node;
+}
+
+// Returns the entry of source in table or NULL, even if it was moved
+map_slot* map_table_find(map_table* table,char* source,uint hash) {
+    int capacity = table->capacity;
+    int pos = map_home_of(capacity,hash);
+    // A reader can see a table that is being changed, so we never search more
+    // than the whole table
+    for (int distance = 0; distance < capacity; distance++) {
+        map_slot* slot = &table->slots[pos];
+        uint slot_hash = __atomic_load_n(&slot->hash,__ATOMIC_ACQUIRE);
+        // Our entry would be before this one
+        if (slot_hash == 0 || map_distance(capacity,slot_hash,pos) < distance)
+            return NULL;
+        if (slot_hash == hash && !strcmp(slot->value.key,source))
+            return slot;
+        pos = (pos + 1) % capacity;
+    }
+    return NULL;
+}
+
+// Returns the entry of source in shard or NULL, it can be in the old hash
+// table. Used by writers and by readers (between map_read_begin and
+// map_read_retry)
+map_slot* map_find_slot(map_shard* shard,char* source,uint hash) {
+    // The old hash table is published before the new one, so if we see the new
+    // one we also see the old
+    map_slot* slot = map_table_find(__atomic_load_n(&shard->hash_table,__ATOMIC_ACQUIRE),source,hash);
+    if (slot != NULL)
+        return slot;
+    map_table* old_hash_table = __atomic_load_n(&shard->old_hash_table,__ATOMIC_ACQUIRE);
+    if (old_hash_table != NULL) {
+        slot = map_table_find(old_hash_table,source,hash);
+        if (slot != NULL && !__atomic_load_n(&slot->moved,__ATOMIC_ACQUIRE))
+            return slot;
     }
-    return mem;
+    return NULL;
+}
+
+// Puts value in table, it must not be already there, and returns its entry.
+// Entries that we pass and are closer to their home than the value we insert,
+// give their place to it, and we continue inserting them instead
+map_slot* map_insert_slot(map_table* table,uint hash,dir_info value) {
+    int capacity = table->capacity;
+    int pos = map_home_of(capacity,hash);
+    int distance = 0;
+    map_slot* inserted = NULL;
+    table->size++;
+    while (1) {
+        map_slot* slot = &table->slots[pos];
+        if (slot->hash == 0) {
+            // The value is complete before a reader can see the hash
+            slot->value = value;
+            __atomic_store_n(&slot->hash,hash,__ATOMIC_RELEASE);
+            return (inserted != NULL) ? inserted : slot;
+        }
+        int slot_distance = map_distance(capacity,slot->hash,pos);
+        if (slot_distance < distance) {
+            map_slot evicted = *slot;
+            slot->value = value;
+            __atomic_store_n(&slot->hash,hash,__ATOMIC_RELEASE);
+            if (inserted == NULL)
+                inserted = slot;
+            hash = evicted.hash;
+            value = evicted.value;
+            distance = slot_distance;
+        }
+        pos = (pos + 1) % capacity;
+        distance++;
+    }
+}
+
+// Moves an entry of the old hash table to the new one, and returns its new
+// entry. The shard's lock must be held
+map_slot* map_move_slot(map_shard* shard,map_slot* slot) {
+    map_slot* moved = map_insert_slot(shard->hash_table,slot->hash,slot->value);
+    __atomic_store_n(&slot->moved,true,__ATOMIC_RELEASE);
+    return moved;
+}
+
+// Moves up to steps entries of the old hash table to the new one. When they
+// all moved, the old hash table is retired. The shard's lock must be held
+void map_migrate(map_shard* shard,int steps) {
+    map_table* old_hash_table = shard->old_hash_table;
+    if (old_hash_table == NULL)
+        return;
+    while (steps > 0 && shard->migrated < old_hash_table->capacity) {
+        map_slot* slot = &old_hash_table->slots[shard->migrated++];
+        if (slot->hash != 0 && !slot->moved)
+            map_move_slot(shard,slot);
+        steps--;
+    }
+    if (shard->migrated == old_hash_table->capacity) {
+        __atomic_store_n(&shard->old_hash_table,NULL,__ATOMIC_RELEASE);
+        map_retire(shard,old_hash_table);
+    }
+}
+
+// Returns the entry of source in shard's current hash table (it is moved
+// there, if it is in the old one), or NULL. The shard's lock must be held
+map_slot* map_take_slot(map_shard* shard,char* source,uint hash) {
+    map_slot* slot = map_find_slot(shard,source,hash);
+    if (slot != NULL && shard->old_hash_table != NULL && slot >= shard->old_hash_table->slots
+        && slot < shard->old_hash_table->slots + shard->old_hash_table->capacity)
+        slot = map_move_slot(shard,slot);
+    return slot;
+}
+
+// A reader enters shard and gets the sequence to check at the end
+uint map_read_begin(map_shard* shard) {
+    uint sequence;
+    // A writer is changing the shard, we let it finish
+    while ((sequence = atomic_load(&shard->sequence)) & 1) {
+        sched_yield();
+    }
+    return sequence;
+}
+
+// Returns true if a writer changed shard since map_read_begin returned
+// sequence, so the reader has to read again
+bool map_read_retry(map_shard* shard,uint sequence) {
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&shard->sequence,memory_order_relaxed) != sequence;
 }
 
 // Adds new_value into structure, or if it exists it modifies it
-void map_add(map* mem,char* source,char* target) {
+unsigned int map_add(map* mem,char* source,char* target) {
+    char dir[1024],host[1024];
     dir_info new_value;
-    strcpy(new_value.key,source);
-    decode_format(source,new_value.source_dir,new_value.source_host,&new_value.source_port);
-    decode_format(target,new_value.target_dir,new_value.target_host,&new_value.target_port);
+    uint hash = hash_code(source);
+    map_shard* shard = map_shard_of(mem,hash);
+    map_write_begin(shard);
+    map_migrate(shard,MAP_MIGRATE_STEP);
+    // The strings are interned in the shard's arena
+    new_value.key = arena_intern(shard->strings,source);
+    decode_format(source,dir,host,&new_value.source_port);
+    new_value.source_dir = arena_intern(shard->strings,dir);
+    new_value.source_host = arena_intern(shard->strings,host);
+    decode_format(target,dir,host,&new_value.target_port);
+    new_value.target_dir = arena_intern(shard->strings,dir);
+    new_value.target_host = arena_intern(shard->strings,host);
+    new_value.targets = arena_intern(shard->strings,target);
     new_value.is_active = true;
-    // If it already exists we just replace value
-    dir_info* pair = map_find(mem,new_value.key);
+    new_value.generation = atomic_fetch_add(&mem->generations,1) + 1;
+    // If it already exists we just replace value (its key, limit and options
+    // stay the same)
+    map_slot* pair = map_take_slot(shard,source,hash);
     if (pair != NULL) {
-        *pair = new_value;
+        new_value.limit = pair->value.limit;
+        new_value.options = pair->value.options;
+        pair->value = new_value;
     }
     else {
-        // New value needs to be saved in chain hash_table[pos]
-        int pos = hash_code(new_value.key) % mem->capacity;
-        // We either create the chain or add it to the chain
-        if (mem->hash_table[pos] == NULL) {
-            mem->hash_table[pos] = lnode_create(new_value, NULL);
-        }
-        else {
-            lnode_add_next(mem->hash_table[pos],new_value);
+        // Workers use the limit without the shard's lock, so it never moves
+        new_value.limit = arena_alloc(shard->strings,sizeof(token_bucket));
+        *new_value.limit = (token_bucket)BUCKET_INITIALIZER;
+        new_value.options.bulk = BULK_OFF;
+        new_value.options.verify = false;
+        new_value.options.dedup = false;
+        // Checking for rehash, if necessary, so there is space for the new
+        // value
+        if (((shard->hash_table->size + 1) / (double)shard->hash_table->capacity) > LOAD_FACTOR) {
+            map_rehash(shard);
         }
-        mem->size++;
-        // Checking for rehash, if necessary
-        if ((mem->size / (double)mem->capacity) > LOAD_FACTOR) {
-            map_rehash(mem);
-        }
-    }    
+        map_insert_slot(shard->hash_table,hash,new_value);
+    }
+    map_write_end(shard);
+    return new_value.generation;
 }
 
 
 // Removes value with given source
 void map_remove(map* mem,char* source) {
-    int pos = hash_code(source) % mem->capacity;
-    lnode_remove(&(mem->hash_table[pos]),source);
+    uint hash = hash_code(source);
+    map_shard* shard = map_shard_of(mem,hash);
+    map_write_begin(shard);
+    map_migrate(shard,MAP_MIGRATE_STEP);
+    map_table* table = shard->hash_table;
+    map_slot* slot = map_table_find(table,source,hash);
+    if (slot != NULL) {
+        // The entries after it that aren't in their home position move one
+        // position back, so no search stops before them
+        int pos = slot - table->slots;
+        int next = (pos + 1) % table->capacity;
+        while (table->slots[next].hash != 0 && map_distance(table->capacity,table->slots[next].hash,next) > 0) {
+            table->slots[pos].value = table->slots[next].value;
+            __atomic_store_n(&table->slots[pos].hash,table->slots[next].hash,__ATOMIC_RELEASE);
+            pos = next;
+            next = (next + 1) % table->capacity;
+        }
+        __atomic_store_n(&table->slots[pos].hash,0,__ATOMIC_RELEASE);
+        table->size--;
+    }
+    else if (shard->old_hash_table != NULL) {
+        // An entry of the old hash table that is marked as moved, is no longer
+        // in the shard
+        slot = map_table_find(shard->old_hash_table,source,hash);
+        if (slot != NULL)
+            __atomic_store_n(&slot->moved,true,__ATOMIC_RELEASE);
+    }
+    map_write_end(shard);
+}
+
+// Copies the status of the source in result, or returns false if it doesn't
+// exist
+bool map_find(map* mem,char* source,dir_info* result) {
+    uint hash = hash_code(source);
+    map_shard* shard = map_shard_of(mem,hash);
+    atomic_fetch_add(&shard->readers,1);
+    bool found;
+    uint sequence;
+    do {
+        sequence = map_read_begin(shard);
+        map_slot* slot = map_find_slot(shard,source,hash);
+        found = slot != NULL;
+        if (found)
+            memcpy(result,&slot->value,sizeof(dir_info));
+    } while (map_read_retry(shard,sequence));
+    atomic_fetch_sub(&shard->readers,1);
+    return found;
+}
+
+// Changes whether the source is actively monitored
+bool map_set_active(map* mem,char* source,bool is_active) {
+    uint hash = hash_code(source);
+    map_shard* shard = map_shard_of(mem,hash);
+    map_write_begin(shard);
+    map_migrate(shard,MAP_MIGRATE_STEP);
+    map_slot* slot = map_take_slot(shard,source,hash);
+    if (slot != NULL) {
+        slot->value.is_active = is_active;
+        // The files that were queued before, belong to the old generation
+        slot->value.generation = atomic_fetch_add(&mem->generations,1) + 1;
+    }
+    map_write_end(shard);
+    return slot != NULL;
+}
+
+// Changes the options of the source
+bool map_set_options(map* mem,char* source,pair_options* options) {
+    uint hash = hash_code(source);
+    map_shard* shard = map_shard_of(mem,hash);
+    map_write_begin(shard);
+    map_migrate(shard,MAP_MIGRATE_STEP);
+    map_slot* slot = map_take_slot(shard,source,hash);
+    if (slot != NULL)
+        slot->value.options = *options;
+    map_write_end(shard);
+    return slot != NULL;
 }
 
-// Returns status of the source or NULL if it doesn't exist
-dir_info* map_find(map* mem,char* source) {
-    int pos = hash_code(source) % mem->capacity;
-    return lnode_find(mem->hash_table[pos], source);
+// Returns true if the source is actively monitored and it is still in the
+// given generation
+bool map_is_current(map* mem,char* source,unsigned int generation) {
+    uint hash = hash_code(source);
+    map_shard* shard = map_shard_of(mem,hash);
+    atomic_fetch_add(&shard->readers,1);
+    bool current;
+    uint sequence;
+    do {
+        sequence = map_read_begin(shard);
+        map_slot* slot = map_find_slot(shard,source,hash);
+        current = slot != NULL && slot->value.is_active && slot->value.generation == generation;
+    } while (map_read_retry(shard,sequence));
+    atomic_fetch_sub(&shard->readers,1);
+    return current;
 }
 
-// Frees the structure from the memory 
+// Frees the structure from the memory. No other thread should use it
 void map_destroy(map* mem) {
-    for (int i = 0; i < mem->capacity; i++) {
-        // We destroy all the chains we have created
-        if (mem->hash_table[i] != NULL) {
-            lnode_destroy(&(mem->hash_table[i]));
+    for (int s = 0; s < MAP_SHARDS; s++) {
+        map_shard* shard = &mem->shards[s];
+        free(shard->hash_table);
+        free(shard->old_hash_table);
+        arena_destroy(shard->strings);
+        while (shard->retired_memory != NULL) {
+            retired* temp = shard->retired_memory;
+            shard->retired_memory = temp->next;
+            free(temp->memory);
+            free(temp);
         }
+        pthread_mutex_destroy(&shard->lock);
     }
-    free(mem->hash_table);
     free(mem);
 }
 
-void map_rehash(map* mem) {
-    // Selecting a new capacity from primes array 
-    int i;
-    i = 0;
-    int old_capacity = mem->capacity;
-    // FIX double when PRIME_SIZES ends
-    int new_capacity = mem->capacity;
-    while (mem->capacity >= PRIME_SIZES[i]) {
-        if (PRIME_SIZES[i] == 1610612741) {
-            new_capacity = 2 * mem->capacity;
+// Makes a bigger hash_table the current one of shard, and the current one its
+// old hash table, that map_migrate empties gradually. The shard's lock must be
+// held
+void map_rehash(map_shard* shard) {
+    // The previous old hash table has to be empty. The new table is about
+    // double the old one, so this happens only if it was made smaller by
+    // removals, and we finish moving it now
+    map_migrate(shard,shard->old_hash_table != NULL ? shard->old_hash_table->capacity : 0);
+    // Selecting a new capacity from primes array, the first prime that is 
+    // bigger than the current capacity (about double of it). When 
+    // PRIME_SIZES ends we just double the capacity
+    int old_capacity = shard->hash_table->capacity;
+    int new_capacity = 2 * old_capacity;
+    for (int i = 0; i < sizeof(PRIME_SIZES) / sizeof(int); i++) {
+        if (PRIME_SIZES[i] > old_capacity) {
+            new_capacity = PRIME_SIZES[i];
             break;
-        }        
-        new_capacity = PRIME_SIZES[i];
-        i++;
-    }
-    mem->capacity = new_capacity;
-    lnode** old_hash_table = mem->hash_table;
-    mem->size = 0;
-    mem->hash_table = malloc(sizeof(lnode*) * mem->capacity);
-    // We put all the values from the old chains to our new hash table
-    //  and then we free the space we allocated for old hash_table
-    for (int i = 0; i < old_capacity; i++) {
-        while (old_hash_table[i] != NULL) {
-            dir_info dir = lnode_get_value(old_hash_table[i]);
-            char target[1024];
-            target[0] = '\0';
-            strcat(target,dir.target_dir);
-            strcat(target,"@");
-            strcat(target,dir.target_host);
-            strcat(target,":");
-            char num[32];
-            strcat(target,number_to_string(num,dir.target_port));
-            map_add(mem,dir.key,target);
-            lnode_remove_head(&(old_hash_table[i]));
         }
     }
-    free(old_hash_table);
+    // The old hash table is published before the new one, so a reader that
+    // sees the new one also searches the old one
+    shard->migrated = 0;
+    __atomic_store_n(&shard->old_hash_table,shard->hash_table,__ATOMIC_RELEASE);
+    __atomic_store_n(&shard->hash_table,map_table_create(new_capacity),__ATOMIC_RELEASE);
 }
 
-// We use the dbj2 hash function
+// We use the dbj2 hash function. 0 marks the empty entries, so we never
+// return it
 uint hash_code(char* value) {
     uint hash = 5381;
     int i = 0;
     while (value[i] != '\0') {
         hash = (hash * 33) + value[i++];
     }
-    return i;
+    return (hash != 0) ? hash : 1;
 }
@@ -0,0 +1,446 @@
+/* Source file for nfs_manager's metrics. Every metric is an atomic variable,
+ * so it can be updated by many workers without locks. Pairs and endpoints are
+ * kept in tables with linear probing, that are searched without locks too. 
+ * When a table gets full, a table twice its size is chained after it, so the
+ * metrics of a pair or an endpoint never move and every one of them is kept.
+ * A mutex is only taken to add a new pair or endpoint, which happens once for
+ * each of them.
+ */
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include "../include/nfs.h"
+#include "../include/metrics.h"
+#include "../include/ratelimit.h"
+#include "../include/breaker.h"
+#include "../include/admission.h"
+
+#define MOD 0644
+
+char* counter_names[COUNTERS] = {"tasks_done","tasks_failed","retries","bytes_pulled","bytes_pushed","bytes_copied","bytes_cached","busy_usec","checksum_mismatches","bytes_moved","bytes_deduped"};
+char* breaker_names[] = {"closed","open","probing"};
+
+char* gauge_names[GAUGES] = {"queue_depth","busy_workers","deferred_tasks"};
+char* phase_names[PHASES] = {"connect","first_byte","relay","close","copy"};
+
+atomic_llong counters[COUNTERS];
+atomic_llong gauges[GAUGES];
+histogram task_latency;
+histogram phase_latency[PHASES];
+metrics_table* pairs;
+metrics_table* endpoints;
+pthread_mutex_t metrics_mtx; // Locks the addition of pairs and endpoints
+long long start_time;
+
+// Used by the snapshot thread
+char* snapshot_file = NULL;
+pthread_t snapshot_thread;
+pthread_mutex_t snapshot_mtx;
+pthread_cond_t snapshot_cond; // Signaled when nfs_manager shuts down
+bool snapshot_stop = false;
+
+// We use the djb2 hash function
+unsigned int metrics_hash(char* key,int size) {
+    unsigned int hash = 5381;
+    for (int i = 0; key[i] != '\0'; i++) {
+        hash = (hash * 33) + key[i];
+    }
+    return hash % size;
+}
+
+// Returns the microseconds since an unspecified point
+long long metrics_now(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Creates a table with room for capacity entries of entry_size bytes
+metrics_table* table_create(int capacity,size_t entry_size) {
+    metrics_table* table = malloc(sizeof(metrics_table));
+    if (table == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    table->capacity = capacity;
+    table->count = 0;
+    table->entry_size = entry_size;
+    table->entries = calloc(capacity,entry_size);
+    if (table->entries == NULL)
+        perror_exit("ERROR! calloc failed\n");
+    atomic_init(&table->next,NULL);
+    return table;
+}
+
+// Returns the i-th entry of table. Every entry starts with its used flag
+atomic_bool* table_entry(metrics_table* table,int i) {
+    return (atomic_bool*)(table->entries + (size_t)i * table->entry_size);
+}
+
+// Returns the entry after *position in table and the tables chained after it,
+// moving *table and *position to it, or NULL after the last entry. It starts
+// with *position -1
+atomic_bool* table_next(metrics_table** table,int* position) {
+    while (*table != NULL) {
+        if (++(*position) < (*table)->capacity)
+            return table_entry(*table,*position);
+        *table = atomic_load(&(*table)->next);
+        *position = -1;
+    }
+    return NULL;
+}
+
+// Returns the entry of table (or of the tables chained after it) whose name,
+// key_offset bytes in the entry, is key, or NULL
+atomic_bool* table_find(metrics_table* table,char* key,size_t key_offset) {
+    for (; table != NULL; table = atomic_load_explicit(&table->next,memory_order_acquire)) {
+        int pos = metrics_hash(key,table->capacity);
+        // Entries are never removed, so the key isn't in this table after 
+        // the first unused entry
+        for (int i = 0; i < table->capacity; i++) {
+            atomic_bool* entry = table_entry(table,(pos + i) % table->capacity);
+            if (!atomic_load_explicit(entry,memory_order_acquire))
+                break;
+            if (!strcmp((char*)entry + key_offset,key))
+                return entry;
+        }
+    }
+    return NULL;
+}
+
+// Returns the entry of key in table, and adds it if it doesn't exist. A new
+// entry gets its name and init is called for it, before it is used
+atomic_bool* table_add(metrics_table* table,char* key,size_t key_offset,void (*init)(void*)) {
+    atomic_bool* entry = table_find(table,key,key_offset);
+    if (entry != NULL)
+        return entry;
+    // We add the entry, unless another thread added it in the meantime
+    pthread_mutex_lock(&metrics_mtx);
+    entry = table_find(table,key,key_offset);
+    if (entry == NULL) {
+        // New entries go to the last table, and a table that is 3/4 full 
+        // gets a bigger one after it, so probes stay short
+        while (atomic_load(&table->next) != NULL) {
+            table = atomic_load(&table->next);
+        }
+        if (table->count >= table->capacity / 4 * 3) {
+            metrics_table* next = table_create(2 * table->capacity,table->entry_size);
+            atomic_store_explicit(&table->next,next,memory_order_release);
+            table = next;
+        }
+        int pos = metrics_hash(key,table->capacity);
+        for (int i = 0; i < table->capacity; i++) {
+            entry = table_entry(table,(pos + i) % table->capacity);
+            if (!atomic_load_explicit(entry,memory_order_relaxed))
+                break;
+        }
+        strcpy((char*)entry + key_offset,key);
+        if (init != NULL)
+            init(entry);
+        table->count++;
+        atomic_store_explicit(entry,true,memory_order_release);
+    }
+    pthread_mutex_unlock(&metrics_mtx);
+    return entry;
+}
+
+// Frees table and the tables chained after it
+void table_destroy(metrics_table* table) {
+    while (table != NULL) {
+        metrics_table* next = atomic_load(&table->next);
+        free(table->entries);
+        free(table);
+        table = next;
+    }
+}
+
+// Initializes the metrics
+void metrics_init(void) {
+    for (int i = 0; i < COUNTERS; i++) {
+        atomic_init(&counters[i],0);
+    }
+    for (int i = 0; i < GAUGES; i++) {
+        atomic_init(&gauges[i],0);
+    }
+    memset(&task_latency,0,sizeof(histogram));
+    memset(phase_latency,0,sizeof(phase_latency));
+    pairs = table_create(METRICS_PAIRS,sizeof(pair_metrics));
+    endpoints = table_create(METRICS_ENDPOINTS,sizeof(endpoint_metrics));
+    pthread_mutex_init(&metrics_mtx,NULL);
+    start_time = metrics_now();
+}
+
+// Adds value to a counter
+void metrics_add(int counter,long long value) {
+    atomic_fetch_add_explicit(&counters[counter],value,memory_order_relaxed);
+}
+
+// Changes a gauge to value
+void metrics_set(int gauge,long long value) {
+    atomic_store_explicit(&gauges[gauge],value,memory_order_relaxed);
+}
+
+// Adds value to a gauge
+void metrics_change(int gauge,long long value) {
+    atomic_fetch_add_explicit(&gauges[gauge],value,memory_order_relaxed);
+}
+
+// Adds a latency of usec microseconds to histogram
+void metrics_observe(histogram* hist,long long usec) {
+    if (usec < 0)
+        usec = 0;
+    // Small values have a bucket each. For bigger ones, the highest bit 
+    // gives us the power of 2 and the next HISTOGRAM_SUB_BITS bits the bucket
+    // inside it
+    int bucket = usec;
+    if (usec >= HISTOGRAM_SUB) {
+        int bit = 63 - __builtin_clzll(usec);
+        bucket = (bit - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB + ((usec >> (bit - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB - 1));
+    }
+    if (bucket >= HISTOGRAM_BUCKETS)
+        bucket = HISTOGRAM_BUCKETS - 1;
+    atomic_fetch_add_explicit(&hist->buckets[bucket],1,memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->count,1,memory_order_relaxed);
+    atomic_fetch_add_explicit(&hist->sum,usec,memory_order_relaxed);
+    long long max = atomic_load_explicit(&hist->max,memory_order_relaxed);
+    while (usec > max && !atomic_compare_exchange_weak(&hist->max,&max,usec));
+}
+
+// Returns the histogram of task latencies
+histogram* metrics_task_latency(void) {
+    return &task_latency;
+}
+
+// Returns the latency histogram of a phase of the transfers
+histogram* metrics_phase(int phase) {
+    return &phase_latency[phase];
+}
+
+// Returns the name of a phase
+char* metrics_phase_name(int phase) {
+    return phase_names[phase];
+}
+
+// Returns the metrics of the pair with the given source
+pair_metrics* metrics_pair(char* source) {
+    return (pair_metrics*)table_add(pairs,source,offsetof(pair_metrics,source),NULL);
+}
+
+// Returns the metrics of host:port
+endpoint_metrics* metrics_endpoint(char* host,int port) {
+    char key[1024],number_buffer[32];
+    strcpy(key,host);
+    strcat(key,":");
+    strcat(key,number_to_string(number_buffer,port));
+    return (endpoint_metrics*)table_add(endpoints,key,offsetof(endpoint_metrics,endpoint),NULL);
+}
+
+// Returns the value (upper bound of its bucket) that fraction of the values
+// of histogram are smaller than
+long long histogram_percentile(histogram* hist,double fraction) {
+    long long count = atomic_load(&hist->count);
+    long long seen = 0;
+    for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+        seen += atomic_load(&hist->buckets[i]);
+        if (seen > 0 && seen >= fraction * count) {
+            // The biggest value of bucket i
+            long long bound = i;
+            if (i >= HISTOGRAM_SUB) {
+                int shift = i / HISTOGRAM_SUB - 1;
+                bound = ((long long)(HISTOGRAM_SUB + i % HISTOGRAM_SUB) << shift) + (1LL << shift) - 1;
+            }
+            long long max = atomic_load(&hist->max);
+            return (bound < max) ? bound : max;
+        }
+    }
+    return atomic_load(&hist->max);
+}
+
+// Writes a histogram to fd, as text or as JSON
+void report_histogram(int fd,histogram* hist,bool json) {
+    long long count = atomic_load(&hist->count);
+    long long mean = (count > 0) ? atomic_load(&hist->sum) / count : 0;
+    if (json)
+        dprintf(fd,"{\"count\": %lld, \"mean_usec\": %lld, \"p50_usec\": %lld, \"p90_usec\": %lld, \"p99_usec\": %lld, \"max_usec\": %lld}",
+            count,mean,histogram_percentile(hist,0.5),histogram_percentile(hist,0.9),histogram_percentile(hist,0.99),atomic_load(&hist->max));
+    else
+        dprintf(fd,"count %lld, mean %lldus, p50 %lldus, p90 %lldus, p99 %lldus, max %lldus",
+            count,mean,histogram_percentile(hist,0.5),histogram_percentile(hist,0.9),histogram_percentile(hist,0.99),atomic_load(&hist->max));
+}
+
+// Writes the rate a limit achieved, and its limit if it has one, as text
+void report_limit(int fd,char* name,token_bucket* limit,long long now) {
+    long long rate = bucket_rate(limit);
+    dprintf(fd,"%s %.0f bytes/sec",name,bucket_achieved(limit,now));
+    if (rate > 0)
+        dprintf(fd," (limit %lld bytes/sec)",rate);
+}
+
+// Writes a report of all the metrics to fd, as text or as JSON
+void metrics_report(int fd,bool json) {
+    long long now = metrics_now();
+    double uptime = (now - start_time) / 1000000.0;
+    long long tasks = atomic_load(&counters[COUNTER_TASKS_DONE]) + atomic_load(&counters[COUNTER_TASKS_FAILED]);
+    double tasks_per_sec = (uptime > 0) ? tasks / uptime : 0;
+    if (json) {
+        dprintf(fd,"{\"uptime_sec\": %.3f, \"tasks_per_sec\": %.3f",uptime,tasks_per_sec);
+        for (int i = 0; i < COUNTERS; i++) {
+            dprintf(fd,", \"%s\": %lld",counter_names[i],atomic_load(&counters[i]));
+        }
+        for (int i = 0; i < GAUGES; i++) {
+            dprintf(fd,", \"%s\": %lld",gauge_names[i],atomic_load(&gauges[i]));
+        }
+        dprintf(fd,", \"global_limit\": %lld, \"global_rate\": %.0f",bucket_rate(ratelimit_global()),bucket_achieved(ratelimit_global(),now));
+        dprintf(fd,", \"task_latency\": ");
+        report_histogram(fd,&task_latency,true);
+        for (int i = 0; i < PHASES; i++) {
+            dprintf(fd,", \"%s_latency\": ",phase_names[i]);
+            report_histogram(fd,&phase_latency[i],true);
+        }
+        dprintf(fd,", \"pairs\": [");
+        bool first = true;
+        metrics_table* table = pairs;
+        int position = -1;
+        pair_metrics* pair;
+        while ((pair = (pair_metrics*)table_next(&table,&position)) != NULL) {
+            if (!atomic_load(&pair->used))
+                continue;
+            token_bucket* limit = atomic_load(&pair->limit);
+            dprintf(fd,"%s{\"source\": \"%s\", \"files_queued\": %lld, \"files_done\": %lld, \"files_failed\": %lld, \"bytes\": %lld, \"limit\": %lld, \"rate\": %.0f}",
+                (first) ? "" : ", ",pair->source,atomic_load(&pair->files_queued),atomic_load(&pair->files_done),atomic_load(&pair->files_failed),atomic_load(&pair->bytes),
+                (limit != NULL) ? bucket_rate(limit) : 0,(limit != NULL) ? bucket_achieved(limit,now) : 0.0);
+            first = false;
+        }
+        dprintf(fd,"], \"endpoints\": [");
+        first = true;
+        table = endpoints;
+        position = -1;
+        endpoint_metrics* endpoint;
+        while ((endpoint = (endpoint_metrics*)table_next(&table,&position)) != NULL) {
+            if (!atomic_load(&endpoint->used))
+                continue;
+            admission_endpoint* settings = admission_lookup(endpoint->endpoint);
+            long long retry_in;
+            int state = breaker_state(&settings->breaker,now,&retry_in);
+            dprintf(fd,"%s{\"endpoint\": \"%s\", \"failures\": %lld, \"breaker\": \"%s\", \"retry_in_usec\": %lld, \"limit\": %lld, \"rate\": %.0f, \"connect_latency\": ",
+                (first) ? "" : ", ",endpoint->endpoint,atomic_load(&endpoint->failures),breaker_names[state],retry_in,bucket_rate(&settings->limit),bucket_achieved(&settings->limit,now));
+            report_histogram(fd,&endpoint->connect_latency,true);
+            dprintf(fd,"}");
+            first = false;
+        }
+        dprintf(fd,"]}\n");
+        return;
+    }
+
+    dprintf(fd,"Uptime: %.3fs\n",uptime);
+    dprintf(fd,"Tasks: %lld done, %lld failed, %lld retries, %lld checksum mismatches, %.3f tasks/sec\n",atomic_load(&counters[COUNTER_TASKS_DONE]),
+        atomic_load(&counters[COUNTER_TASKS_FAILED]),atomic_load(&counters[COUNTER_RETRIES]),atomic_load(&counters[COUNTER_CHECKSUM_MISMATCHES]),tasks_per_sec);
+    dprintf(fd,"Queue depth: %lld, deferred: %lld, busy workers: %lld, worker busy time: %.3fs\n",atomic_load(&gauges[GAUGE_QUEUE_DEPTH]),
+        atomic_load(&gauges[GAUGE_DEFERRED]),atomic_load(&gauges[GAUGE_BUSY_WORKERS]),atomic_load(&counters[COUNTER_BUSY_USEC]) / 1000000.0);
+    dprintf(fd,"Bytes: %lld pulled, %lld pushed, %lld copied, %lld from cache, %lld moved, %lld deduped\n",atomic_load(&counters[COUNTER_BYTES_PULLED]),
+        atomic_load(&counters[COUNTER_BYTES_PUSHED]),atomic_load(&counters[COUNTER_BYTES_COPIED]),atomic_load(&counters[COUNTER_BYTES_CACHED]),
+        atomic_load(&counters[COUNTER_BYTES_MOVED]),atomic_load(&counters[COUNTER_BYTES_DEDUPED]));
+    report_limit(fd,"Global rate",ratelimit_global(),now);
+    dprintf(fd,"\n");
+    dprintf(fd,"Task latency: ");
+    report_histogram(fd,&task_latency,false);
+    dprintf(fd,"\n");
+    for (int i = 0; i < PHASES; i++) {
+        dprintf(fd,"Phase %s: ",phase_names[i]);
+        report_histogram(fd,&phase_latency[i],false);
+        dprintf(fd,"\n");
+    }
+    metrics_table* table = pairs;
+    int position = -1;
+    pair_metrics* pair;
+    while ((pair = (pair_metrics*)table_next(&table,&position)) != NULL) {
+        if (!atomic_load(&pair->used))
+            continue;
+        dprintf(fd,"Pair %s: %lld/%lld files done, %lld failed, %lld bytes, ",pair->source,atomic_load(&pair->files_done),
+            atomic_load(&pair->files_queued),atomic_load(&pair->files_failed),atomic_load(&pair->bytes));
+        token_bucket* limit = atomic_load(&pair->limit);
+        if (limit != NULL)
+            report_limit(fd,"rate",limit,now);
+        else
+            dprintf(fd,"rate 0 bytes/sec");
+        dprintf(fd,"\n");
+    }
+    table = endpoints;
+    position = -1;
+    endpoint_metrics* endpoint;
+    while ((endpoint = (endpoint_metrics*)table_next(&table,&position)) != NULL) {
+        if (!atomic_load(&endpoint->used))
+            continue;
+        dprintf(fd,"Endpoint %s: %lld failures, ",endpoint->endpoint,atomic_load(&endpoint->failures));
+        admission_endpoint* settings = admission_lookup(endpoint->endpoint);
+        long long retry_in;
+        int state = breaker_state(&settings->breaker,now,&retry_in);
+        if (state == BREAKER_OPEN)
+            dprintf(fd,"breaker open (probe in %.1fs), ",retry_in / 1000000.0);
+        else if (state == BREAKER_PROBING)
+            dprintf(fd,"breaker probing, ");
+        report_limit(fd,"rate",&settings->limit,now);
+        dprintf(fd,", connect latency ");
+        report_histogram(fd,&endpoint->connect_latency,false);
+        dprintf(fd,"\n");
+    }
+}
+
+// Writes a report to snapshot_file. We write a temp file and we rename it, so
+// a reader never sees half a report
+void write_snapshot(void) {
+    char tmp_file[1100];
+    strcpy(tmp_file,snapshot_file);
+    strcat(tmp_file,".tmp");
+    int fd = open(tmp_file,O_CREAT | O_WRONLY | O_TRUNC,MOD);
+    if (fd < 0) {
+        perror("ERROR! Couldn't write stats file\n");
+        return;
+    }
+    int len = strlen(snapshot_file);
+    metrics_report(fd,len > 5 && !strcmp(snapshot_file + len - 5,".json"));
+    close(fd);
+    if (rename(tmp_file,snapshot_file) < 0)
+        perror("ERROR! Couldn't write stats file\n");
+}
+
+// The thread that writes a snapshot every STATS_INTERVAL seconds
+void* snapshot_loop(void* args) {
+    pthread_mutex_lock(&snapshot_mtx);
+    while (!snapshot_stop) {
+        struct timespec until;
+        clock_gettime(CLOCK_REALTIME,&until);
+        until.tv_sec += STATS_INTERVAL;
+        pthread_cond_timedwait(&snapshot_cond,&snapshot_mtx,&until);
+        write_snapshot();
+    }
+    pthread_mutex_unlock(&snapshot_mtx);
+    return NULL;
+}
+
+// Starts a thread that writes a report of the metrics to stats_file
+void metrics_start_snapshots(char* stats_file) {
+    snapshot_file = stats_file;
+    pthread_mutex_init(&snapshot_mtx,NULL);
+    pthread_cond_init(&snapshot_cond,NULL);
+    pthread_create(&snapshot_thread,NULL,snapshot_loop,NULL);
+}
+
+// Stops the snapshot thread, after it writes a last report
+void metrics_destroy(void) {
+    if (snapshot_file != NULL) {
+        pthread_mutex_lock(&snapshot_mtx);
+        snapshot_stop = true;
+        pthread_cond_signal(&snapshot_cond);
+        pthread_mutex_unlock(&snapshot_mtx);
+        pthread_join(snapshot_thread,NULL);
+    }
+    table_destroy(pairs);
+    table_destroy(endpoints);
+    pthread_mutex_destroy(&metrics_mtx);
+}
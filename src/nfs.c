@@ -9,11 +9,49 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <netinet/in.h>
 #include <netdb.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
 #include "../include/nfs.h"
 
+resolved_host resolve_cache[RESOLVE_CACHE_SIZE]; // Every host has one slot
+
+pthread_mutex_t resolve_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+int socket_buffers = 0; // 0 means that the kernel sizes the buffers
+
+// The primes of xxHash64, that our digest uses to mix its words
+#define DIGEST_PRIME1 11400714785074694791ULL
+#define DIGEST_PRIME2 14029467366897019727ULL
+#define DIGEST_PRIME3 1609587929392839161ULL
+#define DIGEST_PRIME4 9650029242287828579ULL
+
+// Mixes a word into a lane, like a round of xxHash64. It is a macro, so the
+// lanes are mixed without a call for every word
+#define DIGEST_ROUND(lane,word) do { \
+        lane += (word) * DIGEST_PRIME2; \
+        lane = ((lane << 31) | (lane >> 33)) * DIGEST_PRIME1; \
+    } while (0)
+
+// The round constants of SHA-256
+const uint32_t sha256_constants[64] = {
+    0x428a2f98,0x71374491,0xb5c0fbcf,0xe9b5dba5,0x3956c25b,0x59f111f1,0x923f82a4,0xab1c5ed5,
+    0xd807aa98,0x12835b01,0x243185be,0x550c7dc3,0x72be5d74,0x80deb1fe,0x9bdc06a7,0xc19bf174,
+    0xe49b69c1,0xefbe4786,0x0fc19dc6,0x240ca1cc,0x2de92c6f,0x4a7484aa,0x5cb0a9dc,0x76f988da,
+    0x983e5152,0xa831c66d,0xb00327c8,0xbf597fc7,0xc6e00bf3,0xd5a79147,0x06ca6351,0x14292967,
+    0x27b70a85,0x2e1b2138,0x4d2c6dfc,0x53380d13,0x650a7354,0x766a0abb,0x81c2c92e,0x92722c85,
+    0xa2bfe8a1,0xa81a664b,0xc24b8b70,0xc76c51a3,0xd192e819,0xd6990624,0xf40e3585,0x106aa070,
+    0x19a4c116,0x1e376c08,0x2748774c,0x34b0bcb5,0x391c0cb3,0x4ed8aa4a,0x5b9cca4f,0x682e6ff3,
+    0x748f82ee,0x78a5636f,0x84c87814,0x8cc70208,0x90befffa,0xa4506ceb,0xbef9a3f7,0xc67178f2
+};
+
+#define SHA256_ROTATE(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+
 
 
 /* Puts the current timestamp inside time_buffer and returns a pointer to it */
@@ -35,26 +73,37 @@ void perror_exit(char* error_msg) {
 /* Puts n's decimal representation in buffer, and returns a pointer to buffer. 
  * !!! It doesn't allocate memory for buffer !!!
  */
-char* number_to_string(char* buffer,int n) {
-    int i = 0;
-    if (n == 0) {
-        buffer[0] = '0';
-        buffer[1] = '\0';
-        return buffer;
-    }
-    while (n > 0) {
-        buffer[i++] = n % 10 + '0';
-        n /= 10;
-    }
-    buffer[i] = '\0';
-    // We put the number in reverse, we need to reverse it
-    i--;
-    for (int j = 0; j < i; j++) {
-        int temp = buffer[i];
-        buffer[i] = buffer[j];
-        buffer[j] = temp;
-        i--;
+char* number_to_string(char* buffer,long long n) {
+    // Every pair of digits from 00 to 99, so we produce two digits with every
+    // division instead of one
+    static const char digit_pairs[] = 
+        "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+        "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+        "8081828384858687888990919293949596979899";
+    char digits[24];
+    int i = sizeof(digits);
+    // We work with the absolute value as unsigned, so LLONG_MIN doesn't overflow
+    unsigned long long value = (n < 0) ? -(unsigned long long)n : (unsigned long long)n;
+    // We put the digits from the end of digits, so we don't need to reverse 
+    // them at the end
+    while (value >= 100) {
+        int pos = (value % 100) * 2;
+        value /= 100;
+        digits[--i] = digit_pairs[pos + 1];
+        digits[--i] = digit_pairs[pos];
+    }
+    if (value >= 10) {
+        digits[--i] = digit_pairs[value * 2 + 1];
+        digits[--i] = digit_pairs[value * 2];
     }
+    else 
+        digits[--i] = value + '0';
+
+    if (n < 0)
+        digits[--i] = '-';
+    int len = sizeof(digits) - i;
+    memcpy(buffer,digits + i,len);
+    buffer[len] = '\0';
     return buffer;
 }
 
@@ -78,21 +127,22 @@ char* number_to_string(char* buffer,int n) {
 
 int decode_format(const char* input,char* dir_name,char* host_addr,int* port) {
     char str[1024];
+    char* ptr = NULL; // For strtok_r, so many threads can decode at once
     strcpy(str,input);
-    char* tmp = strtok(str,"@");
+    char* tmp = strtok_r(str,"@",&ptr);
     // str is not in the correct format
     if (tmp[0] == '\0')
         return -1;
 
     strcpy(dir_name,tmp);
 
-    tmp = strtok(NULL,":");
+    tmp = strtok_r(NULL,":",&ptr);
     if (tmp[0] == '\0')
         return -1;
 
     strcpy(host_addr,tmp);
 
-    tmp = strtok(NULL,"\0");
+    tmp = strtok_r(NULL,"\0",&ptr);
     if (tmp[0] == '\0')
         return -1;
 
@@ -106,14 +156,17 @@ int decode_format(const char* input,char* dir_name,char* host_addr,int* port) {
  * !!! This function doesn't allocate space for file buffer it should be already
  *     done by its caller !!!
  *
+ * Returns 0, or -1 if the connection was closed (or dropped) before a word was
+ * read
  */
-void getnextword(int sockfd,char* file) {
+int getnextword(int sockfd,char* file) {
     char buf[1];
+    file[0] = '\0';
     // We skip whitespace
     do {
-        buf[0] = ' ';
-        if (read(sockfd,buf,1) < 0)
-            perror_exit("ERROR! Read failed\n");
+        // The other side closed (or dropped) the connection
+        if (read(sockfd,buf,1) <= 0)
+            return -1;
 
     } while (isspace(buf[0]));
     file[0] = buf[0];
@@ -125,43 +178,117 @@ void getnextword(int sockfd,char* file) {
         file[i++] = buf[0];
     }
     file[i] = '\0';
+    return 0;
 }
 
 /* This function reads a numbers from a socket until whitespace is given and 
  * returns the number that was read
  *
- * In case of an error, it returns INT_MIN
+ * In case of an error, or if the connection was closed, it returns LLONG_MIN
  */
-int getsize(int sockfd) {
-    int num = 0;
-    char buf[1];
+long long getsize(int sockfd) {
+    long long num = 0;
     int sign = 1;
-    buf[0] = ' ';
-    // We skip whitespace
-    do {
-        if (read(sockfd,buf,1) < 0)
-            perror_exit("ERROR! Read failed\n");
-    } while (isspace(buf[0]));
-    if (buf[0] == '-') {
-        sign = -1;
+    bool in_number = false; // True after we read the first character of number
+    char buf[32];
+    // Instead of reading one character at a time, we peek at what's available
+    // in the socket and then consume only the characters of our number, so 
+    // most numbers take two syscalls
+    while (true) {
+        int n = recv(sockfd,buf,sizeof(buf),MSG_PEEK);
+        // The connection was closed (or dropped)
+        if (n <= 0) 
+            return (in_number) ? sign * num : LLONG_MIN;
+
+        for (int i = 0; i < n; i++) {
+            if (isspace(buf[i])) {
+                // We skip whitespace before the number
+                if (!in_number)
+                    continue;
+                // Full number given, we consume it with its whitespace
+                if (read(sockfd,buf,i + 1) < 0)
+                    return LLONG_MIN;
+                return sign * num;
+            }
+            else if (isdigit(buf[i]))
+                num = num * 10 + buf[i] - '0';
+            else if (buf[i] == '-' && !in_number)
+                sign = -1;
+            // Wrong character given 
+            else {
+                read(sockfd,buf,i + 1);
+                return LLONG_MIN; // An error_occured
+            }
+            in_number = true;
+        }
+        // The number continues after what we peeked, we consume it and peek 
+        // again
+        if (read(sockfd,buf,n) < 0)
+            return LLONG_MIN;
     }
-    else if (!isdigit(buf[0]))
-        return INT_MIN; // An error occured
+}
 
-    else 
-        num = buf[0] - '0';
-    while (read(sockfd,buf,1) > 0) {
-        // Full number given
-        if (isspace(buf[0]))
-            return sign * num;
-        else if (isdigit(buf[0]))
-            num = num * 10 + buf[0] - '0';
-        // Wrong character given 
-        else  
-            return INT_MIN; // An error_occured
-        buf[0] = ' ';
+/* Resolves host to its ipv4 address, using the cache of resolved hosts */
+int resolve_host(char* host,struct in_addr* addr) {
+    // We use the djb2 hash function to find host's slot
+    unsigned int hash = 5381;
+    for (int i = 0; host[i] != '\0'; i++) {
+        hash = (hash * 33) + host[i];
+    }
+    resolved_host* slot = &resolve_cache[hash % RESOLVE_CACHE_SIZE];
+    time_t now = time(NULL);
+    pthread_mutex_lock(&resolve_mtx);
+    if (slot->expires > now && !strcmp(slot->host,host)) {
+        *addr = slot->addr;
+        pthread_mutex_unlock(&resolve_mtx);
+        return 0;
+    }
+    pthread_mutex_unlock(&resolve_mtx);
+
+    // getaddrinfo is thread safe, unlike gethostbyname
+    struct addrinfo hints;
+    struct addrinfo* result;
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host,NULL,&hints,&result) != 0) {
+        errno = EHOSTUNREACH;
+        return -1;
     }
-    return sign * num;
+    *addr = ((struct sockaddr_in*)result->ai_addr)->sin_addr;
+    freeaddrinfo(result);
+
+    if (strlen(host) < sizeof(slot->host)) {
+        pthread_mutex_lock(&resolve_mtx);
+        strcpy(slot->host,host);
+        slot->addr = *addr;
+        slot->expires = now + RESOLVE_TTL;
+        pthread_mutex_unlock(&resolve_mtx);
+    }
+    return 0;
+}
+
+/* Sets the size of the buffers of the sockets we create from now on */
+void set_socket_buffers(int bytes) {
+    socket_buffers = bytes;
+}
+
+/* Gives sock the buffers of set_socket_buffers. The kernel may give it less,
+ * so we don't check for errors */
+void tune_socket(int sock) {
+    if (socket_buffers <= 0)
+        return;
+    setsockopt(sock,SOL_SOCKET,SO_SNDBUF,&socket_buffers,sizeof(socket_buffers));
+    setsockopt(sock,SOL_SOCKET,SO_RCVBUF,&socket_buffers,sizeof(socket_buffers));
+}
+
+/* Makes a blocking read of sock fail with EAGAIN after timeout_ms 
+ * milliseconds without data */
+void set_receive_timeout(int sock,int timeout_ms) {
+    struct timeval timeout;
+    timeout.tv_sec = timeout_ms / 1000;
+    timeout.tv_usec = (timeout_ms % 1000) * 1000;
+    setsockopt(sock,SOL_SOCKET,SO_RCVTIMEO,&timeout,sizeof(timeout));
 }
 
 /* Attemps to connect to <host> in port <port>. At success it returns a socket
@@ -171,25 +298,278 @@ int getsize(int sockfd) {
  * that failed
  */
 int connect_to_host(char* host,int port) {
+    return connect_with_timeout(host,port,-1);
+}
 
-        struct sockaddr_in client;
-        struct sockaddr* sourceptr = (struct sockaddr*)&client;
-        struct hostent* rem;
-        int sock = socket(AF_INET,SOCK_STREAM,0);
-        if (sock < 0)
+/* Connects to <host> in port <port>, and gives up after timeout_ms 
+ * milliseconds. The connection is started in non blocking mode, so we can
+ * wait for it with poll, and the socket is made blocking again when it is 
+ * connected
+ */
+int connect_with_timeout(char* host,int port,int timeout_ms) {
+    struct sockaddr_in client;
+    struct sockaddr* sourceptr = (struct sockaddr*)&client;
+
+    // Puting the values to sockaddr before calling connect 
+    memset(&client,0,sizeof(client));
+    client.sin_family = AF_INET;
+    client.sin_port = htons(port);
+    // Get source's host ip address
+    if (resolve_host(host,&client.sin_addr) < 0)
+        return -1;
+
+    int sock = socket(AF_INET,SOCK_STREAM,0);
+    if (sock < 0)
+        return -1;
+    tune_socket(sock);
+    int flags = fcntl(sock,F_GETFL);
+    if (flags < 0 || fcntl(sock,F_SETFL,flags | O_NONBLOCK) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    if (connect(sock,sourceptr,sizeof(client)) < 0) {
+        if (errno != EINPROGRESS) {
+            int error = errno;
+            close(sock);
+            errno = error;
             return -1;
-        
-        // Puting the values to sockaddr before calling connect 
-        client.sin_family = AF_INET;
-        client.sin_port = htons(port);
-        // Get source's host ip address
-        if ((rem = gethostbyname(host)) == NULL) 
+        }
+        // We wait until the connection is complete, or the deadline passes
+        struct timespec start,now;
+        clock_gettime(CLOCK_MONOTONIC,&start);
+        struct pollfd pfd = {sock,POLLOUT,0};
+        int ready;
+        int remaining = timeout_ms;
+        while ((ready = poll(&pfd,1,remaining)) < 0 && errno == EINTR) {
+            if (timeout_ms < 0)
+                continue;
+            clock_gettime(CLOCK_MONOTONIC,&now);
+            long long elapsed = (now.tv_sec - start.tv_sec) * 1000LL + (now.tv_nsec - start.tv_nsec) / 1000000;
+            remaining = (elapsed < timeout_ms) ? timeout_ms - elapsed : 0;
+        }
+        int error = 0;
+        socklen_t len = sizeof(error);
+        if (ready < 0)
+            error = errno;
+        else if (ready == 0)
+            error = ETIMEDOUT;
+        else if (getsockopt(sock,SOL_SOCKET,SO_ERROR,&error,&len) < 0)
+            error = errno;
+        if (error != 0) {
+            close(sock);
+            errno = error;
             return -1;
+        }
+    }
+
+    if (fcntl(sock,F_SETFL,flags) < 0) {
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
 
-        memcpy(&(client.sin_addr),rem->h_addr,rem->h_length);
+/* Starts an empty digest */
+void digest_init(digest* sum) {
+    sum->lanes[0] = DIGEST_PRIME1 + DIGEST_PRIME2;
+    sum->lanes[1] = DIGEST_PRIME2;
+    sum->lanes[2] = 0;
+    sum->lanes[3] = -DIGEST_PRIME1;
+    sum->end = -1;
+    sum->tail_len = 0;
+    sum->length = 0;
+}
 
-        if (connect(sock,sourceptr,sizeof(client)) < 0)
-            return -1;
+// Mixes count stripes of data into sum. The lanes don't wait for each other,
+// so the CPU mixes them at the same time
+void digest_stripes(digest* sum,const unsigned char* data,size_t count) {
+    uint64_t lane0 = sum->lanes[0],lane1 = sum->lanes[1];
+    uint64_t lane2 = sum->lanes[2],lane3 = sum->lanes[3];
+    for (size_t i = 0; i < count; i++) {
+        uint64_t words[DIGEST_LANES];
+        memcpy(words,data + i * DIGEST_STRIPE,DIGEST_STRIPE);
+        DIGEST_ROUND(lane0,words[0]);
+        DIGEST_ROUND(lane1,words[1]);
+        DIGEST_ROUND(lane2,words[2]);
+        DIGEST_ROUND(lane3,words[3]);
+    }
+    sum->lanes[0] = lane0;
+    sum->lanes[1] = lane1;
+    sum->lanes[2] = lane2;
+    sum->lanes[3] = lane3;
+}
+
+// Mixes the bytes of sum's tail, padded with zeros
+void digest_flush(digest* sum) {
+    if (sum->tail_len == 0)
+        return;
+    memset(sum->tail + sum->tail_len,0,DIGEST_STRIPE - sum->tail_len);
+    digest_stripes(sum,sum->tail,1);
+    sum->tail_len = 0;
+}
+
+/* Adds len bytes of data at offset to sum. The data are mixed a stripe at a
+ * time, and the bytes that don't make a whole stripe wait in the tail for 
+ * the next data, so the digest is the same however the data were split */
+void digest_data(digest* sum,long long offset,const void* data,size_t len) {
+    const unsigned char* bytes = data;
+    if (len == 0)
+        return;
+    if (offset != sum->end) {
+        digest_flush(sum);
+        DIGEST_ROUND(sum->lanes[0],(uint64_t)offset);
+    }
+    sum->end = offset + len;
+    sum->length += len;
+    // We complete the stripe of the tail first
+    if (sum->tail_len > 0) {
+        size_t n = (DIGEST_STRIPE - sum->tail_len < len) ? DIGEST_STRIPE - sum->tail_len : len;
+        memcpy(sum->tail + sum->tail_len,bytes,n);
+        sum->tail_len += n;
+        bytes += n;
+        len -= n;
+        if (sum->tail_len < DIGEST_STRIPE)
+            return;
+        digest_flush(sum);
+    }
+    size_t whole = len / DIGEST_STRIPE * DIGEST_STRIPE;
+    digest_stripes(sum,bytes,whole / DIGEST_STRIPE);
+    bytes += whole;
+    len -= whole;
+    memcpy(sum->tail,bytes,len);
+    sum->tail_len = len;
+}
 
-        return sock;
+/* Returns the value of sum, after its lanes are merged and their last bits 
+ * are spread to all of it */
+uint64_t digest_final(digest* sum) {
+    digest_flush(sum);
+    uint64_t hash = 0;
+    for (int i = 0; i < DIGEST_LANES; i++) {
+        uint64_t lane = 0;
+        DIGEST_ROUND(lane,sum->lanes[i]);
+        hash = (hash ^ lane) * DIGEST_PRIME1 + DIGEST_PRIME4;
+    }
+    hash ^= sum->length;
+    hash ^= hash >> 33;
+    hash *= DIGEST_PRIME2;
+    hash ^= hash >> 29;
+    hash *= DIGEST_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+/* Puts the hexadecimal representation of a digest's value in buffer */
+char* digest_to_string(char* buffer,uint64_t value) {
+    static const char hex_digits[] = "0123456789abcdef";
+    for (int i = 15; i >= 0; i--) {
+        buffer[i] = hex_digits[value & 15];
+        value >>= 4;
+    }
+    buffer[16] = '\0';
+    return buffer;
+}
+
+/* Starts an empty SHA-256 hash, with the initial values of the standard */
+void sha256_init(sha256* sum) {
+    static const uint32_t initial[8] = {0x6a09e667,0xbb67ae85,0x3c6ef372,0xa54ff53a,
+        0x510e527f,0x9b05688c,0x1f83d9ab,0x5be0cd19};
+    memcpy(sum->state,initial,sizeof(initial));
+    sum->length = 0;
+    sum->block_len = 0;
+}
+
+// Mixes count blocks of data into sum
+void sha256_blocks(sha256* sum,const unsigned char* data,size_t count) {
+    uint32_t words[64];
+    for (size_t n = 0; n < count; n++, data += SHA256_BLOCK) {
+        for (int i = 0; i < 16; i++) {
+            words[i] = ((uint32_t)data[4 * i] << 24) | ((uint32_t)data[4 * i + 1] << 16)
+                | ((uint32_t)data[4 * i + 2] << 8) | data[4 * i + 3];
+        }
+        for (int i = 16; i < 64; i++) {
+            uint32_t s0 = SHA256_ROTATE(words[i - 15],7) ^ SHA256_ROTATE(words[i - 15],18) ^ (words[i - 15] >> 3);
+            uint32_t s1 = SHA256_ROTATE(words[i - 2],17) ^ SHA256_ROTATE(words[i - 2],19) ^ (words[i - 2] >> 10);
+            words[i] = words[i - 16] + s0 + words[i - 7] + s1;
+        }
+        uint32_t a = sum->state[0],b = sum->state[1],c = sum->state[2],d = sum->state[3];
+        uint32_t e = sum->state[4],f = sum->state[5],g = sum->state[6],h = sum->state[7];
+        for (int i = 0; i < 64; i++) {
+            uint32_t s1 = SHA256_ROTATE(e,6) ^ SHA256_ROTATE(e,11) ^ SHA256_ROTATE(e,25);
+            uint32_t choice = (e & f) ^ (~e & g);
+            uint32_t temp1 = h + s1 + choice + sha256_constants[i] + words[i];
+            uint32_t s0 = SHA256_ROTATE(a,2) ^ SHA256_ROTATE(a,13) ^ SHA256_ROTATE(a,22);
+            uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+            uint32_t temp2 = s0 + majority;
+            h = g;
+            g = f;
+            f = e;
+            e = d + temp1;
+            d = c;
+            c = b;
+            b = a;
+            a = temp1 + temp2;
+        }
+        sum->state[0] += a;
+        sum->state[1] += b;
+        sum->state[2] += c;
+        sum->state[3] += d;
+        sum->state[4] += e;
+        sum->state[5] += f;
+        sum->state[6] += g;
+        sum->state[7] += h;
+    }
+}
+
+/* Adds len bytes of data to sum. Like the digest, the bytes that don't make
+ * a whole block wait for the next data */
+void sha256_data(sha256* sum,const void* data,size_t len) {
+    const unsigned char* bytes = data;
+    sum->length += len;
+    if (sum->block_len > 0) {
+        size_t n = (SHA256_BLOCK - sum->block_len < len) ? SHA256_BLOCK - sum->block_len : len;
+        memcpy(sum->block + sum->block_len,bytes,n);
+        sum->block_len += n;
+        bytes += n;
+        len -= n;
+        if (sum->block_len < SHA256_BLOCK)
+            return;
+        sha256_blocks(sum,sum->block,1);
+        sum->block_len = 0;
+    }
+    sha256_blocks(sum,bytes,len / SHA256_BLOCK);
+    bytes += len / SHA256_BLOCK * SHA256_BLOCK;
+    len %= SHA256_BLOCK;
+    memcpy(sum->block,bytes,len);
+    sum->block_len = len;
+}
+
+/* Puts the value of sum in value, after the data are padded with a 1 bit,
+ * zeros and their length in bits */
+void sha256_final(sha256* sum,unsigned char* value) {
+    uint64_t bits = sum->length * 8;
+    unsigned char padding[SHA256_BLOCK + 8] = {0x80};
+    size_t pad_len = (sum->block_len < SHA256_BLOCK - 8) ? SHA256_BLOCK - 8 - sum->block_len : 2 * SHA256_BLOCK - 8 - sum->block_len;
+    for (int i = 0; i < 8; i++) {
+        padding[pad_len + i] = bits >> (56 - 8 * i);
+    }
+    sha256_data(sum,padding,pad_len + 8);
+    for (int i = 0; i < 8; i++) {
+        value[4 * i] = sum->state[i] >> 24;
+        value[4 * i + 1] = sum->state[i] >> 16;
+        value[4 * i + 2] = sum->state[i] >> 8;
+        value[4 * i + 3] = sum->state[i];
+    }
+}
+
+/* Puts the hexadecimal representation of a SHA-256 value in buffer */
+char* sha256_to_string(char* buffer,const unsigned char* value) {
+    static const char hex_digits[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_SIZE; i++) {
+        buffer[2 * i] = hex_digits[value[i] >> 4];
+        buffer[2 * i + 1] = hex_digits[value[i] & 15];
+    }
+    buffer[2 * SHA256_SIZE] = '\0';
+    return buffer;
 }
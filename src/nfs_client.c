@@ -4,23 +4,82 @@
  * offers the following options:
  *      - LIST source_dir: Sends to the host the files contained inside 
  *                         source_dir. At the end of the message it sends
- *                         the character '.'
+ *                         the character '.', or -1<space><error> if
+ *                         source_dir can't be opened
  *
- *      - PULL /source_dir/file.txt: Sends to the host the contents of
+ *      - LISTX source_dir: Like LIST, with a line for every regular file:
+ *                         <filename> <inode> <filesize> <mtime>
+ *
+ *      - PULL /source_dir/file.txt offset: Sends to the host the contents of
  *                         ./source_dir/file.txt (Paths are relative due
- *                         to security concerns), with the following format:
- *                         <filesize><space><data...>
- *                          If filesize is -1 then data will contain the ERROR
- *                          occured
+ *                         to security concerns) that are after offset, with 
+ *                         the following format:
+ *                         <filesize><space><mtime><space><extents...>-1<space>
+ *                          (followed by <digest><space> if it was verified)
+ *                          filesize is always the size of the whole file and
+ *                          mtime is its modification time in nanoseconds. If 
+ *                          filesize is -1 then the rest of the message is 
+ *                          the ERROR occured. Only the parts of the file that
+ *                          contain data are sent (holes of sparse files are 
+ *                          skipped), each one as an extent:
+ *                          <offset><space><length><space><data...>
 
  *      - PUSH /target_dir/file.txt chunk_size data: Reads from host the data
  *                          sent, and appends it to /target/file.txt. if 
- *                          chunk_size is -1 then we clear the file first and 
- *                          if chunk_size is 0, then we have read all the data
- *                          given, and we can close the file
+ *                          chunk_size is 0 then it is followed by an offset, 
+ *                          and we open the file keeping only its first offset
+ *                          bytes, if chunk_size is -2 then it is followed by 
+ *                          an offset and the file has a hole until offset, 
+ *                          and if chunk_size is -1, then we have read 
+ *                          all the data given, and we can close the file.
+ *                          The data are written in a temp file, that replaces
+ *                          /target/file.txt only when the file is closed.
+ *                          If chunk_size is -3 then it is followed by an 
+ *                          offset, the temp file is opened like with 0, and
+ *                          the rest of the file follows as a stream of 
+ *                          extents <offset><space><length><space><data...>,
+ *                          like the ones of PULL, that ends with -1 (and the 
+ *                          file is closed), so a single PUSH sends the whole
+ *                          file. A verified stream ends with -1 <digest>, 
+ *                          and if the digest of the data we received isn't 
+ *                          the same, the temp file is deleted and we reply 
+ *                          with -2 and our digest instead
+ *
+ *      - STAT /source_dir/file.txt: Sends to the host the size and the 
+ *                          modification time of the file, in the form
+ *                          <filesize><space><mtime><space>, or -1 and the 
+ *                          ERROR occured. It can be followed by a PULL of 
+ *                          the file in the same connection
+ *
+ *      - OFFSET /target_dir/file.txt: Sends to the host how many bytes an 
+ *                          unfinished PUSH of /target/file.txt has written, 
+ *                          so the transfer can be resumed after them
+ *
+ *      - COPY /source_dir/file.txt /target_dir/file.txt: Copies a local file
+ *                          to another local file, without sending its data 
+ *                          through the network. It replies with the number 
+ *                          of bytes copied, or with -1 and the ERROR occured
+ *
+ *      - RENAME (or LINK) /target_dir/old.txt /target_dir/new.txt size: 
+ *                          Renames (or hard links) a file we already have to
+ *                          its new name, if it still has size bytes. It 
+ *                          replies with size, or with -1 and the ERROR occured
+ *
+ *      - UNLINK /target_dir/file.txt: Deletes a file (and its temp file), and
+ *                          replies with 0, or with -1 and the ERROR occured
+ *
+ *      - CLONE /target_dir/old.txt /target_dir/new.txt size hash: Like 
+ *                          LINK, if old.txt still has the given SHA-256 hash
+ *
+ *      - DIGEST /source_dir/file.txt: Sends to the host the size, the
+ *                          modification time and the SHA-256 hash of the file
+ *
+ *      - VERIFY: The PULL or PUSH stream that follows in the connection is 
+ *                          verified, with a digest of its data
  *
  *
  */
+#define _GNU_SOURCE // For SEEK_DATA, SEEK_HOLE, fallocate and copy_file_range
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
@@ -35,29 +94,70 @@
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <signal.h>
 #include "../include/nfs.h"
+#include "../include/outbuf.h"
+#include "../include/commit.h"
 #include "../include/nfs_client.h"
 #define MOD 0777
 
+int uring_depth = 0; // Buffers in flight of a transfer's io_uring, 0 means 
+                     // that transfers use blocking syscalls
+
 int main(int argc,char* argv[]) {
     // Parsing arguments
-    int port;
-    if (argc != 3) {
+    int port = 0;
+    int socket_buffer = 0; // In KB, 0 means that the kernel sizes them
+    int commit_window = COMMIT_WINDOW_MS;
+    if (argc < 3 || argc > 9 || argc % 2 == 0) {
         fprintf(stderr,"ERROR! Wrong number of arguments given\n");
         exit(-1);
     }
+    for (int i = 1; i < argc; i += 2) {
+        if (!strcmp(argv[i],"-p"))
+            port = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i],"-B"))
+            socket_buffer = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i],"-q"))
+            uring_depth = atoi(argv[i + 1]);
+        else if (!strcmp(argv[i],"-g"))
+            commit_window = atoi(argv[i + 1]);
+        else {
+            fprintf(stderr,"ERROR! Wrong argument given <%s>\n",argv[i]);
+            exit(-1);
+        }
+    }
 
-    port = atoi(argv[2]);
     if (port == 0) {
-        fprintf(stderr,"ERROR! Wrong value given as port number <%s>\n",argv[2]);
+        fprintf(stderr,"ERROR! Wrong value given as port number\n");
+        exit(-1);
+    }
+    if (socket_buffer < 0) {
+        fprintf(stderr,"ERROR! Wrong value given as socket buffer size\n");
         exit(-1);
     }
+    if (uring_depth < 0 || uring_depth > URING_MAX_BUFFERS) {
+        fprintf(stderr,"ERROR! Wrong value given as io_uring queue depth\n");
+        exit(-1);
+    }
+    if (commit_window < 0) {
+        fprintf(stderr,"ERROR! Wrong value given as group commit window\n");
+        exit(-1);
+    }
+    set_socket_buffers(socket_buffer * 1024);
+    commit_init(commit_window);
     pthread_t thread; // Will be used to create threads to serve nfs_manager
 
+    // If nfs_manager drops a connection, only the thread serving it should
+    // stop, so we handle EPIPE instead of being terminated
+    signal(SIGPIPE,SIG_IGN);
+
     // Creating our socket
     int sockfd; 
     if ((sockfd = socket(AF_INET,SOCK_STREAM,0)) < 0)
         perror_exit("ERROR! Socket failed\n");
+    // Accepted sockets get the buffers of the listening one
+    tune_socket(sockfd);
 
     // Binding our socket to the specified port
     struct sockaddr_in server; // We use AF_INET so we use this sockaddr
@@ -90,125 +190,1026 @@ int main(int argc,char* argv[]) {
 
 void* provide_service(void* arg) {
     int sockfd = (int)arg; 
-    int fd; // The file descriptor we will use in our PUSH/PULL actions
+    int fd = -1; // The file descriptor we will use in our PUSH/PULL actions
     char buffer[1024];
-    char action[6]; // The action we want to perform
-    
-    getnextword(sockfd,action);
-
-    if (!strcmp(action,"LIST")) {
-        char dir[255]; 
-        // Reading the name of our directory using helping function
-        getnextword(sockfd,dir);
-        // All directories are in the form /dir_name
-        DIR* dir_ptr = opendir(dir + 1); 
-        if (dir_ptr == NULL) {
-            // Sent the halting character "." to client
-            write(sockfd,".\n",2);
-            close(sockfd);
-            return NULL;
-        }
-        struct dirent* direntp;
-        while ((direntp = readdir(dir_ptr)) != NULL) {
-            // We skip . and .. directories
-            if (strcmp(direntp->d_name,".") == 0 || strcmp(direntp->d_name,"..") == 0)
-                continue;
-            write(sockfd,direntp->d_name,strlen(direntp->d_name));
-            write(sockfd,"\n",1);
-        }
-        write(sockfd,".\n",2);
-    }
-    else if (!strcmp(action,"PULL")) {
-        char filename[20];
-        getnextword(sockfd,filename);
-        fd = open(filename + 1,O_RDONLY);
-        if (fd < 0) {
-            write(sockfd,"-1 ",3);
-            write(sockfd,strerror(errno),strlen(strerror(errno)));
-            close(sockfd);
-            return NULL;
-
-        }
-        struct stat info; // To obtain file's size
-        if (stat(filename + 1,&info) < 0) {
-            // Sent -1 error_message
-            write(sockfd,"-1 ",3);
-            write(sockfd,strerror(errno),strlen(strerror(errno)));
-            close(sockfd);
-            return NULL;
-        }
-        // Print size to socket
-        char number_buffer[32];
-        number_to_string(number_buffer, info.st_size);
-        write(sockfd,number_buffer,strlen(number_buffer));
-        write(sockfd," ",1);
-
-        // Print the contents of the file to the socket
-        int n;
-        char buff[1024];
-        int count = 0;
-        while ((n = read(fd,buff,1024)) > 0) {
-            if (write(sockfd,buff,n) < n) {
+    char action[16]; // The action we want to perform
+    char filename[PATH_MAX]; // The file of our PUSH/OFFSET actions
+    char tmp_filename[PATH_MAX]; // The temp file PUSH actually writes to
+    char* stream_buffer = NULL; // Allocated by the first PUSH stream
+    bool halt = false;
+    uring ring; // Set up by a PULL or a PUSH stream, if we use io_uring
+    ring.fd = -1;
+    bulk_io bulk; // The I/O of our PULL or PUSH stream's file
+    bulk.mode = BULK_OFF;
+    bulk.fd = -1;
+    bulk.direct_fd = -1;
+    bool verify = false; // True if our PULL or PUSH stream is verified
+    digest sum; // The digest of the data of a verified stream
+    outbuf out; // Our replies are gathered here, and sent when they are whole
+    outbuf_init(&out,sockfd);
+
+    // A connection serves either a single LIST/COPY, a PULL that can follow a
+    // STAT, or a sequence of OFFSET/PUSH commands that ends with PUSH file -1
+    while (!halt && getnextword(sockfd,action) == 0) {
+        if (!strcmp(action,"LIST")) {
+            char dir[PATH_MAX]; 
+            // Reading the name of our directory using helping function
+            getnextword(sockfd,dir);
+            // All directories are in the form /dir_name
+            DIR* dir_ptr = opendir(dir + 1); 
+            // A directory that can't be opened isn't an empty one
+            if (dir_ptr == NULL) {
+                send_error(&out,errno);
+                close(sockfd);
+                return NULL;
+            }
+            struct dirent* direntp;
+            while ((direntp = readdir(dir_ptr)) != NULL) {
+                // We skip . and .. directories
+                if (strcmp(direntp->d_name,".") == 0 || strcmp(direntp->d_name,"..") == 0)
+                    continue;
+                // We skip unfinished transfers, they are not part of the directory
+                if (is_temp_file(direntp->d_name))
+                    continue;
+                outbuf_string(&out,direntp->d_name);
+                outbuf_string(&out,"\n");
+            }
+            closedir(dir_ptr);
+            outbuf_string(&out,".\n");
+            outbuf_flush(&out);
+            halt = true;
+        }
+        else if (!strcmp(action,"LISTX")) {
+            // Like LIST, with the inode, size and modification time of every
+            // file, so the host can tell which files were renamed or linked
+            char dir[PATH_MAX];
+            getnextword(sockfd,dir);
+            DIR* dir_ptr = opendir(dir + 1);
+            // An empty listing would mean that every file was deleted
+            if (dir_ptr == NULL) {
+                send_error(&out,errno);
+                close(sockfd);
+                return NULL;
+            }
+            struct dirent* direntp;
+            while ((direntp = readdir(dir_ptr)) != NULL) {
+                if (is_temp_file(direntp->d_name))
+                    continue;
+                // Only regular files are synced (this skips . and .. too)
+                struct stat info;
+                if (fstatat(dirfd(dir_ptr),direntp->d_name,&info,0) < 0 || !S_ISREG(info.st_mode))
+                    continue;
+                outbuf_string(&out,direntp->d_name);
+                outbuf_string(&out," ");
+                outbuf_number(&out,info.st_ino);
+                outbuf_string(&out," ");
+                send_stat(&out,&info);
+                outbuf_string(&out,"\n");
+            }
+            closedir(dir_ptr);
+            outbuf_string(&out,".\n");
+            outbuf_flush(&out);
+            halt = true;
+        }
+        else if (!strcmp(action,"PULL")) {
+            getnextword(sockfd,filename);
+            off_t offset = getsize(sockfd);
+            // A missing or negative offset is checked before we open the file,
+            // so errno is ours and no file is left open
+            if (offset < 0) {
+                send_error(&out,EINVAL);
+                close(sockfd);
+                return NULL;
+            }
+            fd = open(filename + 1,O_RDONLY);
+            if (fd < 0) {
+                send_error(&out,errno);
+                close(sockfd);
+                return NULL;
+            }
+            struct stat info; // To obtain file's size
+            if (fstat(fd,&info) < 0) {
+                // Sent -1 error_message
+                send_error(&out,errno);
                 close(fd);
                 close(sockfd);
                 return NULL;
             }
-            count += n;
+            // Print size and modification time to socket. The size is always 
+            // the whole file's size, even when we resume from offset. They go
+            // out with the first extent
+            send_stat(&out,&info);
+            digest_init(&sum);
+            bulk_begin(&bulk,fd,offset,true);
+            bool use_uring = open_uring(&ring,&bulk,sockfd);
+
+            // Print the data extents of the file after offset to the socket. 
+            // The holes of sparse files are skipped, the host recreates them 
+            // from the extents' offsets
+            off_t pos = offset;
+            while (pos < info.st_size) {
+                off_t data = lseek(fd,pos,SEEK_DATA);
+                if (data < 0) {
+                    // There is only a hole until the end of the file
+                    if (errno == ENXIO)
+                        break;
+                    // The filesystem can't find holes, so we send all the rest
+                    data = pos;
+                }
+                off_t hole = lseek(fd,data,SEEK_HOLE);
+                if (hole < 0 || hole > info.st_size)
+                    hole = info.st_size;
+                digest* extent_sum = verify ? &sum : NULL;
+                int sent = use_uring ? send_extent_uring(&ring,&out,&bulk,data,hole - data,extent_sum) : send_extent(&out,&bulk,data,hole - data,extent_sum);
+                if (sent < 0) {
+                    uring_destroy(&ring);
+                    bulk_end(&bulk,false);
+                    close(fd);
+                    close(sockfd);
+                    return NULL;
+                }
+                pos = hole;
+            }
+            // No more extents, and the digest of the data we sent
+            outbuf_string(&out,"-1 ");
+            if (verify) {
+                char digest_buffer[17];
+                outbuf_string(&out,digest_to_string(digest_buffer,digest_final(&sum)));
+                outbuf_string(&out," ");
+            }
+            outbuf_flush(&out);
+            bulk_end(&bulk,false);
+            close(fd);
+            fd = -1;
+            halt = true;
         }
-        close(fd);
-    }
-    else if (!strcmp(action,"PUSH")) {
-        char filename[20];
-        int chunk_size;
-        bool halt = false;
-        // Loop is terminated from inside using break
-        while (true) {
+        else if (!strcmp(action,"COPY")) {
+            // Both files are ours, so we copy them locally instead of sending
+            // the data through nfs_manager
+            char source[PATH_MAX];
+            getnextword(sockfd,source);
+            getnextword(sockfd,filename);
+            temp_file_name(tmp_filename,filename + 1);
+            struct stat info;
+            long long copied = -1;
+            int source_fd = open(source + 1,O_RDONLY);
+            if (source_fd >= 0 && fstat(source_fd,&info) == 0) {
+                fd = open(tmp_filename,O_CREAT | O_WRONLY | O_TRUNC,MOD);
+                if (fd >= 0) {
+                    copied = copy_extents(source_fd,fd,info.st_size);
+                    // The copy is committed like a PUSH, before we reply
+                    if (copied < 0)
+                        close(fd);
+                    else if (commit_file(fd,tmp_filename,filename + 1) < 0)
+                        copied = -1;
+                    fd = -1;
+                }
+            }
+            if (source_fd >= 0)
+                close(source_fd);
+            // We reply with the bytes we copied, or -1 and the error occured
+            outbuf_number(&out,copied);
+            outbuf_string(&out," ");
+            if (copied < 0) 
+                outbuf_string(&out,strerror(errno));
+            outbuf_flush(&out);
+            halt = true;
+        }
+        else if (!strcmp(action,"RENAME") || !strcmp(action,"LINK") || !strcmp(action,"CLONE")) {
+            // A file that we already have under another name, is renamed (or
+            // copied) to its new name, instead of being sent again. A CLONE
+            // gives the SHA-256 hash the old file must have
+            char old_filename[PATH_MAX];
+            char hash_buffer[PATH_MAX];
+            getnextword(sockfd,old_filename);
+            getnextword(sockfd,filename);
+            long long size = getsize(sockfd);
+            bool clone = !strcmp(action,"CLONE");
+            if (clone)
+                getnextword(sockfd,hash_buffer);
+            long long moved = change_file(strcmp(action,"RENAME"),old_filename + 1,filename + 1,size,(clone) ? hash_buffer : NULL);
+            // We reply with the file's size, or -1 and the error occured
+            outbuf_number(&out,moved);
+            outbuf_string(&out," ");
+            if (moved < 0)
+                outbuf_string(&out,strerror(errno));
+            outbuf_flush(&out);
+            halt = true;
+        }
+        else if (!strcmp(action,"UNLINK")) {
+            // The file was deleted from source, so we delete our copy, and 
+            // what an unfinished PUSH of it has written
+            getnextword(sockfd,filename);
+            temp_file_name(tmp_filename,filename + 1);
+            unlink(tmp_filename);
+            if (unlink(filename + 1) < 0 && errno != ENOENT)
+                send_error(&out,errno);
+            else {
+                outbuf_string(&out,"0 ");
+                outbuf_flush(&out);
+            }
+            halt = true;
+        }
+        else if (!strcmp(action,"BULK")) {
+            // The PULL or PUSH stream that follows is a bulk one
+            long long mode = getsize(sockfd);
+            if (mode < BULK_OFF || mode > BULK_DIRECT)
+                break;
+            bulk.mode = mode;
+        }
+        else if (!strcmp(action,"VERIFY")) {
+            // The PULL or PUSH stream that follows is verified
+            verify = true;
+        }
+        else if (!strcmp(action,"DIGEST")) {
+            // We send the size, the modification time and the SHA-256 hash
+            // of the data of filename, so the host can find out if a target
+            // already has the same file
+            getnextword(sockfd,filename);
+            struct stat info;
+            char hash_buffer[2 * SHA256_SIZE + 1];
+            fd = open(filename + 1,O_RDONLY);
+            if (fd < 0 || fstat(fd,&info) < 0 || file_hash(fd,info.st_size,hash_buffer) < 0) {
+                send_error(&out,errno);
+                halt = true;
+            }
+            else {
+                send_stat(&out,&info);
+                outbuf_string(&out,hash_buffer);
+                outbuf_string(&out," ");
+                outbuf_flush(&out);
+            }
+            if (fd >= 0)
+                close(fd);
+            fd = -1;
+        }
+        else if (!strcmp(action,"STAT")) {
+            // We send the size and modification time of filename, so the host
+            // can tell if its copy of the file is still valid
+            getnextword(sockfd,filename);
+            struct stat info;
+            if (stat(filename + 1,&info) < 0) {
+                send_error(&out,errno);
+                close(sockfd);
+                return NULL;
+            }
+            send_stat(&out,&info);
+            outbuf_flush(&out);
+        }
+        else if (!strcmp(action,"OFFSET")) {
+            // We send the number of bytes an unfinished PUSH of filename has 
+            // already written, so the host can resume from there
+            getnextword(sockfd,filename);
+            temp_file_name(tmp_filename,filename + 1);
+            struct stat info;
+            if (stat(tmp_filename,&info) < 0)
+                info.st_size = 0;
+            outbuf_number(&out,info.st_size);
+            outbuf_string(&out," ");
+            outbuf_flush(&out);
+        }
+        else if (!strcmp(action,"PUSH")) {
             getnextword(sockfd,filename);
-            chunk_size = getsize(sockfd);
+            long long chunk_size = getsize(sockfd);
 
             switch (chunk_size) {
-            case INT_MIN:
+            case LLONG_MIN:
                 // Wrong characters given as chunk_size
-                close(sockfd);
-                return NULL;
+                halt = true;
+                break;
             case -1:
-                // We can close the file, PUSH stream ended
-                if (close(fd) < 0) {
-                    perror("ERROR! close failed\n");
-                    exit(-1);
-                }
+                // PUSH stream ended, we commit the temp file in place of the
+                // real one
+                close_push(&out,fd,tmp_filename,filename + 1);
+                fd = -1;
                 halt = true;
                 break;
-            case 0:
-                fd = open(filename + 1,O_CREAT | O_WRONLY | O_TRUNC,MOD);
-                if (fd < 0) {
-                    close(sockfd);
-                    return NULL;
+            case 0: {
+                // We continue writing the temp file after offset (0 for a new 
+                // transfer) 
+                off_t offset = getsize(sockfd);
+                fd = open_push(tmp_filename,filename + 1,offset);
+                if (fd < 0)
+                    halt = true;
+                break;
+            }
+            case -2: {
+                // The next data are after a hole of the file
+                off_t offset = getsize(sockfd);
+                if (offset < 0 || skip_hole(fd,offset) < 0)
+                    halt = true;
+                break;
+            }
+            case -3: {
+                // The whole file follows as a stream of extents, so we read 
+                // them without any more PUSH commands
+                off_t offset = getsize(sockfd);
+                fd = open_push(tmp_filename,filename + 1,offset);
+                int received = -1;
+                digest_init(&sum);
+                digest* stream_sum = verify ? &sum : NULL;
+                if (fd >= 0) {
+                    bulk_begin(&bulk,fd,offset,false);
+                    bulk_open_direct(&bulk,tmp_filename);
                 }
+                if (fd >= 0 && open_uring(&ring,&bulk,sockfd))
+                    received = receive_extents_uring(&ring,sockfd,&bulk,stream_sum);
+                else if (fd >= 0) {
+                    // Aligned, so it can be written with O_DIRECT
+                    if (stream_buffer == NULL)
+                        stream_buffer = aligned_alloc(BULK_ALIGN,STREAM_BUFFER);
+                    if (stream_buffer != NULL)
+                        received = receive_extents(sockfd,&bulk,stream_buffer,stream_sum);
+                }
+                if (fd >= 0)
+                    bulk_end(&bulk,true);
+                // A file whose data weren't the ones that were sent is never
+                // committed
+                if (received == 0 && (!verify || verify_push(&out,sockfd,tmp_filename,&sum)))
+                    close_push(&out,fd,tmp_filename,filename + 1);
+                else if (fd >= 0)
+                    close(fd);
+                fd = -1;
+                halt = true;
                 break;
+            }
             default:
                 // We write the data to the file
                 do {
                     // We read the maximum amount of data we can fit in the buffer.
                     // That will either be all data sent  or buffer's capacity
                     int n = read(sockfd,buffer,(1024 < chunk_size) ? 1024 : chunk_size);
+                    // Connection dropped, what we wrote stays in the temp file
+                    if (n <= 0) {
+                        halt = true;
+                        break;
+                    }
                     write(fd,buffer,n);
                     chunk_size -= n;
                 } while (chunk_size > 0);
             }    
-            // We are done with the PUSH action
-            if (halt)
-                break;
-            getnextword(sockfd,action);
-            action[5] = '\0';
-            // We expected PUSH
-            if (strcmp(action,"PUSH")) {
+        }
+        // Unknown action given
+        else
+            break;
+
+    }
+    if (fd >= 0)
+        close(fd);
+    free(stream_buffer);
+    uring_destroy(&ring);
+    close(sockfd);
+    pthread_exit(NULL);
+}
+
+/* Opens the temp file of filename for a PUSH, keeping its first offset bytes,
+ * and returns its descriptor, or -1 in case of an error. The temp file's name
+ * is put in tmp_filename */
+int open_push(char* tmp_filename,char* filename,off_t offset) {
+    temp_file_name(tmp_filename,filename);
+    int fd = open(tmp_filename,O_CREAT | O_WRONLY,MOD);
+    if (fd < 0)
+        return -1;
+    if (offset < 0 || ftruncate(fd,offset) < 0 || lseek(fd,offset,SEEK_SET) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Commits the temp file of a PUSH in place of filename, and acknowledges it
+ * to out after its group commit round */
+int close_push(outbuf* out,int fd,char* tmp_filename,char* filename) {
+    if (fd < 0 || commit_file(fd,tmp_filename,filename) < 0) {
+        send_error(out,(fd < 0) ? EBADF : errno);
+        return -1;
+    }
+    outbuf_string(out,"0 ");
+    outbuf_flush(out);
+    return 0;
+}
+
+/* Reads the digest that ends a verified PUSH stream, and compares it with 
+ * the digest of the data we received. If they aren't the same, the temp file
+ * is deleted (so the retry starts it over) before we reply with -2 and our 
+ * digest, so the host can tell what went wrong */
+bool verify_push(outbuf* out,int sockfd,char* tmp_filename,digest* sum) {
+    char word[32];
+    char digest_buffer[17];
+    uint64_t received = digest_final(sum);
+    if (getnextword(sockfd,word) < 0)
+        return false;
+    if (strtoull(word,NULL,16) == received)
+        return true;
+    unlink(tmp_filename);
+    outbuf_string(out,"-2 ");
+    outbuf_string(out,digest_to_string(digest_buffer,received));
+    outbuf_string(out," ");
+    outbuf_flush(out);
+    return false;
+}
+
+/* Moves the position of fd to offset, after a hole of the file. If the hole 
+ * is after the end of the file we extend it, else we deallocate any data the
+ * hole covers */
+int skip_hole(int fd,off_t offset) {
+    struct stat info;
+    off_t pos = lseek(fd,0,SEEK_CUR);
+    if (pos < 0 || fstat(fd,&info) < 0)
+        return -1;
+    if (pos < info.st_size && pos < offset) {
+        off_t end = (offset < info.st_size) ? offset : info.st_size;
+        fallocate(fd,FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,pos,end - pos);
+    }
+    if (offset > info.st_size && ftruncate(fd,offset) < 0)
+        return -1;
+    if (lseek(fd,offset,SEEK_SET) < 0)
+        return -1;
+    return 0;
+}
+
+/* Reads the extents of a PUSH stream from sockfd, until the -1 that ends it,
+ * and writes them to bulk's file, through buffer (of STREAM_BUFFER bytes). 
+ * Every read is added to sum (if it isn't NULL) right after it, while its 
+ * data are still in the CPU's cache. 
+ * The data are written when buffer is full, or when the data that follow 
+ * don't continue them. buffer ends at an offset aligned to BULK_ALIGN, so 
+ * after the first one every full buffer can be written with O_DIRECT.
+ *
+ * Returns 0, or -1 if the stream didn't end (what we wrote stays in the file)
+ */
+int receive_extents(int sockfd,bulk_io* bulk,char* buffer,digest* sum) {
+    int fd = bulk->fd;
+    off_t pos = lseek(fd,0,SEEK_CUR); // Where the next data we receive go
+    off_t start = pos; // Where the data of buffer go
+    size_t filled = 0;
+    if (pos < 0)
+        return -1;
+    while (true) {
+        long long offset = getsize(sockfd);
+        if (offset == -1)
+            return bulk_write(bulk,buffer,filled,start);
+        long long length = getsize(sockfd);
+        if (offset < 0 || length < 0) {
+            bulk_write(bulk,buffer,filled,start);
+            return -1;
+        }
+        // Extents usually continue one another, so we rarely need to seek. 
+        // skip_hole uses fd's position, that our writes don't move
+        if (offset != pos) {
+            if (bulk_write(bulk,buffer,filled,start) < 0 || lseek(fd,pos,SEEK_SET) < 0 || skip_hole(fd,offset) < 0)
+                return -1;
+            pos = start = offset;
+            filled = 0;
+        }
+        while (length > 0) {
+            size_t capacity = STREAM_BUFFER - start % BULK_ALIGN;
+            ssize_t n = read(sockfd,buffer + filled,(capacity - filled < length) ? capacity - filled : length);
+            // What we received is written, so a resumed PUSH doesn't need it
+            if (n <= 0) {
+                bulk_write(bulk,buffer,filled,start);
+                return -1;
+            }
+            if (sum != NULL)
+                digest_data(sum,pos,buffer + filled,n);
+            filled += n;
+            length -= n;
+            pos += n;
+            if (filled == capacity) {
+                if (bulk_write(bulk,buffer,filled,start) < 0)
+                    return -1;
+                start = pos;
+                filled = 0;
+            }
+        }
+    }
+}
+
+/* Starts the bulk I/O of fd from offset */
+void bulk_begin(bulk_io* bulk,int fd,off_t offset,bool reading) {
+    bulk->fd = fd;
+    bulk->direct_fd = -1;
+    bulk->synced = offset;
+    bulk->dropped = offset;
+    if (bulk->mode != BULK_OFF && reading)
+        posix_fadvise(fd,0,0,POSIX_FADV_SEQUENTIAL);
+}
+
+/* Opens filename with O_DIRECT, for the writes of a BULK_DIRECT transfer */
+void bulk_open_direct(bulk_io* bulk,char* filename) {
+    if (bulk->mode == BULK_DIRECT)
+        bulk->direct_fd = open(filename,O_WRONLY | O_DIRECT);
+}
+
+/* Returns true if len bytes at offset can be written with O_DIRECT */
+bool bulk_direct(bulk_io* bulk,off_t offset,size_t len) {
+    return bulk->direct_fd >= 0 && offset % BULK_ALIGN == 0 && len % BULK_ALIGN == 0;
+}
+
+/* Drops the pages of the file before pos, a window at a time */
+void bulk_read(bulk_io* bulk,off_t pos) {
+    if (bulk->mode == BULK_OFF || pos - bulk->dropped < BULK_WINDOW)
+        return;
+    posix_fadvise(bulk->fd,bulk->dropped,pos - bulk->dropped,POSIX_FADV_DONTNEED);
+    bulk->dropped = pos;
+}
+
+/* Gives the window before pos to writeback. The previous window had the time
+ * of a whole window to be written, so we wait for it and drop its pages (the
+ * kernel can't drop dirty pages)
+ */
+void bulk_written(bulk_io* bulk,off_t pos) {
+    if (bulk->mode == BULK_OFF || pos - bulk->synced < BULK_WINDOW)
+        return;
+    sync_file_range(bulk->fd,bulk->synced,pos - bulk->synced,SYNC_FILE_RANGE_WRITE);
+    if (bulk->synced > bulk->dropped) {
+        sync_file_range(bulk->fd,bulk->dropped,bulk->synced - bulk->dropped,SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(bulk->fd,bulk->dropped,bulk->synced - bulk->dropped,POSIX_FADV_DONTNEED);
+        bulk->dropped = bulk->synced;
+    }
+    bulk->synced = pos;
+}
+
+/* Writes len bytes of data at offset of bulk's file */
+int bulk_write(bulk_io* bulk,char* data,size_t len,off_t offset) {
+    int fd = bulk_direct(bulk,offset,len) ? bulk->direct_fd : bulk->fd;
+    size_t written = 0;
+    while (written < len) {
+        ssize_t w = pwrite(fd,data + written,len - written,offset + written);
+        if (w < 0) {
+            // The filesystem can't write these data directly, so they go 
+            // through the page cache
+            if (fd != bulk->fd && errno == EINVAL) {
+                fd = bulk->fd;
+                continue;
+            }
+            return -1;
+        }
+        written += w;
+    }
+    bulk_written(bulk,offset + len);
+    return 0;
+}
+
+/* Ends the bulk I/O of its file, dropping what is left of it in the page 
+ * cache (0 length means until the end of the file) */
+void bulk_end(bulk_io* bulk,bool written) {
+    if (bulk->mode != BULK_OFF) {
+        if (written)
+            sync_file_range(bulk->fd,bulk->dropped,0,SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+        posix_fadvise(bulk->fd,bulk->dropped,0,POSIX_FADV_DONTNEED);
+    }
+    if (bulk->direct_fd >= 0)
+        close(bulk->direct_fd);
+    bulk->direct_fd = -1;
+}
+
+/* Sets up ring for a transfer between bulk's file and sockfd. If io_uring 
+ * can't be used, we warn once and every transfer uses the blocking syscalls */
+bool open_uring(uring* ring,bulk_io* bulk,int sockfd) {
+    if (uring_depth == 0)
+        return false;
+    int fds[3];
+    fds[URING_FILE] = bulk->fd;
+    fds[URING_SOCKET] = sockfd;
+    fds[URING_DIRECT] = (bulk->direct_fd >= 0) ? bulk->direct_fd : bulk->fd;
+    if (uring_init(ring,uring_depth,URING_BUFFER) < 0 || uring_register_files(ring,fds,3) < 0) {
+        perror("WARNING! io_uring can't be used, transfers use blocking I/O");
+        uring_destroy(ring);
+        uring_depth = 0;
+        return false;
+    }
+    return true;
+}
+
+/* Sends an extent of a file through ring. Every buffer reads a chunk of the 
+ * extent, and the chunks are sent in order, one at a time, while the next
+ * ones are read.
+ *
+ * Returns 0, or -1 if the extent couldn't be sent
+ */
+int send_extent_uring(uring* ring,outbuf* out,bulk_io* bulk,off_t start,off_t length,digest* sum) {
+    outbuf_number(out,start);
+    outbuf_string(out," ");
+    outbuf_number(out,length);
+    outbuf_string(out," ");
+    // The header goes before any data of the ring
+    if (outbuf_flush_more(out) < 0)
+        return -1;
+
+    off_t offsets[URING_MAX_BUFFERS]; // Where the chunk of a buffer starts
+    size_t wanted[URING_MAX_BUFFERS]; // The length of the chunk of a buffer
+    size_t filled[URING_MAX_BUFFERS]; // Bytes of the chunk that were read
+    int first = 0; // The buffer we send next, the others follow it in order
+    int used = 0; // Buffers that have a chunk
+    size_t sent = 0; // Bytes of first's chunk that were sent
+    bool sending = false;
+    bool failed = false;
+    off_t next = start; // Where the next chunk starts
+    off_t end = start + length;
+    while (!failed && (used > 0 || next < end)) {
+        // We read the next chunks in the free buffers
+        while (used < ring->buffer_count && next < end) {
+            int buffer = (first + used) % ring->buffer_count;
+            offsets[buffer] = next;
+            wanted[buffer] = (end - next < URING_BUFFER) ? end - next : URING_BUFFER;
+            filled[buffer] = 0;
+            uring_file(ring,IORING_OP_READ_FIXED,URING_FILE,uring_buffer(ring,buffer),wanted[buffer],next,buffer * 2 + URING_FILE_IO);
+            next += wanted[buffer];
+            used++;
+        }
+        if (!sending && filled[first] == wanted[first]) {
+            // A chunk is added to the digest once, before it is sent
+            if (sent == 0 && sum != NULL)
+                digest_data(sum,offsets[first],uring_buffer(ring,first),filled[first]);
+            uring_socket(ring,IORING_OP_SEND,URING_SOCKET,uring_buffer(ring,first) + sent,filled[first] - sent,MSG_MORE | MSG_NOSIGNAL,first * 2 + URING_SOCKET_IO);
+            sending = true;
+        }
+        uint64_t user_data;
+        int res;
+        if (uring_wait(ring,&user_data,&res) < 0)
+            return -1;
+        int buffer = user_data / 2;
+        if (user_data % 2 == URING_FILE_IO) {
+            // The file got smaller while we were sending it, we can't send 
+            // the length we promised
+            if (res <= 0) {
+                failed = true;
+                continue;
+            }
+            filled[buffer] += res;
+            // A short read, we read the rest of the chunk
+            if (filled[buffer] < wanted[buffer])
+                uring_file(ring,IORING_OP_READ_FIXED,URING_FILE,uring_buffer(ring,buffer) + filled[buffer],wanted[buffer] - filled[buffer],offsets[buffer] + filled[buffer],user_data);
+        }
+        else {
+            sending = false;
+            if (res <= 0) {
+                failed = true;
+                continue;
+            }
+            sent += res;
+            if (sent == filled[first]) {
+                bulk_read(bulk,offsets[first] + filled[first]);
+                first = (first + 1) % ring->buffer_count;
+                used--;
+                sent = 0;
+            }
+        }
+    }
+    // Reads can still be in flight, and the buffers are used again
+    uring_drain(ring);
+    return failed ? -1 : 0;
+}
+
+/* Reads the extents of a PUSH stream through ring. The data are received in
+ * a buffer until it is full, or until the data that follow don't continue 
+ * it, and then the buffer is written to fd while the next one is received. 
+ * Like in receive_extents, buffers end at aligned offsets, so they can be 
+ * written with O_DIRECT. The writes end before we make a hole, as skip_hole 
+ * uses fd's position. If a write fails, fd is cut where it failed, so it only
+ * keeps data that have nothing missing before them.
+ *
+ * Returns 0, or -1 if the stream didn't end
+ */
+int receive_extents_uring(uring* ring,int sockfd,bulk_io* bulk,digest* sum) {
+    int fd = bulk->fd;
+    off_t offsets[URING_MAX_BUFFERS]; // Where the data of a buffer are written
+    size_t lengths[URING_MAX_BUFFERS]; // Bytes of a buffer we write
+    size_t written[URING_MAX_BUFFERS];
+    int files[URING_MAX_BUFFERS]; // The registered file a buffer is written to
+    bool writing[URING_MAX_BUFFERS];
+    memset(writing,0,sizeof(writing));
+    int current = 0; // The buffer we receive in
+    size_t filled = 0; // Bytes received in current
+    off_t pos = lseek(fd,0,SEEK_CUR); // Where the next data we receive go
+    off_t start = pos; // Where the data of current go
+    long long remaining = 0; // Bytes of the extent we haven't received
+    off_t hole_end = 0;
+    off_t failed_at = -1; // The first offset a write failed at
+    bool receiving = false;
+    bool flush = false; // Every write has to end before we go on
+    bool ended = false;
+    bool failed = false;
+    if (pos < 0)
+        return -1;
+    while (true) {
+        size_t capacity = URING_BUFFER - start % BULK_ALIGN;
+        if (!failed && (filled == capacity || (flush && filled > 0))) {
+            offsets[current] = start;
+            lengths[current] = filled;
+            written[current] = 0;
+            writing[current] = true;
+            files[current] = bulk_direct(bulk,start,filled) ? URING_DIRECT : URING_FILE;
+            uring_file(ring,IORING_OP_WRITE_FIXED,files[current],uring_buffer(ring,current),filled,start,current * 2 + URING_FILE_IO);
+            current = (current + 1) % ring->buffer_count;
+            filled = 0;
+            start = pos;
+        }
+        if (failed || flush) {
+            if (ring->pending == 0 && ring->inflight == 0) {
+                if (failed || ended)
+                    break;
+                // A hole, after all the data before it were written
+                flush = false;
+                if (lseek(fd,pos,SEEK_SET) < 0 || skip_hole(fd,hole_end) < 0)
+                    failed = true;
+                pos = start = hole_end;
+                continue;
+            }
+        }
+        else if (!receiving && remaining == 0) {
+            // The next extent, nothing is received meanwhile
+            long long offset = getsize(sockfd);
+            if (offset == -1) {
+                ended = flush = true;
+                continue;
+            }
+            long long length = getsize(sockfd);
+            if (offset < 0 || length < 0) {
+                failed = true;
+                continue;
+            }
+            remaining = length;
+            if (offset != pos) {
+                hole_end = offset;
+                flush = true;
+            }
+            continue;
+        }
+        else if (!receiving && !writing[current]) {
+            size_t space = URING_BUFFER - start % BULK_ALIGN - filled;
+            size_t len = (space < remaining) ? space : remaining;
+            uring_socket(ring,IORING_OP_RECV,URING_SOCKET,uring_buffer(ring,current) + filled,len,0,current * 2 + URING_SOCKET_IO);
+            receiving = true;
+        }
+        uint64_t user_data;
+        int res;
+        if (uring_wait(ring,&user_data,&res) < 0)
+            return -1;
+        int buffer = user_data / 2;
+        if (user_data % 2 == URING_FILE_IO) {
+            // The filesystem can't write these data directly, so they go 
+            // through the page cache
+            if (res == -EINVAL && files[buffer] == URING_DIRECT) {
+                files[buffer] = URING_FILE;
+                uring_file(ring,IORING_OP_WRITE_FIXED,URING_FILE,uring_buffer(ring,buffer) + written[buffer],lengths[buffer] - written[buffer],offsets[buffer] + written[buffer],user_data);
+                continue;
+            }
+            if (res <= 0) {
+                off_t at = offsets[buffer] + written[buffer];
+                if (failed_at < 0 || at < failed_at)
+                    failed_at = at;
+                writing[buffer] = false;
+                failed = true;
+                continue;
+            }
+            written[buffer] += res;
+            // A short write, we write the rest of the buffer
+            if (written[buffer] < lengths[buffer]) {
+                uring_file(ring,IORING_OP_WRITE_FIXED,files[buffer],uring_buffer(ring,buffer) + written[buffer],lengths[buffer] - written[buffer],offsets[buffer] + written[buffer],user_data);
+                continue;
+            }
+            writing[buffer] = false;
+            // Everything before the first write that is still running, or
+            // before the data we receive, was written
+            off_t done = start;
+            for (int i = 0; i < ring->buffer_count; i++) {
+                if (writing[i] && offsets[i] < done)
+                    done = offsets[i];
+            }
+            bulk_written(bulk,done);
+        }
+        else {
+            receiving = false;
+            // Connection dropped
+            if (res <= 0) {
+                failed = true;
+                continue;
+            }
+            if (sum != NULL)
+                digest_data(sum,pos,uring_buffer(ring,current) + filled,res);
+            filled += res;
+            remaining -= res;
+            pos += res;
+        }
+    }
+    if (failed_at >= 0)
+        ftruncate(fd,failed_at);
+    return failed ? -1 : 0;
+}
+
+/* Puts in buffer the name of the temp file, that PUSH writes before moving it
+ * to filename */
+char* temp_file_name(char* buffer,char* filename) {
+    strcpy(buffer,filename);
+    strcat(buffer,TEMP_SUFFIX);
+    return buffer;
+}
+
+/* Returns true if filename is a temp file of an unfinished PUSH */
+bool is_temp_file(char* filename) {
+    int len = strlen(filename);
+    int suffix_len = strlen(TEMP_SUFFIX);
+    return len > suffix_len && !strcmp(filename + len - suffix_len,TEMP_SUFFIX);
+}
+
+/* Sends to out an extent of fd, that starts at start and has length bytes,
+ * in the form <start><space><length><space><data...>. The header goes out 
+ * with the first data of the extent
+ *
+ * Returns 0, or -1 if the extent couldn't be sent
+ */
+int send_extent(outbuf* out,bulk_io* bulk,off_t start,off_t length,digest* sum) {
+    int fd = bulk->fd;
+    outbuf_number(out,start);
+    outbuf_string(out," ");
+    outbuf_number(out,length);
+    outbuf_string(out," ");
+
+    char buff[SEND_BUFFER];
+    if (lseek(fd,start,SEEK_SET) < 0)
+        return -1;
+    while (length > 0) {
+        int n = read(fd,buff,(SEND_BUFFER < length) ? SEND_BUFFER : length);
+        // The file got smaller while we were sending it, we can't send the 
+        // length we promised
+        if (n <= 0)
+            return -1;
+        if (sum != NULL)
+            digest_data(sum,start,buff,n);
+        // buff is read again, so it is sent before we continue
+        outbuf_add_ref(out,buff,n);
+        if (outbuf_flush_more(out) < 0)
+            return -1;
+        length -= n;
+        start += n;
+        bulk_read(bulk,start);
+    }
+    return 0;
+}
+
+/* Gives filename the file old_filename, that should have size bytes (and 
+ * the given SHA-256 hash, if it isn't NULL). With link, old_filename stays too: 
+ * filename is a hard link to it, or a copy if it can't be linked. The new 
+ * file is committed like a PUSH.
+ *
+ * Returns size, or -1 in case of an error (errno is ESTALE if old_filename 
+ * isn't the file we expected)
+ */
+long long change_file(bool link_file,char* old_filename,char* filename,long long size,char* hash) {
+    char tmp_filename[PATH_MAX];
+    char hash_buffer[2 * SHA256_SIZE + 1];
+    struct stat info;
+    int fd = open(old_filename,O_RDONLY);
+    if (fd < 0)
+        return -1;
+    // The file was changed since it was synced, so it has to be sent again
+    if (fstat(fd,&info) < 0 || !S_ISREG(info.st_mode) || info.st_size != size
+        || (hash != NULL && (file_hash(fd,size,hash_buffer) < 0 || strcmp(hash_buffer,hash)))) {
+        close(fd);
+        errno = ESTALE;
+        return -1;
+    }
+    if (!link_file)
+        return (commit_file(fd,old_filename,filename) < 0) ? -1 : size;
+
+    temp_file_name(tmp_filename,filename);
+    unlink(tmp_filename);
+    if (link(old_filename,tmp_filename) < 0) {
+        // A filesystem without hard links, so we copy the file
+        int tmp_fd = open(tmp_filename,O_CREAT | O_WRONLY | O_TRUNC,MOD);
+        if (tmp_fd < 0 || copy_extents(fd,tmp_fd,size) < 0) {
+            int error = errno;
+            if (tmp_fd >= 0)
+                close(tmp_fd);
+            close(fd);
+            errno = error;
+            return -1;
+        }
+        close(fd);
+        fd = tmp_fd;
+    }
+    return (commit_file(fd,tmp_filename,filename) < 0) ? -1 : size;
+}
+
+/* Puts in value the SHA-256 hash of the data of the first size bytes of fd,
+ * in hexadecimal. The holes of the file are skipped: every extent that has
+ * data adds its offset and its length (8 bytes each, most significant first)
+ * and then its bytes, so two different files never give the same input.
+ *
+ * Returns 0, or -1 if the file couldn't be read
+ */
+int file_hash(int fd,off_t size,char* value) {
+    sha256 sum;
+    char buffer[SEND_BUFFER];
+    unsigned char header[16];
+    unsigned char hash[SHA256_SIZE];
+    sha256_init(&sum);
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(fd,pos,SEEK_DATA);
+        if (data < 0) {
+            if (errno == ENXIO)
                 break;
+            data = pos;
+        }
+        off_t hole = lseek(fd,data,SEEK_HOLE);
+        if (hole < 0 || hole > size)
+            hole = size;
+        if (data >= hole)
+            break;
+        for (int i = 0; i < 8; i++) {
+            header[i] = (uint64_t)data >> (56 - 8 * i);
+            header[8 + i] = (uint64_t)(hole - data) >> (56 - 8 * i);
+        }
+        sha256_data(&sum,header,sizeof(header));
+        for (pos = data; pos < hole; ) {
+            ssize_t n = pread(fd,buffer,(SEND_BUFFER < hole - pos) ? SEND_BUFFER : hole - pos,pos);
+            // The file got smaller while we were reading it
+            if (n <= 0) {
+                if (n == 0)
+                    errno = ESTALE;
+                return -1;
             }
+            sha256_data(&sum,buffer,n);
+            pos += n;
+        }
+    }
+    sha256_final(&sum,hash);
+    sha256_to_string(value,hash);
+    return 0;
+}
+
+/* Sends to out -1 and the message of error, and flushes it */
+void send_error(outbuf* out,int error) {
+    outbuf_string(out,"-1 ");
+    outbuf_string(out,strerror(error));
+    outbuf_flush(out);
+}
 
+/* Copies the first size bytes of in_fd to out_fd. Only the extents that 
+ * contain data are copied, so holes stay holes. We use copy_file_range, so 
+ * the data don't pass through user space (and filesystems that support it 
+ * can share the blocks), and if it isn't supported we fall back to read and
+ * write.
+ *
+ * Returns the number of bytes copied, or -1 in case of an error
+ */
+long long copy_extents(int in_fd,int out_fd,off_t size) {
+    long long copied = 0;
+    bool use_copy_range = true;
+    off_t pos = 0;
+    while (pos < size) {
+        off_t data = lseek(in_fd,pos,SEEK_DATA);
+        if (data < 0) {
+            // There is only a hole until the end of the file
+            if (errno == ENXIO)
+                break;
+            data = pos;
+        }
+        off_t hole = lseek(in_fd,data,SEEK_HOLE);
+        if (hole < 0 || hole > size)
+            hole = size;
+        pos = data;
+        while (pos < hole) {
+            ssize_t n = -1;
+            if (use_copy_range) {
+                off_t in_offset = pos,out_offset = pos;
+                n = copy_file_range(in_fd,&in_offset,out_fd,&out_offset,hole - pos,0);
+                // Files on different filesystems, or a kernel without 
+                // copy_file_range support
+                if (n < 0 && (errno == EXDEV || errno == ENOSYS || errno == EINVAL || errno == EOPNOTSUPP))
+                    use_copy_range = false;
+                else if (n < 0)
+                    return -1;
+            }
+            if (!use_copy_range) {
+                char buffer[1024];
+                n = pread(in_fd,buffer,(1024 < hole - pos) ? 1024 : hole - pos,pos);
+                if (n < 0 || pwrite(out_fd,buffer,n,pos) < n)
+                    return -1;
+            }
+            // The file got smaller while we were copying it
+            if (n == 0)
+                break;
+            pos += n;
+            copied += n;
         }
+        pos = hole;
     }
-    close(sockfd);
-    pthread_exit(NULL);
+    // We recreate the hole at the end of the file, if there is one
+    if (ftruncate(out_fd,size) < 0)
+        return -1;
+    return copied;
 }
 
+/* Adds to out the size and the modification time (in nanoseconds) of the
+ * file info describes, in the form <filesize><space><mtime><space>
+ */
+void send_stat(outbuf* out,struct stat* info) {
+    outbuf_number(out,info->st_size);
+    outbuf_string(out," ");
+    outbuf_number(out,info->st_mtim.tv_sec * 1000000000LL + info->st_mtim.tv_nsec);
+    outbuf_string(out," ");
+}
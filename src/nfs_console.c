@@ -17,6 +17,11 @@
  *
  *      - cancel <source>: Cancels the source syncing
  *
+ *      - limit <global|source|host:port> <rate>: Sets a bandwidth limit, in
+ *        bytes per second (it can end with K, M or G, 0 removes the limit)
+ *
+ *      - stats: Shows nfs_manager's metrics
+ *
  *      - shutdown: Shuts down the program
  *
  *  nfs_console provides nfs_manager with the given commands and outputs to user 
@@ -87,7 +92,8 @@ int main(int argc,char* argv[]) {
     input_fds[STDIN].events = POLLIN;
     printf("Enter your commands:\n");
     do { 
-        if (poll(input_fds,2,0) > 0) {
+        // We sleep in poll until nfs_manager or the user sends something
+        if (poll(input_fds,2,-1) > 0) {
             if (input_fds[SOCKET].revents == POLLIN) {
                 // We read nfs_manager's output from our socket and print it to 
                 // the user
@@ -95,10 +101,10 @@ int main(int argc,char* argv[]) {
                 if (n < 0) 
                     perror_exit("ERROR! failed to read from socket");
                 
-                if (n > 0) {
+                // Every message of nfs_manager ends with a newline, and a 
+                // long one (like the output of stats) can come in many reads
+                if (n > 0)
                     write(1,output,n);
-                    write(1,"\n",1);
-                }    
 
             }
             else if (input_fds[STDIN].revents == POLLIN) {
@@ -107,7 +113,7 @@ int main(int argc,char* argv[]) {
                 source_dir[0] = '\0';
                 target_dir[0] = '\0';
                 scanf("%s",action);
-                if (!strcmp(action,"add")) {
+                if (!strcmp(action,"add") || !strcmp(action,"limit")) {
                     scanf("%s",source_dir);
                     scanf("%s",target_dir);
                 }
@@ -115,7 +121,7 @@ int main(int argc,char* argv[]) {
                     scanf("%s",source_dir);
                 }
                 // We entered a wrong command. No need to send to nfs_manager
-                else if (strcmp(action,"shutdown")) {
+                else if (strcmp(action,"shutdown") && strcmp(action,"stats")) {
                     printf("Wrong command give\n");
                     continue;
 
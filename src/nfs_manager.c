@@ -4,7 +4,10 @@
  * nfs_manager is executed as follows:
  *
  *      ./nfs_manager -l <manager_logfile> -c <config_file> -n <worker_limit> 
- *          -p <port_number> -b <bufferSize>
+ *          -p <port_number> -b <bufferSize> [-m <cache_mb>] [-d <cache_dir>]
+ *          [-D <cache_disk_mb>] [-s <stats_file>] [-t <trace_file>]
+ *          [-f <manifest_file>] [-e <endpoint_limit>] [-w <connect_timeout>]
+ *          [-B <socket_buffer_kb>]
  *
  *  Each parameter is described below:
  *
@@ -21,6 +24,33 @@
  *  bufferSize: number of slots of a buffer that will keep syncing processes 
  *  that will be executed by worker_threads
  *
+ *  cache_mb: memory (in MB) of a cache that keeps the files we pull, so files
+ *  that are synced many times aren't pulled from their source again. Without 
+ *  it there is no cache
+ *
+ *  cache_dir: a directory where files evicted from the cache are kept, until 
+ *  they use cache_disk_mb MB (1024 if it isn't given)
+ *
+ *  stats_file: a file where a report of nfs_manager's metrics is written 
+ *  every few seconds. The report is JSON if the file ends with .json
+ *
+ *  trace_file: a file where the phases of every transfer are written, in 
+ *  Chrome's trace event format, to be opened in a timeline viewer
+ *
+ *  manifest_file: a file where the size, modification time and content hash
+ *  of every synced file are recorded. It is kept between runs
+ *
+ *  endpoint_limit: the maximum number of files that are synced at the same
+ *  time from or to an nfs_client (host:port). The files of a full nfs_client
+ *  wait without keeping a worker busy. Without it there is no limit
+ *
+ *  connect_timeout: the milliseconds we wait for a connection to an 
+ *  nfs_client, before it fails (5000 if it isn't given)
+ *
+ *  socket_buffer_kb: the size (in KB) of the send and receive buffers of our
+ *  sockets, for links with a high bandwidth-delay product. Without it the 
+ *  kernel sizes them
+ *
  */
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,19 +64,30 @@
 #include <netinet/in.h>
 #include <netdb.h>
 #include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/uio.h>
 #include "../include/nfs.h"
 #include "../include/map.h"
+#include "../include/checkpoint.h"
+#include "../include/cache.h"
+#include "../include/logger.h"
+#include "../include/metrics.h"
+#include "../include/trace.h"
+#include "../include/manifest.h"
+#include "../include/ratelimit.h"
+#include "../include/admission.h"
+#include "../include/planner.h"
+#include "../include/dedup.h"
+#include "../include/outbuf.h"
 #include "../include/nfs_manager.h"
 
 int logfile_fd; 
 
 int worker_limit = 5;
 
-pthread_mutex_t log_mtx; // Mutex that locks write on our logfile
-                         // This mutex doesn't need to be asossiated with any 
-                         // condition variables, because we can write anytime
-                         // we want to the logfile (it will be closed after 
-                         // all threads join)
+int connect_timeout = CONNECT_TIMEOUT_MS; // In milliseconds
 
 pthread_mutex_t buffer_mtx; // Mutex that locks access to our pool_t structure
 
@@ -61,14 +102,27 @@ pthread_cond_t cond_nonfull;
 // place functions
 pool_t pool;
 
+// Our sync_info_mem_store structure. The main thread adds and cancels pairs,
+// and workers check it, so they skip the files of a cancelled pair
+map* mem;
+
 
 int main(int argc,char* argv[]) {
     // Parsing arguments
     char* logfile = "";
     char* config_file = "";
     int port_number = 0;
-    // Our arguments are either 9 or 11 (-n <number of workers> can be excluded)
-    if (argc != 11 && argc != 9) {
+    long long cache_memory = 0; // In MB, 0 means that there is no cache
+    char* cache_dir = NULL;
+    long long cache_disk = 1024; // In MB
+    char* stats_file = NULL;
+    char* trace_file = NULL;
+    char* manifest_file = NULL;
+    int endpoint_limit = 0; // 0 means that there is no limit
+    int socket_buffer = 0; // In KB, 0 means that the kernel sizes them
+    // Our arguments are at least 8 (-n <number of workers> and the cache 
+    // options can be excluded), and they are flag and value pairs
+    if (argc < 9 || argc % 2 == 0) {
         fprintf(stderr,"ERROR! Wrong number of arguments given\n");
         exit(-1);
     }
@@ -85,6 +139,24 @@ int main(int argc,char* argv[]) {
             port_number = atoi(argv[++i]);
         else if (!strcmp(argv[i],"-b"))
             buffer_size = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"-m"))
+            cache_memory = atoll(argv[++i]);
+        else if (!strcmp(argv[i],"-d"))
+            cache_dir = argv[++i];
+        else if (!strcmp(argv[i],"-D"))
+            cache_disk = atoll(argv[++i]);
+        else if (!strcmp(argv[i],"-s"))
+            stats_file = argv[++i];
+        else if (!strcmp(argv[i],"-t"))
+            trace_file = argv[++i];
+        else if (!strcmp(argv[i],"-f"))
+            manifest_file = argv[++i];
+        else if (!strcmp(argv[i],"-e"))
+            endpoint_limit = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"-w"))
+            connect_timeout = atoi(argv[++i]);
+        else if (!strcmp(argv[i],"-B"))
+            socket_buffer = atoi(argv[++i]);
 
         // Wrong type of argument
         else {
@@ -99,6 +171,23 @@ int main(int argc,char* argv[]) {
         fprintf(stderr,"ERRROR! Wrong value given as argument\n");
         exit(-1);
     }
+    if (cache_memory < 0 || cache_disk < 0) {
+        fprintf(stderr,"ERRROR! Wrong value given as cache size\n");
+        exit(-1);
+    }
+    if (endpoint_limit < 0) {
+        fprintf(stderr,"ERRROR! Wrong value given as endpoint limit\n");
+        exit(-1);
+    }
+    if (connect_timeout <= 0) {
+        fprintf(stderr,"ERRROR! Wrong value given as connect timeout\n");
+        exit(-1);
+    }
+    if (socket_buffer < 0) {
+        fprintf(stderr,"ERRROR! Wrong value given as socket buffer size\n");
+        exit(-1);
+    }
+    set_socket_buffers(socket_buffer * 1024);
 
     // Opening our files
     logfile_fd = open(logfile,O_WRONLY | O_CREAT | O_TRUNC);
@@ -107,7 +196,7 @@ int main(int argc,char* argv[]) {
         perror_exit("ERROR! fopen failed\n");
 
     // Initializing our sync_info_mem_store structure
-    map* mem = map_create();
+    mem = map_create();
 
     // Time buffer will be used by print_timestamp
     char time_buffer[1024];
@@ -126,16 +215,32 @@ int main(int argc,char* argv[]) {
         perror_exit("ERROR! malloc failed\n");
 
     for (int i = 0; i < buffer_size; i++) {
-        pool.buffer[i] = malloc(sizeof(char) * 1024);
+        pool.buffer[i] = malloc(sizeof(char) * MAX_ACTION);
         if (pool.buffer[i] == NULL)
             perror_exit("ERROR! malloc failed\n");
     }
 
     //Initializing our mutexes and condition variables
     pthread_mutex_init(&buffer_mtx,NULL);
-    pthread_mutex_init(&log_mtx,NULL);
     pthread_cond_init(&cond_nonfull,NULL);
     pthread_cond_init(&cond_nonempty,NULL);
+    checkpoint_init();
+    logger_init(logfile_fd);
+    metrics_init();
+    ratelimit_init();
+    admission_init(endpoint_limit);
+    dedup_init();
+    if (stats_file != NULL)
+        metrics_start_snapshots(stats_file);
+    if (trace_file != NULL)
+        trace_init(trace_file);
+    if (manifest_file != NULL)
+        manifest_init(manifest_file);
+    cache_init(cache_memory * 1024 * 1024,cache_dir,cache_disk * 1024 * 1024);
+
+    // A client that drops its connection shouldn't terminate nfs_manager, 
+    // write will fail with EPIPE instead
+    signal(SIGPIPE,SIG_IGN);
 
     for (int i = 0; i < worker_limit; i++) {
         // Creating our worker threads
@@ -176,17 +281,51 @@ int main(int argc,char* argv[]) {
 
     // We are ready to sync the pairs that are in the config file
     
-    while (!feof(conf_input)) {
-        // Reading from conf_input the source and target pair
-        char source[1024],target[1024];
-        fscanf(conf_input,"%s %s",source,target); 
-        if (feof(conf_input))
-            break; 
-        if (add_pair(source,target,console_sock) == 0) {
-            // Putting all decoded values in map
-            map_add(mem,source,target);
-        }   
-        else {
+    // Every line is a pair, <source> <target> [rate=<rate>] [bulk|bulk=direct]
+    // [verify] [dedup], or a limit, limit <global|source|host:port> <rate>
+    char line[MAX_ACTION];
+    while (fgets(line,MAX_ACTION,conf_input) != NULL) {
+        char* line_ptr = NULL; // For strtok_r
+        char* source = strtok_r(line," \t\n",&line_ptr);
+        char* target = strtok_r(NULL," \t\n",&line_ptr);
+        char* option = strtok_r(NULL," \t\n",&line_ptr);
+        // An empty line
+        if (source == NULL)
+            continue;
+        if (!strcmp(source,"limit")) {
+            set_limit(target,option,console_sock);
+            continue;
+        }
+        if (target == NULL) {
+            dprintf(console_sock,"[%s] Failed to add pair: %s\n",print_timestamp(time_buffer),source);
+            continue;
+        }
+        if (!check_targets(source,target,console_sock)) {
+            dprintf(console_sock,"[%s] Failed to add pair: %s %s\n",print_timestamp(time_buffer),source,target);
+            continue;
+        }
+        // Putting all decoded values in map, the files we queue carry the
+        // pair's generation
+        unsigned int generation = map_add(mem,source,target);
+        // The pair's options are kept with it in map, and they are set before
+        // its files are queued
+        pair_options options = {BULK_OFF,false,false};
+        while (option != NULL) {
+            if (!strncmp(option,"rate=",5))
+                set_limit(source,option + 5,console_sock);
+            else if (!strcmp(option,"bulk"))
+                options.bulk = BULK_CACHE;
+            else if (!strcmp(option,"bulk=direct"))
+                options.bulk = BULK_DIRECT;
+            else if (!strcmp(option,"verify"))
+                options.verify = true;
+            else if (!strcmp(option,"dedup"))
+                options.dedup = true;
+            option = strtok_r(NULL," \t\n",&line_ptr);
+        }
+        map_set_options(mem,source,&options);
+        if (add_pair(source,target,generation,console_sock) < 0) {
+            map_remove(mem,source);
             dprintf(console_sock,"[%s] Failed to add pair: %s %s\n",print_timestamp(time_buffer),source,target);
         }
 
@@ -235,17 +374,21 @@ int main(int argc,char* argv[]) {
 
             // Putting all files of source for syncing with target, if they
             // aren't already syncing
-            dir_info* info = map_find(mem,source);
-            if (info == NULL || info->is_active == false) {
-                // At first we remove the pair if is already in map
-                map_remove(mem,source);
-
-                // Putting files in worker's buffer
-                if (add_pair(source,target,console_sock) == 0) {
-                     // Putting pair in map
-                    map_add(mem,source,target);
-                }
-                else {
+            dir_info info;
+            bool found = map_find(mem,source,&info);
+            if (!check_targets(source,target,console_sock))
+                dprintf(console_sock,"[%s] Failed to add pair: %s %s\n",print_timestamp(time_buffer),source,target);
+            else if (!found || info.is_active == false) {
+                // Putting pair in map, and its files in worker's buffer. A 
+                // cancelled pair is still in map, and map_add keeps its limit
+                // and options
+                unsigned int generation = map_add(mem,source,target);
+                if (add_pair(source,target,generation,console_sock) < 0) {
+                    // A cancelled pair stays cancelled, with its settings
+                    if (found)
+                        map_set_active(mem,source,false);
+                    else
+                        map_remove(mem,source);
                     dprintf(console_sock,"[%s] Failed to add pair: %s %s\n",print_timestamp(time_buffer),source,target);
                 }
 
@@ -265,61 +408,51 @@ int main(int argc,char* argv[]) {
                 action_ptr = NULL;
                 source = strtok_r(command," \n",&action_ptr);
             }
-            dir_info* info = map_find(mem,source);
-            if (info == NULL || info->is_active == false) {
+            dir_info info;
+            if (!map_find(mem,source,&info) || info.is_active == false) {
                 dprintf(console_sock,"[%s] Directory not being synchronized: %s\n",print_timestamp(time_buffer),source);
             }
             // The directory is active
             else {
-                info->is_active = false;
-                // We need to modify the worker's buffer and remove every instance that is still there
-                pthread_mutex_lock(&buffer_mtx);
-                fprintf(stderr,"CANCELING BUFFER\n");
-                int i = pool.start;
-                int k = 0;
-                while (k < pool.count) {
-                    char entry[1024];
-                    strcpy(entry,pool.buffer[i]);
-                    fprintf(stderr,"Canceling entry %s\n",entry);
-                    char* ptr = NULL;
-                    char* tmp = strtok_r(entry," ",&ptr);
-                    // We want the second entry
-                    tmp = strtok_r(NULL," ",&ptr);
-                    // If the entry needs to be canceled then we remove it from
-                    // the pool buffer, by swapping it with the last item in 
-                    // buffer, and making it empty
-                    if (!strcpy(tmp,source)) {
-                        strcpy(pool.buffer[i],pool.buffer[pool.end]);
-                        pool.buffer[pool.end][0] = '\0'; // Mark it as emtpy
-                        pool.end--;
-                        pool.count--;
-                    }
-                    // If we swapped with the last item we want to check that item also 
-                    // so we don't increace i's value
-                    else 
-                        i++;
-
-                    k++;
-                }
-                if (pool.count == 0) {
-                    pool.start = 0;
-                    pool.end = 0;
-                }
-                // Releasing the lock
-                pthread_mutex_unlock(&buffer_mtx);
+                // The pair gets a new generation. The files of the pair that
+                // are still in the worker's buffer stay there, the workers 
+                // that obtain them see that their generation is old and skip
+                // them, and the transfers that are running stop
+                map_set_active(mem,source,false);
                 // Writing in logfile,stdout and nfs_console
-                sprintf(msg,"[%s] Synchronization stopped for %s\n",print_timestamp(time_buffer),source);
+                sprintf(msg,"[%s] Synchronization stopped for %s\n",logger_timestamp(time_buffer),source);
                 msg_len = strlen(msg);
-                // Using mutex so we avoid race condition when we are writing in logfile
-                pthread_mutex_lock(&log_mtx);
-                write(logfile_fd,msg,msg_len);
+                logger_write(msg,msg_len);
                 write(1,msg,msg_len); // stdout
                 write(console_sock,msg,msg_len); // console
-                pthread_mutex_unlock(&log_mtx);
 
             }
 
         }
+        else if (!strcmp(action,"limit")) {
+            source = strtok_r(NULL," \n",&action_ptr);
+            // We need to read new data from console
+            while (source == NULL) {
+                n = read(console_sock,command,1024);
+                command[n] = '\0';
+                action_ptr = NULL;
+                source = strtok_r(command," \n",&action_ptr);
+            }
+            target = strtok_r(NULL," \n",&action_ptr);
+            // We need to read new data from console
+            while (target == NULL) {
+                n = read(console_sock,command,1024);
+                command[n] = '\0';
+                action_ptr = NULL;
+                target = strtok_r(command," \n",&action_ptr);
+            }
+            // The new limit applies to the chunks that are relayed from now on
+            set_limit(source,target,console_sock);
+        }
+        else if (!strcmp(action,"stats")) {
+            // Sending a report of our metrics to nfs_console
+            metrics_report(console_sock,false);
+        }
         else if (!strcmp(action,"shutdown")) {
             // Writing messages to nfs_console stdout
             dprintf(console_sock,"[%s] Shutting down manager...\n",print_timestamp(time_buffer));
@@ -350,20 +483,116 @@ int main(int argc,char* argv[]) {
             break;
         pthread_mutex_unlock(&buffer_mtx);
     }
+    pthread_mutex_unlock(&buffer_mtx);
+    // Every worker got a shutdown, so we wait for their last transfers
+    for (int i = 0; i < worker_limit; i++) {
+        pthread_join(workers[i],NULL);
+    }
+
+    if (cache_enabled()) {
+        char report[1024],line[2100];
+        cache_report(report);
+        sprintf(line,"[%s] %s\n",logger_timestamp(time_buffer),report);
+        msg_len = strlen(line);
+        logger_write(line,msg_len);
+        write(1,line,msg_len); // stdout
+        write(console_sock,line,msg_len); // console
+    }
+    cache_destroy();
+    metrics_destroy();
+    trace_destroy();
+    manifest_destroy();
+    admission_destroy();
+    dedup_destroy();
+    // Every record is written before we close the logfile
+    logger_destroy();
 
 
     dprintf(console_sock,"[%s] Manager shutdown complete...\n",print_timestamp(time_buffer));
     printf("[%s] Manager shutdown complete...\n",print_timestamp(time_buffer));
+    map_destroy(mem);
     close(logfile_fd);
     return 0;
 
 }
 
+/* Returns true if source's pair has at most MAX_TARGETS targets (separated by
+ * commas), or else writes to nfs_console that it has too many and returns
+ * false. A pair can't lose some of its targets, so it isn't added at all */
+bool check_targets(char* source,char* targets,int console_sock) {
+    char time_buffer[32];
+    int count = 1;
+    for (int i = 0; targets[i] != '\0'; i++) {
+        if (targets[i] == ',')
+            count++;
+    }
+    if (count <= MAX_TARGETS)
+        return true;
+    dprintf(console_sock,"[%s] Too many targets for %s: %d, at most %d\n",print_timestamp(time_buffer),source,count,MAX_TARGETS);
+    return false;
+}
+
+/* Sets the bandwidth limit of what to rate (bytes per second, that can end 
+ * with K, M or G, 0 removes the limit). what is global, the source of a pair
+ * that was added (<source_dir>@<host>:<port>) or an endpoint (<host>:<port>). The result is
+ * written to the logfile, stdout and nfs_console.
+ *
+ * Returns 0, or -1 if what or rate aren't valid
+ */
+int set_limit(char* what,char* rate,int console_sock) {
+    char time_buffer[32];
+    char msg[2100];
+    long long bytes = (rate != NULL) ? ratelimit_parse(rate) : -1;
+    token_bucket* limit = NULL;
+    if (what != NULL && bytes >= 0) {
+        if (!strcmp(what,"global"))
+            limit = ratelimit_global();
+        // A pair's source contains its directory
+        else if (strchr(what,'@') != NULL) {
+            dir_info pair;
+            if (map_find(mem,what,&pair))
+                limit = pair.limit;
+        }
+        else if (strchr(what,':') != NULL) {
+            char host[1024];
+            snprintf(host,sizeof(host),"%s",what);
+            char* port = strrchr(host,':');
+            *port++ = '\0';
+            limit = &endpoint_of(host,atoi(port))->limit;
+            // The stats show the endpoint, even before we connect to it
+            metrics_endpoint(host,atoi(port));
+        }
+    }
+    if (limit == NULL) {
+        dprintf(console_sock,"[%s] Failed to set limit: %s %s\n",print_timestamp(time_buffer),(what != NULL) ? what : "",(rate != NULL) ? rate : "");
+        return -1;
+    }
+    bucket_set_rate(limit,bytes);
+    // Writing in logfile,stdout and nfs_console
+    if (bytes > 0)
+        sprintf(msg,"[%s] Limit of %s set to %lld bytes/sec\n",logger_timestamp(time_buffer),what,bytes);
+    else
+        sprintf(msg,"[%s] Limit of %s removed\n",logger_timestamp(time_buffer),what);
+    int msg_len = strlen(msg);
+    logger_write(msg,msg_len);
+    write(1,msg,msg_len); // stdout
+    write(console_sock,msg,msg_len); // console
+    return 0;
+}
+
 /* Adds a pair for sychronization, by doing the following:
  *      - Starts a connection with source's nfs_client in the specified port
- *      - Sends LIST command to source's nfs_client, to obtain source_dir's 
- *        files
+ *      - Sends LISTX command to source's nfs_client, to obtain source_dir's 
+ *        files with their inodes, sizes and modification times
+ *      - Compares them with the files the manifest says were synced to the
+ *        targets (see planner.h), to find the ones that were renamed, linked
+ *        or deleted in source
  *      - For every file in source_dir, adds a sync request in worker's queue
+ *        for the targets that need its data, and a RENAME or LINK request for
+ *        every target that already has it under another name, and an UNLINK
+ *        request for every file that a target has but source doesn't. They 
+ *        carry the pair's generation, so workers skip them (or stop them) if
+ *        the pair is cancelled
  *
  *  
  *  This function acts as the producer in our consumer-producer approach to 
@@ -373,12 +602,16 @@ int main(int argc,char* argv[]) {
  *  This function will be run by our main thread whenever we want to sync a 
  *  directory.
  *
- *  Returns 0, or else -1 in case of an error.
+ *  Returns 0, or else -1 if the pair has more than MAX_TARGETS targets, if
+ *  source can't be reached, or if its listing failed or was cut off (then
+ *  nothing is queued).
  *
  */
-int add_pair(char* source,char* target,int console_sock) {
+int add_pair(char* source,char* target,unsigned int generation,int console_sock) {
     char src[1024];
     char time_buffer[32];
+    if (!check_targets(source,target,console_sock))
+        return -1;
     strcpy(src,source);
     char* ptr = NULL; // For strtok_r
 
@@ -389,233 +622,1399 @@ int add_pair(char* source,char* target,int console_sock) {
     int source_port = atoi(sp);       
 
     // Creating a socket, to connect with the clients
-    int sockfd = connect_to_host(source_host,source_port);
+    int sockfd = connect_endpoint(source_host,source_port);
     if (sockfd < 0) {
         return -1;
     }
     
-    char trc[1024];
-    strcpy(trc,target);
-    ptr = NULL; // For strtok_r
-
-    // Decoding the values that are in target string to print them to logfile
-    char* target_dir = strtok_r(trc,"@",&ptr);
-    char* target_host = strtok_r(NULL,":",&ptr);
-    sp = strtok_r(NULL,"\0",&ptr);
-    int target_port = atoi(sp);       
-
-
+    // Enter LISTX command to nfs_client
+    char action[MAX_ACTION]; // The action we will put in worker's buffer
 
-    // Enter LIST command to nfs_client
-    char action[1024]; // The action we will put in worker's buffer
-
-    char msg[1024]; // For printing messages
+    char msg[MAX_ACTION]; // For printing messages
     int msg_len;
 
     char filename[256];
-    dprintf(sockfd,"LIST %s\n",source_dir);
-
-    getnextword(sockfd, filename);
-    // For every file in source_dir creating a new action and append it in 
-    // worker's buffer, until "." is given as filename
-    while (strcmp(filename,".")) {             
-        // Create action to place to buffer 
-        sprintf(action,"%s %s %s\n",filename,source,target);
-        // Write to logfile,nfs_console and to stdout that the file was added
-        pthread_mutex_lock(&log_mtx);
-        sprintf(msg,"[%s] Added file: %s/%s@%s:%d\n",print_timestamp(time_buffer),target_dir,filename,target_host,target_port);
+    dprintf(sockfd,"LISTX %s\n",source_dir);
+    pair_metrics* pair = metrics_pair(source);
+    // The stats show the rate of the pair's limit
+    dir_info info;
+    if (map_find(mem,source,&info))
+        atomic_store(&pair->limit,info.limit);
+    // The messages of the added files are gathered, and they are sent to 
+    // stdout and nfs_console many at a time
+    outbuf stdout_out,console_out;
+    outbuf_init(&stdout_out,1);
+    outbuf_init(&console_out,console_sock);
+
+    // Every file of source_dir is listed with its inode, size and 
+    // modification time, until "." is given as filename
+    plan_t* plan = malloc(sizeof(plan_t));
+    if (plan == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    // check_targets made sure that every target fits in plan, unless the
+    // planner's limit is smaller
+    if (!plan_init(plan,source,target)) {
+        dprintf(console_sock,"[%s] Too many targets for %s: at most %d\n",print_timestamp(time_buffer),source,PLAN_MAX_TARGETS);
+        close(sockfd);
+        plan_free(plan);
+        free(plan);
+        return -1;
+    }
+    char error_buffer[1024];
+    strcpy(error_buffer,"listing cut off");
+    while (getnextword(sockfd,filename) == 0) {
+        if (!strcmp(filename,".")) {
+            plan->complete = true;
+            break;
+        }
+        // Source couldn't list the directory, it sent -1 and the error
+        if (plan->file_count == 0 && !strcmp(filename,"-1")) {
+            int n = read(sockfd,error_buffer,sizeof(error_buffer) - 1);
+            error_buffer[(n > 0) ? n : 0] = '\0';
+            break;
+        }
+        long long inode = getsize(sockfd);
+        long long size = getsize(sockfd);
+        long long mtime = getsize(sockfd);
+        if (inode < 0 || size < 0 || mtime == LLONG_MIN) {
+            strcpy(error_buffer,"malformed listing");
+            break;
+        }
+        plan_add(plan,filename,inode,size,mtime);
+    }
+    close(sockfd);
+    // A listing that failed, or that didn't end, isn't the whole directory.
+    // Its missing files would be taken as deleted, so nothing is queued
+    if (!plan->complete) {
+        dprintf(console_sock,"[%s] Failed to list %s: %s\n",print_timestamp(time_buffer),source,error_buffer);
+        plan_free(plan);
+        free(plan);
+        return -1;
+    }
+    // The files that were renamed, linked or deleted since they were synced
+    plan_changes(plan);
+
+    char target_dir[1024],target_host[1024];
+    int target_port;
+    for (int i = 0; i < plan->file_count; i++) {
+        listed_file* file = &plan->files[i];
+        // An action for the targets that need the file's data, and one for
+        // every target that changes a file it already has
+        char sync_targets[MAX_ACTION];
+        sync_targets[0] = '\0';
+        for (int t = 0; t < plan->target_count; t++) {
+            decode_format(plan->targets[t],target_dir,target_host,&target_port);
+            if (file->changes[t] == CHANGE_SYNC) {
+                if (sync_targets[0] != '\0')
+                    strcat(sync_targets,",");
+                strcat(sync_targets,plan->targets[t]);
+                sprintf(msg,"[%s] Added file: %s/%s@%s:%d\n",logger_timestamp(time_buffer),target_dir,file->name,target_host,target_port);
+            }
+            else {
+                sprintf(action,"%s %s %s %u %llu %d %s\n",file->name,source,plan->targets[t],generation,
+                    (unsigned long long)file->inode,file->changes[t],file->old_names[t]);
+                place_action(action,pair);
+                sprintf(msg,"[%s] %s file: %s/%s@%s:%d (from %s)\n",logger_timestamp(time_buffer),(file->changes[t] == CHANGE_RENAME) ? "Renamed" : "Linked",
+                    target_dir,file->name,target_host,target_port,file->old_names[t]);
+            }
+            // Write to logfile,nfs_console and to stdout that the file was 
+            // added, once for every target
+            msg_len = strlen(msg); 
+            outbuf_add(&stdout_out,msg,msg_len); // Stdout
+            logger_write(msg,msg_len); // Logfile
+            outbuf_add(&console_out,msg,msg_len);
+        }
+        // An action that doesn't fit in worker's buffer is dropped
+        if (sync_targets[0] != '\0' && snprintf(action,sizeof(action),"%s %s %s %u %llu %d .\n",file->name,source,sync_targets,
+                generation,(unsigned long long)file->inode,CHANGE_SYNC) < (int)sizeof(action))
+            place_action(action,pair);
+    }
+    for (int i = 0; i < plan->synced_count; i++) {
+        synced_file* synced = &plan->synced[i];
+        if (!plan_unlinked(synced))
+            continue;
+        sprintf(action,"%s %s %s %u 0 %d .\n",synced->name,source,plan->targets[synced->target],generation,CHANGE_UNLINK);
+        place_action(action,pair);
+        decode_format(plan->targets[synced->target],target_dir,target_host,&target_port);
+        sprintf(msg,"[%s] Deleted file: %s/%s@%s:%d\n",logger_timestamp(time_buffer),target_dir,synced->name,target_host,target_port);
         msg_len = strlen(msg); 
-        write(1,msg,msg_len); // Stdout
-        write(logfile_fd,msg,msg_len); // Logfile
-        write(console_sock,msg,msg_len);
-        pthread_mutex_unlock(&log_mtx);
-        place(&pool, action);
-        pthread_cond_signal(&cond_nonempty);
-        // Get the next file
-        getnextword(sockfd,filename);
+        outbuf_add(&stdout_out,msg,msg_len);
+        logger_write(msg,msg_len);
+        outbuf_add(&console_out,msg,msg_len);
     }
+    plan_free(plan);
+    free(plan);
+    outbuf_flush(&stdout_out);
+    outbuf_flush(&console_out);
 
     return 0;
 }
 
+/* Places an action of add_pair in worker's buffer, and counts it in the 
+ * metrics of its pair */
+void place_action(char* action,pair_metrics* pair) {
+    place(&pool, action);
+    if (pair != NULL)
+        atomic_fetch_add(&pair->files_queued,1);
+    pthread_cond_signal(&cond_nonempty);
+}
+
 
 void* worker_thread(void* args) {
-    // Our consumer, that implements the synchronization process accross two 
-    // hosts (one for target and one for source)
+    // Our consumer, that implements the synchronization process accross 
+    // hosts (one for source and one for every target)
+    deferred_task* admitted_tasks = NULL; // Deferred files that were admitted
+                                          // when our transfers ended
     while (true) {
-        char error_buffer[1024]; // Our error buffer, used to append every 
-                                 // error we are able to catch
-
-        error_buffer[0] = '\0'; // We initialize it as empty to know whether or
-                                // not an error occured when strlen > 0
-
-        char number_buffer[16]; // Buffer that will be used to repressent numbers 
+        char number_buffer[32]; // Buffer that will be used to repressent numbers 
                                 // as strings
 
-        char action[1024];
-        obtain(&pool,action);
+        char action[MAX_ACTION];
         char* source_ptr; // Pointer that will be used by strtok_r
                              // changing by another thread after signaling
-        pthread_cond_signal(&cond_nonfull);
+        // Files that were admitted for us go before the ones of the buffer
+        bool admitted = admission_next(&admitted_tasks,action);
+        if (!admitted) {
+            obtain(&pool,action);
+            pthread_cond_signal(&cond_nonfull);
+        }
 
         // We can shutdown
         if (!strcmp(action,"shutdown")) {
             pthread_exit(NULL);
         }
+        // The action is broken by strtok_r, so we keep it in case it is deferred
+        char task[MAX_ACTION];
+        strcpy(task,action);
 
+        transfer_t transfer;
         // At first we break the given action into parts using strtok_r
-        char* filename = strtok_r(action," \n",&source_ptr);
+        transfer.filename = strtok_r(action," \n",&source_ptr);
         char* source = strtok_r(NULL," \n",&source_ptr);
-        char* target = strtok_r(NULL," \n",&source_ptr);
+        char* targets = strtok_r(NULL," \n",&source_ptr);
+        transfer.generation = strtoul(strtok_r(NULL," \n",&source_ptr),NULL,10);
+        transfer.inode = strtoull(strtok_r(NULL," \n",&source_ptr),NULL,10);
+        transfer.change = atoi(strtok_r(NULL," \n",&source_ptr));
+        transfer.old_filename = strtok_r(NULL," \n",&source_ptr);
+        strcpy(transfer.pair,source);
 
         source_ptr = NULL;
-        char* source_file = strtok_r(source,"@",&source_ptr);
-        char* source_host = strtok_r(NULL,":",&source_ptr);
-        int source_port = atoi(strtok_r(NULL," \n",&source_ptr));
+        transfer.source_file = strtok_r(source,"@",&source_ptr);
+        transfer.source_host = strtok_r(NULL,":",&source_ptr);
+        transfer.source_port = atoi(strtok_r(NULL," \n",&source_ptr));
+        transfer.bytes_pulled = 0;
+        transfer.bytes_cached = 0;
+        transfer.size = 0;
+        transfer.mtime = 0;
+        transfer.content_size = -1;
 
-        char* target_ptr; // Pointer that will be used by strtok_r
-        char* target_file = strtok_r(target,"@",&target_ptr);
-        char* target_host = strtok_r(NULL,":",&target_ptr);
-        int target_port = atoi(strtok_r(NULL," \n",&target_ptr));
+        // Creating SOURCE_DIR value (source_dir/sourcefile@hostname:port)
+        char* source_dir = transfer.source_path;
+        snprintf(source_dir,sizeof(transfer.source_path),"%s/%s@%s:%d",transfer.source_file,transfer.filename,transfer.source_host,transfer.source_port);
+
+        // Every target is seperated by a comma
+        char* targets_ptr = NULL;
+        char* target = strtok_r(targets,",",&targets_ptr);
+        transfer.target_count = 0;
+        while (target != NULL && transfer.target_count < MAX_TARGETS) {
+            transfer_target* tgt = &transfer.targets[transfer.target_count++];
+            char* target_ptr = NULL; // Pointer that will be used by strtok_r
+            tgt->target_file = strtok_r(target,"@",&target_ptr);
+            tgt->target_host = strtok_r(NULL,":",&target_ptr);
+            tgt->target_port = atoi(strtok_r(NULL," \n",&target_ptr));
+            tgt->state = TARGET_PENDING;
+            tgt->bytes_pushed = 0;
+            tgt->content_hash = 0;
+            tgt->cloned = false;
+            tgt->error_buffer[0] = '\0';
+            // When source and target are the same nfs_client, it can copy the 
+            // file by itself, without the data passing through us
+            tgt->local = !strcmp(transfer.source_host,tgt->target_host) && transfer.source_port == tgt->target_port;
+
+            // Creating TARGET_DIR value (target_dir/targetfile@hostname:port)
+            snprintf(tgt->target_path,sizeof(tgt->target_path),"%s/%s@%s:%d",tgt->target_file,transfer.filename,tgt->target_host,tgt->target_port);
+
+            target = strtok_r(NULL,",",&targets_ptr);
+        }
+        // add_pair doesn't queue files of pairs with more targets, but a
+        // target we can't sync is never dropped without a record of it
+        while (target != NULL) {
+            write_worker_result(source_dir,target,"PUSH","ERROR","Too many targets");
+            target = strtok_r(NULL,",",&targets_ptr);
+        }
 
-        // Connecting to source and target hosts
+        // The endpoints the file has to be admitted for
+        char endpoint_keys[MAX_ENDPOINTS][1024];
+        char* endpoints[MAX_ENDPOINTS];
+        int endpoint_count = 0;
+        snprintf(endpoint_keys[endpoint_count],1024,"%s:%d",transfer.source_host,transfer.source_port);
+        endpoints[endpoint_count] = endpoint_keys[endpoint_count];
+        endpoint_count++;
+        for (int i = 0; i < transfer.target_count; i++) {
+            snprintf(endpoint_keys[endpoint_count],1024,"%s:%d",transfer.targets[i].target_host,transfer.targets[i].target_port);
+            endpoints[endpoint_count] = endpoint_keys[endpoint_count];
+            endpoint_count++;
+        }
+
+        // The pair was cancelled (or added again) after the file was queued
+        if (!map_is_current(mem,transfer.pair,transfer.generation)) {
+            if (admitted)
+                admission_release(endpoints,endpoint_count,&admitted_tasks);
+            continue;
+        }
+        // The file waits for a full endpoint, and we go on with the next one
+        if (!admitted && !admission_acquire(endpoints,endpoint_count,task))
+            continue;
+        // The pair's options when the file is taken. A pair that is no longer
+        // in map has no files that are current, so they aren't synced anyway
+        dir_info info;
+        bool found = map_find(mem,transfer.pair,&info);
+        transfer.limit = (found) ? info.limit : NULL;
+        transfer.bulk = (found) ? info.options.bulk : BULK_OFF;
+        transfer.verify = found && info.options.verify;
+        transfer.dedup = found && info.options.dedup;
+        pair_metrics* pair = metrics_pair(transfer.pair);
+        long long task_start = metrics_now();
+        metrics_change(GAUGE_BUSY_WORKERS,1);
+
+        // The target already has the file's data under another name, or it 
+        // has to delete the file
+        if (transfer.change != CHANGE_SYNC && map_is_current(mem,transfer.pair,transfer.generation)) {
+            transfer_target* tgt = &transfer.targets[0];
+            if (change_file(&transfer,tgt) == 0)
+                tgt->state = TARGET_DONE;
+            else if (transfer.change != CHANGE_UNLINK) {
+                // The file is synced instead
+                write_worker_result(source_dir,tgt->target_path,plan_change_name(transfer.change),"ERROR",tgt->error_buffer);
+                transfer.change = CHANGE_SYNC;
+            }
+        }
+        // Targets that already have the file's content, under any name, 
+        // clone it
+        if (transfer.dedup && transfer.change == CHANGE_SYNC && map_is_current(mem,transfer.pair,transfer.generation))
+            dedup_file(&transfer);
+
+        // A failed attempt leaves checkpoints behind, so every retry continues
+        // from where the previous one stopped, and only for the targets that
+        // didn't finish
+        int attempt = 1;
+        while (transfer.change != CHANGE_UNLINK) {
+            bool remote = false; // True if a target needs the file from source
+            for (int i = 0; i < transfer.target_count; i++) {
+                transfer_target* tgt = &transfer.targets[i];
+                if (tgt->state == TARGET_DONE)
+                    continue;
+                tgt->state = TARGET_PENDING;
+                if (!tgt->local) {
+                    remote = true;
+                    continue;
+                }
+                if (!map_is_current(mem,transfer.pair,transfer.generation))
+                    continue;
+                long long copy_start = metrics_now();
+                if (copy_file(&transfer,tgt) == 0)
+                    tgt->state = TARGET_DONE;
+                long long copy_time = metrics_now() - copy_start;
+                metrics_observe(metrics_phase(PHASE_COPY),copy_time);
+                trace_event(metrics_phase_name(PHASE_COPY),tgt->target_path,copy_start,copy_time,tgt->bytes_pushed);
+            }
+            if (remote) {
+                transfer_file(&transfer);
+                record_phases(&transfer);
+            }
 
-        int source_sock = connect_to_host(source_host, source_port);
-        int target_sock = connect_to_host(target_host, target_port);
-        int bytes_pulled = 0;
-        int bytes_pushed = 0;
+            // A cancelled pair isn't retried
+            if (!map_is_current(mem,transfer.pair,transfer.generation))
+                break;
+            int failed = 0;
+            int lagging = 0;
+            for (int i = 0; i < transfer.target_count; i++) {
+                if (transfer.targets[i].state == TARGET_LAGGING)
+                    lagging++;
+                else if (transfer.targets[i].state != TARGET_DONE)
+                    failed++;
+            }
+            // Targets that were left behind, are synced again right away
+            // without the fast ones, so it doesn't count as a failure
+            if (failed == 0 && lagging > 0)
+                continue;
+            // A file whose source, or all of whose failed targets, don't 
+            // answer fails at once, instead of keeping the worker busy with
+            // retries that would fail too
+            bool unavailable = endpoint_unavailable(transfer.source_host,transfer.source_port);
+            if (!unavailable) {
+                unavailable = true;
+                for (int i = 0; i < transfer.target_count; i++) {
+                    transfer_target* tgt = &transfer.targets[i];
+                    if (tgt->state == TARGET_PENDING && (tgt->local || !endpoint_unavailable(tgt->target_host,tgt->target_port)))
+                        unavailable = false;
+                }
+            }
+            if (failed == 0 || attempt == MAX_ATTEMPTS || unavailable)
+                break;
+            for (int i = 0; i < transfer.target_count; i++) {
+                transfer_target* tgt = &transfer.targets[i];
+                if (tgt->state == TARGET_PENDING)
+                    write_worker_result(source_dir,tgt->target_path,(tgt->local) ? "COPY" : "PUSH","RETRY",tgt->error_buffer);
+            }
+            metrics_add(COUNTER_RETRIES,1);
+            // We give the network some time to recover before retrying
+            sleep(attempt++);
+        }
 
-        if (source_sock < 0 || target_sock < 0) {
+        // Writing to logfile our results from the performed action. 
+        char details[2 * 1024];
+        // TARGET_DIR of PULL is all the targets it was pulled for
+        char pull_targets[MAX_TARGET_LIST];
+        int pull_length = 0;
+        pull_targets[0] = '\0';
+        bool pull_failed = false;
+        bool task_failed = false;
+        bool cancelled = !map_is_current(mem,transfer.pair,transfer.generation);
+        long long task_bytes = 0;
+        for (int i = 0; i < transfer.target_count; i++) {
+            transfer_target* tgt = &transfer.targets[i];
+            bool failed = tgt->state != TARGET_DONE;
+            task_failed = task_failed || failed;
+            task_bytes += tgt->bytes_pushed;
+            char* operation = (transfer.change != CHANGE_SYNC) ? plan_change_name(transfer.change) : (tgt->cloned) ? "CLONE" : (tgt->local) ? "COPY" : "PUSH";
+            if (failed)
+                strcpy(details,(cancelled) ? "Synchronization cancelled" : tgt->error_buffer);
+            else if (tgt->cloned)
+                snprintf(details,sizeof(details),"%lldbytes from %s",transfer.content_size,tgt->clone_path);
+            else if (transfer.change == CHANGE_UNLINK)
+                strcpy(details,"File deleted");
+            else if (transfer.change != CHANGE_SYNC)
+                snprintf(details,sizeof(details),"%lldbytes from %s",transfer.size,transfer.old_filename);
+            else {
+                number_to_string(number_buffer,tgt->bytes_pushed);
+                strcpy(details,number_buffer);
+                strcat(details,(tgt->local) ? "bytes copied" : "bytes pushed");
+            }
+            write_worker_result(source_dir,tgt->target_path,operation,(failed) ? "ERROR" : "SUCCESS",details);
+            // A local copy doesn't pass through us, so we only know its size
+            if (!failed && transfer.change != CHANGE_SYNC)
+                change_manifest(&transfer,tgt);
+            else if (!failed && tgt->cloned)
+                manifest_set(source_dir,tgt->target_path,transfer.content_size,transfer.content_mtime,0,transfer.inode);
+            else if (!failed && tgt->local)
+                manifest_set(source_dir,tgt->target_path,tgt->bytes_pushed,0,0,transfer.inode);
+            else if (!failed) {
+                manifest_set(source_dir,tgt->target_path,transfer.size,transfer.mtime,tgt->content_hash,transfer.inode);
+                // The target has the content we asked source's digest for, 
+                // unless the file changed before we pulled it
+                if (transfer.content_size == transfer.size && transfer.content_mtime == transfer.mtime) {
+                    char path[1300];
+                    snprintf(path,sizeof(path),"%s/%s",tgt->target_file,transfer.filename);
+                    dedup_add(tgt->target_host,tgt->target_port,transfer.content_size,transfer.content_hash,path);
+                }
+            }
+            if (!tgt->local && !tgt->cloned && transfer.change == CHANGE_SYNC) {
+                pull_length += snprintf(pull_targets + pull_length,sizeof(pull_targets) - pull_length,"%s%s",
+                    (pull_length > 0) ? "," : "",tgt->target_path);
+                if (failed && strlen(transfer.error_buffer) > 0)
+                    pull_failed = true;
+            }
+        }
+        if (pull_targets[0] != '\0') {
+            if (pull_failed)
+                write_worker_result(source_dir,pull_targets,"PULL","ERROR",transfer.error_buffer);
+            else {
+                // A file sent from our cache wasn't pulled at all
+                number_to_string(number_buffer,(transfer.bytes_cached > 0) ? transfer.bytes_cached : transfer.bytes_pulled);
+                strcpy(details,number_buffer);
+                strcat(details,(transfer.bytes_cached > 0) ? "bytes from cache" : "bytes pulled");
+                write_worker_result(source_dir,pull_targets,"PULL","SUCCESS",details);
+            }
+        }
+
+        long long task_time = metrics_now() - task_start;
+        metrics_observe(metrics_task_latency(),task_time);
+        trace_event("sync",source_dir,task_start,task_time,task_bytes);
+        metrics_add(COUNTER_BUSY_USEC,task_time);
+        metrics_add((task_failed) ? COUNTER_TASKS_FAILED : COUNTER_TASKS_DONE,1);
+        metrics_change(GAUGE_BUSY_WORKERS,-1);
+        atomic_fetch_add((task_failed) ? &pair->files_failed : &pair->files_done,1);
+        atomic_fetch_add(&pair->bytes,task_bytes);
+        admission_release(endpoints,endpoint_count,&admitted_tasks);
+
+    }
+    return NULL;
+}
+
+/* Adds the phases of the last transfer_file of transfer to the phase 
+ * histograms of our metrics, and to the trace if it is enabled */
+void record_phases(transfer_t* transfer) {
+    long long* marks = transfer->phase_marks;
+    for (int phase = PHASE_CONNECT; phase <= PHASE_CLOSE; phase++) {
+        if (marks[phase] == 0)
+            continue;
+        // A phase ends when the next one that happened starts
+        int next = phase + 1;
+        while (marks[next] == 0) {
+            next++;
+        }
+        long long duration = marks[next] - marks[phase];
+        metrics_observe(metrics_phase(phase),duration);
+        trace_event(metrics_phase_name(phase),transfer->source_path,marks[phase],duration,(phase == PHASE_RELAY) ? transfer->bytes_pulled + transfer->bytes_cached : -1);
+    }
+}
+
+/* Makes a single attempt to copy transfer's file from source to all of its 
+ * pending targets that are not local. The file is pulled once and every 
+ * chunk is queued for every target. A target whose queue grows more than 
+ * FANOUT_BACKLOG, while others keep up, is left behind (TARGET_LAGGING), so 
+ * it doesn't stall the rest. If a target has a part of the file from a 
+ * previous attempt, that we have a checkpoint for, it only receives the rest 
+ * of the file. Targets that don't finish get a checkpoint of the bytes that 
+ * were sent to them. If the manifest is enabled, targets that receive the 
+ * whole file get its content hash. The transfer stops if its pair is 
+ * cancelled.
+ *
+ * Returns 0, or -1 if a target didn't finish (its error_buffer contains the
+ * reason)
+ */
+int transfer_file(transfer_t* transfer) {
+    transfer->error_buffer[0] = '\0'; // We initialize it as empty to know 
+                                      // whether or not an error occured 
+    long long* marks = transfer->phase_marks;
+    for (int i = 0; i <= PHASE_CLOSE + 1; i++) {
+        marks[i] = 0;
+    }
+    marks[PHASE_CONNECT] = metrics_now();
+    transfer_target* active[MAX_TARGETS]; // Targets we are sending the file to
+    int active_count = 0;
+    checkpoint_source checkpoint_files[MAX_TARGETS]; // The source files of active's
+                                                     // checkpoints
+    long long pull_offset = LLONG_MAX; // We pull from the smallest offset of
+                                       // our targets
+
+    // Connecting to target hosts
+    for (int i = 0; i < transfer->target_count; i++) {
+        transfer_target* target = &transfer->targets[i];
+        target->committed = -1; // Nothing was sent to target yet
+        if (target->state != TARGET_PENDING || target->local)
+            continue;
+        char* error_buffer = target->error_buffer;
+        error_buffer[0] = '\0';
+        target->sock = connect_endpoint(target->target_host,target->target_port);
+        if (target->sock < 0) {
             strcat(error_buffer,strerror(errno));
             strcat(error_buffer,",");
+            continue;
         }
-        // Connected to hosts successfully, starting synchronization
-        else {
-            // We will sent the PULL command to source host and sent the data we 
-            // read to target host, using PUSH command
-            
-            write_and_check(source_sock,"PULL ",5,error_buffer);
-            write_and_check(source_sock,source_file,strlen(source_file),error_buffer);
-            write_and_check(source_sock,"/",1,error_buffer);
-            write_and_check(source_sock,filename,strlen(filename),error_buffer);
-            write_and_check(source_sock," ",1,error_buffer);
-
-            char buffer[1024];
-            int data_sent = getsize(source_sock);
-            // If an error happened in nfs_client
-            if (data_sent < 0) {
-                strcat(error_buffer,"File: ");
-                strcat(error_buffer,filename);
-                strcat(error_buffer," ");
-                read(source_sock,error_buffer,1024);
+        // A target that hangs doesn't keep the worker (and its endpoints) 
+        // waiting for a reply forever
+        set_receive_timeout(target->sock,REPLY_TIMEOUT_MS);
+
+        // We can only trust the bytes that we sent and the target also wrote, 
+        // so we resume from the smallest of the two
+        target->offset = checkpoint_get(target->target_path,&checkpoint_files[active_count]);
+        if (target->offset > 0) {
+            outbuf out;
+            outbuf_init(&out,target->sock);
+            outbuf_string(&out,"OFFSET ");
+            outbuf_string(&out,target->target_file);
+            outbuf_string(&out,"/");
+            outbuf_string(&out,transfer->filename);
+            outbuf_string(&out,"\n");
+            flush_and_check(&out,error_buffer);
+            errno = 0; // EAGAIN tells us that the reply didn't come in time
+            long long written = getsize(target->sock);
+            if (written == LLONG_MIN) {
+                strcat(error_buffer,(errno == EAGAIN || errno == EWOULDBLOCK) ? "no OFFSET reply from target," : "connection to target lost,");
+                close(target->sock);
+                continue;
             }
-            else {
+            if (written < target->offset)
+                target->offset = (written < 0) ? 0 : written;
+        }
+        if (target->offset < pull_offset)
+            pull_offset = target->offset;
+        target->head = NULL;
+        target->tail = NULL;
+        target->backlog = 0;
+        active[active_count++] = target;
+    }
+    if (active_count == 0) {
+        marks[PHASE_CLOSE + 1] = metrics_now();
+        return -1;
+    }
 
-                // Sending PUSH requests to target's nfs_client
-
-                // Sending PUSH filename 0 to notify client to open the file 
-                write_and_check(target_sock,"PUSH ",5,error_buffer);
-                write_and_check(target_sock,target_file,strlen(target_file),error_buffer);
-                write_and_check(target_sock,"/",1,error_buffer);
-                write_and_check(target_sock,filename,strlen(filename),error_buffer);
-                write_and_check(target_sock," 0\n",3,error_buffer);
-
-                do {
-                    // We read the maximum amount of data we can from source file
-                    // and sent them in buffer
-                    int snt = read(source_sock,buffer,(1024 < data_sent) ? 1024 : data_sent);
-                    bytes_pulled += snt;
-                    if (snt < 0) {
-                        strcat(error_buffer,"read failed ");
-                        strcat(error_buffer,strerror(errno));
-                        strcat(error_buffer,",");
-                    }
-                    // Pushing the new chunk of data in target
-                    write_and_check(target_sock,"PUSH ",5,error_buffer);
-                    write_and_check(target_sock,target_file,strlen(target_file),error_buffer);
-                    write_and_check(target_sock,"/",1,error_buffer);
-                    write_and_check(target_sock,filename,strlen(filename),error_buffer);
-                    write_and_check(target_sock," ",1,error_buffer);
-                    number_to_string(number_buffer, snt);
-                    if (atoi(number_buffer) != snt || snt <= 0) {
-                        printf("NUMBER IS %s %d\n",number_buffer,snt);
-                        exit(-1);
-                    }
-                    write_and_check(target_sock,number_buffer,strlen(number_buffer),error_buffer);
-                    write_and_check(target_sock," ",1,error_buffer);
-                    write_and_check(target_sock,buffer,snt,error_buffer);
-                    bytes_pushed += snt;
-                    data_sent -= snt;
-                } while (data_sent > 0);
-
-                // Pushing PUSH file -1 so the client knows we stopped sending
-                // data
-                write_and_check(target_sock,"PUSH ",5,error_buffer);
-                write_and_check(target_sock,target_file,strlen(target_file),error_buffer);
-                write_and_check(target_sock,"/",1,error_buffer);
-                write_and_check(target_sock,filename,strlen(filename),error_buffer);
-                write_and_check(target_sock," -1\n",4,error_buffer);
-            }    
- 
+    // Connected to hosts successfully, starting synchronization. We will sent
+    // the PULL command to source host and sent the data we read to target 
+    // hosts, using PUSH command. If the file is in our cache, we only ask
+    // source for its size and modification time, to know that it is the same
+    // file, and we send the cached data instead
+    int source_sock = connect_endpoint(transfer->source_host,transfer->source_port);
+    long long file_size = -1;
+    cache_entry* cached = NULL;
+    if (source_sock >= 0) {
+        marks[PHASE_FIRST_BYTE] = metrics_now();
+        if (cache_enabled()) {
+            file_size = request_stat(source_sock,transfer);
+            if (file_size >= 0)
+                cached = cache_lookup(transfer->source_path,file_size,transfer->mtime);
         }
-        // Writing to logfile our results from the performed action. 
+        if (cached == NULL && (file_size >= 0 || !cache_enabled()))
+            file_size = request_pull(source_sock,transfer,pull_offset);
+
+        // If the source file changed since a target's checkpoint, the part the
+        // target has is useless and it needs the whole file again. A file
+        // that was rewritten in place keeps its size, but not its mtime
+        bool restart = false;
+        for (int i = 0; i < active_count; i++) {
+            if (file_size >= 0 && active[i]->offset > 0 && (checkpoint_files[i].size != file_size
+                    || checkpoint_files[i].mtime != transfer->mtime || checkpoint_files[i].inode != transfer->inode)) {
+                active[i]->offset = 0;
+                restart = pull_offset > 0;
+            }
+        }
+        // Cached data always start from 0
+        if (restart && cached == NULL) {
+            close(source_sock);
+            source_sock = connect_endpoint(transfer->source_host,transfer->source_port);
+            if (source_sock >= 0)
+                file_size = request_pull(source_sock,transfer,0);
+        }
+        if (restart || cached != NULL)
+            pull_offset = 0;
+        // A digest covers the data from pull_offset, so a target that resumes
+        // after it can't be verified in this attempt
+        for (int i = 0; i < active_count; i++) {
+            active[i]->verify = transfer->verify && active[i]->offset == pull_offset;
+        }
+    }
+    
+    char* error_buffer = transfer->error_buffer;
+    if (source_sock < 0) {
+        strcat(error_buffer,strerror(errno));
+        strcat(error_buffer,",");
+    }
+    // If an error happened in nfs_client
+    else if (file_size < 0) {
+        strcat(error_buffer,"File: ");
+        strcat(error_buffer,transfer->filename);
+        strcat(error_buffer," ");
+        int len = strlen(error_buffer);
+        int n = read(source_sock,error_buffer + len,1023 - len);
+        error_buffer[len + ((n > 0) ? n : 0)] = '\0';
+        // We always need a reason in error_buffer
+        if (n <= 0)
+            strcat(error_buffer,"connection to source lost,");
+    }
+    if (strlen(error_buffer) > 0) {
+        for (int i = 0; i < active_count; i++) {
+            strcpy(active[i]->error_buffer,error_buffer);
+            close(active[i]->sock);
+        }
+        if (source_sock >= 0)
+            close(source_sock);
+        marks[PHASE_CLOSE + 1] = metrics_now();
+        return -1;
+    }
+    marks[PHASE_RELAY] = metrics_now();
+    transfer->size = file_size;
+    // The content hash covers the offset and the data of every extent, so
+    // it is only complete if we send the file from its start
+    uint64_t content_hash = MANIFEST_HASH_INIT;
+
+    // We keep the file we pull in a new cache entry, if it fits in our cache
+    cache_entry* caching = NULL;
+    if (cached == NULL && cache_enabled() && pull_offset == 0 && file_size <= cache_max_entry())
+        caching = cache_entry_create(transfer->source_path,file_size,transfer->mtime);
+    int cached_extent = 0; // The next extent of cached we will send
+    long long cached_data = 0; // Where the current extent's data are in cached
+    // Source doesn't send us a digest for cached data, so we make it ourselves
+    digest cached_sum;
+    digest_init(&cached_sum);
+
+    // Every target opens the file after its offset. From now on we only write
+    // to targets when they can accept data, so a slow target doesn't block 
+    // the others
+    for (int i = 0; i < active_count; i++) {
+        active[i]->position = active[i]->offset;
+        active[i]->committed = active[i]->offset;
+        queue_push(transfer,active[i],0,active[i]->offset,NULL,0);
+        fcntl(active[i]->sock,F_SETFL,fcntl(active[i]->sock,F_GETFL) | O_NONBLOCK);
+    }
 
-        // Creating SOURCE_DIR value (source_dir/sourcefile@hostname:port)
-        char source_dir[1024];
-        source_dir[0] = '\0';
-        strcat(source_dir,source_file);
-        strcat(source_dir,"/");
-        strcat(source_dir,filename);
-        strcat(source_dir,"@");
-        strcat(source_dir,source_host);
-        strcat(source_dir,":");
-        number_to_string(number_buffer,source_port);
-        strcat(source_dir,number_buffer);
-        // Creating TARGET_DIR value (target_dir/targetfile@hostname:port)
-        char target_dir[1024];
-        target_dir[0] = '\0';
-        strcat(target_dir,target_file);
-        strcat(target_dir,"/");
-        strcat(target_dir,filename);
-        strcat(target_dir,"@");
-        strcat(target_dir,target_host);
-        strcat(target_dir,":");
-        number_to_string(number_buffer,target_port);
-        strcat(target_dir,number_buffer);
-
-        pthread_mutex_lock(&log_mtx);
-        // Writing to logfile
-        if (strlen(error_buffer) > 0) {
-            write_worker_result(logfile_fd,source_dir,target_dir,"PUSH","ERROR",error_buffer);
-            write_worker_result(logfile_fd,source_dir,target_dir,"PULL","ERROR",error_buffer);
+    // Every chunk we relay counts in the global limit, in the pair's limit and
+    // in the limits of the endpoints it passes through
+    token_bucket* limits[MAX_TARGETS + 3];
+    int limit_count = 0;
+    limits[limit_count++] = ratelimit_global();
+    if (transfer->limit != NULL)
+        limits[limit_count++] = transfer->limit;
+    if (cached == NULL)
+        limits[limit_count++] = &endpoint_of(transfer->source_host,transfer->source_port)->limit;
+    for (int i = 0; i < active_count; i++) {
+        limits[limit_count++] = &endpoint_of(active[i]->target_host,active[i]->target_port)->limit;
+    }
+    long long throttled_until = 0; // We don't read source until then
+
+    // Source (or our cache) sends only the extents of the file that contain 
+    // data, until it sends -1 as an extent's offset
+    long long extent_offset = 0;
+    long long extent_left = 0; // Bytes of the current extent we haven't read
+    int chunk_size = FANOUT_MIN_CHUNK; // Grows with the transfer's throughput
+    bool source_done = false;
+    struct pollfd fds[MAX_TARGETS + 1];
+    transfer_target* polled[MAX_TARGETS]; // The target of every pollfd
+    while (active_count > 0) {
+        // Source is read only when every target has room for more data, and
+        // our limits allow it
+        bool read_source = !source_done;
+        long long now = metrics_now();
+        bool throttled = read_source && throttled_until > now;
+        if (throttled)
+            read_source = false;
+        int nfds = 0;
+        for (int i = 0; i < active_count; i++) {
+            if (active[i]->backlog >= FANOUT_BACKLOG)
+                read_source = false;
+            if (active[i]->head != NULL) {
+                polled[nfds] = active[i];
+                fds[nfds].fd = active[i]->sock;
+                fds[nfds++].events = POLLOUT;
+            }
+        }
+        int targets_polled = nfds;
+        // Everything was sent to every target
+        if (source_done && targets_polled == 0)
+            break;
+        // Cached data can always be read, so we don't wait for the targets
+        if (read_source && cached == NULL) {
+            fds[nfds].fd = source_sock;
+            fds[nfds++].events = POLLIN;
+        }
+        // The pair was cancelled, the targets keep what they received so far
+        if (!map_is_current(mem,transfer->pair,transfer->generation)) {
+            strcat(error_buffer,"Synchronization cancelled,");
+            break;
+        }
+        // We wait in poll until we can read source again
+        int timeout = CANCEL_CHECK_MS;
+        if (read_source && cached != NULL)
+            timeout = 0;
+        else if (throttled && (throttled_until - now + 999) / 1000 < timeout)
+            timeout = (throttled_until - now + 999) / 1000;
+        if (poll(fds,nfds,timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            strcat(error_buffer,"poll failed ");
+            strcat(error_buffer,strerror(errno));
+            strcat(error_buffer,",");
+            break;
+        }
+
+        // Sending to the targets that can accept data
+        for (int k = 0; k < targets_polled; k++) {
+            if (fds[k].revents == 0 || flush_queue(polled[k]) == 0)
+                continue;
+            // The target failed, we stop sending it data
+            drop_queue(polled[k]);
+            close(polled[k]->sock);
+            for (int i = 0; i < active_count; i++) {
+                if (active[i] == polled[k])
+                    active[i] = active[--active_count];
+            }
+        }
+        if (!read_source || (cached == NULL && fds[nfds - 1].revents == 0))
+            continue;
+
+        // Reading the next chunk of data from source
+        if (extent_left == 0) {
+            if (cached != NULL)
+                extent_offset = (cached_extent < cached->extent_count) ? cached->extent_offsets[cached_extent] : -1;
+            else
+                extent_offset = getsize(source_sock);
+            if (extent_offset == -1) {
+                // The digest of a verified transfer follows the extents
+                char digest_buffer[32];
+                if (transfer->verify && cached != NULL)
+                    transfer->digest = digest_final(&cached_sum);
+                else if (transfer->verify) {
+                    if (getnextword(source_sock,digest_buffer) < 0) {
+                        strcat(error_buffer,"connection to source lost,");
+                        break;
+                    }
+                    transfer->digest = strtoull(digest_buffer,NULL,16);
+                }
+                // The file ends with a hole, so every target needs to extend 
+                // the file, before closing it with PUSH file -1
+                source_done = true;
+                marks[PHASE_CLOSE] = metrics_now();
+                for (int i = 0; i < active_count; i++) {
+                    if (active[i]->position < file_size)
+                        queue_push(transfer,active[i],-2,file_size,NULL,0);
+                    queue_push(transfer,active[i],-1,0,NULL,0);
+                }
+                continue;
+            }
+            if (cached != NULL)
+                extent_left = cached->extent_lengths[cached_extent++];
+            else
+                extent_left = getsize(source_sock);
+            if (extent_offset < 0 || extent_left < 0) {
+                strcat(error_buffer,"connection to source lost,");
+                break;
+            }
+            if (manifest_enabled())
+                content_hash = manifest_hash(content_hash,&extent_offset,sizeof(extent_offset));
+            continue;
+        }
+        int snt = (chunk_size < extent_left) ? chunk_size : extent_left;
+        fanout_chunk* chunk = malloc(sizeof(fanout_chunk) + snt);
+        if (chunk == NULL)
+            perror_exit("ERROR! malloc failed\n");
+        chunk->refs = 0;
+        if (cached != NULL) {
+            memcpy(chunk->data,cached->data + cached_data,snt);
+            if (transfer->verify)
+                digest_data(&cached_sum,extent_offset,chunk->data,snt);
+            cached_data += snt;
+            transfer->bytes_cached += snt;
+            metrics_add(COUNTER_BYTES_CACHED,snt);
         }
         else {
-            char details[1024];
-            number_to_string(number_buffer,bytes_pushed);
-            strcpy(details,number_buffer);
-            strcat(details,"bytes pushed");
-            write_worker_result(logfile_fd,source_dir,target_dir,"PUSH","SUCCESS",details);
-            number_to_string(number_buffer,bytes_pulled);
-            strcpy(details,number_buffer);
-            strcat(details,"bytes pulled");
-            write_worker_result(logfile_fd,source_dir,target_dir,"PULL","SUCCESS",details);
-        }
-       
-        pthread_mutex_unlock(&log_mtx);
-        close(source_sock);
-        close(target_sock);
+            snt = read_available(source_sock,chunk->data,snt);
+            if (snt <= 0) {
+                strcat(error_buffer,(snt < 0) ? strerror(errno) : "connection to source lost");
+                strcat(error_buffer,",");
+                free(chunk);
+                break;
+            }
+            transfer->bytes_pulled += snt;
+            metrics_add(COUNTER_BYTES_PULLED,snt);
+            if (caching != NULL)
+                cache_entry_add(caching,extent_offset,chunk->data,snt);
+        }
+        if (manifest_enabled())
+            content_hash = manifest_hash(content_hash,chunk->data,snt);
+        long long wait = 0;
+        now = metrics_now();
+        chunk_size = fanout_chunk_size(transfer->bytes_pulled + transfer->bytes_cached,now - marks[PHASE_RELAY]);
+        for (int i = 0; i < limit_count; i++) {
+            long long limit_wait = bucket_take(limits[i],snt,now);
+            if (limit_wait > wait)
+                wait = limit_wait;
+        }
+        if (wait > 0)
+            throttled_until = now + wait;
+        for (int i = 0; i < active_count; i++) {
+            transfer_target* target = active[i];
+            // Target already has this part of the file
+            if (extent_offset + snt <= target->position)
+                continue;
+            // There is a hole before the data, so we tell target to skip it
+            if (extent_offset > target->position)
+                queue_push(transfer,target,-2,extent_offset,NULL,0);
+            int start = (target->position > extent_offset) ? target->position - extent_offset : 0;
+            queue_push(transfer,target,snt - start,0,chunk,start);
+        }
+        if (chunk->refs == 0)
+            free(chunk);
+        extent_offset += snt;
+        extent_left -= snt;
+
+        // A target that can't keep up while others can is left behind, it 
+        // will get the rest of the file on its own
+        for (int i = 0; i < active_count; i++) {
+            if (active[i]->backlog < FANOUT_BACKLOG)
+                continue;
+            bool others_keep_up = false;
+            for (int j = 0; j < active_count; j++) {
+                if (active[j]->backlog < FANOUT_BACKLOG)
+                    others_keep_up = true;
+            }
+            if (others_keep_up) {
+                active[i]->state = TARGET_LAGGING;
+                drop_queue(active[i]);
+                close(active[i]->sock);
+                active[i] = active[--active_count];
+                i--;
+            }
+        }
+    }
+    close(source_sock);
+    marks[PHASE_CLOSE + 1] = metrics_now();
+    if (cached != NULL)
+        cache_release(cached);
+    // Only a file that was pulled whole is cached
+    if (caching != NULL && source_done && strlen(error_buffer) == 0)
+        cache_insert(caching);
+    else if (caching != NULL)
+        cache_entry_free(caching);
+
+    // Targets that are still active received the whole file, unless source 
+    // failed. They are done when they acknowledge that the file is durable
+    for (int i = 0; i < active_count; i++) {
+        if (strlen(error_buffer) > 0) 
+            strcpy(active[i]->error_buffer,error_buffer);
+        else if (receive_commit(transfer,active[i]) == 0) {
+            active[i]->state = TARGET_DONE;
+            active[i]->content_hash = (pull_offset == 0 && manifest_enabled()) ? content_hash : 0;
+        }
+        drop_queue(active[i]);
+        close(active[i]->sock);
+    }
 
+    int result = 0;
+    checkpoint_source source = {file_size,transfer->mtime,transfer->inode};
+    for (int i = 0; i < transfer->target_count; i++) {
+        transfer_target* target = &transfer->targets[i];
+        if (target->local)
+            continue;
+        if (target->state != TARGET_DONE)
+            result = -1;
+        // We never started sending to target, so its checkpoint is still valid
+        if (target->committed < 0)
+            continue;
+        // Next attempt continues after the bytes we managed to send
+        if (target->state != TARGET_DONE && target->committed > 0)
+            checkpoint_set(target->target_path,&source,target->committed);
+        else
+            checkpoint_remove(target->target_path);
     }
-    return NULL;
+    return result;
+}
+
+/* Waits for target to acknowledge that the file it received is committed,
+ * after the PUSH stream ended. A target that doesn't answer in 
+ * REPLY_TIMEOUT_MS fails.
+ *
+ * Returns 0, or -1 in case of an error (target's error_buffer contains the 
+ * reason)
+ */
+int receive_commit(transfer_t* transfer,transfer_target* target) {
+    char* error_buffer = target->error_buffer;
+    // The stream was sent without blocking, the reply comes after the 
+    // target's group commit round
+    fcntl(target->sock,F_SETFL,fcntl(target->sock,F_GETFL) & ~O_NONBLOCK);
+    errno = 0; // EAGAIN tells us that the reply didn't come in time
+    long long result = getsize(target->sock);
+    if (result == 0)
+        return 0;
+    bool timed_out = result == LLONG_MIN && (errno == EAGAIN || errno == EWOULDBLOCK);
+    strcat(error_buffer,"File: ");
+    strcat(error_buffer,transfer->filename);
+    strcat(error_buffer," ");
+    if (timed_out) {
+        strcat(error_buffer,"target didn't commit in time,");
+        return -1;
+    }
+    // Target received other data than the ones source sent, and it deleted
+    // them, so the retry starts the file over
+    char digest_buffer[32];
+    if (result == -2 && getnextword(target->sock,digest_buffer) == 0) {
+        char source_digest[17];
+        strcat(error_buffer,"checksum mismatch, source digest ");
+        strcat(error_buffer,digest_to_string(source_digest,transfer->digest));
+        strcat(error_buffer," target digest ");
+        strcat(error_buffer,digest_buffer);
+        strcat(error_buffer,",");
+        metrics_add(COUNTER_CHECKSUM_MISMATCHES,1);
+        target->committed = 0;
+        return -1;
+    }
+    int len = strlen(error_buffer);
+    int n = (result == -1) ? read(target->sock,error_buffer + len,1023 - len) : 0;
+    error_buffer[len + ((n > 0) ? n : 0)] = '\0';
+    if (n <= 0)
+        strcat(error_buffer,"connection to target lost before commit,");
+    return -1;
+}
+
+/* Reads from sock the data that are available, up to length bytes. It waits
+ * only for the first of them, so a chunk takes all the data that arrived 
+ * while we were sending the previous one, without a read for every packet.
+ *
+ * Returns the bytes read, or what read returned if nothing was read */
+int read_available(int sock,char* buffer,int length) {
+    int total = read(sock,buffer,length);
+    while (total > 0 && total < length) {
+        // Errors and the end of the data show up in our next read
+        ssize_t n = recv(sock,buffer + total,length - total,MSG_DONTWAIT);
+        if (n <= 0)
+            break;
+        total += n;
+    }
+    return total;
+}
+
+/* Returns the size of the next chunk of a transfer that relayed bytes in 
+ * elapsed microseconds, so a chunk holds about FANOUT_CHUNK_USEC of the 
+ * transfer. Fast transfers use big chunks, so they need few syscalls and 
+ * commands, and slow ones small chunks, so their targets receive data often */
+int fanout_chunk_size(long long bytes,long long elapsed) {
+    if (elapsed <= 0)
+        return FANOUT_MIN_CHUNK;
+    long long size = bytes * FANOUT_CHUNK_USEC / elapsed;
+    if (size < FANOUT_MIN_CHUNK)
+        return FANOUT_MIN_CHUNK;
+    if (size > FANOUT_MAX_CHUNK)
+        return FANOUT_MAX_CHUNK;
+    return size;
+}
+
+/* Queues a part of the PUSH stream of target. When chunk_size is 0 the stream
+ * starts (PUSH <target_dir>/<filename> -3 <argument>), when it is -2 there is
+ * a hole until argument, when it is -1 the stream ends, and when it is 
+ * positive we send an extent at target's position, with chunk_size bytes of
+ * chunk after data_start */
+void queue_push(transfer_t* transfer,transfer_target* target,long long chunk_size,long long argument,fanout_chunk* chunk,int data_start) {
+    char number_buffer[32];
+    fanout_record* record = malloc(sizeof(fanout_record));
+    if (record == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    char* header = record->header;
+    header[0] = '\0';
+    record->chunk = NULL;
+    record->data_start = 0;
+    record->data_len = 0;
+    if (chunk_size == 0) {
+        // The only PUSH command of the file, the rest are its extents. A bulk
+        // transfer tells target before it
+        if (transfer->bulk != BULK_OFF) {
+            strcat(header,"BULK ");
+            strcat(header,number_to_string(number_buffer,transfer->bulk));
+            strcat(header,"\n");
+        }
+        if (target->verify)
+            strcat(header,"VERIFY\n");
+        strcat(header,"PUSH ");
+        strcat(header,target->target_file);
+        strcat(header,"/");
+        strcat(header,transfer->filename);
+        strcat(header," -3 ");
+        strcat(header,number_to_string(number_buffer,argument));
+        strcat(header,"\n");
+    }
+    else if (chunk_size == -2) {
+        // An empty extent after the hole
+        strcat(header,number_to_string(number_buffer,argument));
+        strcat(header," 0 ");
+        target->position = argument;
+    }
+    else if (chunk_size == -1) {
+        strcat(header,"-1");
+        if (target->verify) {
+            strcat(header," ");
+            strcat(header,digest_to_string(number_buffer,transfer->digest));
+        }
+        strcat(header,"\n");
+    }
+    else {
+        strcat(header,number_to_string(number_buffer,target->position));
+        strcat(header," ");
+        number_to_string(number_buffer,chunk_size);
+        strcat(header,number_buffer);
+        strcat(header," ");
+        record->chunk = chunk;
+        record->data_start = data_start;
+        record->data_len = chunk_size;
+        chunk->refs++;
+        target->position += chunk_size;
+    }
+    record->header_len = strlen(header);
+    record->sent = 0;
+    record->end_position = target->position;
+    record->next = NULL;
+    if (target->tail == NULL)
+        target->head = record;
+    else
+        target->tail->next = record;
+    target->tail = record;
+    target->backlog += record->header_len + record->data_len;
+}
+
+/* Sends as many queued commands of target as its socket accepts, without 
+ * blocking.
+ *
+ * Returns 0, or -1 in case of an error (target's error_buffer contains the 
+ * reason)
+ */
+int flush_queue(transfer_target* target) {
+    while (target->head != NULL) {
+        fanout_record* record = target->head;
+        // We send the header and the data of the command with one syscall
+        struct iovec iov[2];
+        int iovcnt = 0;
+        if (record->sent < record->header_len) {
+            iov[iovcnt].iov_base = record->header + record->sent;
+            iov[iovcnt++].iov_len = record->header_len - record->sent;
+        }
+        if (record->data_len > 0) {
+            int data_sent = (record->sent > record->header_len) ? record->sent - record->header_len : 0;
+            iov[iovcnt].iov_base = record->chunk->data + record->data_start + data_sent;
+            iov[iovcnt++].iov_len = record->data_len - data_sent;
+        }
+        ssize_t n = writev(target->sock,iov,iovcnt);
+        if (n < 0) {
+            // Socket's buffer is full, we continue when it has room again
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                return 0;
+            strcat(target->error_buffer,"write: ");
+            strcat(target->error_buffer,strerror(errno));
+            strcat(target->error_buffer,",");
+            return -1;
+        }
+        record->sent += n;
+        target->backlog -= n;
+        // The command wasn't sent whole
+        if (record->sent < record->header_len + record->data_len)
+            return 0;
+        // The command was sent, so we can free it
+        target->committed = record->end_position;
+        target->bytes_pushed += record->data_len;
+        metrics_add(COUNTER_BYTES_PUSHED,record->data_len);
+        target->head = record->next;
+        if (target->head == NULL)
+            target->tail = NULL;
+        if (record->chunk != NULL && --record->chunk->refs == 0)
+            free(record->chunk);
+        free(record);
+    }
+    return 0;
+}
+
+/* Drops all the queued commands of target */
+void drop_queue(transfer_target* target) {
+    while (target->head != NULL) {
+        fanout_record* record = target->head;
+        target->head = record->next;
+        if (record->chunk != NULL && --record->chunk->refs == 0)
+            free(record->chunk);
+        free(record);
+    }
+    target->tail = NULL;
+    target->backlog = 0;
+}
+
+/* Asks the nfs_client of transfer, that is both its source and target's 
+ * nfs_client, to copy the file locally with the COPY command.
+ *
+ * Returns 0, or -1 in case of an error (error_buffer contains the reason)
+ */
+int copy_file(transfer_t* transfer,transfer_target* target) {
+    char* error_buffer = target->error_buffer;
+    error_buffer[0] = '\0';
+    int sock = connect_endpoint(transfer->source_host,transfer->source_port);
+    if (sock < 0) {
+        strcat(error_buffer,strerror(errno));
+        strcat(error_buffer,",");
+        return -1;
+    }
+    outbuf out;
+    outbuf_init(&out,sock);
+    outbuf_string(&out,"COPY ");
+    outbuf_string(&out,transfer->source_file);
+    outbuf_string(&out,"/");
+    outbuf_string(&out,transfer->filename);
+    outbuf_string(&out," ");
+    outbuf_string(&out,target->target_file);
+    outbuf_string(&out,"/");
+    outbuf_string(&out,transfer->filename);
+    outbuf_string(&out,"\n");
+    flush_and_check(&out,error_buffer);
+
+    long long copied = getsize(sock);
+    if (copied < 0) {
+        strcat(error_buffer,"File: ");
+        strcat(error_buffer,transfer->filename);
+        strcat(error_buffer," ");
+        int len = strlen(error_buffer);
+        int n = read(sock,error_buffer + len,1023 - len);
+        error_buffer[len + ((n > 0) ? n : 0)] = '\0';
+        if (n <= 0)
+            strcat(error_buffer,"connection to client lost,");
+        close(sock);
+        return -1;
+    }
+    target->bytes_pushed += copied;
+    metrics_add(COUNTER_BYTES_COPIED,copied);
+    close(sock);
+    return 0;
+}
+
+/* Puts in buffer the key of filename of transfer's source, or of target if
+ * it isn't NULL, in the form <dir>/<filename>@<host>:<port> */
+char* change_path(char* buffer,transfer_t* transfer,transfer_target* target,char* filename) {
+    if (target == NULL)
+        sprintf(buffer,"%s/%s@%s:%d",transfer->source_file,filename,transfer->source_host,transfer->source_port);
+    else
+        sprintf(buffer,"%s/%s@%s:%d",target->target_file,filename,target->target_host,target->target_port);
+    return buffer;
 }
 
-/* This function writes the given message using write, and if write fails, it 
- * appends an error message, for the reason of fail in error_buffer. 
+/* Asks the nfs_client of target to rename or link its copy of transfer's 
+ * old_filename to filename, or to delete filename, with the RENAME, LINK or
+ * UNLINK command.
+ *
+ * Returns 0, or -1 in case of an error (error_buffer contains the reason)
+ */
+int change_file(transfer_t* transfer,transfer_target* target) {
+    char* error_buffer = target->error_buffer;
+    error_buffer[0] = '\0';
+    char old_source[1024],old_target[1024];
+    manifest_record record;
+    record.size = 0;
+    // The old file must still be the one we synced
+    if (transfer->change != CHANGE_UNLINK && !manifest_get(change_path(old_source,transfer,NULL,transfer->old_filename),
+            change_path(old_target,transfer,target,transfer->old_filename),&record)) {
+        strcat(error_buffer,"File: ");
+        strcat(error_buffer,transfer->old_filename);
+        strcat(error_buffer," isn't in the manifest,");
+        return -1;
+    }
+    int sock = connect_endpoint(target->target_host,target->target_port);
+    if (sock < 0) {
+        strcat(error_buffer,strerror(errno));
+        strcat(error_buffer,",");
+        return -1;
+    }
+    outbuf out;
+    outbuf_init(&out,sock);
+    outbuf_string(&out,plan_change_name(transfer->change));
+    outbuf_string(&out," ");
+    if (transfer->change != CHANGE_UNLINK) {
+        outbuf_string(&out,target->target_file);
+        outbuf_string(&out,"/");
+        outbuf_string(&out,transfer->old_filename);
+        outbuf_string(&out," ");
+    }
+    outbuf_string(&out,target->target_file);
+    outbuf_string(&out,"/");
+    outbuf_string(&out,transfer->filename);
+    if (transfer->change != CHANGE_UNLINK) {
+        outbuf_string(&out," ");
+        outbuf_number(&out,record.size);
+    }
+    outbuf_string(&out,"\n");
+    flush_and_check(&out,error_buffer);
+
+    // We get the file's size back, or 0 for UNLINK
+    long long size = receive_size(sock,transfer,error_buffer);
+    if (size < 0) {
+        close(sock);
+        return -1;
+    }
+    transfer->size = size;
+    metrics_add(COUNTER_BYTES_MOVED,size);
+    close(sock);
+    return 0;
+}
+
+/* Asks the source of a deduped transfer for the SHA-256 hash of its file, 
+ * and the targets that already have its content to clone it */
+void dedup_file(transfer_t* transfer) {
+    char hash_buffer[1024];
+    int sock = connect_endpoint(transfer->source_host,transfer->source_port);
+    if (sock < 0)
+        return;
+    dprintf(sock,"DIGEST %s/%s\n",transfer->source_file,transfer->filename);
+    long long size = getsize(sock);
+    long long mtime = getsize(sock);
+    // The file is synced as always, if source can't tell its hash
+    if (size < 0 || mtime == LLONG_MIN || getnextword(sock,hash_buffer) < 0 || strlen(hash_buffer) != 2 * SHA256_SIZE) {
+        close(sock);
+        return;
+    }
+    close(sock);
+    transfer->content_size = size;
+    transfer->content_mtime = mtime;
+    strcpy(transfer->content_hash,hash_buffer);
+    for (int i = 0; i < transfer->target_count; i++) {
+        transfer_target* tgt = &transfer->targets[i];
+        char path[1024];
+        char own_path[1300];
+        snprintf(own_path,sizeof(own_path),"%s/%s",tgt->target_file,transfer->filename);
+        // A local target copies the file without the network anyway, and a
+        // target whose own file has the content is synced as always
+        if (tgt->local || !dedup_find(tgt->target_host,tgt->target_port,size,transfer->content_hash,path) || !strcmp(path,own_path))
+            continue;
+        if (clone_file(transfer,tgt,path) == 0) {
+            tgt->state = TARGET_DONE;
+            tgt->cloned = true;
+            strcpy(tgt->clone_path,path);
+            continue;
+        }
+        // The file was changed or deleted, so it doesn't have the content
+        write_worker_result(transfer->source_path,tgt->target_path,"CLONE","ERROR",tgt->error_buffer);
+        dedup_forget(tgt->target_host,tgt->target_port,size,transfer->content_hash,path);
+    }
+}
+
+/* Asks the nfs_client of target to clone its file path, with the CLONE 
+ * command */
+int clone_file(transfer_t* transfer,transfer_target* target,char* path) {
+    char* error_buffer = target->error_buffer;
+    error_buffer[0] = '\0';
+    int sock = connect_endpoint(target->target_host,target->target_port);
+    if (sock < 0) {
+        strcat(error_buffer,strerror(errno));
+        strcat(error_buffer,",");
+        return -1;
+    }
+    outbuf out;
+    outbuf_init(&out,sock);
+    outbuf_string(&out,"CLONE ");
+    outbuf_string(&out,path);
+    outbuf_string(&out," ");
+    outbuf_string(&out,target->target_file);
+    outbuf_string(&out,"/");
+    outbuf_string(&out,transfer->filename);
+    outbuf_string(&out," ");
+    outbuf_number(&out,transfer->content_size);
+    outbuf_string(&out," ");
+    outbuf_string(&out,transfer->content_hash);
+    outbuf_string(&out,"\n");
+    flush_and_check(&out,error_buffer);
+
+    long long size = receive_size(sock,transfer,error_buffer);
+    close(sock);
+    if (size < 0)
+        return -1;
+    metrics_add(COUNTER_BYTES_DEDUPED,size);
+    return 0;
+}
+
+/* Reads the reply of a command of transfer's file from sock, its size or -1
+ * and an error */
+long long receive_size(int sock,transfer_t* transfer,char* error_buffer) {
+    long long size = getsize(sock);
+    if (size < 0) {
+        strcat(error_buffer,"File: ");
+        strcat(error_buffer,transfer->filename);
+        strcat(error_buffer," ");
+        int len = strlen(error_buffer);
+        int n = read(sock,error_buffer + len,1023 - len);
+        error_buffer[len + ((n > 0) ? n : 0)] = '\0';
+        if (n <= 0)
+            strcat(error_buffer,"connection to client lost,");
+        return -1;
+    }
+    return size;
+}
+
+/* Moves the manifest's record of transfer's old file to its file, after a 
+ * RENAME (or copies it, after a LINK), or removes the file's record after an
+ * UNLINK */
+void change_manifest(transfer_t* transfer,transfer_target* target) {
+    char old_source[1024],old_target[1024];
+    manifest_record record;
+    if (transfer->change == CHANGE_UNLINK) {
+        manifest_remove(transfer->source_path,target->target_path);
+        return;
+    }
+    change_path(old_source,transfer,NULL,transfer->old_filename);
+    change_path(old_target,transfer,target,transfer->old_filename);
+    if (!manifest_get(old_source,old_target,&record))
+        return;
+    manifest_set(transfer->source_path,target->target_path,record.size,record.mtime,record.content_hash,record.inode);
+    if (transfer->change == CHANGE_RENAME)
+        manifest_remove(old_source,old_target);
+}
+
+/* Connects to host:port like connect_to_host, and keeps the connection's 
+ * latency (or its failure) in the metrics of the endpoint, and in its circuit
+ * breaker */
+int connect_endpoint(char* host,int port) {
+    endpoint_metrics* endpoint = metrics_endpoint(host,port);
+    circuit_breaker* breaker = &endpoint_of(host,port)->breaker;
+    long long start = metrics_now();
+    // An endpoint that doesn't answer fails at once, until its breaker lets a
+    // connection through to probe it
+    if (!breaker_allow(breaker,start)) {
+        errno = EHOSTDOWN;
+        return -1;
+    }
+    int sock = connect_with_timeout(host,port,connect_timeout);
+    int error = errno;
+    if (sock < 0) {
+        atomic_fetch_add(&endpoint->failures,1);
+        breaker_failure(breaker,metrics_now());
+    }
+    else {
+        metrics_observe(&endpoint->connect_latency,metrics_now() - start);
+        breaker_success(breaker);
+    }
+    errno = error;
+    return sock;
+}
+
+/* Returns true if the circuit breaker of host:port is open */
+bool endpoint_unavailable(char* host,int port) {
+    return breaker_is_open(&endpoint_of(host,port)->breaker,metrics_now());
+}
+
+/* Returns the endpoint host:port of admission control, that keeps its 
+ * bandwidth limit and its circuit breaker */
+admission_endpoint* endpoint_of(char* host,int port) {
+    char key[1024];
+    snprintf(key,sizeof(key),"%s:%d",host,port);
+    return admission_lookup(key);
+}
+
+/* Sends STAT <source_dir>/<filename> to source_sock and returns the file's 
+ * size that source's nfs_client replied with (its modification time is put in
+ * transfer's mtime), or a negative number in case of an error */
+long long request_stat(int source_sock,transfer_t* transfer) {
+    outbuf out;
+    outbuf_init(&out,source_sock);
+    request_bulk(&out,transfer->bulk);
+    outbuf_string(&out,"STAT ");
+    outbuf_string(&out,transfer->source_file);
+    outbuf_string(&out,"/");
+    outbuf_string(&out,transfer->filename);
+    outbuf_string(&out,"\n");
+    flush_and_check(&out,transfer->error_buffer);
+    long long size = getsize(source_sock);
+    if (size >= 0)
+        transfer->mtime = getsize(source_sock);
+    return size;
+}
+
+/* Sends PULL <source_dir>/<filename> <offset> to source_sock and returns the
+ * file's size that source's nfs_client replied with (its modification time is
+ * put in transfer's mtime), or a negative number in case of an error */
+long long request_pull(int source_sock,transfer_t* transfer,long long offset) {
+    outbuf out;
+    outbuf_init(&out,source_sock);
+    request_bulk(&out,transfer->bulk);
+    if (transfer->verify)
+        outbuf_string(&out,"VERIFY\n");
+    outbuf_string(&out,"PULL ");
+    outbuf_string(&out,transfer->source_file);
+    outbuf_string(&out,"/");
+    outbuf_string(&out,transfer->filename);
+    outbuf_string(&out," ");
+    outbuf_number(&out,offset);
+    outbuf_string(&out," ");
+    flush_and_check(&out,transfer->error_buffer);
+    long long size = getsize(source_sock);
+    if (size >= 0)
+        transfer->mtime = getsize(source_sock);
+    return size;
+}
+
+/* Adds BULK <bulk> to out, if the transfer is a bulk one */
+void request_bulk(outbuf* out,int bulk) {
+    if (bulk == BULK_OFF)
+        return;
+    outbuf_string(out,"BULK ");
+    outbuf_number(out,bulk);
+    outbuf_string(out,"\n");
+}
+
+/* This function flushes the message gathered in out, and if the flush fails,
+ * it appends an error message, for the reason of fail in error_buffer. 
  * This function will be used by worker threads, to reduce the number of 
- * conditional branches that check for fails of syscalls, as worker threads 
- * are using a lot of write syscalls */
-void write_and_check(int fd,char* buf,int len,char* error_buffer) {
-    if (write(fd,buf,len) < 0) {
+ * conditional branches that check for fails of syscalls. A message is made 
+ * of many pieces, and they are all sent with a single syscall */
+void flush_and_check(outbuf* out,char* error_buffer) {
+    if (outbuf_flush(out) < 0) {
         // We need to append an error message to the buffer
         strcat(error_buffer,"write: ");
         strcat(error_buffer,strerror(errno));
@@ -623,40 +2022,26 @@ void write_and_check(int fd,char* buf,int len,char* error_buffer) {
     }
 }
 
-void write_worker_result(int logfile_fd,char* source_dir,char* target_dir,char* operation,char* result,char* details) {
-    // We use low-level I/O (write). The format is
+void write_worker_result(char* source_dir,char* target_dir,char* operation,char* result,char* details) {
+    // The whole record is formatted here and given to the logger, that 
+    // writes it in the background. The format is
     // [TIMESTAMP] [SOURCE_DIR] [TARGET_DIR] [THREAD_PID] [OPERATION] [RESULT] [DETAILS]
-    char time_buffer[32],number_buffer[32];
-    write(logfile_fd,"[",1);
-    print_timestamp(time_buffer);
-    write(logfile_fd,time_buffer,strlen(time_buffer));
-    write(logfile_fd,"] [",3);
-    // Writing SOURCE_DIR 
-    write(logfile_fd,source_dir,strlen(source_dir));
-    write(logfile_fd,"] [",3);
-    // Writing TARGET_DIR
-    write(logfile_fd,target_dir,strlen(target_dir));
-    write(logfile_fd,"] [",3);
-    // Writing THREAD_PID 
-    int id = pthread_self();
-    number_to_string(number_buffer,id);
-    write(logfile_fd,number_buffer,strlen(number_buffer));
-    write(logfile_fd,"] [",3);
-    // Writing operation
-    write(logfile_fd,operation,strlen(operation));
-    write(logfile_fd,"] [",3);
-    // Writing result
-    write(logfile_fd,result,strlen(result));
-    write(logfile_fd,"] [",3);
-    // Writin details
-    write(logfile_fd,details,strlen(details));
-    write(logfile_fd,"]\n",2);
- 
+    char time_buffer[32];
+    char record[MAX_TARGET_LIST + 4 * 1024];
+    long long id = (unsigned long)pthread_self();
+    int len = snprintf(record,sizeof(record),"[%s] [%s] [%s] [%lld] [%s] [%s] [%s]\n",logger_timestamp(time_buffer),
+        source_dir,target_dir,id,operation,result,details);
+    // A record that didn't fit still ends with a newline
+    if (len >= (int)sizeof(record)) {
+        len = sizeof(record) - 1;
+        record[len - 1] = '\n';
+    }
+    logger_write(record,len);
 }
 
 void place(pool_t* pool,char* action) {
     // Places a new action inside the buffer, when there is available space
-    char bf[1024];
+    char bf[MAX_ACTION];
     strcpy(bf,action);
     pthread_mutex_lock(&buffer_mtx);
     while (pool->count >= buffer_size) {
@@ -666,6 +2051,7 @@ void place(pool_t* pool,char* action) {
     pool->end = (pool->end + 1) % buffer_size;
     strcpy(pool->buffer[pool->end],bf);
     pool->count++;
+    metrics_set(GAUGE_QUEUE_DEPTH,pool->count);
     pthread_mutex_unlock(&buffer_mtx);
 }
 
@@ -678,6 +2064,7 @@ void obtain(pool_t* pool,char* action) {
     data = pool->buffer[pool->start];
     pool->start = (pool->start + 1) % buffer_size;
     pool->count--;
+    metrics_set(GAUGE_QUEUE_DEPTH,pool->count);
     strcpy(action,data);
     pthread_mutex_unlock(&buffer_mtx);
 }
@@ -0,0 +1,117 @@
+/* Source file for our output buffers */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "../include/nfs.h"
+#include "../include/outbuf.h"
+
+// Initializes out
+void outbuf_init(outbuf* out,int fd) {
+    struct stat info;
+    out->fd = fd;
+    out->socket = fstat(fd,&info) == 0 && S_ISSOCK(info.st_mode);
+    out->iovcnt = 0;
+    out->used = 0;
+    out->error = 0;
+}
+
+// Sends the iovecs of out with flags (only for sockets)
+int outbuf_send(outbuf* out,int flags) {
+    struct iovec* iov = out->iov;
+    int iovcnt = out->iovcnt;
+    out->iovcnt = 0;
+    out->used = 0;
+    if (out->error != 0) {
+        errno = out->error;
+        return -1;
+    }
+    while (iovcnt > 0) {
+        ssize_t n;
+        if (out->socket) {
+            struct msghdr msg;
+            memset(&msg,0,sizeof(msg));
+            msg.msg_iov = iov;
+            msg.msg_iovlen = iovcnt;
+            n = sendmsg(out->fd,&msg,flags | MSG_NOSIGNAL);
+        }
+        else
+            n = writev(out->fd,iov,iovcnt);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            out->error = errno;
+            return -1;
+        }
+        // We skip the iovecs that were sent whole, and the part of the first
+        // one that was sent
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+// Sends everything out has gathered
+int outbuf_flush(outbuf* out) {
+    return outbuf_send(out,0);
+}
+
+// Sends everything out has gathered, and more data follow
+int outbuf_flush_more(outbuf* out) {
+    return outbuf_send(out,MSG_MORE);
+}
+
+// Adds data to out without copying them
+void outbuf_add_ref(outbuf* out,const void* data,size_t len) {
+    if (len == 0)
+        return;
+    if (out->iovcnt == OUTBUF_IOVECS)
+        outbuf_flush_more(out);
+    out->iov[out->iovcnt].iov_base = (void*)data;
+    out->iov[out->iovcnt++].iov_len = len;
+}
+
+// Adds a copy of data to out
+void outbuf_add(outbuf* out,const void* data,size_t len) {
+    // A piece that doesn't fit in space is sent right away
+    if (len > OUTBUF_SPACE) {
+        outbuf_add_ref(out,data,len);
+        outbuf_flush_more(out);
+        return;
+    }
+    // The copy needs room in space, and maybe a new iovec
+    if (out->used + len > OUTBUF_SPACE || out->iovcnt == OUTBUF_IOVECS)
+        outbuf_flush_more(out);
+    char* copy = out->space + out->used;
+    memcpy(copy,data,len);
+    out->used += len;
+    // Pieces that are copied one after the other share an iovec
+    struct iovec* last = (out->iovcnt > 0) ? &out->iov[out->iovcnt - 1] : NULL;
+    if (last != NULL && (char*)last->iov_base + last->iov_len == copy)
+        last->iov_len += len;
+    else
+        outbuf_add_ref(out,copy,len);
+}
+
+// Adds a copy of string to out
+void outbuf_string(outbuf* out,const char* string) {
+    outbuf_add(out,string,strlen(string));
+}
+
+// Adds the decimal representation of n to out
+void outbuf_number(outbuf* out,long long n) {
+    char number_buffer[32];
+    outbuf_string(out,number_to_string(number_buffer,n));
+}
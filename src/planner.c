@@ -0,0 +1,233 @@
+/* Source file for nfs_manager's change planner. The listed files are sorted
+ * by name and the synced files by target and name, so we find a file of the
+ * other side with a binary search. To find the synced files of a listed
+ * file's inode, we sort pointers to them by target and inode too.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include "../include/nfs.h"
+#include "../include/manifest.h"
+#include "../include/planner.h"
+
+char* change_names[] = {"PUSH","RENAME","LINK","UNLINK"};
+
+// Orders listed files by name
+int compare_listed(const void* a,const void* b) {
+    return strcmp(((listed_file*)a)->name,((listed_file*)b)->name);
+}
+
+// Orders synced files by target and name
+int compare_synced(const void* a,const void* b) {
+    const synced_file* x = a;
+    const synced_file* y = b;
+    if (x->target != y->target)
+        return (x->target < y->target) ? -1 : 1;
+    return strcmp(x->name,y->name);
+}
+
+// Orders pointers to synced files by target and inode
+int compare_inodes(const void* a,const void* b) {
+    const synced_file* x = *(synced_file**)a;
+    const synced_file* y = *(synced_file**)b;
+    if (x->target != y->target)
+        return (x->target < y->target) ? -1 : 1;
+    if (x->inode != y->inode)
+        return (x->inode < y->inode) ? -1 : 1;
+    return 0;
+}
+
+// Starts the plan of a pair, or returns false if it has too many targets
+bool plan_init(plan_t* plan,char* source,char* targets) {
+    char host[1024];
+    int port;
+    strcpy(plan->source,source);
+    decode_format(source,plan->source_dir,host,&port);
+    snprintf(plan->source_suffix,sizeof(plan->source_suffix),"@%s:%d",host,port);
+
+    char trc[4096];
+    strcpy(trc,targets);
+    char* ptr = NULL; // For strtok_r
+    char* next_target = strtok_r(trc,",",&ptr);
+    plan->target_count = 0;
+    while (next_target != NULL && plan->target_count < PLAN_MAX_TARGETS) {
+        int t = plan->target_count++;
+        strcpy(plan->targets[t],next_target);
+        decode_format(next_target,plan->target_dirs[t],host,&port);
+        snprintf(plan->target_suffixes[t],sizeof(plan->target_suffixes[t]),"@%s:%d",host,port);
+        next_target = strtok_r(NULL,",",&ptr);
+    }
+    plan->files = NULL;
+    plan->file_count = 0;
+    plan->file_capacity = 0;
+    plan->complete = false;
+    plan->synced = NULL;
+    plan->synced_count = 0;
+    // A target that doesn't fit would never be synced
+    return next_target == NULL;
+}
+
+// Adds a file that source listed
+void plan_add(plan_t* plan,char* name,uint64_t inode,long long size,long long mtime) {
+    if (plan->file_count == plan->file_capacity) {
+        plan->file_capacity = (plan->file_capacity == 0) ? 64 : plan->file_capacity * 2;
+        plan->files = realloc(plan->files,plan->file_capacity * sizeof(listed_file));
+        if (plan->files == NULL)
+            perror_exit("ERROR! realloc failed\n");
+    }
+    listed_file* file = &plan->files[plan->file_count++];
+    snprintf(file->name,sizeof(file->name),"%s",name);
+    file->inode = inode;
+    file->size = size;
+    file->mtime = mtime;
+    for (int t = 0; t < PLAN_MAX_TARGETS; t++) {
+        file->changes[t] = CHANGE_SYNC;
+        file->old_names[t] = NULL;
+    }
+}
+
+// Fills synced from the manifest entry of a file of source's directory, if
+// it was synced to a target of the pair. Returns false if it wasn't
+bool plan_parse(plan_t* plan,manifest_entry* entry,synced_file* synced) {
+    // The key is <source_dir>/<filename>@<host>:<port> <target_path>
+    char* target_path = strchr(entry->key,' ');
+    if (target_path == NULL)
+        return false;
+    *target_path++ = '\0';
+    char* name = entry->key + strlen(plan->source_dir) + 1;
+    char* suffix = strrchr(name,'@');
+    if (suffix == NULL || strcmp(suffix,plan->source_suffix) || suffix - name >= (int)sizeof(synced->name))
+        return false;
+    *suffix = '\0';
+    // A file of a subdirectory isn't listed
+    if (strchr(name,'/') != NULL)
+        return false;
+    char expected[3072];
+    for (int t = 0; t < plan->target_count; t++) {
+        snprintf(expected,sizeof(expected),"%s/%s%s",plan->target_dirs[t],name,plan->target_suffixes[t]);
+        if (strcmp(expected,target_path))
+            continue;
+        strcpy(synced->name,name);
+        synced->target = t;
+        synced->inode = entry->record.inode;
+        synced->size = entry->record.size;
+        synced->mtime = entry->record.mtime;
+        synced->listed = false;
+        synced->unchanged = false;
+        synced->used = false;
+        return true;
+    }
+    return false;
+}
+
+// Finds the synced files of the pair's source directory in the manifest
+void plan_synced(plan_t* plan) {
+    char prefix[1100];
+    snprintf(prefix,sizeof(prefix),"%s/",plan->source_dir);
+    manifest_entry* entries;
+    int count = manifest_list(prefix,&entries);
+    if (count == 0)
+        return;
+    plan->synced = malloc(count * sizeof(synced_file));
+    if (plan->synced == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    for (int i = 0; i < count; i++) {
+        if (plan_parse(plan,&entries[i],&plan->synced[plan->synced_count]))
+            plan->synced_count++;
+    }
+    manifest_free(entries,count);
+    qsort(plan->synced,plan->synced_count,sizeof(synced_file),compare_synced);
+}
+
+// Decides the change of every listed file for every target
+void plan_changes(plan_t* plan) {
+    qsort(plan->files,plan->file_count,sizeof(listed_file),compare_listed);
+    if (!manifest_enabled() || !plan->complete)
+        return;
+    plan_synced(plan);
+    if (plan->synced_count == 0)
+        return;
+
+    listed_file key_file;
+    synced_file key_synced;
+    for (int i = 0; i < plan->synced_count; i++) {
+        synced_file* synced = &plan->synced[i];
+        strcpy(key_file.name,synced->name);
+        listed_file* file = bsearch(&key_file,plan->files,plan->file_count,sizeof(listed_file),compare_listed);
+        synced->listed = file != NULL;
+        synced->unchanged = file != NULL && synced->inode != 0 && file->inode == synced->inode
+            && file->size == synced->size && file->mtime == synced->mtime;
+    }
+    synced_file** by_inode = malloc(plan->synced_count * sizeof(synced_file*));
+    if (by_inode == NULL)
+        perror_exit("ERROR! malloc failed\n");
+    for (int i = 0; i < plan->synced_count; i++) {
+        by_inode[i] = &plan->synced[i];
+    }
+    qsort(by_inode,plan->synced_count,sizeof(synced_file*),compare_inodes);
+
+    for (int i = 0; i < plan->file_count; i++) {
+        listed_file* file = &plan->files[i];
+        if (file->inode == 0)
+            continue;
+        for (int t = 0; t < plan->target_count; t++) {
+            // The target has a file with this name, so the file is synced
+            strcpy(key_synced.name,file->name);
+            key_synced.target = t;
+            if (bsearch(&key_synced,plan->synced,plan->synced_count,sizeof(synced_file),compare_synced) != NULL)
+                continue;
+            // The first synced file of the target with the file's inode
+            key_synced.inode = file->inode;
+            synced_file* key = &key_synced;
+            int low = 0,high = plan->synced_count;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (compare_inodes(&by_inode[middle],&key) < 0)
+                    low = middle + 1;
+                else
+                    high = middle;
+            }
+            synced_file* link_from = NULL;
+            for (int j = low; j < plan->synced_count && compare_inodes(&by_inode[j],&key) == 0; j++) {
+                synced_file* synced = by_inode[j];
+                if (synced->size != file->size || synced->mtime != file->mtime)
+                    continue;
+                // The old name is gone, so the file was renamed. A file is
+                // renamed once, the other new names are synced
+                if (!synced->listed && !synced->used) {
+                    synced->used = true;
+                    file->changes[t] = CHANGE_RENAME;
+                    file->old_names[t] = synced->name;
+                    break;
+                }
+                if (synced->unchanged && link_from == NULL)
+                    link_from = synced;
+            }
+            if (file->changes[t] == CHANGE_SYNC && link_from != NULL) {
+                file->changes[t] = CHANGE_LINK;
+                file->old_names[t] = link_from->name;
+            }
+        }
+    }
+    free(by_inode);
+}
+
+// Returns true if the synced file has to be deleted from its target
+bool plan_unlinked(synced_file* synced) {
+    return !synced->listed && !synced->used;
+}
+
+// Returns the name of a change
+char* plan_change_name(int change) {
+    return change_names[change];
+}
+
+// Frees the files of plan
+void plan_free(plan_t* plan) {
+    free(plan->files);
+    free(plan->synced);
+    plan->files = NULL;
+    plan->synced = NULL;
+}
@@ -0,0 +1,110 @@
+/* Source file for nfs_manager's bandwidth limits. Every bucket has its own
+ * mutex, a worker takes it once for every chunk it relays.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "../include/ratelimit.h"
+
+token_bucket global_limit;
+
+// Initializes bucket without a limit
+void bucket_init(token_bucket* bucket) {
+    pthread_mutex_init(&bucket->lock,NULL);
+    bucket->rate = 0;
+    bucket->tokens = 0;
+    bucket->last = 0;
+    bucket->window_start = 0;
+    bucket->window_bytes = 0;
+    bucket->achieved = 0;
+}
+
+// Changes the rate of bucket
+void bucket_set_rate(token_bucket* bucket,long long rate) {
+    pthread_mutex_lock(&bucket->lock);
+    bucket->rate = rate;
+    // A new limit starts without debt
+    bucket->tokens = 0;
+    bucket->last = 0;
+    pthread_mutex_unlock(&bucket->lock);
+}
+
+// Returns the rate of bucket
+long long bucket_rate(token_bucket* bucket) {
+    pthread_mutex_lock(&bucket->lock);
+    long long rate = bucket->rate;
+    pthread_mutex_unlock(&bucket->lock);
+    return rate;
+}
+
+// Closes the window of bucket if it is over. bucket's lock must be held
+void bucket_measure(token_bucket* bucket,long long now) {
+    long long elapsed = now - bucket->window_start;
+    if (elapsed < RATE_WINDOW_USEC)
+        return;
+    // A window without any bytes can also be much longer than a second
+    bucket->achieved = (elapsed < 2 * RATE_WINDOW_USEC) ? bucket->window_bytes * 1000000.0 / elapsed : 0;
+    bucket->window_start = now;
+    bucket->window_bytes = 0;
+}
+
+// Takes bytes tokens from bucket, and returns the microseconds to wait
+long long bucket_take(token_bucket* bucket,long long bytes,long long now) {
+    long long wait = 0;
+    pthread_mutex_lock(&bucket->lock);
+    bucket_measure(bucket,now);
+    bucket->window_bytes += bytes;
+    if (bucket->rate > 0) {
+        double burst = bucket->rate * (RATE_BURST_USEC / 1000000.0);
+        if (bucket->last > 0)
+            bucket->tokens += (now - bucket->last) * (bucket->rate / 1000000.0);
+        if (bucket->tokens > burst)
+            bucket->tokens = burst;
+        bucket->last = now;
+        bucket->tokens -= bytes;
+        if (bucket->tokens < 0)
+            wait = -bucket->tokens * 1000000.0 / bucket->rate;
+    }
+    pthread_mutex_unlock(&bucket->lock);
+    return wait;
+}
+
+// Returns the rate bucket achieved in the last second
+double bucket_achieved(token_bucket* bucket,long long now) {
+    pthread_mutex_lock(&bucket->lock);
+    bucket_measure(bucket,now);
+    double achieved = bucket->achieved;
+    pthread_mutex_unlock(&bucket->lock);
+    return achieved;
+}
+
+// Initializes the global limit
+void ratelimit_init(void) {
+    bucket_init(&global_limit);
+}
+
+// Returns the global limit
+token_bucket* ratelimit_global(void) {
+    return &global_limit;
+}
+
+// Returns the rate of a limit, or -1 if it isn't valid
+long long ratelimit_parse(char* rate) {
+    char* end;
+    long long value = strtoll(rate,&end,10);
+    if (end == rate || value < 0)
+        return -1;
+    if (*end == 'K' || *end == 'k')
+        value *= 1024;
+    else if (*end == 'M' || *end == 'm')
+        value *= 1024 * 1024;
+    else if (*end == 'G' || *end == 'g')
+        value *= 1024 * 1024 * 1024;
+    else if (*end != '\0')
+        return -1;
+    if (*end != '\0' && *(end + 1) != '\0')
+        return -1;
+    return value;
+}
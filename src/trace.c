@@ -0,0 +1,73 @@
+/* Source file for nfs_manager's trace. The events are complete events ("ph":
+ * "X") with a start and a duration. They are few (a handful for every file),
+ * so a mutex around a buffered FILE is enough.
+ */
+#define _GNU_SOURCE // For gettid
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "../include/nfs.h"
+#include "../include/trace.h"
+
+FILE* trace_output = NULL;
+bool first_event = true;
+pthread_mutex_t trace_mtx; // Locks writing to trace_output
+
+// Opens trace_file and starts the trace
+void trace_init(char* trace_file) {
+    trace_output = fopen(trace_file,"w");
+    if (trace_output == NULL)
+        perror_exit("ERROR! fopen failed\n");
+    pthread_mutex_init(&trace_mtx,NULL);
+    fprintf(trace_output,"{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+}
+
+// Returns true if the trace is enabled
+bool trace_enabled(void) {
+    return trace_output != NULL;
+}
+
+// Writes value to trace_output as the contents of a JSON string, with '"',
+// '\\' and the control characters escaped
+void trace_string(char* value) {
+    for (int i = 0; value[i] != '\0'; i++) {
+        unsigned char c = value[i];
+        if (c == '"' || c == '\\')
+            fprintf(trace_output,"\\%c",c);
+        else if (c < 0x20)
+            fprintf(trace_output,"\\u%04x",c);
+        else
+            fputc(c,trace_output);
+    }
+}
+
+// Writes an event of the calling thread
+void trace_event(char* name,char* file,long long start,long long duration,long long bytes) {
+    if (trace_output == NULL)
+        return;
+    int tid = gettid();
+    pthread_mutex_lock(&trace_mtx);
+    fprintf(trace_output,"%s{\"name\": \"%s\", \"cat\": \"sync\", \"ph\": \"X\", \"pid\": %d, \"tid\": %d, \"ts\": %lld, \"dur\": %lld, \"args\": {\"file\": \"",
+        (first_event) ? "" : ",\n",name,getpid(),tid,start,duration);
+    // A file name can contain quotes, backslashes and control characters
+    trace_string(file);
+    fprintf(trace_output,"\"");
+    if (bytes >= 0)
+        fprintf(trace_output,", \"bytes\": %lld",bytes);
+    fprintf(trace_output,"}}");
+    first_event = false;
+    pthread_mutex_unlock(&trace_mtx);
+}
+
+// Ends the trace and closes the trace file
+void trace_destroy(void) {
+    if (trace_output == NULL)
+        return;
+    fprintf(trace_output,"\n]}\n");
+    fclose(trace_output);
+    trace_output = NULL;
+    pthread_mutex_destroy(&trace_mtx);
+}
@@ -0,0 +1,205 @@
+/* Source file for our io_uring rings. The submission and completion rings are
+ * shared with the kernel, so their heads and tails are read and written with
+ * atomic loads and stores. A ring is used by a single thread.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include "../include/uring.h"
+
+#define URING_ALIGNMENT 4096 // Buffers start at a page
+
+// Our wrappers of the io_uring syscalls
+int io_uring_setup(unsigned entries,struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup,entries,params);
+}
+
+int io_uring_enter(int fd,unsigned to_submit,unsigned min_complete,unsigned flags) {
+    return syscall(__NR_io_uring_enter,fd,to_submit,min_complete,flags,NULL,0);
+}
+
+int io_uring_register(int fd,unsigned opcode,void* arg,unsigned nr_args) {
+    return syscall(__NR_io_uring_register,fd,opcode,arg,nr_args);
+}
+
+// Sets up ring, with its buffers registered
+int uring_init(uring* ring,int buffer_count,size_t buffer_size) {
+    memset(ring,0,sizeof(uring));
+    ring->fd = -1;
+    if (buffer_count < 1 || buffer_count > URING_MAX_BUFFERS) {
+        errno = EINVAL;
+        return -1;
+    }
+    // Every buffer can be in flight, and one more socket operation
+    struct io_uring_params params;
+    memset(&params,0,sizeof(params));
+    int fd = io_uring_setup(buffer_count + 1,&params);
+    if (fd < 0)
+        return -1;
+    ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    // Newer kernels map both rings together
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cq_ring_size > ring->sq_ring_size)
+            ring->sq_ring_size = ring->cq_ring_size;
+        ring->cq_ring_size = ring->sq_ring_size;
+    }
+    ring->sq_ring = mmap(NULL,ring->sq_ring_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQ_RING);
+    if (ring->sq_ring == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    ring->cq_ring = ring->sq_ring;
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ring = mmap(NULL,ring->cq_ring_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_CQ_RING);
+        if (ring->cq_ring == MAP_FAILED) {
+            munmap(ring->sq_ring,ring->sq_ring_size);
+            close(fd);
+            return -1;
+        }
+    }
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL,ring->sqes_size,PROT_READ | PROT_WRITE,MAP_SHARED | MAP_POPULATE,fd,IORING_OFF_SQES);
+    ring->buffers = aligned_alloc(URING_ALIGNMENT,buffer_count * buffer_size);
+    ring->fd = fd;
+    if (ring->sqes == MAP_FAILED || ring->buffers == NULL) {
+        if (ring->sqes == MAP_FAILED)
+            ring->sqes = NULL;
+        uring_destroy(ring);
+        return -1;
+    }
+    char* sq = ring->sq_ring;
+    char* cq = ring->cq_ring;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ring->buffer_count = buffer_count;
+    ring->buffer_size = buffer_size;
+    // All the buffers are a single registered buffer, so we use index 0
+    struct iovec iov;
+    iov.iov_base = ring->buffers;
+    iov.iov_len = buffer_count * buffer_size;
+    if (io_uring_register(fd,IORING_REGISTER_BUFFERS,&iov,1) < 0) {
+        uring_destroy(ring);
+        return -1;
+    }
+    return 0;
+}
+
+// Registers the descriptors of a transfer
+int uring_register_files(uring* ring,int* fds,int count) {
+    return io_uring_register(ring->fd,IORING_REGISTER_FILES,fds,count) < 0 ? -1 : 0;
+}
+
+// Returns a registered buffer
+char* uring_buffer(uring* ring,int buffer) {
+    return ring->buffers + buffer * ring->buffer_size;
+}
+
+// Returns the next free entry of the submission ring, cleared
+struct io_uring_sqe* uring_entry(uring* ring) {
+    unsigned tail = *ring->sq_tail;
+    unsigned index = tail & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe,0,sizeof(struct io_uring_sqe));
+    ring->sq_array[index] = index;
+    return sqe;
+}
+
+// Gives the entry we filled to the kernel
+void uring_queue(uring* ring) {
+    __atomic_store_n(ring->sq_tail,*ring->sq_tail + 1,__ATOMIC_RELEASE);
+    ring->pending++;
+}
+
+// Prepares a read or a write of a registered file, with a registered buffer
+void uring_file(uring* ring,int op,int file,char* data,unsigned len,off_t offset,uint64_t user_data) {
+    struct io_uring_sqe* sqe = uring_entry(ring);
+    sqe->opcode = op;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->buf_index = 0;
+    sqe->user_data = user_data;
+    uring_queue(ring);
+}
+
+// Prepares a send or a receive of a registered socket
+void uring_socket(uring* ring,int op,int file,char* data,unsigned len,int flags,uint64_t user_data) {
+    struct io_uring_sqe* sqe = uring_entry(ring);
+    sqe->opcode = op;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->fd = file;
+    sqe->addr = (uint64_t)(uintptr_t)data;
+    sqe->len = len;
+    sqe->msg_flags = flags;
+    sqe->user_data = user_data;
+    uring_queue(ring);
+}
+
+// Submits what we prepared and waits for a completion
+int uring_wait(uring* ring,uint64_t* user_data,int* res) {
+    while (true) {
+        unsigned head = *ring->cq_head;
+        if (head != __atomic_load_n(ring->cq_tail,__ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            *user_data = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(ring->cq_head,head + 1,__ATOMIC_RELEASE);
+            ring->inflight--;
+            return 0;
+        }
+        // Nothing would ever complete
+        if (ring->pending == 0 && ring->inflight == 0) {
+            errno = EINVAL;
+            return -1;
+        }
+        int submitted = io_uring_enter(ring->fd,ring->pending,1,IORING_ENTER_GETEVENTS);
+        if (submitted < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        ring->pending -= submitted;
+        ring->inflight += submitted;
+    }
+}
+
+// Waits for all the operations of ring
+void uring_drain(uring* ring) {
+    uint64_t user_data;
+    int res;
+    while (ring->pending > 0 || ring->inflight > 0) {
+        if (uring_wait(ring,&user_data,&res) < 0)
+            break;
+    }
+}
+
+// Frees ring
+void uring_destroy(uring* ring) {
+    if (ring->fd < 0)
+        return;
+    if (ring->sqes != NULL)
+        munmap(ring->sqes,ring->sqes_size);
+    if (ring->cq_ring != ring->sq_ring)
+        munmap(ring->cq_ring,ring->cq_ring_size);
+    munmap(ring->sq_ring,ring->sq_ring_size);
+    close(ring->fd);
+    free(ring->buffers);
+    ring->fd = -1;
+    ring->buffers = NULL;
+}